@@ -0,0 +1,119 @@
+/*  DSM atomic operations benchmark
+ *
+ *  DESCRIPTION ---------------------------------------------------------------
+ *
+ *  Every node adds 1 to a shared counter INCREMENTS times, first with plain
+ *  loads and stores (which lose updates whenever two nodes race) and then
+ *  with sm_fetch_add(), BATCH increments to a message with sm_atomic_batch()
+ *  (BATCH 1 is one sm_fetch_add() at a time). The atomic counter is executed
+ *  where its page is and never moves, e.g.
+ *
+ *      for o in "" -d -r "-m touch" -s; do dsm $o -n 16 atomicbench 1000000; done
+ *      dsm -n 4 atomicbench 2000 1
+ *
+ *  Both counters, and a 32-bit word swapped at the end, are checked.
+ *
+ *  usage: atomicbench [INCREMENTS] [BATCH]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "sm.h"
+#include "sm_ext.h"
+
+static double now (void)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+int main (int argc, char *argv[])
+{
+  int   nodes, nid, batch = 1024, bad = 0;
+  long  increments = 100000;
+  char *shared;
+  volatile long *plain;
+  long *counter;
+  int32_t *word, old32;
+  long old;
+  struct sm_atomic_op *ops;
+  double start, stored, added;
+
+  if (sm_node_init (&argc, &argv, &nodes, &nid)) {
+    fprintf (stderr, "atomicbench: cannot initialise\n");
+    exit (1);
+  }
+  if (argc > 1) increments = atol (argv[1]);
+  if (argc > 2) batch = atoi (argv[2]);
+  if (batch < 1) batch = 1;
+
+  /* Each counter is on a page of its own */
+  if (0 == nid) {
+    shared = sm_malloc (2 * getpagesize ());
+    if (shared == NULL) {
+      fprintf (stderr, "atomicbench: cannot allocate the counters\n");
+      exit (1);
+    }
+    memset (shared, 0, 2 * getpagesize ());
+  }
+  sm_bcast ((void **) &shared, 0);
+  plain   = (volatile long *) shared;
+  counter = (long *) (shared + getpagesize ());
+  word    = (int32_t *) (counter + 1);
+
+  ops = malloc (batch * sizeof (struct sm_atomic_op));
+  for (int i = 0; i < batch; i++)
+    ops[i] = (struct sm_atomic_op) { counter, SM_ATOMIC_ADD, sizeof (long), 1, 0, 0 };
+
+  sm_barrier ();
+  start = now ();
+  for (long i = 0; i < increments; i++)
+    *plain += 1;
+  sm_barrier ();
+  stored = now () - start;
+
+  start = now ();
+  for (long i = 0; i < increments; i += batch) {
+    int n = (increments - i < batch) ? increments - i : batch;
+
+    if (n == 1) {
+      if (sm_fetch_add (counter, 1, &old)) {
+        bad = 1;
+        break;
+      }
+    } else if (sm_atomic_batch (ops, n)) {
+      bad = 1;
+      break;
+    }
+  }
+  bad |= (sm_fetch_add (word, nid + 1, &old32) != 0);
+  sm_barrier ();
+  added = now () - start;
+
+  if (0 == nid) {
+    long    expected = increments * nodes;
+    int32_t sum = nodes * (nodes + 1) / 2;
+
+    /* The word holds the sum of every node's id plus one, and is swapped back to 0 through -1 */
+    bad |= (*counter != expected);
+    bad |= (sm_compare_swap (word, sum + 1, 7, &old32) || old32 != sum);
+    bad |= (sm_compare_swap (word, sum, -1, &old32) || old32 != sum);
+    bad |= (sm_swap (word, 0, &old32) || old32 != -1);
+
+    printf ("atomicbench: %d nodes, %ld increments each, %d to a message\n", nodes, increments, batch);
+    printf ("  plain stores   %8.3fs %8.2fus an increment, %ld of %ld updates lost\n", stored,
+            stored * 1e6 / increments, expected - *plain, expected);
+    printf ("  sm_fetch_add() %8.3fs %8.2fus an increment\n", added, added * 1e6 / increments);
+    printf ("  %s (%ld of %ld)\n", bad ? "WRONG VALUES" : "all values correct", *counter, expected);
+  }
+
+  free (ops);
+  sm_node_exit ();
+  return 0;
+}
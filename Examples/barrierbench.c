@@ -0,0 +1,72 @@
+/*  DSM barrier latency benchmark
+ *
+ *  DESCRIPTION ---------------------------------------------------------------
+ *
+ *  Every node runs the same number of back to back barriers (and then of
+ *  broadcasts from the last node), nothing else touches the network. Node #0
+ *  reports the mean latency of each, e.g.
+ *
+ *      for n in 2 4 8 16 32 64; do dsm -d -n $n barrierbench 1000; done
+ *
+ *  shows how the combining tree scales with the number of nodes, and
+ *
+ *      for f in 2 4 8; do dsm -d -f $f -n 64 barrierbench 1000; done
+ *
+ *  how it depends on the fan-out of the tree.
+ *
+ *  usage: barrierbench [ROUNDS]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "sm.h"
+
+static double now (void)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+int main (int argc, char *argv[])
+{
+  int    nodes, nid, rounds = 1000;
+  double start, barrier, bcast;
+  void  *value = NULL;
+
+  if (sm_node_init (&argc, &argv, &nodes, &nid)) {
+    fprintf (stderr, "barrierbench: cannot initialise\n");
+    exit (1);
+  }
+  if (argc > 1) rounds = atoi (argv[1]);
+
+  /* Make sure every node has started before anything is timed */
+  sm_barrier ();
+
+  start = now ();
+  for (int r = 0; r < rounds; r++)
+    sm_barrier ();
+  barrier = now () - start;
+
+  start = now ();
+  for (int r = 0; r < rounds; r++) {
+    if (nid == nodes - 1) value = (void *) (uintptr_t) (r + 1);
+    sm_bcast (&value, nodes - 1);
+  }
+  bcast = now () - start;
+
+  if ((uintptr_t) value != (uintptr_t) rounds)
+    fprintf (stderr, "barrierbench: node %d received %lu from the last broadcast\n",
+             nid, (unsigned long) (uintptr_t) value);
+
+  if (0 == nid)
+    printf ("barrierbench: %d nodes, %d rounds, barrier %.1fus, broadcast %.1fus\n",
+            nodes, rounds, barrier * 1e6 / rounds, bcast * 1e6 / rounds);
+
+  sm_node_exit ();
+  return 0;
+}
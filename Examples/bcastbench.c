@@ -0,0 +1,135 @@
+/*  DSM buffer broadcast benchmark
+ *
+ *  DESCRIPTION ---------------------------------------------------------------
+ *
+ *  The last node hands a block of SIZE bytes of parameters to every other
+ *  node, first the way it is done with shared memory alone (it writes the
+ *  block into a shared array, and after a barrier every node copies it out)
+ *  and then with sm_bcast_buf(), e.g.
+ *
+ *      for o in "" -d -r "-m touch" -s; do dsm $o -n 8 bcastbench 4194304; done
+ *
+ *  Both copies are checked, as are broadcasts of a few odd sizes from other
+ *  roots.
+ *
+ *  usage: bcastbench [SIZE]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "sm.h"
+#include "sm_ext.h"
+
+static double now (void)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* The byte at index `i' of a block broadcast from node `root'
+ */
+static unsigned char byte (int root, long i)
+{
+  return (unsigned char) (i * 7 + i / 4096 + root);
+}
+
+/* Fill the block if this node is the root, broadcast it and check it, returns whether it is wrong
+ */
+static int check (unsigned char *block, long size, int root, int nid)
+{
+  int bad = 0;
+
+  memset (block, 0, size);
+  if (nid == root)
+    for (long i = 0; i < size; i++)
+      block[i] = byte (root, i);
+
+  bad |= sm_bcast_buf (block, size, root);
+  for (long i = 0; i < size; i++)
+    bad |= (block[i] != byte (root, i));
+
+  return bad;
+}
+
+int main (int argc, char *argv[])
+{
+  int            nodes, nid, root, bad = 0;
+  long           size = 4 << 20;
+  long           sizes[] = { 1, 5, 8, 9, 4096, 65536, 65537, 300000 };
+  unsigned char *shared, *block;
+  double         start, through_memory, broadcast;
+
+  if (sm_node_init (&argc, &argv, &nodes, &nid)) {
+    fprintf (stderr, "bcastbench: cannot initialise\n");
+    exit (1);
+  }
+  if (argc > 1) size = atol (argv[1]);
+  if (size < 1) size = 1;
+  root = nodes - 1;
+
+  block = malloc (size > 300000 ? size : 300000);
+  if (block == NULL) {
+    fprintf (stderr, "bcastbench: cannot allocate the block\n");
+    exit (1);
+  }
+
+  if (0 == nid) {
+    shared = sm_malloc (size);
+    if (shared == NULL) {
+      fprintf (stderr, "bcastbench: cannot allocate the shared array\n");
+      exit (1);
+    }
+  }
+  sm_bcast ((void **) &shared, 0);
+
+  if (nid == root)
+    for (long i = 0; i < size; i++)
+      block[i] = byte (root, i);
+
+  sm_barrier ();
+  start = now ();
+  if (nid == root)
+    memcpy (shared, block, size);
+  sm_barrier ();
+  if (nid != root)
+    memcpy (block, shared, size);
+  sm_barrier ();
+  through_memory = now () - start;
+
+  for (long i = 0; i < size; i++)
+    bad |= (block[i] != byte (root, i));
+
+  if (nid != root)
+    memset (block, 0, size);
+  sm_barrier ();
+  start = now ();
+  bad |= sm_bcast_buf (block, size, root);
+  sm_barrier ();
+  broadcast = now () - start;
+
+  for (long i = 0; i < size; i++)
+    bad |= (block[i] != byte (root, i));
+
+  /* Odd sizes, either side of a pointer and of a chunk, from every root in turn */
+  for (int s = 0; s < (int) (sizeof (sizes) / sizeof (sizes[0])); s++)
+    bad |= check (block, sizes[s], s % nodes, nid);
+
+  /* Every node's checks are summed, node 0 reports them */
+  bad = (bad != 0);
+  sm_allreduce (&bad, 1, SM_INT32, SM_SUM);
+
+  if (0 == nid) {
+    printf ("bcastbench: %d nodes, %ld bytes from node %d\n", nodes, size, root);
+    printf ("  shared array + barrier %8.3fs\n", through_memory);
+    printf ("  sm_bcast_buf()         %8.3fs\n", broadcast);
+    printf ("  %s\n", bad ? "WRONG VALUES" : "all values correct");
+  }
+
+  free (block);
+  sm_node_exit ();
+  return 0;
+}
@@ -0,0 +1,132 @@
+/*  DSM bulk access benchmark
+ *
+ *  DESCRIPTION ---------------------------------------------------------------
+ *
+ *  Node #0 initialises a large array of doubles and every other node then
+ *  reads the whole of it back, first with plain loads and stores (a fault per
+ *  page) and then with the bulk access API of sm_ext.h: sm_put() for the
+ *  initialisation, sm_get() or sm_prefetch() ahead of the loop for the
+ *  read-back. Each variant uses its own fresh array. Node #0 reports the
+ *  times and checks every node read back what was written, e.g.
+ *
+ *      dsm -n 4 bulkbench 2048
+ *
+ *  usage: bulkbench [PAGES]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "sm.h"
+#include "sm_ext.h"
+
+static double now (void)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static double value (long i, int variant)
+{
+  return i * 0.5 + variant;
+}
+
+int main (int argc, char *argv[])
+{
+  int     nodes, nid, pages = 1024, bad = 0;
+  long    page_size = getpagesize (), n;
+  double *arrays[3], *local, start, init[3], readback[3];
+  int    *errors;
+
+  if (sm_node_init (&argc, &argv, &nodes, &nid)) {
+    fprintf (stderr, "bulkbench: cannot initialise\n");
+    exit (1);
+  }
+  if (argc > 1) pages = atoi (argv[1]);
+  n = pages * page_size / sizeof (double);
+
+  local = malloc (n * sizeof (double));
+  if (local == NULL) {
+    fprintf (stderr, "bulkbench: cannot allocate %d pages\n", pages);
+    exit (1);
+  }
+
+  /* One array per variant, and a flag per node for the results of the checks */
+  if (0 == nid) {
+    for (int v = 0; v < 3; v++) {
+      arrays[v] = sm_malloc (n * sizeof (double));
+      if (arrays[v] == NULL) {
+        fprintf (stderr, "bulkbench: cannot allocate %d pages\n", pages);
+        exit (1);
+      }
+    }
+    errors = sm_malloc (nodes * sizeof (int));
+    memset (errors, 0, nodes * sizeof (int));
+  }
+  for (int v = 0; v < 3; v++)
+    sm_bcast ((void **) &arrays[v], 0);
+  sm_bcast ((void **) &errors, 0);
+
+  for (int v = 0; v < 3; v++) {
+    double *array = arrays[v];
+
+    /* Initialisation, element by element or from a private copy */
+    sm_barrier ();
+    start = now ();
+    if (0 == nid) {
+      if (v == 0) {
+        for (long i = 0; i < n; i++)
+          array[i] = value (i, v);
+      } else {
+        for (long i = 0; i < n; i++)
+          local[i] = value (i, v);
+        sm_put (array, local, n * sizeof (double));
+      }
+    }
+    sm_barrier ();
+    init[v] = now () - start;
+
+    /* Read-back by every other node */
+    start = now ();
+    if (0 != nid) {
+      int wrong = 0;
+
+      if (v == 1) {
+        sm_get (local, array, n * sizeof (double));
+        for (long i = 0; i < n; i++)
+          wrong |= (local[i] != value (i, v));
+      } else {
+        if (v == 2)
+          sm_prefetch (array, n * sizeof (double), SM_PREFETCH_READ);
+        for (long i = 0; i < n; i++)
+          wrong |= (array[i] != value (i, v));
+      }
+      if (wrong)
+        errors[nid] = 1;
+    }
+    sm_barrier ();
+    readback[v] = now () - start;
+  }
+
+  if (0 == nid) {
+    for (int i = 0; i < nodes; i++)
+      bad |= errors[i];
+
+    printf ("bulkbench: %d nodes, %d pages\n", nodes, pages);
+    printf ("  init:      loop %.3fs, sm_put %.3fs (%.1fx)\n",
+            init[0], init[1], init[0] / init[1]);
+    printf ("  read-back: loop %.3fs, sm_get %.3fs (%.1fx), sm_prefetch %.3fs (%.1fx)\n",
+            readback[0], readback[1], readback[0] / readback[1],
+            readback[2], readback[0] / readback[2]);
+    printf ("  %s\n", bad ? "WRONG VALUES READ BACK" : "all values read back correctly");
+  }
+
+  free (local);
+  sm_node_exit ();
+  return 0;
+}
@@ -0,0 +1,77 @@
+/*  DSM fault throughput benchmark
+ *
+ *  DESCRIPTION ---------------------------------------------------------------
+ *
+ *  Every node hammers its own block of pages with write faults. The blocks
+ *  rotate between the nodes each round, so every fault has to take the page
+ *  away from its previous writer, but no two nodes ever want the same page
+ *  at the same time. Node #0 reports the fault throughput, e.g.
+ *
+ *      for w in 0 1 2 4; do dsm -w $w -n 16 faultbench 32 20; done
+ *
+ *  shows how the allocator scales with its number of worker threads.
+ *
+ *  usage: faultbench [PAGES-PER-NODE] [ROUNDS]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "sm.h"
+
+static double now (void)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+int main (int argc, char *argv[])
+{
+  int   nodes, nid, pages = 32, rounds = 20;
+  long  page_size = getpagesize ();
+  char *region;
+  double start = 0;
+
+  if (sm_node_init (&argc, &argv, &nodes, &nid)) {
+    fprintf (stderr, "faultbench: cannot initialise\n");
+    exit (1);
+  }
+  if (argc > 1) pages  = atoi (argv[1]);
+  if (argc > 2) rounds = atoi (argv[2]);
+
+  /* One block of pages per node, aligned to a page boundary */
+  if (0 == nid) {
+    region = sm_malloc ((nodes * pages + 1) * page_size);
+    if (region == NULL) {
+      fprintf (stderr, "faultbench: cannot allocate %d pages\n", nodes * pages);
+      exit (1);
+    }
+    region = (char *) (((uintptr_t) region + page_size - 1) & ~(page_size - 1));
+  }
+  sm_bcast ((void **) &region, 0);
+
+  /* Round 0 gives every node its first block, it is not timed as nothing has to be invalidated */
+  for (int r = 0; r <= rounds; r++) {
+    char *block = region + (long) ((nid + r) % nodes) * pages * page_size;
+
+    if (r == 1) start = now ();
+    for (int p = 0; p < pages; p++)
+      block[p * page_size] = (char) r;
+    sm_barrier ();
+  }
+
+  if (0 == nid) {
+    double elapsed = now () - start;
+    long   faults  = (long) nodes * pages * rounds;
+
+    printf ("faultbench: %d nodes, %ld write faults in %.3fs, %.0f faults/s\n",
+            nodes, faults, elapsed, faults / elapsed);
+  }
+
+  sm_node_exit ();
+  return 0;
+}
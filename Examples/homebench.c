@@ -0,0 +1,91 @@
+/*  DSM home placement benchmark
+ *
+ *  DESCRIPTION ---------------------------------------------------------------
+ *
+ *  Node #0 allocates and clears an array of PAGES pages per node, then for
+ *  ROUNDS rounds every node updates its own slice of the array and, after a
+ *  barrier, reads the first page of the next node's slice. Under release
+ *  consistency (dsm -r) every page is homed at the allocator; with dsm -m
+ *  the pages start at node #0 (alloc or touch) and move to the node that
+ *  keeps writing them, after which its diffs never leave the node, e.g.
+ *
+ *      for o in -r "-m touch"; do dsm $o -n 4 homebench 32 100; done
+ *
+ *  usage: homebench [PAGES] [ROUNDS]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "sm.h"
+
+static double now (void)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+int main (int argc, char *argv[])
+{
+  int   nodes, nid, pages = 32, rounds = 100, bad = 0;
+  long  page_words, size;
+  volatile long *array, *checks;
+  double start, elapsed;
+
+  if (sm_node_init (&argc, &argv, &nodes, &nid)) {
+    fprintf (stderr, "homebench: cannot initialise\n");
+    exit (1);
+  }
+  if (argc > 1) pages = atoi (argv[1]);
+  if (argc > 2) rounds = atoi (argv[2]);
+  page_words = getpagesize () / sizeof (long);
+  size = (long) nodes * pages * getpagesize ();
+
+  if (0 == nid) {
+    array  = sm_malloc (size);
+    checks = sm_malloc (nodes * sizeof (long));
+    if (array == NULL || checks == NULL) {
+      fprintf (stderr, "homebench: cannot allocate the shared pages\n");
+      exit (1);
+    }
+    memset ((void *) array, 0, size);
+  }
+  sm_bcast ((void **) &array, 0);
+  sm_bcast ((void **) &checks, 0);
+
+  sm_barrier ();
+  start = now ();
+  for (int r = 1; r <= rounds; r++) {
+    for (long p = (long) nid * pages; p < (long) (nid + 1) * pages; p++)
+      for (long w = 0; w < page_words; w += 64)
+        array[p * page_words + w] += 1;
+    sm_barrier ();
+
+    /* The first page of the next slice, so every home also serves a reader */
+    bad |= (array[(long) ((nid + 1) % nodes) * pages * page_words] != r);
+    sm_barrier ();
+  }
+  elapsed = now () - start;
+
+  checks[nid] = bad;
+  sm_barrier ();
+
+  if (0 == nid) {
+    for (long p = 0; p < (long) nodes * pages; p++)
+      for (long w = 0; w < page_words; w += 64)
+        bad |= (array[p * page_words + w] != rounds);
+    for (int i = 0; i < nodes; i++)
+      bad |= checks[i];
+
+    printf ("homebench: %d nodes, %d rounds of %d pages each, %.3fs (%.1fus a round)\n", nodes, rounds,
+            pages, elapsed, elapsed * 1e6 / rounds);
+    printf ("  %s\n", bad ? "WRONG VALUES" : "all values correct");
+  }
+
+  sm_node_exit ();
+  return 0;
+}
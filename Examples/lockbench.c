@@ -0,0 +1,113 @@
+/*  DSM lock hand-off benchmark
+ *
+ *  DESCRIPTION ---------------------------------------------------------------
+ *
+ *  Every node increments a shared counter ROUNDS times, first under an
+ *  sm_lock() and then taking turns by spinning on a shared flag that names
+ *  the node whose turn it is, which sets it to the next node when it is
+ *  done. Both times are given per hand-off of the counter from one node to
+ *  another. With "bind" the counter is bound to the lock, so that under
+ *  release consistency only the counter travels with it, e.g.
+ *
+ *      for o in "" -d -r "-m touch"; do dsm $o -n 4 lockbench 200; done
+ *      dsm -r -n 4 lockbench 200 bind
+ *
+ *  Under sequential consistency every spinning node faults on the flag page
+ *  at each hand-off, so a hand-off by spinning costs time in proportion to
+ *  the number of nodes and the spinning as a whole grows with its square.
+ *  ROUNDS therefore defaults to 3200 / N^2 for N nodes (at most 200), which
+ *  is 200 with 4 nodes and 12 with 16.
+ *
+ *  usage: lockbench [ROUNDS] [bind]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "sm.h"
+#include "sm_ext.h"
+
+static double now (void)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+int main (int argc, char *argv[])
+{
+  int   nodes, nid, rounds = 200, bind, lock = -1;
+  char *shared;
+  volatile long *counter;
+  volatile int  *turn;
+  void *handle;
+  double start, locked, spun;
+
+  if (sm_node_init (&argc, &argv, &nodes, &nid)) {
+    fprintf (stderr, "lockbench: cannot initialise\n");
+    exit (1);
+  }
+  if (3200 / (nodes * nodes) < rounds)
+    rounds = 3200 / (nodes * nodes);
+  if (argc > 1) rounds = atoi (argv[1]);
+  bind = (argc > 2 && strcmp (argv[2], "bind") == 0);
+
+  /* The counter and the flag are on pages of their own */
+  if (0 == nid) {
+    shared = sm_malloc (2 * getpagesize ());
+    lock   = sm_lock_create ();
+    if (shared == NULL || lock < 0) {
+      fprintf (stderr, "lockbench: cannot allocate the counter or its lock\n");
+      exit (1);
+    }
+    memset (shared, 0, 2 * getpagesize ());
+    if (bind && sm_lock_bind (lock, shared, sizeof (long))) {
+      fprintf (stderr, "lockbench: cannot bind the counter to the lock\n");
+      exit (1);
+    }
+  }
+  handle = (void *) (intptr_t) lock;
+  sm_bcast ((void **) &shared, 0);
+  sm_bcast (&handle, 0);
+  lock    = (int) (intptr_t) handle;
+  counter = (volatile long *) shared;
+  turn    = (volatile int *) (shared + getpagesize ());
+
+  sm_barrier ();
+  start = now ();
+  for (int r = 0; r < rounds; r++) {
+    sm_lock (lock);
+    *counter += 1;
+    sm_unlock (lock);
+  }
+  sm_barrier ();
+  locked = now () - start;
+
+  start = now ();
+  for (int r = 0; r < rounds; r++) {
+    while (*turn != nid)
+      sm_acquire ();
+    *counter += 1;
+    *turn = (nid + 1) % nodes;
+    sm_release ();
+  }
+  sm_barrier ();
+  spun = now () - start;
+
+  if (0 == nid) {
+    long expected = 2L * rounds * nodes;
+
+    printf ("lockbench: %d nodes, %d rounds%s\n", nodes, rounds, bind ? ", counter bound to the lock" : "");
+    printf ("  sm_lock()     %8.1fus a hand-off\n", locked * 1e6 / ((double) rounds * nodes));
+    printf ("  flag spinning %8.1fus a hand-off\n", spun * 1e6 / ((double) rounds * nodes));
+    printf ("  %s (%ld of %ld)\n", (*counter == expected) ? "all values correct" : "WRONG VALUES", *counter,
+            expected);
+  }
+
+  sm_node_exit ();
+  return 0;
+}
@@ -0,0 +1,134 @@
+/*  DSM coherence protocol benchmark
+ *
+ *  DESCRIPTION ---------------------------------------------------------------
+ *
+ *  Times the two sharing patterns write-invalidate handles worst, each for
+ *  ROUNDS rounds separated by barriers:
+ *
+ *    producer/consumer  node #0 changes a few words of each of PAGES pages,
+ *                       then every other node reads all of them
+ *    migratory          the nodes take turns to read and then update a
+ *                       record of PAGES pages, one node per round
+ *
+ *  POLICY is passed to sm_advise() for both ranges: auto (the default, the
+ *  allocator picks the protocol from the faults it sees), invalidate,
+ *  update or migratory. Node #0 reports the times and checks the results,
+ *  e.g.
+ *
+ *      for p in invalidate auto; do dsm -n 4 protocolbench 200 8 $p; done
+ *
+ *  usage: protocolbench [ROUNDS] [PAGES] [POLICY]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "sm.h"
+#include "sm_ext.h"
+
+static double now (void)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+int main (int argc, char *argv[])
+{
+  static const char *policies[] = { "invalidate", "update", "migratory", "auto" };
+  int   nodes, nid, rounds = 100, pages = 4, policy = SM_ADVISE_AUTO, bad = 0;
+  long  page_words, sum;
+  volatile long *produced, *record, *checks;
+  double start, produce_time, migrate_time;
+
+  if (sm_node_init (&argc, &argv, &nodes, &nid)) {
+    fprintf (stderr, "protocolbench: cannot initialise\n");
+    exit (1);
+  }
+  if (argc > 1) rounds = atoi (argv[1]);
+  if (argc > 2) pages = atoi (argv[2]);
+  if (argc > 3) {
+    for (policy = 0; policy < 4 && strcmp (argv[3], policies[policy]); policy++);
+    if (policy == 4) {
+      fprintf (stderr, "protocolbench: unknown policy %s\n", argv[3]);
+      exit (1);
+    }
+  }
+  page_words = getpagesize () / sizeof (long);
+
+  if (0 == nid) {
+    produced = sm_malloc (pages * getpagesize ());
+    record   = sm_malloc (pages * getpagesize ());
+    checks   = sm_malloc (nodes * sizeof (long));
+    if (produced == NULL || record == NULL || checks == NULL) {
+      fprintf (stderr, "protocolbench: cannot allocate the shared pages\n");
+      exit (1);
+    }
+    memset ((void *) produced, 0, pages * getpagesize ());
+    memset ((void *) record, 0, pages * getpagesize ());
+    sm_advise ((void *) produced, pages * getpagesize (), policy);
+    sm_advise ((void *) record, pages * getpagesize (), policy);
+  }
+  sm_bcast ((void **) &produced, 0);
+  sm_bcast ((void **) &record, 0);
+  sm_bcast ((void **) &checks, 0);
+
+  /* Producer/consumer: a few words per page change each round */
+  sm_barrier ();
+  start = now ();
+  for (int r = 1; r <= rounds; r++) {
+    if (0 == nid) {
+      for (int p = 0; p < pages; p++)
+        for (int w = 0; w < 4; w++)
+          produced[p * page_words + w * 64] = r + p + w;
+    }
+    sm_barrier ();
+    if (0 != nid) {
+      for (int p = 0; p < pages; p++)
+        for (int w = 0; w < 4; w++)
+          bad |= (produced[p * page_words + w * 64] != r + p + w);
+    }
+    sm_barrier ();
+  }
+  produce_time = now () - start;
+
+  /* Migratory: each round one node reads the record and then adds to it */
+  sm_barrier ();
+  start = now ();
+  for (int r = 0; r < rounds; r++) {
+    if (r % nodes == nid) {
+      for (int p = 0; p < pages; p++) {
+        sum = record[p * page_words];
+        record[p * page_words] = sum + 1;
+      }
+    }
+    sm_barrier ();
+  }
+  migrate_time = now () - start;
+
+  if (0 == nid) {
+    for (int p = 0; p < pages; p++)
+      bad |= (record[p * page_words] != rounds);
+  }
+
+  /* Every node's check of what it consumed is gathered at node #0 */
+  checks[nid] = bad;
+  sm_barrier ();
+
+  if (0 == nid) {
+    for (int i = 0; i < nodes; i++)
+      bad |= checks[i];
+
+    printf ("protocolbench: %d nodes, %d rounds of %d pages, policy %s\n", nodes, rounds, pages,
+            policies[policy]);
+    printf ("  producer/consumer %.3fs (%.1fus a round), migratory %.3fs (%.1fus a round)\n",
+            produce_time, produce_time * 1e6 / rounds, migrate_time, migrate_time * 1e6 / rounds);
+    printf ("  %s\n", bad ? "WRONG VALUES" : "all values correct");
+  }
+
+  sm_node_exit ();
+  return 0;
+}
@@ -0,0 +1,149 @@
+/*  DSM reduction benchmark
+ *
+ *  DESCRIPTION ---------------------------------------------------------------
+ *
+ *  Every node sums its vector of COUNT doubles with every other node's, first
+ *  the way it is done with shared memory alone (each node copies its vector
+ *  into a shared array, and after a barrier adds up every node's slice of it)
+ *  and then with sm_allreduce(), e.g.
+ *
+ *      for o in "" -d -r "-m touch" -s; do dsm $o -n 8 reducebench 1000000; done
+ *      dsm -n 4 reducebench 1000
+ *
+ *  Both sums are checked, as are sm_reduce() with SM_MIN and SM_MAX and an
+ *  operation of the program's own.
+ *
+ *  usage: reducebench [COUNT]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/time.h>
+#include "sm.h"
+#include "sm_ext.h"
+
+static double now (void)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* The element of node `nid' at index `i', whole numbers so that every sum is exact
+ */
+static double element (int nid, long i)
+{
+  return (double) (i % 1000 + nid);
+}
+
+/* Multiply 32-bit integers, keeping the product's low bits
+ */
+static void multiply (void *inout, const void *in, size_t count)
+{
+  uint32_t       *to = inout;
+  const uint32_t *from = in;
+
+  for (size_t i = 0; i < count; i++)
+    to[i] *= from[i];
+}
+
+int main (int argc, char *argv[])
+{
+  int      nodes, nid, bad = 0, product;
+  long     count = 1000000;
+  double  *shared, *mine, *sums, start, through_memory, reduced;
+  int32_t  small[64];
+  uint32_t factors[64];
+
+  if (sm_node_init (&argc, &argv, &nodes, &nid)) {
+    fprintf (stderr, "reducebench: cannot initialise\n");
+    exit (1);
+  }
+  if (argc > 1) count = atol (argv[1]);
+  if (count < 1) count = 1;
+
+  mine = malloc (count * sizeof (double));
+  sums = malloc (count * sizeof (double));
+  if (mine == NULL || sums == NULL) {
+    fprintf (stderr, "reducebench: cannot allocate the vectors\n");
+    exit (1);
+  }
+  for (long i = 0; i < count; i++)
+    mine[i] = element (nid, i);
+
+  /* One slice of the shared array for each node */
+  if (0 == nid) {
+    shared = sm_malloc (nodes * count * sizeof (double));
+    if (shared == NULL) {
+      fprintf (stderr, "reducebench: cannot allocate the shared array\n");
+      exit (1);
+    }
+  }
+  sm_bcast ((void **) &shared, 0);
+
+  sm_barrier ();
+  start = now ();
+  memcpy (shared + nid * count, mine, count * sizeof (double));
+  sm_barrier ();
+  memset (sums, 0, count * sizeof (double));
+  for (int n = 0; n < nodes; n++)
+    for (long i = 0; i < count; i++)
+      sums[i] += shared[n * count + i];
+  sm_barrier ();
+  through_memory = now () - start;
+
+  for (long i = 0; i < count; i++)
+    bad |= (sums[i] != nodes * (double) (i % 1000) + nodes * (nodes - 1) / 2);
+
+  start = now ();
+  bad |= sm_allreduce (mine, count, SM_DOUBLE, SM_SUM);
+  reduced = now () - start;
+
+  for (long i = 0; i < count; i++)
+    bad |= (mine[i] != sums[i]);
+
+  /* The smallest and largest node ids, at a root other than node 0 */
+  for (int i = 0; i < 64; i++)
+    small[i] = nid * (i + 1);
+  bad |= sm_reduce (small, 64, SM_INT32, SM_MIN, nodes - 1);
+  if (nid == nodes - 1)
+    for (int i = 0; i < 64; i++)
+      bad |= (small[i] != 0);
+  for (int i = 0; i < 64; i++)
+    small[i] = -nid * (i + 1);
+  bad |= sm_allreduce (small, 64, SM_INT32, SM_MAX);
+  for (int i = 0; i < 64; i++)
+    bad |= (small[i] != 0);
+
+  /* The product of every node's id plus one */
+  product = sm_op_create (multiply);
+  for (int i = 0; i < 64; i++)
+    factors[i] = nid + 1;
+  bad |= sm_allreduce (factors, 64, SM_UINT32, product);
+  for (int i = 0; i < 64; i++) {
+    uint32_t expected = 1;
+
+    for (int n = 1; n <= nodes; n++)
+      expected *= n;
+    bad |= (factors[i] != expected);
+  }
+
+  /* Every node's checks are summed at node 0 */
+  small[0] = bad;
+  sm_reduce (small, 1, SM_INT32, SM_SUM, 0);
+
+  if (0 == nid) {
+    printf ("reducebench: %d nodes, %ld doubles each\n", nodes, count);
+    printf ("  shared array + barrier %8.3fs\n", through_memory);
+    printf ("  sm_allreduce()         %8.3fs\n", reduced);
+    printf ("  %s\n", small[0] ? "WRONG VALUES" : "all values correct");
+  }
+
+  free (mine);
+  free (sums);
+  sm_node_exit ();
+  return 0;
+}
@@ -0,0 +1,127 @@
+/*  DSM split-phase barrier benchmark
+ *
+ *  DESCRIPTION ---------------------------------------------------------------
+ *
+ *  Each round every node does some work that the other nodes depend on, and
+ *  then some that they don't, WORK microseconds each. One node is slow in
+ *  each round (a different one every time), its dependent work taking
+ *  twice as long. With sm_barrier() between the two parts every node waits
+ *  for the slow one each round; with sm_barrier_begin() before the
+ *  independent work and sm_barrier_end() after it the wait is hidden, e.g.
+ *
+ *      for o in "" -d -r "-m touch" -s; do dsm $o -n 4 splitbench 200 2000; done
+ *
+ *  Work is simulated by sleeping, so that what is measured doesn't depend on
+ *  how many CPUs the nodes share. Each round also broadcasts a value with
+ *  sm_ibcast(), polled with sm_test() during the independent work, and
+ *  checks the other nodes' writes before the barrier under either form.
+ *
+ *  usage: splitbench [ROUNDS] [WORK]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/time.h>
+#include "sm.h"
+#include "sm_ext.h"
+
+#define SLICES 10 /* The independent work is done in slices, testing the broadcast after each */
+
+static double now (void)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void work (long us)
+{
+  struct timespec ts = { us / 1000000, (us % 1000000) * 1000 };
+
+  while (nanosleep (&ts, &ts))
+    ;
+}
+
+int main (int argc, char *argv[])
+{
+  int   nodes, nid, rounds = 200, bad = 0;
+  long  us = 2000;
+  long *slots;
+  double start, blocking, split;
+
+  if (sm_node_init (&argc, &argv, &nodes, &nid)) {
+    fprintf (stderr, "splitbench: cannot initialise\n");
+    exit (1);
+  }
+  if (argc > 1) rounds = atoi (argv[1]);
+  if (argc > 2) us = atol (argv[2]);
+
+  /* A slot for each node, written before each barrier and read by every node after it. The rounds
+   * alternate between two sets, a node can only be one round ahead of the slowest. */
+  if (0 == nid) {
+    slots = sm_malloc (2 * nodes * sizeof (long));
+    if (slots == NULL) {
+      fprintf (stderr, "splitbench: cannot allocate the slots\n");
+      exit (1);
+    }
+  }
+  sm_bcast ((void **) &slots, 0);
+
+  for (int phased = 0; phased <= 1; phased++) {
+    sm_barrier ();
+    start = now ();
+
+    for (int round = 0; round < rounds; round++) {
+      int   root = (round + 1) % nodes, request, barrier = -1, done = 0;
+      void *value = (void *) (uintptr_t) (round * 1000 + root);
+      long *mine = slots + (round % 2) * nodes;
+
+      work ((nid == round % nodes) ? 2 * us : us);
+      mine[nid] = round * nodes + nid;
+
+      /* The broadcast is outstanding during the independent work */
+      request = sm_ibcast ((void **) &value, root);
+      if (phased)
+        barrier = sm_barrier_begin ();
+      else
+        sm_barrier ();
+
+      for (int slice = 0; slice < SLICES; slice++) {
+        work (us / SLICES);
+        if (!done)
+          done = sm_test (request);
+      }
+      if (!done)
+        bad |= sm_wait (request);
+      if (phased) {
+        bad |= (barrier < 0);
+        sm_barrier_end ();
+      }
+
+      bad |= (value != (void *) (uintptr_t) (round * 1000 + root));
+      for (int n = 0; n < nodes; n++)
+        bad |= (mine[n] != round * nodes + n);
+    }
+
+    if (phased)
+      split = now () - start;
+    else
+      blocking = now () - start;
+  }
+
+  if (bad)
+    fprintf (stderr, "splitbench: node %d saw wrong values\n", nid);
+
+  if (0 == nid) {
+    printf ("splitbench: %d nodes, %d rounds, %ldus of work twice a round\n", nodes, rounds, us);
+    printf ("  sm_barrier()                      %8.3fs %8.1fus a round\n", blocking, blocking * 1e6 / rounds);
+    printf ("  sm_barrier_begin()/_end()         %8.3fs %8.1fus a round\n", split, split * 1e6 / rounds);
+    printf ("  %s\n", bad ? "WRONG VALUES" : "all values correct");
+  }
+
+  sm_node_exit ();
+  return 0;
+}
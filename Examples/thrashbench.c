@@ -0,0 +1,81 @@
+/*  DSM false sharing benchmark
+ *
+ *  DESCRIPTION ---------------------------------------------------------------
+ *
+ *  Every node increments its own counter ITERATIONS times, doing WORK steps
+ *  of private computation between increments, but all of the counters live
+ *  in the same page, so every increment may have to take the page away from
+ *  whichever node wrote it last. Node #0 reports the time and checks the
+ *  counters, e.g.
+ *
+ *      for t in 0 200 1000; do dsm -t $t -n 4 -l log thrashbench 20000 200; done
+ *
+ *  shows what the allocator's hold window (dsm -t) does to a page thrashing
+ *  between writers; the log lists the most contended pages at the end.
+ *
+ *  usage: thrashbench [ITERATIONS] [WORK]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "sm.h"
+
+static double now (void)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+int main (int argc, char *argv[])
+{
+  int   nodes, nid, iterations = 1000, work = 100, bad = 0;
+  volatile long *counters;
+  volatile double sink = 0;
+  double start, elapsed;
+
+  if (sm_node_init (&argc, &argv, &nodes, &nid)) {
+    fprintf (stderr, "thrashbench: cannot initialise\n");
+    exit (1);
+  }
+  if (argc > 1) iterations = atoi (argv[1]);
+  if (argc > 2) work = atoi (argv[2]);
+
+  /* One counter per node, a cache line apart but all in one page */
+  if (0 == nid) {
+    counters = sm_malloc (nodes * 8 * sizeof (long));
+    if (counters == NULL) {
+      fprintf (stderr, "thrashbench: cannot allocate the counters\n");
+      exit (1);
+    }
+    for (int i = 0; i < nodes; i++)
+      counters[i * 8] = 0;
+  }
+  sm_bcast ((void **) &counters, 0);
+
+  sm_barrier ();
+  start = now ();
+  for (int i = 0; i < iterations; i++) {
+    for (int j = 0; j < work; j++)
+      sink += j * 0.5;
+    counters[nid * 8]++;
+  }
+  sm_barrier ();
+  elapsed = now () - start;
+
+  if (0 == nid) {
+    for (int i = 0; i < nodes; i++)
+      bad |= (counters[i * 8] != iterations);
+
+    printf ("thrashbench: %d nodes, %d increments each in %.3fs, %.0f increments/s\n",
+            nodes, iterations, elapsed, nodes * iterations / elapsed);
+    printf ("  %s\n", bad ? "WRONG COUNTS" : "all counts correct");
+  }
+
+  sm_node_exit ();
+  return 0;
+}
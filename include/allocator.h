@@ -9,6 +9,5 @@ int allocator_init   ();
 int socket_init      ();
 int allocator_end    ();
 int allocate         ();
-int wait_for_messages();
 
 #endif
\ No newline at end of file
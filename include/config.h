@@ -1,11 +1,43 @@
 
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifndef _CONFIG_H
+#define _CONFIG_H
+
 #define USAGE "Usage: dsm [OPTION]... EXECUTABLE-FILE NODE-OPTION...\n\n\
+    -d          transfer pages directly between the nodes, using a dynamic\n\
+                distributed manager instead of the allocator\n\
+    -r          release consistency: writes are only made visible to other\n\
+                nodes by sm_release() (or sm_barrier()) and seen after their\n\
+                next sm_acquire() (or sm_barrier())\n\
+    -e ENGINE   event engine: select, epoll (default) or uring\n\
+    -f FANOUT   fan-out of the barrier and broadcast tree with -d (default 2)\n\
     -H HOSTFILE list of host names\n\
     -h          this usage message\n\
     -l LOGFILE  log each significant allocator action to LOGFILE\n\
                 (e.g., read/write fault, invalidate request)\n\
+    -m HOMES    home-based release consistency (implies -r): each page's\n\
+                master copy is kept by a node, its home, which serves its\n\
+                faults and receives its diffs. HOMES is touch (the first\n\
+                node to use the page) or alloc (the node that allocated it),\n\
+                a page moves to a node that keeps using it at a barrier\n\
     -n N        start N node processes\n\
-    -v          print version information\n\n\
+    -p          prefetch: a read fault also fetches the next pages of a\n\
+                sequential or strided walk the node is making\n\
+    -s          the nodes run on this host and share its memory, there are\n\
+                no page faults\n\
+    -t MAX      hold a page granted to a writer for a window of up to MAX\n\
+                microseconds before another node's fault may take it away,\n\
+                the window adapts to how often the page changes hands\n\
+                (default 0, no window)\n\
+    -u          the nodes handle page faults with userfaultfd instead of\n\
+                SIGSEGV, where the kernel allows it\n\
+    -v          print version information\n\
+    -w N        handle faults on N allocator worker threads, each owning\n\
+                the pages p where p % N is its index (default 0, faults\n\
+                are handled by the network thread)\n\n\
 Starts the allocator, which starts N copies (one copy if -n not given) of \
 EXECUTABLE-FILE.  The NODE-OPTIONs are passed as arguments to the node \
 processes.  The hosts on which node processes are started are given in \
@@ -18,7 +50,7 @@ HOSTFILE, which defaults to `hosts'.  If the file does not exist, \
 #define NAME_LEN_MAX    256
 #define COMMAND_LEN_MAX 256
 #define MSG_LEN_MAX     256
-#define SM_MAX_NODES    16
+#define SM_MAX_NODES    64
 
 #define SM_BUFF_SIZE 1024
 
@@ -29,15 +61,30 @@ HOSTFILE, which defaults to `hosts'.  If the file does not exist, \
 #define SM_ARG_MAX 32
 #define SM_HOSTS_MAX 10
 #define SM_PAGESIZE  1024
-#define SM_MAX_PAGES 1000
+#define SM_MAX_PAGES SM_NUM_PAGES
 #define SM_PORT      9243
 
+#define SM_HOLD_MIN  50      /* The first window of a contended page, in microseconds (dsm -t) */
+#define SM_HOLD_MAX  1000000 /* The largest window dsm -t accepts */
+
+#define SM_HOME_TOUCH 1 /* A page's home is the first node to touch it (dsm -m touch) */
+#define SM_HOME_ALLOC 2 /* A page's home is the node that allocated it (dsm -m alloc) */
+
 #define ANSI_COLOR_RED   "\x1b[31m"
 #define ANSI_COLOR_RESET "\x1b[0m"
 
 /* */
 struct options {
     int    n_nodes;    /* The number of nodes required */   
+    int    n_workers;  /* The number of allocator worker threads (0 to handle faults inline) */
+    int    distributed; /* Pages are moved between the nodes by the distributed manager */
+    int    release;    /* Memory is release consistent, writers send diffs of their pages */
+    int    homes;      /* How pages get their home nodes under release consistency (dsm -m), 0 for none */
+    int    fanout;     /* The fan-out of the barrier and broadcast tree (dsm -d) */
+    int    shared;     /* The nodes share the allocator's host and memory (dsm -s) */
+    int    userfault;  /* The nodes handle their faults with userfaultfd (dsm -u) */
+    int    prefetch;   /* The nodes prefetch along the pages their read faults walk (dsm -p) */
+    uint32_t hold;     /* The longest window a writer holds a contended page for, in microseconds (dsm -t) */
     FILE  *log_file;   /* The log file for the operations performed */
     
     char **host_names; /* A list of host-names (addresses of the nodes) */
@@ -46,19 +93,41 @@ struct options {
     char  *program;    /* The name of the program to be ran */
     char **prog_args;  /* The arguments to be passed to the program */
 };
-struct options *options;
+extern struct options *options;
 
-/* */
-struct memory_page {    
-    int  writer;  /* The nid of the node with writer permissions (-1 if no writer) */
-    int *readers; /* Indicates if a node has read permissions (1 if so, 0 if not) */
-};
-struct memory_page sm_page_table[SM_MAX_PAGES];
-
-void *sm_memory_map;                /* A cache of all of the shared memory */
-int   sm_current_page;              /* The next available page in the memory map */
-int   sm_current_offset;            /* The next memory allocation offset within the free page */
-int   sm_node_count;                /* The number of active nodes */
-int   sm_socket;                    /* The socket used to receive connections */
-int   client_sockets[SM_MAX_NODES]; /* All of the connected client sockets */
-pid_t client_pids[SM_MAX_NODES];    /* The PIDs of all of the clients */
\ No newline at end of file
+/*
+ * The allocator's directory entry for a page, one cache line each. The entries are allocated lazily in
+ * the two-level directory of sm_directory.h, so pages that have never been touched cost nothing.
+ */
+struct memory_page {
+    int16_t  writer;  /* The nid of the node with writer permissions (-1 if no writer) */
+    uint8_t  busy;    /* Set while the page's copies are being changed, by a pending fault or a bulk request */
+    uint8_t  protocol; /* The coherence protocol (SM_PROTO_* of sm_message.h) and the SM_PAGE_* flags */
+    uint32_t version; /* Incremented every time the page's contents may have changed */
+    uint64_t readers; /* Bit n is set if node n has a read copy */
+    uint64_t stale;   /* Bit n is set if node n is owed a write notice (dsm -r) or kept its copy (write-update) */
+    uint64_t waiting; /* The nodes yet to answer the requests of the pending fault */
+    struct sm_message *pending; /* The fault waiting on the nodes in `waiting' (the page is busy), if any */
+    uint64_t granted; /* When the writer was granted the page, in microseconds */
+    uint32_t window;  /* How long the writer holds the page before other faults may take it (dsm -t) */
+    uint32_t steals;  /* The times ownership was taken away soon after being granted */
+    uint32_t held;    /* The faults held back by the window */
+    int16_t  last;    /* The nid of the node granted ownership last (-1 if none has been) */
+    int8_t   votes;   /* Write faults in a row suggesting write-update (> 0) or migratory (< 0) */
+} __attribute__((aligned(64)));
+
+#define SM_PAGE_PROTOCOL  0x03 /* The protocol bits of memory_page.protocol */
+#define SM_PAGE_PINNED    0x04 /* The protocol was chosen by sm_advise(), it doesn't switch by itself */
+#define SM_PAGE_MIGRATING 0x08 /* The read fault pending on the page is being granted ownership */
+#define SM_PAGE_MIGRATED  0x10 /* The writer was granted ownership by a read fault and may not have written */
+#define SM_PAGE_VOTES     2    /* The write faults in a row that switch a page's protocol */
+
+extern void *sm_memory_map;                /* A cache of all of the shared memory */
+extern void *sm_twin_map;                  /* What the readers of write-update pages kept, same offsets */
+extern int   sm_current_page;              /* The next available page in the memory map */
+extern int   sm_node_count;                /* The number of active nodes */
+extern int   sm_socket;                    /* The socket used to receive connections */
+extern int   client_sockets[SM_MAX_NODES]; /* All of the connected client sockets */
+extern pid_t client_pids[SM_MAX_NODES];    /* The PIDs of all of the clients */
+
+#endif
@@ -3,15 +3,39 @@
 #ifndef NODE_FUNCTIONS_H
 #define NODE_FUNCTIONS_H
 
+#define SM_PENDING 1 /* Returned by a fault handler that left the fault pending on its page */
+
 int node_init    (int socket);
-int node_close   (int nid);
+int node_close   (int nid, msg_t *request);
+int node_peers   ();
 
 int node_execute (msg_t *request);
+int node_deferred();
+long node_hold_time();
+
+int node_await   (int nid, int type, uint32_t page, msg_t **reply);
+int node_barrier (int nid, msg_t *request);
+int node_allocate(int nid, msg_t *request);
+int node_cast    (int nid, msg_t *request);
+int node_diff    (int nid, msg_t *request);
+int node_acquire (int nid, msg_t *request);
+int node_where   (int nid, msg_t *request);
+int node_notice  (int nid, msg_t *request);
+int node_fetch   (int nid, msg_t *request);
+int node_get     (int nid, msg_t *request);
+int node_put     (int nid, msg_t *request);
+int node_put_done(int nid, msg_t *request);
+int node_advise  (int nid, msg_t *request);
+int node_lock_create(int nid, msg_t *request);
+int node_lock_bind(int nid, msg_t *request);
+int node_lock    (int nid, msg_t *request);
+int node_unlock  (int nid, msg_t *request);
+int node_atomic  (int nid, msg_t *request);
+int node_reduce  (int nid, msg_t *request);
+int node_reduce_data(int nid, msg_t *request);
 
-int node_wait    (int nid, int mode, void **ret, int root);
-int node_barrier (int nid);
-int node_allocate(int nid, char request[]);
-int node_cast    (int nid, char request[]);
-int handle_fault (int nid, char request[]);
+int handle_read_fault (int nid, msg_t *request);
+int handle_write_fault(int nid, msg_t *request);
+int node_answered     (msg_t *reply);
 
-#endif
\ No newline at end of file
+#endif
@@ -23,6 +23,7 @@
 #define	_SM_H
 
 #include <stdlib.h>
+#include <signal.h>
 
 /* Register a node process with the SM allocator.
  *
@@ -0,0 +1,29 @@
+#include <stdint.h>
+#include "config.h"
+
+#ifndef _SM_DIRECTORY_H
+#define _SM_DIRECTORY_H
+
+/*
+ * The allocator's page directory, a two-level radix table covering all SM_NUM_PAGES pages. The root is
+ * indexed by the high bits of the page number and each leaf holds the entries of SM_DIR_LEAF pages,
+ * leaves are only allocated once one of their pages is first used.
+ */
+#define SM_DIR_BITS 8
+#define SM_DIR_LEAF (1 << SM_DIR_BITS)
+#define SM_DIR_ROOT ((SM_NUM_PAGES + SM_DIR_LEAF - 1) / SM_DIR_LEAF)
+
+/* Copysets are single words */
+_Static_assert(SM_MAX_NODES <= 64, "a copyset has one bit per node");
+
+/* Iterate over the nids set in a copyset, lowest first */
+#define SM_FOR_EACH_NODE(nid, set) \
+    for (uint64_t _set = (set); _set && ((nid) = __builtin_ctzll(_set), 1); _set &= _set - 1)
+
+struct memory_page *sm_page          (uint32_t page_n);
+struct memory_page *sm_page_lookup   (uint32_t page_n);
+void                sm_page_stale    (uint32_t page_n, uint64_t nodes);
+int                 sm_directory_stale(int nid, uint32_t *pages, int max);
+void                sm_directory_free(void);
+
+#endif
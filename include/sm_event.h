@@ -0,0 +1,35 @@
+#include "sm_message.h"
+
+#ifndef _SM_EVENT_H
+#define _SM_EVENT_H
+
+/*
+ * An event engine delivers complete messages from the client sockets to the allocator. The engine is
+ * chosen at start up with `dsm -e ENGINE'.
+ *
+ * - select: rebuilds an fd_set and scans every client each time (the original loop)
+ * - epoll:  only visits the clients that have data waiting (the default)
+ * - uring:  keeps a header receive posted on every client and reaps completions in batches, sends
+ *           are queued and submitted together on the next turn of the loop
+ */
+struct sm_event_engine {
+    char *name;
+
+    int  (*init)  (int max_clients);      /* Prepare the engine for up to max_clients sockets */
+    int  (*add)   (int nid, int socket);  /* Start delivering messages from the node's socket */
+    int  (*remove)(int nid);              /* Stop delivering messages from the node's socket */
+    int  (*next)  (msg_t **message, long timeout); /* Block until a complete message has arrived from any node,
+                                                      * or for at most timeout microseconds (-1 for no limit)
+                                                      * after which *message is NULL */
+    void (*end)   (void);                 /* Release the engine's resources */
+};
+
+extern struct sm_event_engine sm_event_select;
+extern struct sm_event_engine sm_event_epoll;
+extern struct sm_event_engine sm_event_uring;
+
+extern struct sm_event_engine *sm_event; /* The engine in use */
+
+int sm_event_choose(char *name);
+
+#endif
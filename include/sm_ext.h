@@ -0,0 +1,279 @@
+/*  DSM Assignment: Shared memory library - extensions
+ *
+ *  DESCRIPTION ---------------------------------------------------------------
+ *
+ *  This header defines extensions to the shared memory API (sm.h), which is
+ *  fixed: the release and acquire of release consistency, locks, calls for
+ *  moving whole ranges of shared memory at once rather than one page fault
+ *  at a time, for choosing how the allocator keeps a range's copies
+ *  coherent, atomic operations on shared words that don't move their
+ *  pages, reductions across every node, barriers and broadcasts split
+ *  into a start and a completion, and broadcasts of whole buffers.
+ *
+ *  The bulk calls are only worth anything with the allocator's own protocol
+ *  (the default, -w, -u and -p). Under -d, -r and -s the copies are plain
+ *  memcpy() calls and sm_prefetch() and sm_advise() do nothing. The atomic
+ *  operations and the reductions work under every protocol.
+ *
+ */
+
+#ifndef	_SM_EXT_H
+#define	_SM_EXT_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#define SM_PREFETCH_READ  0 /* Read copies of the range */
+#define SM_PREFETCH_WRITE 1 /* Ownership of the range, its old contents are still sent */
+
+#define SM_ADVISE_INVALIDATE 0 /* A write invalidates every other copy */
+#define SM_ADVISE_UPDATE     1 /* Readers keep their copies and are sent what a write changed */
+#define SM_ADVISE_MIGRATORY  2 /* A read fault takes ownership of the page along with it */
+#define SM_ADVISE_AUTO       3 /* The allocator picks one of the above from the faults it sees */
+
+#define SM_ATOMIC_ADD  0 /* The word is incremented by `value' */
+#define SM_ATOMIC_SWAP 1 /* The word is replaced by `value' */
+#define SM_ATOMIC_CAS  2 /* The word is replaced by `value' if it equals `compare' */
+
+/* An atomic operation on a 32 or 64-bit word of shared memory, for sm_atomic_batch() */
+struct sm_atomic_op {
+    void     *addr;    /* The word, aligned to its width */
+    int       op;      /* SM_ATOMIC_ADD, SM_ATOMIC_SWAP or SM_ATOMIC_CAS */
+    int       width;   /* 4 or 8 bytes */
+    uint64_t  value;
+    uint64_t  compare; /* SM_ATOMIC_CAS only */
+    uint64_t  result;  /* Set to the word's value before the operation */
+};
+
+/* Acquire
+ *
+ * - Makes the writes released by other node processes visible to this one.
+ * - Only needed when dsm runs with release consistency (-r), otherwise
+ *   memory is sequentially consistent and this does nothing.
+ * - sm_barrier() both releases and acquires.
+ */
+void sm_acquire (void);
+
+/* Release
+ *
+ * - Makes the writes of this node process since its last release visible
+ *   to the other node processes at their next acquire.
+ * - Only needed when dsm runs with release consistency (-r), otherwise
+ *   memory is sequentially consistent and this does nothing.
+ */
+void sm_release (void);
+
+/* Create a lock
+ *
+ * - Returns the new lock, or -1 if there are no more. Locks are made known
+ *   to the other node processes by the program, e.g. with sm_bcast().
+ */
+int sm_lock_create (void);
+
+/* Bind `len' bytes of shared memory at `addr' to a lock
+ *
+ * - Returns 0 upon successful completion; otherwise, -1.
+ * - Under release consistency (-r, -m) taking a bound lock only makes the
+ *   range up to date, its last holder's changes to it come with the lock,
+ *   and releasing the lock only releases the range. Unbound locks acquire
+ *   and release everything. Otherwise binding makes no difference.
+ * - The range is at most 64KB and `len' 0 unbinds the lock. Bind a lock
+ *   before it is first taken.
+ */
+int sm_lock_bind (int lock, void *addr, size_t len);
+
+/* Take a lock, waiting for it if another node process holds it
+ *
+ * - The waiters are granted the lock in the order they asked for it, each
+ *   one is handed the lock as its holder releases it.
+ */
+void sm_lock (int lock);
+
+/* Release a lock
+ */
+void sm_unlock (int lock);
+
+/* Prefetch a range of shared memory
+ *
+ * - Returns 0 once the request has been sent, the pages arrive in the
+ *   background and the first access to each of them no longer waits for
+ *   the allocator. Returns -1 if the request couldn't be sent.
+ * - Pages that are busy elsewhere when the request is handled are skipped,
+ *   they are faulted in as usual.
+ * - Only one request is outstanding at a time, a second call (and the
+ *   other calls below) waits for the first to have been handled.
+ */
+int sm_prefetch (void *addr, size_t len, int mode);
+
+/* Copy `len' bytes from shared memory at `src' to private memory at `dst'
+ *
+ * - Returns 0 upon successful completion; otherwise, -1.
+ * - Pages the node holds no copy of are sent in a batch straight into `dst'
+ *   and the node doesn't become a reader of them, so later writes by other
+ *   nodes don't have to invalidate anything here.
+ */
+int sm_get (void *dst, const void *src, size_t len);
+
+/* Copy `len' bytes from private memory at `src' to shared memory at `dst'
+ *
+ * - Returns 0 upon successful completion; otherwise, -1.
+ * - Pages the node doesn't own are written at the allocator, which
+ *   invalidates every copy of them first, so the node doesn't have to
+ *   fault them in only to overwrite them.
+ */
+int sm_put (void *dst, const void *src, size_t len);
+
+/* Choose the coherence protocol of the pages covering a range
+ *
+ * - Returns 0 once the allocator has switched the pages over; otherwise, -1.
+ * - The allocator otherwise switches each page between the protocols by
+ *   itself: pages one node writes and others then read become
+ *   write-update, and pages read and then written by one node after
+ *   another become migratory. The protocol chosen here sticks until
+ *   SM_ADVISE_AUTO hands the pages back.
+ * - Write-update only saves the readers a round trip when one of them
+ *   faults on the page after a write, the others are sent the changes
+ *   then. Migratory saves the upgrade fault of a read followed by a write.
+ */
+int sm_advise (void *addr, size_t len, int policy);
+
+/* Apply an atomic operation to a word of shared memory, setting `*old' to
+ * its old value
+ *
+ * - The operation is executed wherever the page's latest contents are: at
+ *   the allocator (which invalidates any copies of the page first), at the
+ *   page's home (dsm -m) or at its owner (dsm -d), with a single request
+ *   and reply. The page isn't moved to this node. Under -s it is a hardware
+ *   atomic, and under -d an owner that has handed out read copies makes
+ *   this node take the page as for a write.
+ * - Under release consistency (dsm -r and -m) the word is changed for the
+ *   other nodes as if this node had written it and released it, they see
+ *   it after their next acquire; this node's own copy is updated in place.
+ * - Returns 0 upon successful completion; otherwise, -1 (e.g. if the word
+ *   isn't in shared memory or isn't aligned to its width), and `*old' is
+ *   then 0.
+ *
+ * sm_fetch_add(), sm_swap() and sm_compare_swap() take a pointer to any 32
+ * or 64-bit integer and a pointer to one of the same type for its old value.
+ */
+int sm_atomic (void *addr, int op, int width, uint64_t value, uint64_t compare, uint64_t *old);
+
+#define SM_ATOMIC_OLD(addr, op, value, compare, old) ({ \
+    uint64_t sm_old_; \
+    int sm_status_ = sm_atomic ((void *) (addr), (op), sizeof(*(addr)), (uint64_t) (value), (uint64_t) (compare), \
+                                &sm_old_); \
+    *(old) = (__typeof__(*(addr))) sm_old_; \
+    sm_status_; })
+
+#define sm_fetch_add(addr, value, old)              SM_ATOMIC_OLD(addr, SM_ATOMIC_ADD, value, 0, old)
+#define sm_swap(addr, value, old)                   SM_ATOMIC_OLD(addr, SM_ATOMIC_SWAP, value, 0, old)
+#define sm_compare_swap(addr, expected, value, old) SM_ATOMIC_OLD(addr, SM_ATOMIC_CAS, value, expected, old)
+
+/* Apply `n_ops' atomic operations, setting the result of each
+ *
+ * - Returns 0 upon successful completion; otherwise, -1.
+ * - Consecutive operations on the same page go in one message (up to 1024
+ *   of them), applied in order, so many increments cost one round trip.
+ *   Each operation is atomic by itself, not the batch as a whole.
+ */
+int sm_atomic_batch (struct sm_atomic_op *ops, int n_ops);
+
+/* The element types and operations of reductions
+ */
+#define SM_INT32  0
+#define SM_INT64  1
+#define SM_UINT32 2
+#define SM_UINT64 3
+#define SM_FLOAT  4
+#define SM_DOUBLE 5
+
+#define SM_SUM    0
+#define SM_MIN    1
+#define SM_MAX    2
+
+/* Reduction
+ *
+ * - The `count' elements of `type' at `buf' in every node process are
+ *   combined element by element with `op', and the result is left at `buf'
+ *   in node process `root_nid'. The other node processes' `buf' is unchanged.
+ * - `op' is SM_SUM, SM_MIN, SM_MAX or an operation from sm_op_create().
+ * - Every node process takes part, with the same `count', `type', `op' and
+ *   `root_nid'.
+ * - Returns 0 upon successful completion; otherwise, -1.
+ * - `buf' may not refer to shared memory.
+ */
+int sm_reduce (void *buf, size_t count, int type, int op, int root_nid);
+
+/* Reduction whose result is left at `buf' in every node process
+ *
+ * - As sm_reduce(), without a root.
+ */
+int sm_allreduce (void *buf, size_t count, int type, int op);
+
+/* Create a reduction operation
+ *
+ * - `combine' combines the `count' elements at `in' into those at `inout'.
+ *   It is called by the root with each node process' elements in turn, in
+ *   the order they arrive, so it has to be associative and commutative; it
+ *   may be called from a thread of the library's.
+ * - Returns the operation, or -1 if there are no more. Every node process
+ *   creates the same operations in the same order.
+ */
+int sm_op_create (void (*combine) (void *inout, const void *in, size_t count));
+
+/* Start a barrier
+ *
+ * - Returns a request for sm_test() and sm_wait(), or -1 if the barrier
+ *   couldn't be started. It completes at sm_barrier_end(), or once
+ *   sm_test() or sm_wait() finds that it has.
+ * - In between, the node process may get on with work that doesn't need
+ *   the other node processes to have arrived; the library keeps serving
+ *   them in the meantime. Under release consistency (-r, -m) the node
+ *   process' writes in between belong after the barrier, and writes by
+ *   the others before it are only visible once it has completed.
+ * - A node process has at most one barrier in progress, starting another
+ *   one (or calling sm_barrier()) completes it first.
+ */
+int sm_barrier_begin (void);
+
+/* Complete the barrier started by sm_barrier_begin()
+ */
+void sm_barrier_end (void);
+
+/* Start a broadcast
+ *
+ * - As sm_bcast(), but `*addr' is only set once the request returned has
+ *   completed, by sm_test() or sm_wait(); until then `addr' must stay
+ *   valid. Returns -1 if the broadcast couldn't be started.
+ * - A node process has at most one broadcast in progress, starting another
+ *   one (or calling sm_bcast()) completes it first.
+ */
+int sm_ibcast (void **addr, int root_nid);
+
+/* Wait for a request of sm_barrier_begin() or sm_ibcast() to complete
+ *
+ * - Returns 0 upon successful completion (also if the request had already
+ *   completed); otherwise, -1.
+ */
+int sm_wait (int request);
+
+/* Complete a request of sm_barrier_begin() or sm_ibcast() if it can be
+ * without waiting
+ *
+ * - Returns 1 if the request has completed, 0 if it hasn't yet and -1 on
+ *   failure.
+ */
+int sm_test (int request);
+
+/* Broadcast a buffer
+ *
+ * - The `len' bytes at `buf' in node process `root_nid' are copied to `buf'
+ *   in the remaining node processes, which all pass the same `len'.
+ * - Large buffers are sent in chunks which reach every node process as
+ *   they arrive; up to the size of a pointer it is sent as by sm_bcast().
+ * - Returns 0 upon successful completion; otherwise, -1.
+ * - `buf' may not refer to shared memory.
+ */
+int sm_bcast_buf (void *buf, size_t len, int root_nid);
+
+#endif
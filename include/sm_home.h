@@ -0,0 +1,37 @@
+#include <stdint.h>
+#include "sm_message.h"
+#include "sm_node.h"
+
+#ifndef _SM_HOME_H
+#define _SM_HOME_H
+
+/*
+ * Home-based release consistency (dsm -m), on top of the twins and diffs of sm_lrc.c.
+ *
+ * Every page has a home node, named by the allocator: the first node to touch it, or the node that
+ * allocated it. The home keeps the page's master copy in a separate mapping, a home thread serves the
+ * other nodes' faults from it over direct connections and applies the diffs they release to it, so
+ * the allocator only tracks where the homes are and collects the write notices. A node's own use of a
+ * page homed at it never leaves the node.
+ *
+ * A home counts the accesses to each page homed at it, and a run of them by one other node proposes
+ * that node as the page's home at the next barrier. The allocator lists the moves it agreed to in the
+ * barrier's release, the old homes hand the master copies over and the nodes then meet at the barrier
+ * again, so that nobody asks a new home for a page before it has it.
+ */
+extern int sm_home_active;
+
+int   sm_home_init      (void);
+int   sm_home_start     (void);
+int   sm_home_read_fault(uint32_t page_n);
+int   sm_home_fetch     (uint32_t page_n);
+int   sm_home_diff      (uint32_t page_n, const char *diff, uint32_t len);
+int   sm_home_atomic    (uint32_t page_n, const char *ops, uint32_t len, char *olds);
+int   sm_home_release   (void);
+int   sm_home_barrier_begin(uint32_t *seq);
+int   sm_home_barrier_end(msg_t *message);
+char *sm_home_sink      (msg_t *message);
+int   sm_home_socket    (int nid);
+void  sm_home_exit      (void);
+
+#endif
@@ -0,0 +1,24 @@
+#include <stdint.h>
+#include "sm_message.h"
+#include "sm_node.h"
+
+#ifndef _SM_LOCK_H
+#define _SM_LOCK_H
+
+/*
+ * Locks (sm_lock() in sm.h), queued first come first served at the allocator.
+ *
+ * A node asks the allocator for a lock and waits for its grant, nobody polls. A free lock is granted by
+ * the allocator straight away. Otherwise, when the nodes are connected to each other (dsm -d and -m),
+ * the allocator tells the last node to ask for the lock who asked after it, and that node hands the lock
+ * over directly when it releases it; without the connections the waiters queue at the allocator, which
+ * grants the lock to the next of them when it is released.
+ *
+ * Under release consistency (dsm -r and -m) a lock is an acquire and its release a release, unless a
+ * range of shared memory is bound to it. Then only the range is released, and its contents travel with
+ * the grant and are copied into place by the next holder, which acquires nothing else.
+ */
+void sm_lock_next(msg_t *message);
+void sm_lock_exit(void);
+
+#endif
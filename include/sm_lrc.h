@@ -0,0 +1,29 @@
+#include <stdint.h>
+#include "sm_message.h"
+#include "sm_node.h"
+
+#ifndef _SM_LRC_H
+#define _SM_LRC_H
+
+/*
+ * Release consistency, used by the node library when dsm is started with -r.
+ *
+ * The first write to a page makes a twin of it and no other node is told. At a release the page is
+ * compared against its twin and the runs that changed are sent to the allocator as a diff, which it
+ * applies to its copy of the page (so pages written by several nodes at once merge). At an acquire the
+ * allocator sends back a write notice for every page another node has changed since this node's last
+ * acquire, and those pages are invalidated to be fetched again when they are next used.
+ *
+ * With dsm -m the pages are fetched from, and the diffs sent to, each page's home node instead (sm_home.h).
+ */
+extern int sm_lrc_active;
+
+int  sm_lrc_init       (void);
+int  sm_lrc_write_fault(uint32_t page_n);
+int  sm_lrc_flush      (void);
+int  sm_lrc_flush_range(uint32_t first, uint32_t last);
+int  sm_lrc_install    (uint64_t offset, const char *range, uint32_t len);
+void sm_lrc_notices    (const char *notices, uint32_t len);
+void sm_lrc_exit       (void);
+
+#endif
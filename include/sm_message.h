@@ -1,46 +1,274 @@
 #include <stdlib.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <poll.h>
 
-#define HEADER_LEN 3 /* message_header = {message.type, message.len, message.nid} */
-#define SM_MSG_MAX 128
+#ifndef _SM_MESSAGE_H
+#define _SM_MESSAGE_H
 
-/*  */
+#define SM_MSG_VERSION 1      /* Bumped whenever the header layout changes */
+#define HEADER_LEN     16     /* message_header = {version, type, nid, len, page, seq} */
+#define SM_MSG_MAX     0x10400 /* The largest message body (at least one page, and a bulk transfer) */
+#define SM_BULK_MAX    0x10000 /* The most page contents a bulk transfer (sm_ext.h) carries in one message */
+
+/*
+ * The header that prefixes every message on the wire, all fields are little-endian
+ */
+struct sm_header {
+    uint8_t  version; /* The protocol version (SM_MSG_VERSION) */
+    uint8_t  type;    /* The type of message */
+    int16_t  nid;     /* The node id of sender (allocator == -1) */
+    uint32_t len;     /* The length of the message body in bytes */
+    uint32_t page;    /* The page the message refers to (0 if none) */
+    uint32_t seq;     /* The sequence id, replies echo the sequence id of their request */
+} __attribute__((packed));
+
+/*
+ * A message received by sm_recv(). Its body is a view into the socket's receive ring, in the message's
+ * own buffer, or wherever sm_msg_sink() put it; either way it stays put until sm_msg_free().
+ */
 typedef struct sm_message {
-    char type; /* The type of message */
-    char len;  /* The length of the message */
-    char nid;  /* The node id of sender (allocator == -1) */
-    char buffer[SM_MSG_MAX]; /* the message (includes header and body) */
+    int      type; /* The type of message */
+    int      nid;  /* The node id of sender (allocator == -1) */
+    uint32_t len;  /* The length of the message body */
+    uint32_t page; /* The page the message refers to */
+    uint32_t seq;  /* The sequence id of the message */
+    char    *body; /* The body */
+    /* Kept by sm_message.c */
+    struct sm_recv_ring *ring; /* The ring a view is in, NULL for a pooled message */
+    uint32_t at;               /* Where the view's bytes start in the ring */
+    int      released;         /* Set once the view has been freed, the ring takes its bytes back in order */
+    int      pool;             /* The size class of a pooled message, whose buffer follows it */
+    struct sm_message *pool_next;
 } msg_t;
 
-/* 
+#define SM_MSG_BODY(message) ((message)->body)
+
+/*
  * The identifiers for messages (the type in the above struct)
  *
- * Replies are sent back generally as an acknowledgement, but for the case of read faults (as an 
+ * Replies are sent back generally as an acknowledgement, but for the case of read faults (as an
  * example) may also be used to send back non-resident memory from the allocator -> node
  *
- * The comments after the message identifiers indicate the expected message body format
+ * The comments after the message identifiers indicate the expected message body format, any
+ * field named page is carried in the header rather than the body
 */
 #define SM_INIT       0 // {}
-#define SM_INIT_REPLY 1 // {nid}
+#define SM_INIT_REPLY 1 // {n_nodes:32, flags:32, fanout:32, shm:32}
 #define SM_EXIT       2 // {}
 #define SM_EXIT_REPLY 3 // {}
-#define SM_BARR       4 // {}
-#define SM_BARR_REPLY 5 // {}
-#define SM_ALOC       6 // {size}
-#define SM_ALOC_REPLY 7 // {offset}
-#define SM_CAST       8 // {root_nid, value}
-#define SM_CAST_REPLY 9 // {value}
+#define SM_BARR       4 // {} or {(page:32, home:32) *} the moves proposed by the node's homes under dsm -m
+#define SM_BARR_REPLY 5 // {} or the write notices under dsm -r, {n_moves:32, (page:32, home:32) * n_moves, notices} under dsm -m
+#define SM_ALOC       6 // {size:64}
+#define SM_ALOC_REPLY 7 // {offset:64}
+#define SM_CAST       8 // {root_nid:32, value:64}
+#define SM_CAST_REPLY 9 // {value:64}
 /* Specifically read/write faults */
-#define SM_READ       10 // {page}
-#define SM_READ_REPLY 11 // {page_contents}
-#define SM_WRIT       12 // {page}
-#define SM_WRIT_REPLY 13 // {}
-#define SM_RELEASE    14 // {page}
-#define SM_RLSE_REPLY 15 // {page_contents}
+#define SM_READ       10 // {page, kept:32, (page:32 *) to prefetch} kept is set if the node kept its copy through a write
+#define SM_READ_REPLY 11 // {page, page_contents} no contents if the kept copy has been brought up to date (SM_UPDATE)
+#define SM_WRIT       12 // {page, has_copy:32} has_copy is set if the node holds a read copy of the page
+#define SM_WRIT_REPLY 13 // {page, page_contents} no contents if the node's read copy is still current
+#define SM_RELEASE    14 // {page, [keep:32]} keep asks a reader to hold on to its copy for an SM_UPDATE
+#define SM_RLSE_REPLY 15 // {page, page_contents if the node was the writer} none if granted by SM_MIGR_REPLY and never written
 #define SM_REQUEST    16 // {page}
-#define SM_REQU_REPLY 17 // {}
+#define SM_REQU_REPLY 17 // {page, page_contents} none if granted by SM_MIGR_REPLY and never written
+/* The dynamic distributed manager (dsm -d), between nodes unless noted otherwise */
+#define SM_PEER_ADDR  18 // {port:32} node -> allocator, the port the node accepts peers on
+#define SM_PEERS      19 // {(addr:32, port:32) * n_nodes} allocator -> node, addr in network order
+#define SM_PEER_HELLO 20 // {} sent once by the connecting node, identifying itself
+#define SM_PEER_READ  21 // {page, requester:32} forwarded along the probable owners
+#define SM_PEER_WRIT  22 // {page, requester:32} forwarded along the probable owners
+#define SM_PEER_PAGE  23 // {page, page_contents} owner -> requester
+#define SM_PEER_OWNER 24 // {page, copyset:64} owner -> requester, follows SM_PEER_PAGE
+#define SM_PEER_INV   25 // {page} new owner -> every node in the copyset
+#define SM_PEER_INV_REPLY 26 // {page}
+/* Release consistency (dsm -r) */
+#define SM_DIFF       27 // {page, (offset:16, len:16, bytes)*} the runs of the page a node has changed
+#define SM_ACQU       28 // {}
+#define SM_ACQU_REPLY 29 // {page:32 *} write notices, also the body of SM_BARR_REPLY under dsm -r
+#define SM_NOTICE_ALL 0xFFFFFFFF // a lone notice for every page, when there are too many to list
+/* Barriers and broadcasts combined along a tree of the nodes (dsm -d), page is SM_BARR or SM_CAST */
+#define SM_TREE_UP    30 // {page, has_value:32, value:64} child -> parent, once its whole subtree arrived
+#define SM_TREE_DOWN  31 // {page, value:64} parent -> child, the release
+/* Prefetching (dsm -p), a read fault's SM_READ may list up to SM_PREF_MAX more pages after kept:32 */
+#define SM_PREF_PAGE  32 // {page, page_contents *} allocator -> node, read copies of consecutive pages sent ahead of the SM_READ_REPLY
+#define SM_PREF_MAX   32
+/* Bulk access (sm_ext.h), only with the allocator's own protocol */
+#define SM_FETCH      33 // {page, n_pages:32, write:32} read copies or ownership of a range, sent without being faulted on
+#define SM_FETCH_REPLY 34 // {} once every page of the range has been sent
+#define SM_PREF_OWN   35 // {page, page_contents *} allocator -> node, ownership of consecutive pages sent ahead of the node's first access
+#define SM_GET        36 // {(page:32, n_pages:32) *} runs of pages to copy, the node doesn't become a reader
+#define SM_GET_PAGES  37 // {page, page_contents *} allocator -> node, consecutive pages from `page'
+#define SM_GET_REPLY  38 // {} follows the last SM_GET_PAGES
+#define SM_PUT        39 // {page, offset:32, bytes} node -> allocator, written over part of the page
+#define SM_PUT_PAGES  40 // {page, page_contents *} node -> allocator, written over consecutive pages from `page'
+#define SM_PUT_DONE   41 // {n_puts:32} follows each window of SM_PUTs and SM_PUT_PAGES
+#define SM_PUT_REPLY  42 // {} once every put of the window has been applied, each after every copy of its pages is gone
+#define SM_PUT_WINDOW 16 // the most puts a node sends before waiting for the SM_PUT_REPLY
+/* Per-page coherence protocols, only with the allocator's own protocol */
+#define SM_MIGR_REPLY 43 // {page, page_contents} answers SM_READ with ownership of a migratory page
+#define SM_UPDATE     44 // {page, (offset:16, len:16, bytes)*} allocator -> node, the runs changed since the node's copy was kept
+#define SM_ADVISE     45 // {page, n_pages:32, protocol:32} pins the protocol of a range (SM_PROTO_AUTO lets it switch again)
+#define SM_ADVISE_REPLY 46 // {}
+#define SM_PROTO_INVALIDATE 0 // other copies are invalidated by a write (the default)
+#define SM_PROTO_UPDATE     1 // readers keep their copies through a write and are sent its diff
+#define SM_PROTO_MIGRATORY  2 // a read fault is granted ownership straight away
+#define SM_PROTO_AUTO       3 // switched between the above by the page's fault history
+/* Home-based release consistency (dsm -m), each page's master copy is kept by its home node */
+#define SM_HOME_WHERE 47 // {page} node -> allocator, the node becomes the page's home if it has none (first touch)
+#define SM_HOME_WHERE_REPLY 48 // {(home:32) * SM_HOME_RUN} the homes of `page' and the pages after it, -1 for none yet
+#define SM_HOME_READ  49 // {page} node -> home
+#define SM_HOME_PAGE  50 // {page, page_contents} home -> node, no contents if the page isn't homed there
+#define SM_HOME_DIFF  51 // {page, (offset:16, len:16, bytes)*} node -> home, the runs of the page the node has changed
+#define SM_HOME_FLUSH 52 // {} node -> home, answered once every diff sent before it has been applied
+#define SM_HOME_FLUSH_REPLY 53 // {}
+#define SM_NOTICE     54 // {page:32 *} node -> allocator, pages the node has released changes to at their homes
+#define SM_HOME_GIVE  55 // {page, page_contents} old home -> new home, the master copy of a page whose home moves
+#define SM_HOME_RUN   64   // the pages an SM_HOME_WHERE_REPLY gives the homes of
+#define SM_HOME_MOVES_MAX 1024 // the most moves a node proposes, and the allocator makes, at one barrier
+/* Locks (sm_lock()), queued at the allocator and handed from one holder to the next */
+#define SM_LOCK_CREATE 56 // {} node -> allocator
+#define SM_LOCK_CREATE_REPLY 57 // {lock:32} -1 if there are none left
+#define SM_LOCK_BIND  58 // {lock:32, offset:64, len:32} binds a range of shared memory to the lock, len 0 unbinds it
+#define SM_LOCK_BIND_REPLY 59 // {}
+#define SM_LOCK       60 // {lock} node -> allocator, answered by an SM_LOCK_GRANT from the allocator or the holder
+#define SM_LOCK_GRANT 61 // {lock, offset:64, len:32, range *} the bound range as last released, if it was
+#define SM_LOCK_NEXT  62 // {lock, hold:32, next:32, next_seq:32} allocator -> holder, hand the lock to `next' (dsm -d and -m)
+#define SM_UNLOCK     63 // {lock, hold:32, offset:64, len:32, range *} the hold is the seq of the SM_LOCK granted
+#define SM_LOCKS_MAX  1024 // the most locks there can be
+#define SM_LOCK_RANGE_MAX SM_BULK_MAX // the largest range bound to a lock, it travels whole with the grant
+/* Atomic operations on shared words (sm_ext.h), executed where the page's latest contents are */
+#define SM_ATOMIC     64 // {page, (offset:16, op:8, width:8, value:64, compare:64) *} node -> allocator or the page's home
+#define SM_ATOMIC_REPLY 65 // {(old:64) *} the word's value before each operation, none if they weren't applied
+#define SM_PEER_ATOMIC 66 // {page, requester:32, operations} forwarded along the probable owners (dsm -d)
+#define SM_ATOM_ADD   0    // the word is incremented by `value'
+#define SM_ATOM_SWAP  1    // the word is replaced by `value'
+#define SM_ATOM_CAS   2    // the word is replaced by `value' if it equals `compare'
+#define SM_ATOM_LEN   20   // the bytes of each operation
+#define SM_ATOMIC_MAX 1024 // the most operations in one message
+/* Reductions (sm_reduce() and sm_allreduce() in sm.h), combined at the allocator */
+#define SM_REDUCE     67 // {root:32, op:32, type:32, count:64} node -> allocator, sent ahead of the node's chunks
+#define SM_REDUCE_DATA 68 // {page = chunk, elements} a chunk of a vector, SM_BULK_MAX bytes but for the last
+#define SM_REDUCE_REPLY 69 // {} once every node has sent its chunks, after those of the result
+#define SM_RED_SUM    0    // the contributions are combined at the allocator
+#define SM_RED_MIN    1
+#define SM_RED_MAX    2
+#define SM_RED_GATHER 3    // the contributions are relayed to the root, which combines them itself
+#define SM_RED_ROOT   4    // only the root contributes, its vector is the result
+#define SM_RED_INT32  0    // the element types
+#define SM_RED_INT64  1
+#define SM_RED_UINT32 2
+#define SM_RED_UINT64 3
+#define SM_RED_FLOAT  4
+#define SM_RED_DOUBLE 5
+#define SM_RED_BYTE   6    // bytes, only of SM_RED_ROOT (sm_bcast_buf())
+#define SM_REDUCE_ALL 0xFFFFFFFF // the root of a reduction whose result goes to every node
+#define SM_REDUCE_CHUNKS 1024    // the most chunks in one reduction, longer vectors are reduced a part at a time
+#define SM_TREE_DATA  70 // {page = chunk, seq = broadcast << 6 | root, bytes} a chunk of sm_bcast_buf() passed down the tree (dsm -d)
+
+/* Flags in the body of SM_INIT_REPLY */
+#define SM_INIT_PEER  0x1 // pages are transferred between the nodes by the distributed manager
+#define SM_INIT_LRC   0x2 // memory is release consistent, writers send diffs to the allocator
+#define SM_INIT_SHM   0x4 // the node is on the allocator's host, it attaches to shared memory `shm'
+#define SM_INIT_UFFD  0x8 // the node handles its faults with userfaultfd if it can
+#define SM_INIT_PREFETCH 0x10 // the node prefetches the pages its read faults are heading for
+#define SM_INIT_HOME  0x20 // with SM_INIT_LRC, the pages' homes are nodes, which connect to each other
+
+/* Helpers to read and write little-endian integers within a message body */
+void     sm_put32(char *buffer, uint32_t value);
+void     sm_put64(char *buffer, uint64_t value);
+uint32_t sm_get32(const char *buffer);
+uint64_t sm_get64(const char *buffer);
+
+/* Encode the bytes of a page that differ from its twin as SM_DIFF/SM_UPDATE runs, and apply them */
+uint32_t sm_diff (const char *page, const char *twin, uint32_t size, char *diff);
+int      sm_patch(char *page, uint32_t size, const char *diff, uint32_t len);
+
+/* Apply the operations of an SM_ATOMIC to a page, the old value of each word goes to `olds' */
+int      sm_atomic_apply(char *page, uint32_t size, const char *ops, uint32_t len, char *olds);
+
+/* Called by sm_recv_type() for any message that arrives while waiting for a different type */
+extern void (*sm_msg_unsolicited)(msg_t *message);
+
+/*
+ * Called by sm_recv() once a header has been decoded, returns where the body should be received to
+ * (e.g. straight into the page it carries) or NULL to receive it into the socket's receive ring or the
+ * message's own buffer
+ */
+extern char *(*sm_msg_sink)(msg_t *message);
 
-msg_t *sm_msg_create(char nid, char type, char buffer[]);
+/*
+ * Replaces the synchronous socket write for every frame sent (e.g. to queue it for a batched
+ * submission), the header and any body smaller than a page must be copied before returning. The io
+ * vector holds one or more whole frames for the socket, as (header, body) pairs.
+ */
+extern int (*sm_msg_writer)(int socket, struct iovec *iov, int iovcnt);
+
+/* Replaces the socket read for every header and body received (e.g. to read from a shared ring) */
+extern int (*sm_msg_reader)(int socket, char *buffer, size_t len);
+
+/* Byte counters for message bodies, used to check that pages never pass through a staging buffer, and
+ * the system calls the frames took */
+struct sm_msg_stats {
+    uint64_t sent_bytes;      /* Body bytes sent, always straight from the caller's memory */
+    uint64_t direct_bytes;    /* Body bytes received straight into a sm_msg_sink() destination */
+    uint64_t buffered_bytes;  /* Body bytes received into a message's own buffer */
+    uint64_t buffered_copies; /* The number of bodies received into a message's own buffer */
+    uint64_t sent_frames;     /* Frames sent */
+    uint64_t send_calls;      /* Calls to sendmsg() writing them to a socket */
+    uint64_t recv_calls;      /* Calls to recvmsg() reading frames from a socket */
+    uint64_t allocations;     /* Calls to malloc() for messages and send queues, none once they are pooled */
+    uint64_t refills;         /* Of those, the messages of a size the pool had made before */
+    uint64_t rings;           /* Receive rings made, one for each socket received from */
+    uint64_t pooled;          /* Frames received into a pooled message, their ring being held by earlier ones */
+};
+extern struct sm_msg_stats sm_msg_stats;
+
+/* One frame of a batch sent by sm_send_all() */
+struct sm_frame {
+    int         socket;
+    int         nid;
+    int         type;
+    uint32_t    page;
+    const void *body;
+    uint32_t    len;
+    uint32_t    seq;    /* The sequence id of the request being answered, 0 for a new one */
+};
+
+msg_t *sm_msg_begin (const char *header);
+int    sm_writev_all(int socket, struct iovec *iov, int iovcnt);
+int    sm_read_all  (int socket, char *buffer, size_t len);
+
+msg_t *sm_msg_alloc (uint32_t len);
+msg_t *sm_msg_copy  (const msg_t *message);
+int    sm_msg_in_place(const msg_t *message);
 int    sm_msg_free  (msg_t *message);
-int    sm_send      (int socket, char nid, char type, char buffer[]);
+void   sm_msg_guard (int signo);
+int    sm_send      (int socket, int nid, int type, uint32_t page, const void *body, uint32_t len);
+int    sm_reply     (int socket, msg_t *request, int nid, int type, const void *body, uint32_t len);
+int    sm_request   (int socket, int nid, int type, uint32_t page, const void *body, uint32_t len,
+                     uint32_t *seq);
+int    sm_send_all  (struct sm_frame *frames, int n_frames);
+
+/*
+ * Between sm_msg_cork() and sm_msg_uncork() the thread's frames are queued and then written with one
+ * call per socket, short bodies being copied. Anything that waits for a reply calls sm_msg_flush() first,
+ * so nothing queued can hold up a wait. Not for code a signal handler can interrupt to send.
+ */
+void   sm_msg_cork  (void);
+int    sm_msg_uncork(void);
+int    sm_msg_flush (void);
 int    sm_recv      (int socket, msg_t **message);
-int    sm_recv_type (int socket, msg_t **messsage, int type);
\ No newline at end of file
+int    sm_recv_type (int socket, msg_t **messsage, int type);
+
+/*
+ * sm_recv() receives the header after each body along with it into the socket's receive ring, so a
+ * frame can be waiting in the ring when the socket itself isn't readable. sm_msg_poll() is poll() for
+ * message sockets, it finds those first. A socket is forgotten as it is closed, its descriptor may come
+ * back for another connection.
+ */
+int    sm_msg_buffered(int socket);
+int    sm_msg_poll    (struct pollfd *fds, nfds_t n_fds, int timeout);
+void   sm_msg_forget  (int socket);
+
+#endif
@@ -0,0 +1,43 @@
+#include <stdint.h>
+#include <signal.h>
+#include "sm_message.h"
+
+#ifndef _SM_NODE_H
+#define _SM_NODE_H
+
+/*
+ * State shared between the parts of the node library (sm.c and the protocols it hands faults to)
+ */
+
+/* The access a node currently holds for a page */
+#define SM_ACCESS_NONE  0
+#define SM_ACCESS_READ  1
+#define SM_ACCESS_WRITE 2
+
+extern int           sm_sock;      /* The socket connected to the allocator */
+extern int           sm_nid;       /* This node's id */
+extern int           sm_nodes;     /* The number of nodes */
+extern char         *sm_map;       /* The start of the shared region */
+extern long          sm_page_size;
+extern unsigned char sm_access[];  /* The access held for each page of the region */
+
+/* Block (or unblock) SIGIO while a reply is awaited (dsm -d) */
+void sm_block_io(int block, sigset_t *previous);
+
+/* Send a request to the allocator and wait for its reply of the given type */
+int sm_call(int type, uint32_t page, const void *body, uint32_t len, int reply_type, msg_t **reply);
+
+/* Ownership granted by a read fault on a migratory page, taken up by the first write */
+void sm_owned_grant  (uint32_t page_n);
+int  sm_owned_upgrade(uint32_t page_n);
+
+/* Pages sent for sm_get() (sm_ext.c) */
+char *sm_ext_sink (msg_t *message);
+void  sm_ext_serve(msg_t *message);
+void  sm_ext_exit (void);
+
+/* Chunks of a reduction (sm_reduce.c) */
+char *sm_reduce_sink (msg_t *message);
+void  sm_reduce_serve(msg_t *message);
+
+#endif
@@ -0,0 +1,36 @@
+#include <stdint.h>
+#include "sm_message.h"
+#include "sm_node.h"
+
+#ifndef _SM_PEER_H
+#define _SM_PEER_H
+
+/*
+ * The dynamic distributed manager (Li & Hudak), used by the node library when dsm is started with -d.
+ *
+ * Every node keeps a probable owner for each page and the nodes are connected to each other directly.
+ * A fault is sent to the probable owner and forwarded along the owner hints until it reaches the real
+ * owner, which sends the page straight to the faulting node. A write fault also moves ownership (and
+ * the copyset) to the faulting node, which then invalidates the read copies itself. The allocator is
+ * only used to start the nodes, for allocations and as the top of the barrier and broadcast tree. Buffer
+ * broadcasts (sm_bcast_buf()) don't involve it at all, they stream down a tree rooted at their root.
+ */
+
+extern int sm_peer_active;
+
+int  sm_peer_connect    (int *peers);
+int  sm_peer_socket     (int nid);
+int  sm_peer_init       (int fanout);
+int  sm_peer_read_fault (uint32_t page_n);
+int  sm_peer_write_fault(uint32_t page_n);
+int  sm_peer_atomic     (uint32_t page_n, const char *ops, uint32_t len, char *olds);
+int  sm_peer_await      (int type, uint32_t page, msg_t **reply);
+int  sm_peer_begin      (int kind, uint64_t value, int root);
+int  sm_peer_test       (int kind, uint64_t *value);
+int  sm_peer_end        (int kind, uint64_t *value);
+int  sm_peer_bcast      (char *buf, uint64_t len, int root);
+char *sm_peer_sink      (msg_t *message);
+void sm_peer_poll       (void);
+void sm_peer_exit       (void);
+
+#endif
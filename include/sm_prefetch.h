@@ -0,0 +1,42 @@
+#include <stdint.h>
+#include "sm_message.h"
+#include "sm_node.h"
+
+#ifndef _SM_PREFETCH_H
+#define _SM_PREFETCH_H
+
+/*
+ * Prefetching for read faults (dsm -p). Every read fault is fed to a small table of streams, each
+ * following a run of faults a constant number of pages apart (1 for a sequential walk). Once a
+ * stream has seen the same stride twice in a row a read fault that misses also asks for the next
+ * pages along the stride, which the allocator sends back ahead of the faulting page in the same round
+ * trip. Each stream doubles its depth while nearly every page it prefetched gets used and halves it
+ * when fewer than half do.
+ *
+ * Prefetched pages (and those sm_prefetch() asks for, with or without -p) are received into a shadow
+ * of the region and stay there until used, so their first use still faults, moves the page into
+ * place with the access it was sent with and keeps the stream going. Until then the progress thread
+ * answers the allocator's requests and invalidations for them from the shadow.
+ *
+ * The shadow also holds the copies readers keep through another node's write to a write-update page,
+ * until the writer's changes (SM_UPDATE) have been applied to them and they are next used.
+ */
+extern int sm_prefetch_active;
+
+int      sm_prefetch_init   (void);
+char    *sm_prefetch_sink   (msg_t *message);
+int      sm_prefetch_hit    (uint32_t page_n, int write);
+uint32_t sm_prefetch_plan   (uint32_t page_n, char *body);
+void     sm_prefetch_granted(void);
+void     sm_prefetch_asked  (uint32_t n_pages);
+void     sm_prefetch_arrived(uint32_t page_n, int access);
+void     sm_prefetch_forget (uint32_t page_n);
+int      sm_prefetch_request(msg_t *message);
+int      sm_prefetch_release(msg_t *message);
+void     sm_prefetch_keep   (uint32_t page_n);
+void     sm_prefetch_update (msg_t *message);
+int      sm_prefetch_kept   (uint32_t page_n);
+int      sm_prefetch_take   (uint32_t page_n);
+void     sm_prefetch_exit   (void);
+
+#endif
@@ -0,0 +1,25 @@
+#include <stdint.h>
+#include "sm_message.h"
+
+#ifndef _SM_PROGRESS_H
+#define _SM_PROGRESS_H
+
+/*
+ * The node's progress thread, used unless the node talks to other nodes directly (-d) or shares the
+ * allocator's memory (-s). It owns the allocator's socket: page requests and invalidations are served
+ * as soon as they arrive, even while the application thread is inside a fault, and everything else is a
+ * reply handed to the application thread, matched by the sequence id of the request it answers.
+ *
+ * A request for the page a fault has just been granted on is held back until the faulting thread has
+ * applied the grant (sm_progress_done()), so that it can't be undone before it has taken effect.
+ */
+extern int sm_progress_active;
+
+int  sm_progress_start  (void (*serve)(msg_t *message));
+int  sm_progress_await  (uint32_t seq, msg_t **reply);
+int  sm_progress_test   (uint32_t seq, msg_t **reply);
+void sm_progress_deliver(msg_t *reply);
+void sm_progress_done   (uint32_t page_n);
+void sm_progress_stop   (void);
+
+#endif
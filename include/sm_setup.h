@@ -9,6 +9,7 @@ int options_init();
 int process_arguments(int argc, char **argv);
 int process_program(int argc, char **argv, int optind);
 int read_hostfile();
+int local_hosts();
 int initialize();
 int node_start();
 
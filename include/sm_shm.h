@@ -0,0 +1,27 @@
+#include <stdint.h>
+#include "sm_message.h"
+#include "sm_event.h"
+
+#ifndef _SM_SHM_H
+#define _SM_SHM_H
+
+/*
+ * Co-located mode (`dsm -s'), every node runs on the allocator's host. The allocator creates a POSIX
+ * shared memory object holding the whole region followed by a pair of rings per node, and the nodes map
+ * the region from it at SM_MAP_START, so there is a single copy of every page on the host. Coherence is
+ * left to the hardware and nodes never fault. Once a node has been started over TCP every message
+ * between it and the allocator goes through its rings instead of its socket (the sm_msg_writer and
+ * sm_msg_reader hooks), a waiting reader spins briefly and then sleeps on a futex.
+ */
+#define SM_SHM_NAME      "/dsm.%u"  /* Formatted with the allocator's pid */
+#define SM_SHM_RING_SIZE 0x10000    /* Bytes per ring, a power of two larger than any message */
+
+/* The allocator's event engine, it also creates the shared memory object */
+extern struct sm_event_engine sm_event_shm;
+
+unsigned sm_shm_id    (void);
+int      sm_shm_attach(unsigned id, int socket, int nid);
+void     sm_shm_detach(void);
+int      sm_shm_pending(void);
+
+#endif
@@ -0,0 +1,26 @@
+#include <stdint.h>
+#include "sm_message.h"
+#include "sm_node.h"
+
+#ifndef _SM_UFFD_H
+#define _SM_UFFD_H
+
+/*
+ * Fault handling through userfaultfd(2), used when dsm is started with -u and the kernel allows it
+ * (otherwise the node falls back to SIGSEGV and mprotect()). The region is mapped read-write and
+ * registered for missing and write-protect faults: a page the node holds no copy of is simply not
+ * present, a read copy is present but write-protected and a write copy is present and writable.
+ *
+ * Faults are read from the userfaultfd by a handler thread, the faulting thread stays blocked in the
+ * kernel until the page is in place. A page received from the allocator is staged in a buffer and
+ * installed with UFFDIO_COPY, which maps it and wakes the faulting thread in one step.
+ */
+extern int sm_uffd_active;
+
+int   sm_uffd_init      (void);
+char *sm_uffd_sink      (msg_t *message);
+int   sm_uffd_install   (uint32_t page_n, const char *source, int write);
+void  sm_uffd_protect   (uint32_t page_n, int access);
+void  sm_uffd_exit      (void);
+
+#endif
@@ -0,0 +1,22 @@
+#include "sm_message.h"
+
+#ifndef _SM_WORKERS_H
+#define _SM_WORKERS_H
+
+/*
+ * Allocator worker threads (`dsm -w N'). The page table is split into N shards by page number
+ * (page % N), each owned by one worker which starts every fault on its pages in arrival order, a fault
+ * waiting on other nodes being left pending on its page while the worker goes on with the next. The
+ * main thread stays the network thread: it receives every message, hands faults and the page replies
+ * they wait for to the owning shard's queue and executes everything else itself. The bulk requests
+ * of sm_ext.h cover every shard, each shard handles its own pages of them and the last one replies.
+ */
+int  sm_workers_start   (int n_workers);
+int  sm_workers_dispatch(msg_t *message);
+int  sm_workers_await   (int nid, int type, uint32_t page, msg_t **reply);
+int  sm_workers_last    (int nid);
+int  sm_worker_thread   ();
+int  sm_worker_owns     (uint32_t page);
+void sm_workers_stop    ();
+
+#endif
@@ -15,12 +15,37 @@
 #include "allocator.h"
 #include "config.h"
 #include "node_functions.h"
+#include "sm_event.h"
+#include "sm_workers.h"
+#include "sm_directory.h"
+
+#define SM_CONTENDED 16 /* The number of contended pages listed in the log */
+
+struct options    *options;
+
+void *sm_memory_map;
+void *sm_twin_map;
+int   sm_current_page;
+int   sm_node_count;
+int   sm_socket;
+int   client_sockets[SM_MAX_NODES];
+pid_t client_pids[SM_MAX_NODES];
 
 int sm_fatal(char *message) {
     fprintf(stderr, ANSI_COLOR_RED "Error: %s.\n" ANSI_COLOR_RESET, message);
     return -1;
 }
 
+/*
+ * Page contents sent back by a node are received straight into the allocator's cache of the page
+*/
+static char *allocator_sink(msg_t *message) {
+    if (message->type != SM_REQU_REPLY && message->type != SM_RLSE_REPLY) return NULL;
+    if (message->page >= SM_MAX_PAGES || message->len > getpagesize()) return NULL;
+
+    return (char *) sm_memory_map + (long) message->page * getpagesize();
+}
+
 /* 
  *
 */
@@ -30,24 +55,19 @@ int allocator_init() {
     /* Prepare the shared memory mapping and information */
     /* Keep a cache of the memory map in the allocator to reduce the overhead of read-faults */
     sm_memory_map = mmap((void *)SM_MAP_START, SM_NUM_PAGES * getpagesize(), 
-                PROT_NONE, MAP_FIXED|MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+                PROT_READ|PROT_WRITE, MAP_FIXED|MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
     if (sm_memory_map == MAP_FAILED) return sm_fatal("failed to map memory");
+
+    /* Twins are only made for write-update pages, the rest of the mapping is never touched */
+    sm_twin_map = mmap(NULL, SM_NUM_PAGES * getpagesize(), PROT_READ|PROT_WRITE,
+                       MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if (sm_twin_map == MAP_FAILED) return sm_fatal("failed to map the twins");
     sm_current_page = 0;
+    sm_msg_sink = allocator_sink;
     
     sm_node_count = 0;
 
-    /* Create and initialize the list of memory pages */
-    for (int i = 0; i < SM_MAX_PAGES; i++) {
-        sm_page_table[i].writer = -1;
-        sm_page_table[i].readers = malloc(options->n_nodes * sizeof(int));
-
-        for (int j = 0; j < options->n_nodes; j++) {
-            sm_page_table[i].readers[j] = 0;
-        }
-    }
-
     /* Initialize all the client sockets to 0 */
-    client_sockets = malloc(options->n_nodes * sizeof(int));
     for (int i = 0; i < options->n_nodes; i++) {
         client_sockets[i] = 0;
     }
@@ -63,6 +83,9 @@ int allocator_init() {
     status  = socket_init();
     if (status) return sm_fatal("failed to initialize global listen socket.");
 
+    status = sm_event->init(options->n_nodes);
+    if (status) return sm_fatal("failed to start the event engine");
+
     return 0;
 }
 
@@ -71,7 +94,7 @@ int allocator_init() {
 */
 int socket_init() {
     struct sockaddr_in address;
-    int opt = 1, client, addrlen = sizeof(address);
+    int opt = 1, status;
 
     /* Create the communication socket */
     sm_socket = socket(AF_INET, SOCK_STREAM, 0);
@@ -81,7 +104,7 @@ int socket_init() {
     address.sin_addr.s_addr = INADDR_ANY;
     address.sin_port        = htons(SM_PORT);
 
-    status = setsockopt(sm_socket, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt));
+    status = setsockopt(sm_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
     if (status < 0) return sm_fatal("failed setting socket options");
     status = bind(sm_socket, (struct sockaddr *)&address, sizeof(address));
     if (status < 0) return sm_fatal("failed to bind socket");
@@ -91,78 +114,109 @@ int socket_init() {
     return 0;
 }
 
+/*
+ * Log the pages ownership was taken away from soonest after it was granted most often, the ones
+ * thrashing between nodes
+ */
+static void allocator_contention() {
+    uint32_t top[SM_CONTENDED], n_top = 0, i;
+    uint64_t steals = 0, held = 0;
+    struct memory_page *page;
+
+    for (uint32_t page_n = 0; page_n < sm_current_page; page_n++) {
+        page = sm_page_lookup(page_n);
+        if (page == NULL || page->steals == 0) continue;
+
+        steals += page->steals;
+        held   += page->held;
+
+        /* Keep the most contended pages, most first */
+        if (n_top == SM_CONTENDED && sm_page_lookup(top[n_top - 1])->steals >= page->steals) continue;
+        if (n_top < SM_CONTENDED) n_top++;
+
+        for (i = n_top - 1; i > 0 && sm_page_lookup(top[i - 1])->steals < page->steals; i--) top[i] = top[i - 1];
+        top[i] = page_n;
+    }
+
+    fprintf(options->log_file, "-= %lu contended transfers of ownership, %lu faults held back\n", steals, held);
+    for (i = 0; i < n_top; i++) {
+        page = sm_page_lookup(top[i]);
+        fprintf(options->log_file, "-= page %u: %u contended transfers, %u faults held back, window %uus\n",
+                top[i], page->steals, page->held, page->window);
+    }
+}
+
 /*
  *
 */
 int allocator_end() {
-    /* Free the page list  */
-    for (int i = 0; i < SM_MAX_PAGES; i++) {
-        free(sm_page_table[i].writers);
-    }
+    sm_event->end();
 
-    /* Free the list of client sockets */
-    free(client_sockets);
+    if (options->log_file) allocator_contention();
 
-    if (options->log_file)
-        fclose(options->log_file);
-    
+    /* Free the page directory */
+    sm_directory_free();
+
+    if (options->log_file) {
+        fprintf(options->log_file, "-= page bytes sent %lu, received in place %lu, staged %lu (%lu copies)\n",
+                sm_msg_stats.sent_bytes, sm_msg_stats.direct_bytes, sm_msg_stats.buffered_bytes,
+                sm_msg_stats.buffered_copies);
+        fprintf(options->log_file, "-= %lu frames sent in %lu sendmsg() calls, %lu recvmsg() calls, %lu message allocations "
+                "(%lu refills), %lu receive rings, %lu frames pooled\n", sm_msg_stats.sent_frames,
+                sm_msg_stats.send_calls, sm_msg_stats.recv_calls, sm_msg_stats.allocations, sm_msg_stats.refills,
+                sm_msg_stats.rings, sm_msg_stats.pooled);
+    }
+
+    munmap(sm_memory_map, SM_NUM_PAGES * getpagesize());
+    munmap(sm_twin_map, SM_NUM_PAGES * getpagesize());
     close(sm_socket);
 
     return 0;
 }
 
 /*
- *
+ * Serve requests from the nodes, running until all nodes have been closed
 */
 int allocate() {
-    int status, activity;
-    msg_t *request
+    int status;
+    msg_t *request;
+
+    /* Faults are handed to the worker threads (if there are any) from here on */
+    status = sm_workers_start(options->n_workers);
+    if (status) return sm_fatal("failed to start the allocator workers");
+
+    /* What a turn of the loop sends is queued, and written a socket at a time before the next wait */
+    sm_msg_cork();
 
     /*
      * Wait for messages from the clients to come in, running until all nodes have been closed
     */
     while(sm_node_count > 0) {
-        fd_set fds = wait_for_messages();
-        
-        /* Check each client to see if they have any pending requests */
-        for (int i = 0; i < options->n_nodes; i++) {
-            if (FD_ISSET(client_sockets[i], &fds)) {
-                memset(request, 0, sizeof(msg_t) + 1024);
-                sm_recv(client_sockets[i], &request);
-
-                /* Execute the received request */
-                status = node_execute(i, request);
-                if (status) return sm_fatal("failed to execute command");
-
-                sm_msg_free(request);
-            }
-        }
+        /* Faults which arrived while their page was busy can go ahead once it has been released */
+        status = node_deferred();
+        if (status) return sm_fatal("failed to execute deferred fault");
+        if (sm_node_count == 0) break;
+
+        status = sm_msg_flush();
+        if (status) return sm_fatal("failed to send to the nodes");
+
+        /* Faults held back by a writer's window are due again when it ends */
+        status = sm_event->next(&request, node_hold_time());
+        if (status) return sm_fatal("lost connection to node");
+        if (request == NULL) continue;
+
+        status = sm_workers_dispatch(request);
+        if (status < 0) return sm_fatal("failed to hand fault to its worker");
+        if (status) continue;
+
+        /* Execute the received request */
+        status = node_execute(request);
+        if (status) return sm_fatal("failed to execute command");
     }
 
+    if (sm_msg_uncork()) return sm_fatal("failed to send to the nodes");
+    sm_workers_stop();
+
     while(wait(NULL) > 0);
     return 0;
 }
-
-/*
- *
-*/
-int wait_for_messages() {
-    fd_set fds;
-    int max_sock, activity;
-
-    FD_ZERO(&fds);
-    max_sock = 0;
-
-    /* Initialize the list of client sockets */
-    for (int i = 0; i < options->n_nodes; i++) {
-        if (client_sockets[i] > 0)
-            FD_SET(client_sockets[i], &fds);
-
-        if (client_sockets[i] > max_sock)
-            max_sock = client_sockets[i];
-    }
-
-    activity = select(max_sock+1, &fds, NULL, NULL, NULL);
-
-    return fds;
-}
\ No newline at end of file
@@ -1,37 +1,178 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <assert.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 
 #include "node_functions.h"
 #include "allocator.h"
 #include "config.h"
+#include "sm_event.h"
+#include "sm_workers.h"
+#include "sm_directory.h"
+#include "sm_shm.h"
+
+static int      sm_barrier_count = 0; /* The number of nodes currently waiting in a barrier */
+static int      sm_cast_count    = 0; /* The number of nodes currently waiting in a broadcast */
+static uint64_t sm_cast_value    = 0; /* The value supplied by the root of the current broadcast */
+static uint32_t sm_barrier_seq[SM_MAX_NODES]; /* The SM_BARR each node's release answers */
+static uint32_t sm_cast_seq[SM_MAX_NODES];    /* The SM_CAST each node's value answers, a node may be in both */
+
+/* The reduction in progress. Every node takes part in each one, so there is only ever one: the nodes'
+ * chunks are combined into `result' as they arrive (or relayed to the root, which combines them with an
+ * operation of its own) and the result goes out once every node has sent all of its chunks. */
+static struct sm_reduction {
+    int      active;
+    uint32_t root, op, type;
+    uint64_t count;
+    uint32_t n_chunks;
+    uint64_t joined;                       /* The nodes whose SM_REDUCE has arrived */
+    int      arrived;                      /* The nodes which have also sent all of their chunks */
+    uint32_t chunks[SM_MAX_NODES];         /* The chunks received from each node */
+    uint32_t seq[SM_MAX_NODES];            /* The SM_REDUCE each node's reply answers */
+    uint16_t combined[SM_REDUCE_CHUNKS];   /* The contributions combined into each chunk of the result */
+    char    *result;                       /* Grown to the longest reduction so far */
+    uint64_t result_size;
+    msg_t  **held;                         /* Chunks to relay to a root which hasn't arrived yet */
+    int      n_held, max_held;
+} sm_reduction;
+
+#define SM_STASH_MAX (SM_MAX_NODES * (SM_PREF_MAX + 4)) /* Pages sent ahead may each wait on every node */
+static msg_t *sm_stash[SM_STASH_MAX]; /* Replies received by node_await() on behalf of an outer wait */
+static int    sm_stashed = 0;
+
+/* The home of each page plus one, 0 until it has one (dsm -m) */
+static int16_t  sm_homes[SM_MAX_PAGES];
+
+/* The moves the homes have proposed at the current barrier, made once it completes (dsm -m) */
+static uint32_t sm_proposed[SM_MAX_NODES][SM_HOME_MOVES_MAX * 2];
+static int      sm_n_proposed[SM_MAX_NODES];
+
+/* The locks of sm_lock(). A free lock is granted straight away, otherwise the node waits its turn: with
+ * the nodes connected to each other (dsm -d and -m) the holder is told who is next and hands the lock
+ * over itself, otherwise the waiters are queued here and the allocator grants each in turn. */
+static struct sm_lock {
+    int16_t  holder;      /* The node holding the lock (or the last to ask for it, dsm -d and -m), -1 if free */
+    uint32_t seq;         /* The SM_LOCK that the holder was, or is to be, granted the lock by */
+    int16_t  first, last; /* The nodes waiting for the lock, oldest first, linked through sm_lock_queue[] */
+    char    *grant;       /* {offset:64, len:32, range *} the bound range, as last released if it came back here */
+    uint32_t grant_len;
+} sm_locks[SM_LOCKS_MAX];
+static int      sm_n_locks = 0;
+static int16_t  sm_lock_queue[SM_MAX_NODES];    /* The node waiting behind each waiting node */
+static uint32_t sm_lock_waiting[SM_MAX_NODES];  /* The SM_LOCK each waiting node is to be granted by */
+
+/* The address each node accepts connections from the other nodes on (dsm -d and -m) */
+static uint32_t sm_peer_addr[SM_MAX_NODES];
+static uint32_t sm_peer_port[SM_MAX_NODES];
+
+/* The network thread and each worker defer the requests for their own pages */
+#define SM_DEFER_MAX (SM_MAX_NODES * (SM_PUT_WINDOW + 2)) /* A fault or a window of puts per node */
+static __thread msg_t *sm_deferred[SM_DEFER_MAX]; /* Requests received while their pages were busy, oldest first */
+static __thread int    sm_n_deferred = 0;
+
+#define SM_HELD 2 /* node_blocked(): the fault waits for the end of the writer's window (dsm -t) */
+static __thread uint64_t sm_hold_until = UINT64_MAX; /* When the first window holding back a deferred fault ends */
+
+#define SM_HOLD_SOON 1000 /* Ownership taken away this soon after the window ends means the page is contended */
+
+#define SM_BULK_PAGES (SM_BULK_MAX / 0x1000) /* The most pages a put carries, with the smallest pages */
+static __thread uint32_t sm_puts_done[SM_MAX_NODES]; /* The puts applied since each node's last SM_PUT_DONE */
+
+static uint32_t node_notices(int nid, char *notices, uint32_t max);
+static int      node_write_done(int nid, struct memory_page *page, msg_t *request);
+
+/*
+ * The page after the last one a put covers
+ */
+static uint32_t node_put_end(msg_t *request) {
+    uint32_t n_pages = (request->type == SM_PUT_PAGES) ? request->len / getpagesize() : 1;
+
+    return (n_pages < SM_MAX_PAGES - request->page) ? request->page + n_pages : SM_MAX_PAGES;
+}
 
 /* Initialize the connection between the allocator and the client node */
 int node_init(int client) {
     msg_t *init = NULL;
+    char body[16];
 
     /* Add it to the database */
     client_sockets[sm_node_count] = client;
 
     /* Ensure that it is an initialization request */
-    int status = sm_recv(sm_node_count, &init);
+    int status = sm_recv(client, &init);
     if (status || init->type != SM_INIT) {
         return sm_fatal("invalid initialization request");
     }
+    sm_msg_free(init);
 
-    /* */
-    sm_send(client, sm_node_count, SM_INIT_REPLY, NULL);
+    /* Reply with the nid assigned to the node, the total number of nodes and the protocol in use */
+    sm_put32(body, options->n_nodes);
+    sm_put32(body + 4, (options->distributed ? SM_INIT_PEER : 0) | (options->release ? SM_INIT_LRC : 0) |
+                       (options->shared ? SM_INIT_SHM : 0) | (options->userfault ? SM_INIT_UFFD : 0) |
+                       (options->prefetch ? SM_INIT_PREFETCH : 0) | (options->homes ? SM_INIT_HOME : 0));
+    sm_put32(body + 8, options->fanout);
+    sm_put32(body + 12, options->shared ? sm_shm_id() : 0);
+    status = sm_send(client, sm_node_count, SM_INIT_REPLY, 0, body, sizeof(body));
+    if (status) return sm_fatal("failed to send initialization acknowledgement");
+
+    /* The node then says which port it accepts the other nodes on, its address is the one it came from */
+    if (options->distributed || options->homes) {
+        struct sockaddr_in address;
+        socklen_t addrlen = sizeof(address);
+
+        status = sm_recv(client, &init);
+        if (status || init->type != SM_PEER_ADDR || init->len < 4 ||
+                getpeername(client, (struct sockaddr *) &address, &addrlen)) {
+            return sm_fatal("invalid peer address");
+        }
+
+        sm_peer_addr[sm_node_count] = address.sin_addr.s_addr;
+        sm_peer_port[sm_node_count] = sm_get32(SM_MSG_BODY(init));
+        sm_msg_free(init);
+    }
+
+    status = sm_event->add(sm_node_count, client);
+    if (status) return sm_fatal("failed to watch the node's socket");
     sm_node_count++;
 
     return 0;
 }
 
+/*
+ * Send every node the addresses of all of the nodes, once they have all connected (dsm -d and -m)
+ */
+int node_peers() {
+    char body[SM_MAX_NODES * 8];
+    int status;
+
+    for (int i = 0; i < options->n_nodes; i++) {
+        memcpy(body + i * 8, &sm_peer_addr[i], 4);
+        sm_put32(body + i * 8 + 4, sm_peer_port[i]);
+    }
+
+    for (int i = 0; i < options->n_nodes; i++) {
+        status = sm_send(client_sockets[i], i, SM_PEERS, 0, body, options->n_nodes * 8);
+        if (status) return sm_fatal("failed to send peer addresses");
+    }
+
+    return 0;
+}
+
 /* Remove the memory allocated to a node and close it's socket */
-int node_close(int nid) {
+int node_close(int nid, msg_t *request) {
     /* */
-    sm_send(client_sockets[nid], nid, SM_EXIT_REPLY, NULL);
+    sm_reply(client_sockets[nid], request, nid, SM_EXIT_REPLY, NULL, 0);
+    sm_msg_flush();
 
     /* Close and NULL out the clients socket from the list */
+    sm_event->remove(nid);
+    sm_msg_forget(client_sockets[nid]);
     close(client_sockets[nid]);
 
     client_sockets[nid] = 0;
@@ -40,205 +181,1644 @@ int node_close(int nid) {
     return 0;
 }
 
+/*
+ * The time in microseconds, for the hold windows (dsm -t)
+ */
+static uint64_t node_now() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+/*
+ * Returns whether the page's writer is still within its window, so a fault by another node has to wait
+ * for it to end, noting when the window ends
+ */
+static int node_held(struct memory_page *page, int nid) {
+    uint64_t end;
+
+    if (page->window == 0 || page->writer < 0 || page->writer == nid) return 0;
+
+    end = page->granted + page->window;
+    if (node_now() >= end) return 0;
+
+    if (end < sm_hold_until) sm_hold_until = end;
+    return 1;
+}
+
+/*
+ * Ownership of the page is being taken away from its writer by another node's fault. A page taken away
+ * again as soon as its window allows is contended, its window doubles (up to dsm -t), while a page left
+ * with its writer for much longer than its window halves it.
+ */
+static void node_contend(struct memory_page *page) {
+    uint64_t owned;
+
+    if (!options->hold && !options->log_file) return;
+    owned = node_now() - page->granted;
+
+    if (owned < page->window + SM_HOLD_SOON) {
+        if (page->steals < UINT32_MAX) page->steals++;
+        if (options->hold) page->window = (page->window * 2 > options->hold) ? options->hold :
+                                          (page->window < SM_HOLD_MIN) ? SM_HOLD_MIN : page->window * 2;
+    } else if (owned > 8 * (page->window + SM_HOLD_SOON)) {
+        page->window = (page->window / 2 < SM_HOLD_MIN) ? 0 : page->window / 2;
+    }
+}
+
+/*
+ * The per-page protocols are part of the allocator's own (sequentially consistent) protocol
+ */
+static int node_adaptive() {
+    return !options->release && !options->distributed;
+}
+
+/*
+ * Switch the page over to another protocol
+ */
+static void node_switch(struct memory_page *page, uint32_t page_n, int protocol) {
+    static const char *names[] = { "write-invalidate", "write-update", "migratory" };
+
+    if ((page->protocol & SM_PAGE_PROTOCOL) == protocol) return;
+    page->protocol = (page->protocol & ~SM_PAGE_PROTOCOL) | protocol;
+
+    if (options->log_file) fprintf(options->log_file, "-= page %u is now %s\n", page_n, names[protocol]);
+}
+
+/*
+ * Count a write fault towards the protocol the page's history suggests, unless sm_advise() pinned it.
+ * A node upgrading the copy it read from the last writer, which holds the only other copy, is the page
+ * migrating from node to node; the last writer writing again after other nodes read the page is a
+ * producer with consumers. SM_PAGE_VOTES such faults in a row switch the page over, a fault that fits
+ * neither (another node taking the page from its readers) switches it back to write-invalidate.
+ * Ownership moving between writers, or a page nobody else holds, says nothing either way.
+ */
+static void node_classify(struct memory_page *page, uint32_t page_n, int nid, uint64_t copies) {
+    uint64_t node = 1ULL << nid;
+
+    if (!node_adaptive() || (page->protocol & SM_PAGE_PINNED)) return;
+    if (copies == 0 || (page->writer >= 0 && copies == (1ULL << page->writer))) return;
+
+    if (page->last >= 0 && page->last != nid && (page->readers & node) && copies == (1ULL << page->last)) {
+        if (page->votes > -SM_PAGE_VOTES) page->votes = (page->votes < 0) ? page->votes - 1 : -1;
+    } else if (page->last == nid) {
+        if (page->votes < SM_PAGE_VOTES) page->votes = (page->votes > 0) ? page->votes + 1 : 1;
+    } else {
+        page->votes = 0;
+    }
+
+    if (page->votes == 0) {
+        node_switch(page, page_n, SM_PROTO_INVALIDATE);
+    } else if (page->votes == SM_PAGE_VOTES) {
+        node_switch(page, page_n, SM_PROTO_UPDATE);
+    } else if (page->votes == -SM_PAGE_VOTES) {
+        node_switch(page, page_n, SM_PROTO_MIGRATORY);
+    }
+}
+
+/*
+ * The page's writer is giving it up. One granted ownership by a read fault that never wrote to the page
+ * (it sends nothing back) wasn't migrating, the page goes back to write-invalidate.
+ */
+static void node_migrated(struct memory_page *page, uint32_t page_n, msg_t *reply) {
+#ifdef SM_CHECK_COPIES
+    /* The page the writer sent back was received straight into the cache */
+    assert(sm_msg_in_place(reply));
+#endif
+    if (!(page->protocol & SM_PAGE_MIGRATED)) return;
+    page->protocol &= ~SM_PAGE_MIGRATED;
+
+    if (reply->len > 0 || (page->protocol & SM_PAGE_PINNED)) return;
+    page->votes = 0;
+    node_switch(page, page_n, SM_PROTO_INVALIDATE);
+}
+
+/*
+ * The readers of a write-update page hold on to their copies through a write, unless some nodes still
+ * hold older ones, and the twin records what they hold. Returns the readers keeping their copies.
+ */
+static uint64_t node_keep(struct memory_page *page, uint32_t page_n, int nid) {
+    int page_size = getpagesize();
+    uint64_t kept = page->readers & ~(1ULL << nid);
+
+    if ((page->protocol & SM_PAGE_PROTOCOL) != SM_PROTO_UPDATE || page->stale || !kept) return 0;
+
+    memcpy((char *) sm_twin_map + (long) page_n * page_size, (char *) sm_memory_map + (long) page_n * page_size,
+           page_size);
+    page->stale = kept;
+
+    return kept;
+}
+
+/*
+ * Send the nodes that kept their copies of a write-update page the runs that changed since, they are
+ * readers again without having to fault. A diff bigger than half the page isn't worth sending, the
+ * nodes fault the page in as usual instead.
+ */
+static int node_update(struct memory_page *page, uint32_t page_n, uint64_t nodes) {
+    static __thread char diff[SM_MSG_MAX];
+    struct sm_frame frames[SM_MAX_NODES];
+    int page_size = getpagesize(), n_frames = 0, i;
+    char *twin = (char *) sm_twin_map + (long) page_n * page_size;
+    uint32_t len;
+
+    len = sm_diff((char *) sm_memory_map + (long) page_n * page_size, twin, page_size, diff);
+    madvise(twin, page_size, MADV_DONTNEED);
+    if (len > page_size / 2) return 0;
+
+    SM_FOR_EACH_NODE(i, nodes) {
+        if (client_sockets[i] <= 0) continue;
+
+        frames[n_frames++] = (struct sm_frame) { client_sockets[i], i, SM_UPDATE, page_n, diff, len, 0 };
+        page->readers |= 1ULL << i;
+    }
+    if (sm_send_all(frames, n_frames)) return sm_fatal("failed to send page updates");
+
+    if (options->log_file) {
+        fprintf(options->log_file, "-= updating %d copies of %u with %u bytes\n", n_frames, page_n, len);
+    }
+
+    return 0;
+}
+
+/*
+ * How long until the first window holding back a deferred fault ends, in microseconds (-1 if none is)
+ */
+long node_hold_time() {
+    uint64_t now;
+
+    if (sm_hold_until == UINT64_MAX) return -1;
+
+    now = node_now();
+    return (sm_hold_until > now) ? sm_hold_until - now : 0;
+}
+
+/*
+ * Returns whether the request has to wait. A fault (or any other change to a page's copies) on a page
+ * which is part way through another fault (pending on other nodes, or from inside a nested wait) has to
+ * wait until that fault has finished, otherwise both would change the page's copies at once. A fault
+ * on a page another node was granted ownership of moments ago waits for its window (SM_HELD). A node's
+ * SM_PUT_DONE waits for the puts it follows, which may have been deferred themselves.
+ */
+static int node_blocked(msg_t *request) {
+    struct memory_page *page;
+
+    switch (request->type) {
+        case SM_READ:
+        case SM_WRIT:
+        case SM_ATOMIC:
+            page = sm_page_lookup(request->page);
+            if (page == NULL) return 0;
+            if (page->busy) return 1;
+            return node_held(page, request->nid) ? SM_HELD : 0;
+        case SM_PUT:
+        case SM_PUT_PAGES:
+            for (uint32_t page_n = request->page; page_n < node_put_end(request); page_n++) {
+                if (!sm_worker_owns(page_n)) continue;
+
+                page = sm_page_lookup(page_n);
+                if (page != NULL && page->busy) return 1;
+            }
+            return 0;
+        case SM_GET:
+            for (uint32_t i = 0; i + 8 <= request->len; i += 8) {
+                uint32_t first = sm_get32(SM_MSG_BODY(request) + i), n = sm_get32(SM_MSG_BODY(request) + i + 4);
+
+                for (uint32_t page_n = first; page_n < first + n && page_n < SM_MAX_PAGES; page_n++) {
+                    if (!sm_worker_owns(page_n)) continue;
+
+                    page = sm_page_lookup(page_n);
+                    if (page != NULL && page->busy) return 1;
+                }
+            }
+            return 0;
+        case SM_PUT_DONE:
+            return (sm_puts_done[request->nid] < sm_get32(SM_MSG_BODY(request)));
+        default:
+            return 0;
+    }
+}
+
 /* Pass the received command from the client to the correct function to execute it */
 int node_execute(msg_t *request) {
-    int status = 0;
-    
+    int status = 0, blocked = node_blocked(request);
+
+    if (blocked) {
+        if (sm_n_deferred == SM_DEFER_MAX) return sm_fatal("too many deferred requests");
+
+        sm_deferred[sm_n_deferred++] = request;
+
+        if (blocked == SM_HELD) {
+            struct memory_page *page = sm_page_lookup(request->page);
+
+            if (page->held < UINT32_MAX) page->held++;
+            if (options->log_file) {
+                fprintf(options->log_file, "#%d: held back from %u for %ldus\n", request->nid, request->page,
+                        node_hold_time());
+            }
+        }
+        return 0;
+    }
+
     switch(request->type) {
         case SM_EXIT: /* Handle sm_node_exit() */
-            status = node_close(request->nid);
+            status = node_close(request->nid, request);
             break;
         case SM_BARR: /* Handle sm_barrier() */
-            status = node_barrier(request->nid);
+            status = node_barrier(request->nid, request);
             break;
         case SM_ALOC: /* Handle sm_malloc() */
-            status = node_allocate(request->nid, request->buffer);
+            status = node_allocate(request->nid, request);
             break;
         case SM_CAST: /* Handle sm_bcast() */
-            status = node_cast(request->nid, request->buffer);
+            status = node_cast(request->nid, request);
             break;
         case SM_READ: /* Handle a read fault */
+            status = handle_read_fault(request->nid, request);
+            break;
         case SM_WRIT: /* Handle a write fault */
-            status = handle_fault(request->nid, request->buffer);
+            status = handle_write_fault(request->nid, request);
+            break;
+        case SM_DIFF: /* Handle the changes released by a node */
+            status = node_diff(request->nid, request);
+            break;
+        case SM_ACQU: /* Handle sm_acquire() */
+            status = node_acquire(request->nid, request);
+            break;
+        case SM_HOME_WHERE: /* Handle a node looking up a page's home */
+            status = node_where(request->nid, request);
+            break;
+        case SM_NOTICE: /* Handle the pages a node has released at their homes */
+            status = node_notice(request->nid, request);
+            break;
+        case SM_FETCH: /* Handle sm_prefetch() */
+            status = node_fetch(request->nid, request);
+            break;
+        case SM_GET: /* Handle sm_get() */
+            status = node_get(request->nid, request);
+            break;
+        case SM_PUT: /* Handle part of a page of sm_put() */
+        case SM_PUT_PAGES: /* Handle whole pages of sm_put() */
+            status = node_put(request->nid, request);
+            break;
+        case SM_PUT_DONE: /* Handle the end of a window of sm_put() */
+            status = node_put_done(request->nid, request);
+            break;
+        case SM_ADVISE: /* Handle sm_advise() */
+            status = node_advise(request->nid, request);
+            break;
+        case SM_LOCK_CREATE: /* Handle sm_lock_create() */
+            status = node_lock_create(request->nid, request);
+            break;
+        case SM_LOCK_BIND: /* Handle sm_lock_bind() */
+            status = node_lock_bind(request->nid, request);
+            break;
+        case SM_LOCK: /* Handle sm_lock() */
+            status = node_lock(request->nid, request);
+            break;
+        case SM_UNLOCK: /* Handle sm_unlock() */
+            status = node_unlock(request->nid, request);
+            break;
+        case SM_ATOMIC: /* Handle sm_fetch_add() and the other atomic operations */
+            status = node_atomic(request->nid, request);
+            break;
+        case SM_REDUCE: /* Handle sm_reduce() and sm_allreduce() */
+            status = node_reduce(request->nid, request);
+            break;
+        case SM_REDUCE_DATA: /* Handle a chunk of a node's vector for the reduction */
+            status = node_reduce_data(request->nid, request);
+            break;
+        case SM_REQU_REPLY: /* Handle a node's answer to a pending fault */
+        case SM_RLSE_REPLY:
+            status = node_answered(request);
+            if (status > 0) status = sm_fatal("unexpected page reply");
             break;
         default: /* Handle an invalid command received */
             status = sm_fatal("Invalid message received");
     }
 
-    free(request);
+    /* A pending fault is freed once it has been answered */
+    if (status == SM_PENDING) return 0;
+
+    sm_msg_free(request);
     return status;
 }
 
-/* Wait for each node to have sent the correct message (either barrier() or bm_cast()) */
-int node_wait(int nid, int mode, void **ret, int root) {
+/*
+ * Execute every deferred request whose pages are no longer busy, oldest first. Each node has at most
+ * one fault outstanding, and its puts are to distinct pages, so they can be run in any order.
+ */
+int node_deferred() {
+    int i = 0, status;
+
+    /* The windows still holding faults back are noted again as they are checked */
+    sm_hold_until = UINT64_MAX;
+
+    while (i < sm_n_deferred) {
+        msg_t *request = sm_deferred[i];
+        if (node_blocked(request)) {
+            i++;
+            continue;
+        }
+
+        memmove(&sm_deferred[i], &sm_deferred[i + 1], (sm_n_deferred - i - 1) * sizeof(msg_t *));
+        sm_n_deferred--;
+
+        status = node_execute(request);
+        if (status) return status;
+
+        /* Executing it may have deferred (or released) others */
+        i = 0;
+    }
+
+    return 0;
+}
+
+/*
+ * Receive messages until the reply of the given type for the page arrives from the node, executing
+ * any other requests in the meantime. Replies that belong to an outer (recursive) wait
+ * are stashed until that wait picks them up.
+ */
+int node_await(int nid, int type, uint32_t page, msg_t **reply) {
+    msg_t *message;
     int status;
-    msg_t *request;
 
-    for (int i = 0; i < options->n_nodes; i++) {
-        /* Don't check the node that initiated the request */
-        if (i == nid) continue;
-
-        /* receive and execute requests until the correct message is found (barrier/cast) */
-        while(1) {
-            status = sm_recv(i, &request);
-            if (status) sm_fatal("wait: failed to receive message from socket");
-
-            /* If the request is a barrier, and this is a barrier ack go to the next node */
-            if (mode == SM_BARR && request->type == SM_BARR_REPLY) {
-            /* If the request is a cast and this is a cast ack, capture the value from the root node */
-            } else if (mode == SM_CAST && request->type == SM_CAST_REPLY) {
-                if (i == root) sscanf(request->buffer, "%p", ret);
-            /* Otherwise it is another request, execute it */
-            } else {
-                status = node_execute(request);
-                if (status) return sm_fatal("failed to execute command");
+    /* On a worker the network thread receives the reply and hands it over */
+    if (sm_worker_thread()) return sm_workers_await(nid, type, page, reply);
+
+    while (1) {
+        /* The reply may already have arrived while a nested wait was reading from the node */
+        for (int i = 0; i < sm_stashed; i++) {
+            message = sm_stash[i];
+            if (message->nid == nid && message->type == type && message->page == page) {
+                sm_stash[i] = sm_stash[--sm_stashed];
+                *reply = message;
+                return 0;
             }
+        }
+
+        if (sm_msg_flush()) return sm_fatal("await: failed to send queued messages");
+        status = sm_event->next(&message, -1);
+        if (status) return sm_fatal("await: failed to receive message from socket");
 
-            free(request);
+        if (message->nid == nid && message->type == type && message->page == page) break;
+
+        /* A reply for a pending fault, or for an outer wait */
+        if (message->type == SM_REQU_REPLY || message->type == SM_RLSE_REPLY) {
+            status = node_answered(message);
+            if (status < 0) return sm_fatal("failed to finish a pending fault");
+            if (status == 0) {
+                sm_msg_free(message);
+                continue;
+            }
+
+            if (sm_stashed == SM_STASH_MAX) return sm_fatal("await: too many outstanding replies");
+            sm_stash[sm_stashed++] = message;
+            continue;
         }
+
+        status = node_execute(message);
+        if (status) return sm_fatal("failed to execute command");
     }
 
+    *reply = message;
     return 0;
 }
 
-/* */
-int node_barrier(int nid) {
-    int status = 0;
+/*
+ * The number of arrivals that complete a barrier or broadcast. With -d the nodes combine their arrivals
+ * along a tree, so only the root of the tree (node 0) reaches the allocator.
+ */
+static int node_arrivals() {
+    return options->distributed ? 1 : sm_node_count;
+}
+
+/*
+ * Keep the moves a node's homes propose with its arrival at a barrier (dsm -m). They are only made once
+ * every node has arrived, as a node still running could otherwise be told of a home that doesn't have
+ * the page yet.
+ */
+static void node_propose(int nid, msg_t *request) {
+    uint32_t n = request->len / 8;
+
+    if (n > SM_HOME_MOVES_MAX) n = SM_HOME_MOVES_MAX;
+    for (uint32_t i = 0; i < n * 2; i++) sm_proposed[nid][i] = sm_get32(SM_MSG_BODY(request) + i * 4);
+    sm_n_proposed[nid] = n;
+}
+
+/*
+ * Make the moves proposed at the barrier that has just completed and list them as the start of the
+ * SM_BARR_REPLY body, {n_moves:32, (page:32, home:32) * n_moves}. Returns the length of the list.
+ */
+static uint32_t node_moves(char *body) {
+    uint32_t n_moves = 0;
+
+    for (int nid = 0; nid < options->n_nodes; nid++) {
+        for (int i = 0; i < sm_n_proposed[nid] && n_moves < SM_HOME_MOVES_MAX; i++) {
+            uint32_t page_n = sm_proposed[nid][i * 2], home = sm_proposed[nid][i * 2 + 1];
 
-    /* Wait until all nodes have sent a barrier request */
-    status = node_wait(nid, SM_BARR, NULL, -1);
-    if (status) return sm_fatal("node wait failed");
+            /* Only a page's current home may give it away */
+            if (page_n >= (uint32_t) sm_current_page || home >= (uint32_t) options->n_nodes ||
+                    sm_homes[page_n] != nid + 1 || home == (uint32_t) nid) {
+                continue;
+            }
+            sm_homes[page_n] = home + 1;
+
+            sm_put32(body + 4 + n_moves * 8, page_n);
+            sm_put32(body + 8 + n_moves * 8, home);
+            n_moves++;
+
+            if (options->log_file) fprintf(options->log_file, "-= home of %u moves from #%d to #%u\n", page_n, nid, home);
+        }
+        sm_n_proposed[nid] = 0;
+    }
+
+    sm_put32(body, n_moves);
+    return 4 + n_moves * 8;
+}
+
+/*
+ * Release every node waiting in a barrier or broadcast, answering the requests in `seqs', all of the
+ * replies go out as one batch
+ */
+static int node_release(int type, const uint32_t *seqs, const void *body, uint32_t len) {
+    static char notices[SM_MAX_NODES][SM_MSG_MAX];
+    struct sm_frame frames[SM_MAX_NODES];
+    uint32_t moves = 0;
+    int n_frames = 0;
+
+    /* With homes at the nodes every node is told of every move, ahead of its own write notices */
+    if (type == SM_BARR_REPLY && options->homes) moves = node_moves(notices[0]);
 
-    /* Once all of the nodes have completed the barrier, send them a ACK */
     for (int i = 0; i < options->n_nodes; i++) {
-        sm_send(client_sockets[i], i, SM_BARR_REPLY, NULL);
+        if (client_sockets[i] <= 0 || (options->distributed && i != 0)) continue;
+
+        frames[n_frames] = (struct sm_frame) { client_sockets[i], i, type, 0, body, len, seqs[i] };
+
+        /* Under release consistency each node gets its own write notices with the barrier */
+        if (type == SM_BARR_REPLY && options->release) {
+            if (i != 0) memcpy(notices[i], notices[0], moves);
+
+            frames[n_frames].body = notices[i];
+            frames[n_frames].len  = moves + node_notices(i, notices[i] + moves, (SM_MSG_MAX - moves) / 4);
+        }
+        n_frames++;
     }
 
+    return sm_send_all(frames, n_frames);
+}
+
+/*
+ * Record the node's arrival at the barrier, once every node has arrived send them all an ACK
+ */
+int node_barrier(int nid, msg_t *request) {
+    sm_barrier_seq[nid] = request->seq;
+    if (options->homes) node_propose(nid, request);
+    if (++sm_barrier_count < node_arrivals()) return 0;
+    sm_barrier_count = 0;
+
+    /* Once all of the nodes have completed the barrier, send them a ACK (with their write notices) */
+    if (node_release(SM_BARR_REPLY, sm_barrier_seq, NULL, 0))
+        return sm_fatal("failed to send barrier acknowledgement");
+
     return 0;
 }
 
-/* Allocate some memory for the node and store metadata about it */
-int node_allocate(int nid, char request[]) {
-    int alloc_size, offset;
+/*
+ * Grant the node a range of whole pages, nodes carve their small objects out of these chunks themselves
+ * so a request is either a chunk for the node's arena or a single large object
+ */
+int node_allocate(int nid, msg_t *request) {
+    int status, page_size = getpagesize();
+    uint64_t alloc_size, pages, offset = UINT64_MAX;
+    char buffer[8];
 
-    /* If there are no free pages, send back a message and return */
-    if (sm_current_page >= SM_MAX_PAGES) {
-        // send message
-        // return
-    /* Otherwise allocated the new page for the client sending the request */
-    } else {
-        /* Find how much memory the node is requesting */
-        alloc_size = request[0];
+    /* Find how many pages the node is requesting */
+    alloc_size = sm_get64(SM_MSG_BODY(request));
+    pages = (alloc_size + page_size - 1) / page_size;
+    if (pages == 0) pages = 1;
 
-        sm_page_table[sm_current_page]->writer = nid;
-        sm_page_table[sm_current_page]->readers[nid] = 1;
+    /* Allocate the pages if there are enough free (otherwise the offset is left invalid) */
+    if (pages <= SM_MAX_PAGES - sm_current_page) {
+        offset = (uint64_t) sm_current_page * page_size;
 
-        offset = (sm_current_page * SM_PAGE_SIZE) + sm_current_offset;
+        /* The allocating node is the home of every page it is granted (dsm -m alloc) */
+        if (options->homes == SM_HOME_ALLOC) {
+            for (uint64_t p = 0; p < pages; p++) sm_homes[sm_current_page + p] = nid + 1;
+        }
+        sm_current_page += pages;
     }
 
     /* Return a message informing the client of the offset their allocation will be at */
-    char buffer[] = {offset};
-    status = sm_send(client_sockets[nid], nid, SM_ALOC_REPLY, buffer);
-    if (status) return sm_fatal("milk");
+    sm_put64(buffer, offset);
+    status = sm_reply(client_sockets[nid], request, nid, SM_ALOC_REPLY, buffer, sizeof(buffer));
+    if (status) return sm_fatal("failed to send allocation reply");
 
     /* Write the action to the log file */
     if (options->log_file != NULL) {
-        fprintf(options->log_file, "#%d: allocated %d-%d\n", nid, sm_current_page, sm_current_offset);
+        fprintf(options->log_file, "#%d: allocated %lu bytes @ %ld\n", nid, alloc_size, (long) offset);
     }
 
-    /* Update the global sizes */
-    sm_current_page += alloc_size / SM_PAGESIZE;
-    sm_current_offset = (sm_current_offset + alloc_size) % SM_PAGESIZE;
-
     return 0;
 }
 
-int node_cast(int nid, char request[]) {
-    int status, root, value;
+/*
+ * Record the node's arrival at the broadcast (and the value if it is the root), once every node has
+ * arrived send the root's value to all of them
+ */
+int node_cast(int nid, msg_t *request) {
+    int root;
+    char buffer[8];
 
-    root  = request[0];
-    value = request[1];
+    root = sm_get32(SM_MSG_BODY(request));
+    sm_cast_seq[nid] = request->seq;
+    if (nid == root) sm_cast_value = sm_get64(SM_MSG_BODY(request) + 4);
 
-    status = node_wait(nid, SM_CAST, &address, root);
-    if (status) return sm_fatal("node wait failed");
+    if (++sm_cast_count < node_arrivals()) return 0;
+    sm_cast_count = 0;
 
     /* All of the nodes have hit the cast, so send back the new value */
-    for (int i = 0; i < allocator->total_nodes; i++) {
-        memset(buffer, 0, SM_BUFF_SIZE);
+    sm_put64(buffer, sm_cast_value);
+    if (node_release(SM_CAST_REPLY, sm_cast_seq, buffer, sizeof(buffer)))
+        return sm_fatal("failed to send broadcast value");
+
+    return 0;
+}
+
+/*
+ * The bytes of each element type of a reduction
+ */
+static const uint32_t sm_reduce_size[] = { 4, 8, 4, 8, 4, 8, 1 };
+
+#define NODE_SUM(x, y) ((x) + (y))
+#define NODE_MIN(x, y) (((y) < (x)) ? (y) : (x))
+#define NODE_MAX(x, y) (((y) > (x)) ? (y) : (x))
+#define NODE_COMBINE(T, combine) do {                                                   \
+        T *restrict to = (T *) result;                                                  \
+        const T *restrict from = (const T *) chunk;                                     \
+        for (uint32_t i = 0; i < n; i++) to[i] = combine(to[i], from[i]);              \
+    } while (0)
+#define NODE_COMBINE_ALL(T) do {                                                        \
+        if (op == SM_RED_SUM)      NODE_COMBINE(T, NODE_SUM);                           \
+        else if (op == SM_RED_MIN) NODE_COMBINE(T, NODE_MIN);                           \
+        else                       NODE_COMBINE(T, NODE_MAX);                           \
+    } while (0)
+
+/*
+ * Combine `n' elements of a node's chunk into the result. The allocator is built without optimisation,
+ * these loops are where a reduction spends its time so they are optimised (into vector instructions).
+ */
+__attribute__((optimize("O3")))
+static void node_combine(char *result, const char *chunk, uint32_t n, uint32_t type, uint32_t op) {
+    switch (type) {
+        case SM_RED_INT32:  NODE_COMBINE_ALL(int32_t);  break;
+        case SM_RED_INT64:  NODE_COMBINE_ALL(int64_t);  break;
+        case SM_RED_UINT32: NODE_COMBINE_ALL(uint32_t); break;
+        case SM_RED_UINT64: NODE_COMBINE_ALL(uint64_t); break;
+        case SM_RED_FLOAT:  NODE_COMBINE_ALL(float);    break;
+        default:            NODE_COMBINE_ALL(double);   break;
+    }
+}
+
+/*
+ * Returns whether the node sends its vector to the reduction, rather than only the SM_REDUCE
+ */
+static int node_contributes(int nid) {
+    if (sm_reduction.op == SM_RED_GATHER) return (uint32_t) nid != sm_reduction.root;
+    if (sm_reduction.op == SM_RED_ROOT)   return (uint32_t) nid == sm_reduction.root;
+
+    return 1;
+}
+
+/*
+ * Returns whether the result of the reduction is sent to the node
+ */
+static int node_receives(int nid) {
+    if (sm_reduction.op == SM_RED_GATHER) return 0;
+    if (sm_reduction.op == SM_RED_ROOT)   return (uint32_t) nid != sm_reduction.root;
+
+    return sm_reduction.root == SM_REDUCE_ALL || (uint32_t) nid == sm_reduction.root;
+}
+
+/*
+ * Send chunks `first' to `last' - 1 of the result to the nodes in `to', a chunk at a time to all of them
+ * (so they all receive at once)
+ */
+static int node_reduce_send(uint64_t to, uint32_t first, uint32_t last) {
+    struct sm_reduction *r = &sm_reduction;
+    struct sm_frame frames[SM_MAX_NODES];
+    uint64_t size = r->count * sm_reduce_size[r->type];
+    int n_frames;
+
+    for (uint32_t chunk = first; chunk < last; chunk++) {
+        uint64_t offset = (uint64_t) chunk * SM_BULK_MAX;
+        uint32_t len = (size - offset < SM_BULK_MAX) ? size - offset : SM_BULK_MAX;
+
+        n_frames = 0;
+        for (int i = 0; i < options->n_nodes; i++) {
+            if (client_sockets[i] <= 0 || !(to & (1ULL << i))) continue;
 
-        /* The root_nid node also will be waiting on an acknowledgement */
-        snprintf(buffer, SM_BUFF_SIZE, "address %p", address);
-        send(c_sockets[i], buffer, strlen(buffer), 0);
+            frames[n_frames++] = (struct sm_frame) { client_sockets[i], i, SM_REDUCE_DATA, chunk, r->result + offset,
+                                                     len, 0 };
+        }
+        if (sm_send_all(frames, n_frames)) return sm_fatal("failed to send the result of a reduction");
     }
 
     return 0;
 }
 
-int handle_read_fault(int nid, char request[]) {
-    int status, offset;
-    
-    /* Get the allocation from the page list */
-    page_n = offset / getpagesize();
-    page = sm_page_table[page_n];
+/*
+ * The nodes that have reached the reduction and receive its result
+ */
+static uint64_t node_receivers() {
+    uint64_t receivers = 0;
 
-    /* Send the page to the node that triggered the fault */
-    char buffer[] = {}
-    status = sm_send(client_sockets[nid], nid, SM_READ)
-    if (status) return sm_fatal("failed to send page to node");
+    for (int i = 0; i < options->n_nodes; i++) {
+        if ((sm_reduction.joined & (1ULL << i)) && node_receives(i)) receivers |= 1ULL << i;
+    }
+
+    return receivers;
+}
+
+/*
+ * Every node has sent its chunks, send the result to each node that receives it and then answer every
+ * node's SM_REDUCE. The root's vector has already been passed on as it arrived.
+ */
+static int node_reduced() {
+    struct sm_reduction *r = &sm_reduction;
+    struct sm_frame frames[SM_MAX_NODES];
+    int n_frames;
+
+    if (r->op != SM_RED_ROOT && node_reduce_send(node_receivers(), 0, r->n_chunks)) return -1;
 
-    if (allocator->log) {
-        fprintf(options->log_file, "#%d: read fault @ %d\n\
-                                            #%d: releasing ownership of %d\n\
-                                            #%d: receiving read permission for %d\n", 
-                                            nid, page_n, page->writer, page_n, nid, page_n);
+    n_frames = 0;
+    for (int i = 0; i < options->n_nodes; i++) {
+        if (client_sockets[i] <= 0 || !(r->joined & (1ULL << i))) continue;
+
+        frames[n_frames++] = (struct sm_frame) { client_sockets[i], i, SM_REDUCE_REPLY, 0, NULL, 0, r->seq[i] };
+    }
+
+    if (options->log_file) {
+        fprintf(options->log_file, "-= reduction of %lu elements (op %u, type %u) complete\n", (unsigned long) r->count,
+                r->op, r->type);
     }
+
+    memset(r->combined, 0, r->n_chunks * sizeof(r->combined[0]));
+    memset(r->chunks, 0, sizeof(r->chunks));
+    r->active  = 0;
+    r->joined  = 0;
+    r->arrived = 0;
+
+    if (sm_send_all(frames, n_frames)) return sm_fatal("failed to acknowledge a reduction");
+
+    return 0;
 }
 
-int handle_write_fault(int nid, char request[]) {
-    int status, offset;
-    msg_t *message;
-    char *page_contents, buffer[4096];
+/*
+ * The node has sent everything it sends for the reduction, the root of a gather is sent the chunks which
+ * were held back for it. Once every node has arrived the reduction is complete.
+ */
+static int node_reduce_arrived(int nid) {
+    struct sm_reduction *r = &sm_reduction;
+
+    if (r->op == SM_RED_GATHER && (uint32_t) nid == r->root) {
+        for (int i = 0; i < r->n_held; i++) {
+            msg_t *chunk = r->held[i];
+            int status = sm_send(client_sockets[nid], nid, SM_REDUCE_DATA, chunk->page, SM_MSG_BODY(chunk), chunk->len);
+
+            sm_msg_free(chunk);
+            if (status) return sm_fatal("failed to relay a reduction to its root");
+        }
+        r->n_held = 0;
+    }
+
+    if (++r->arrived < sm_node_count) return 0;
 
-    /* Find where the fault occurred from the message */
-    sscanf(request, "%d", &offset);
+    return node_reduced();
+}
 
-    /* Find the page from the page table */
-    page_n = offset / getpagesize();
-    page   = sm_page_table[page_n];
+/*
+ * A node has reached a reduction, its chunks follow unless it doesn't contribute to it
+ */
+int node_reduce(int nid, msg_t *request) {
+    struct sm_reduction *r = &sm_reduction;
+    const char *body = SM_MSG_BODY(request);
+    uint32_t root, op, type;
+    uint64_t count;
 
-    /* Send a message to the current writer of the node to release ownership of the page */
-    buffer = {offset}
-    status = sm_send(client_sockets[page->writer], page->writer, SM_RELEASE, buffer);
-    if (status) return sm_fatal("sending invalidate release message failed.");
+    if (request->len < 20) return sm_fatal("malformed reduction");
+    root  = sm_get32(body);
+    op    = sm_get32(body + 4);
+    type  = sm_get32(body + 8);
+    count = sm_get64(body + 12);
 
-    /* Wait for a response from the node */
-    while(1) {
-        status = sm_recv(client_sockets[page->writer], &message);
-        if (status) return sm_fatal("receiving release acknowledgement failed in write fault handler");
+    if (!r->active) {
+        uint64_t size;
 
-        /* If the received message is the release reply, break from the loop */
-        if (message->type == SM_RLSE_REPLY) {
-            sscanf(message->buffer, "%p", &page_contents);
-            free(message);
-            break;
-        /* Otherwise, execute the command and receive another message from the node */
+        if (type > SM_RED_BYTE || (type == SM_RED_BYTE && op != SM_RED_ROOT) || op > SM_RED_ROOT ||
+                count > (uint64_t) SM_REDUCE_CHUNKS * SM_BULK_MAX ||
+                (root >= (uint32_t) options->n_nodes && (root != SM_REDUCE_ALL || op >= SM_RED_GATHER))) {
+            return sm_fatal("invalid reduction");
+        }
+        size = count * sm_reduce_size[type];
+        if (size > (uint64_t) SM_REDUCE_CHUNKS * SM_BULK_MAX) return sm_fatal("invalid reduction");
+
+        /* Only reductions combined here need room for their result */
+        if (op < SM_RED_GATHER || op == SM_RED_ROOT) {
+            if (size > r->result_size) {
+                char *result = realloc(r->result, size);
+
+                if (result == NULL) return sm_fatal("failed to allocate the result of a reduction");
+                r->result      = result;
+                r->result_size = size;
+            }
+        }
+
+        r->active   = 1;
+        r->root     = root;
+        r->op       = op;
+        r->type     = type;
+        r->count    = count;
+        r->n_chunks = (size + SM_BULK_MAX - 1) / SM_BULK_MAX;
+    } else if (root != r->root || op != r->op || type != r->type || count != r->count) {
+        return sm_fatal("nodes disagree on a reduction");
+    }
+    if (r->joined & (1ULL << nid)) return sm_fatal("node is already taking part in the reduction");
+
+    r->joined |= 1ULL << nid;
+    r->seq[nid] = request->seq;
+
+    /* The root's vector goes on as it arrives, a node that gets here late is first sent what has */
+    if (r->op == SM_RED_ROOT && node_receives(nid) && node_reduce_send(1ULL << nid, 0, r->chunks[r->root]))
+        return -1;
+
+    if (node_contributes(nid) && r->n_chunks > 0) return 0;
+
+    return node_reduce_arrived(nid);
+}
+
+/*
+ * Combine a chunk of the node's vector into the result, or relay it to the root of a gather (holding it
+ * back if the root hasn't reached the reduction yet, it may still be asking the allocator for pages).
+ * Returns SM_PENDING if the chunk is being held.
+ */
+int node_reduce_data(int nid, msg_t *request) {
+    struct sm_reduction *r = &sm_reduction;
+    uint32_t chunk = request->page, size = sm_reduce_size[r->type];
+    uint64_t offset = (uint64_t) chunk * SM_BULK_MAX, total = r->count * size;
+    int held = 0;
+
+    if (!r->active || !(r->joined & (1ULL << nid)) || !node_contributes(nid) || chunk >= r->n_chunks ||
+            request->len != ((total - offset < SM_BULK_MAX) ? total - offset : SM_BULK_MAX)) {
+        return sm_fatal("malformed reduction");
+    }
+
+    if (r->op == SM_RED_GATHER) {
+        if (r->joined & (1ULL << r->root)) {
+            if (sm_send(client_sockets[r->root], r->root, SM_REDUCE_DATA, chunk, SM_MSG_BODY(request), request->len))
+                return sm_fatal("failed to relay a reduction to its root");
+        } else {
+            if (r->n_held == r->max_held) {
+                int max = r->max_held ? r->max_held * 2 : SM_MAX_NODES;
+                msg_t **grown = realloc(r->held, max * sizeof(msg_t *));
+
+                if (grown == NULL) return sm_fatal("failed to hold a reduction for its root");
+                r->held     = grown;
+                r->max_held = max;
+            }
+            r->held[r->n_held++] = request;
+            held = 1;
+        }
+    } else if (r->op == SM_RED_ROOT) {
+        memcpy(r->result + offset, SM_MSG_BODY(request), request->len);
+        if (node_reduce_send(node_receivers(), chunk, chunk + 1)) return -1;
+    } else if (r->combined[chunk]++ == 0) {
+        memcpy(r->result + offset, SM_MSG_BODY(request), request->len);
+    } else {
+        node_combine(r->result + offset, SM_MSG_BODY(request), request->len / size, r->type, r->op);
+    }
+
+    if (++r->chunks[nid] == r->n_chunks && node_reduce_arrived(nid)) return -1;
+
+    return held ? SM_PENDING : 0;
+}
+
+/*
+ * Collect the write notices owed to the node, the pages other nodes have released changes to since
+ * the node's last acquire. Returns the length of the notices.
+ */
+static uint32_t node_notices(int nid, char *notices, uint32_t max) {
+    uint32_t pages[SM_MSG_MAX / 4];
+    int n_pages = sm_directory_stale(nid, pages, max);
+
+    /* Too many to list, the node drops every copy it has instead */
+    if (n_pages < 0) {
+        sm_put32(notices, SM_NOTICE_ALL);
+        return 4;
+    }
+
+    for (int i = 0; i < n_pages; i++) sm_put32(notices + i * 4, pages[i]);
+
+    return n_pages * 4;
+}
+
+/*
+ * Apply the runs a node has changed to the cached page, every other node is now owed a write notice
+ */
+int node_diff(int nid, msg_t *request) {
+    char *page, *diff = SM_MSG_BODY(request);
+    uint32_t page_n = request->page;
+    int bytes;
+
+    if (page_n >= SM_MAX_PAGES) return sm_fatal("diff outside of the allocated memory");
+    page = (char *) sm_memory_map + (long) page_n * getpagesize();
+
+    bytes = sm_patch(page, getpagesize(), diff, request->len);
+    if (bytes < 0) return sm_fatal("malformed diff");
+
+    sm_page(page_n)->version++;
+    sm_page_stale(page_n, ~(1ULL << nid));
+
+    if (options->log_file) fprintf(options->log_file, "#%d: diff of %d bytes @ %u\n", nid, bytes, page_n);
+
+    return 0;
+}
+
+/*
+ * Send the node its write notices
+ */
+int node_acquire(int nid, msg_t *request) {
+    char notices[SM_MSG_MAX];
+    uint32_t len = node_notices(nid, notices, SM_MSG_MAX / 4);
+
+    if (sm_reply(client_sockets[nid], request, nid, SM_ACQU_REPLY, notices, len)) {
+        return sm_fatal("failed to send write notices");
+    }
+
+    if (options->log_file) fprintf(options->log_file, "#%d: acquired %u write notices\n", nid, len / 4);
+
+    return 0;
+}
+
+/*
+ * Tell the node the homes of the page it is about to fetch and of the pages after it, the page gets the
+ * node as its home if it has none yet (dsm -m)
+ */
+int node_where(int nid, msg_t *request) {
+    char body[SM_HOME_RUN * 4];
+    uint32_t page_n = request->page;
+
+    if (page_n >= (uint32_t) sm_current_page) return sm_fatal("home asked for outside of the allocated memory");
+
+    if (sm_homes[page_n] == 0) {
+        sm_homes[page_n] = nid + 1;
+        if (options->log_file) fprintf(options->log_file, "#%d: home of %u by first touch\n", nid, page_n);
+    }
+
+    for (uint32_t i = 0; i < SM_HOME_RUN; i++) {
+        int home = (page_n + i < (uint32_t) sm_current_page) ? sm_homes[page_n + i] - 1 : -1;
+        sm_put32(body + i * 4, home);
+    }
+
+    if (sm_reply(client_sockets[nid], request, nid, SM_HOME_WHERE_REPLY, body, sizeof(body))) {
+        return sm_fatal("failed to send homes");
+    }
+
+    return 0;
+}
+
+/*
+ * The node has released changes to these pages at their homes (dsm -m), every other node is now owed a
+ * write notice for each
+ */
+int node_notice(int nid, msg_t *request) {
+    for (uint32_t i = 0; i + 4 <= request->len; i += 4) {
+        uint32_t page_n = sm_get32(SM_MSG_BODY(request) + i);
+
+        if (page_n >= SM_MAX_PAGES) return sm_fatal("write notice outside of the allocated memory");
+
+        sm_page(page_n)->version++;
+        sm_page_stale(page_n, ~(1ULL << nid));
+    }
+
+    if (options->log_file) fprintf(options->log_file, "#%d: released %u pages\n", nid, request->len / 4);
+
+    return 0;
+}
+
+/*
+ * Merge frames of the same type carrying consecutive pages of the cache, which are consecutive in
+ * memory too, into frames of up to SM_BULK_MAX bytes. Returns the number of frames left.
+ */
+static int node_merge(struct sm_frame *frames, int n_frames) {
+    int page_size = getpagesize(), n_merged = 0;
+
+    for (int i = 0; i < n_frames; i++) {
+        struct sm_frame *last = &frames[n_merged - 1];
+
+        if (n_merged > 0 && last->type == frames[i].type && last->socket == frames[i].socket &&
+                last->seq == 0 && frames[i].seq == 0 && last->page + last->len / page_size == frames[i].page &&
+                last->len + frames[i].len <= SM_BULK_MAX) {
+            last->len += frames[i].len;
+            continue;
+        }
+        frames[n_merged++] = frames[i];
+    }
+
+    return n_merged;
+}
+
+/*
+ * Add a frame sending each of the pages to the node ahead of its first access to them, as a read copy
+ * (SM_PREF_PAGE) or with ownership (SM_PREF_OWN). Pages that aren't allocated, aren't owned by this
+ * thread, are part way through another fault or that the node already holds are skipped. The copies in
+ * the way are downgraded or invalidated first, every request going out in one batch before any reply is
+ * awaited, so this costs at most one more round trip however many nodes hold the pages. The pages are
+ * left busy until the caller has sent them, as faults run in the meantime must not change their copies.
+ * Returns the number of frames added (at most SM_PREF_MAX).
+ */
+static int node_ahead(int nid, const uint32_t *candidates, int n_candidates, int write, struct sm_frame *frames) {
+    int page_size = getpagesize(), n_pages = 0, n_requests = 0, status, i;
+    static __thread struct sm_frame requests[SM_PREF_MAX * SM_MAX_NODES];
+    uint32_t pages[SM_PREF_MAX];
+    struct memory_page *page;
+    uint64_t copies;
+    msg_t *reply;
+
+    for (int c = 0; c < n_candidates && n_pages < SM_PREF_MAX; c++) {
+        uint32_t page_n = candidates[c];
+        if (page_n >= sm_current_page || !sm_worker_owns(page_n)) continue;
+
+        page = sm_page(page_n);
+        if (page == NULL || page->busy || page->writer == nid) continue;
+        if (!write && (page->readers & (1ULL << nid))) continue;
+
+        page->busy = 1;
+        if (write) {
+            copies = (page->readers | ((page->writer >= 0) ? 1ULL << page->writer : 0)) & ~(1ULL << nid);
+            SM_FOR_EACH_NODE(i, copies) {
+                requests[n_requests++] = (struct sm_frame) { client_sockets[i], i, SM_RELEASE, page_n, NULL, 0, 0 };
+            }
+        } else if (page->writer >= 0) {
+            requests[n_requests++] = (struct sm_frame) { client_sockets[page->writer], page->writer,
+                                                         SM_REQUEST, page_n, NULL, 0, 0 };
+        }
+        pages[n_pages++] = page_n;
+    }
+
+    if (n_requests > 0 && sm_send_all(requests, n_requests)) return sm_fatal("sending page requests failed");
+
+    for (int p = 0; p < n_pages; p++) {
+        page = sm_page(pages[p]);
+
+        if (write) {
+            copies = (page->readers | ((page->writer >= 0) ? 1ULL << page->writer : 0)) & ~(1ULL << nid);
+            SM_FOR_EACH_NODE(i, copies) {
+                status = node_await(i, SM_RLSE_REPLY, pages[p], &reply);
+                if (status) return sm_fatal("receiving release acknowledgement failed while prefetching");
+                if (i == page->writer) node_migrated(page, pages[p], reply);
+                sm_msg_free(reply);
+            }
+
+            page->readers = 0;
+            page->writer  = nid;
+            page->version++;
+        } else {
+            if (page->writer >= 0) {
+                status = node_await(page->writer, SM_REQU_REPLY, pages[p], &reply);
+                if (status) return sm_fatal("receiving page failed while prefetching");
+                node_migrated(page, pages[p], reply);
+                sm_msg_free(reply);
+
+                page->readers |= 1ULL << page->writer;
+                page->writer = -1;
+            }
+            page->readers |= 1ULL << nid;
+        }
+        if (node_adaptive()) page->stale &= ~(1ULL << nid);
+
+        frames[p] = (struct sm_frame) { client_sockets[nid], nid, write ? SM_PREF_OWN : SM_PREF_PAGE, pages[p],
+                                        (char *) sm_memory_map + (long) pages[p] * page_size, page_size, 0 };
+
+        if (options->log_file) {
+            fprintf(options->log_file, "#%d: prefetching %s of %u\n", nid, write ? "ownership" : "a copy", pages[p]);
+        }
+    }
+
+    return n_pages;
+}
+
+/*
+ * Send every page of the range to the node ahead of its first access to them, SM_PREF_MAX at a time
+ */
+int node_fetch(int nid, msg_t *request) {
+    uint32_t n_pages = sm_get32(SM_MSG_BODY(request)), write = sm_get32(SM_MSG_BODY(request) + 4);
+    uint32_t page_n = request->page, end, candidates[SM_PREF_MAX];
+    struct sm_frame frames[SM_PREF_MAX];
+    int n_candidates, n_frames, status;
+
+    end = (n_pages < SM_MAX_PAGES - page_n) ? page_n + n_pages : SM_MAX_PAGES;
+
+    while (page_n < end && page_n < sm_current_page) {
+        for (n_candidates = 0; page_n < end && n_candidates < SM_PREF_MAX; page_n++) {
+            if (sm_worker_owns(page_n)) candidates[n_candidates++] = page_n;
+        }
+
+        n_frames = node_ahead(nid, candidates, n_candidates, write, frames);
+        if (n_frames < 0) return -1;
+
+        for (int i = 0; i < n_frames; i++) candidates[i] = frames[i].page;
+
+        status = sm_send_all(frames, node_merge(frames, n_frames));
+        for (int i = 0; i < n_frames; i++) sm_page(candidates[i])->busy = 0;
+        if (status) return sm_fatal("failed to send prefetched pages to node");
+    }
+
+    /* With workers every shard sends its own pages, the reply goes out once they all have */
+    if (sm_workers_last(nid) && sm_reply(client_sockets[nid], request, nid, SM_FETCH_REPLY, NULL, 0))
+        return sm_fatal("failed to send prefetch reply");
+
+    return 0;
+}
+
+/*
+ * Send the node copies of the pages without making it a reader, downgrading their writers first
+ */
+static int node_get_pages(int nid, const uint32_t *pages, int n_pages) {
+    int page_size = getpagesize(), n_requests = 0, status;
+    struct sm_frame requests[SM_PREF_MAX], frames[SM_PREF_MAX];
+    struct memory_page *page;
+    msg_t *reply;
+
+    for (int i = 0; i < n_pages; i++) {
+        page = sm_page(pages[i]);
+
+        /* A writer other than the node has changes the cache doesn't, the node's own would be used in place */
+        page->busy = 1;
+        if (page->writer >= 0 && page->writer != nid) {
+            requests[n_requests++] = (struct sm_frame) { client_sockets[page->writer], page->writer,
+                                                         SM_REQUEST, pages[i], NULL, 0, 0 };
+        }
+    }
+
+    if (n_requests > 0 && sm_send_all(requests, n_requests)) return sm_fatal("sending page requests failed");
+
+    for (int i = 0; i < n_pages; i++) {
+        page = sm_page(pages[i]);
+
+        if (page->writer >= 0 && page->writer != nid) {
+            status = node_await(page->writer, SM_REQU_REPLY, pages[i], &reply);
+            if (status) return sm_fatal("receiving page failed while getting pages");
+            node_migrated(page, pages[i], reply);
+            sm_msg_free(reply);
+
+            page->readers |= 1ULL << page->writer;
+            page->writer = -1;
+        }
+
+        frames[i] = (struct sm_frame) { client_sockets[nid], nid, SM_GET_PAGES, pages[i],
+                                        (char *) sm_memory_map + (long) pages[i] * page_size, page_size, 0 };
+    }
+
+    status = sm_send_all(frames, node_merge(frames, n_pages));
+    for (int i = 0; i < n_pages; i++) sm_page(pages[i])->busy = 0;
+    if (status) return sm_fatal("failed to send pages to node");
+
+    return 0;
+}
+
+/*
+ * Send the node copies of the runs of pages it asked for, followed by the reply
+ */
+int node_get(int nid, msg_t *request) {
+    uint32_t pages[SM_PREF_MAX], n_gets = 0;
+    int n_pages = 0;
+
+    for (uint32_t i = 0; i + 8 <= request->len; i += 8) {
+        uint32_t first = sm_get32(SM_MSG_BODY(request) + i), n = sm_get32(SM_MSG_BODY(request) + i + 4);
+
+        for (uint32_t page_n = first; page_n < first + n && page_n < sm_current_page; page_n++) {
+            if (!sm_worker_owns(page_n) || sm_page(page_n) == NULL) continue;
+
+            pages[n_pages++] = page_n;
+            if (n_pages == SM_PREF_MAX) {
+                if (node_get_pages(nid, pages, n_pages)) return -1;
+                n_gets += n_pages;
+                n_pages = 0;
+            }
+        }
+    }
+    if (n_pages > 0 && node_get_pages(nid, pages, n_pages)) return -1;
+    n_gets += n_pages;
+
+    if (options->log_file) fprintf(options->log_file, "#%d: getting %u pages\n", nid, n_gets);
+
+    /* With workers every shard sends its own pages, the reply goes out once they all have */
+    if (sm_workers_last(nid) && sm_reply(client_sockets[nid], request, nid, SM_GET_REPLY, NULL, 0))
+        return sm_fatal("failed to send get reply");
+
+    return 0;
+}
+
+/*
+ * Write what the node put over the cached pages (those owned by this thread), once every copy of them
+ * has been invalidated (their writers' changes arriving first)
+ */
+int node_put(int nid, msg_t *request) {
+    int page_size = getpagesize(), n_requests = 0, status, i;
+    static __thread struct sm_frame requests[SM_BULK_PAGES * SM_MAX_NODES];
+    uint32_t end = node_put_end(request), offset = 0, len = request->len;
+    const char *bytes = SM_MSG_BODY(request);
+    struct memory_page *page;
+    uint64_t copies;
+    msg_t *reply;
+
+    if (request->type == SM_PUT) {
+        offset = (len >= 4) ? sm_get32(bytes) : UINT32_MAX;
+        if (offset > page_size || len - 4 > page_size - offset) return sm_fatal("malformed put");
+
+        bytes += 4;
+        len   -= 4;
+    } else if (len % page_size != 0 || len > SM_BULK_MAX) {
+        return sm_fatal("malformed put");
+    }
+    if (end > sm_current_page) return sm_fatal("put outside of the allocated memory");
+
+    /* Every copy of every page goes in one batch, the pages stay busy until they have been written */
+    for (uint32_t page_n = request->page; page_n < end; page_n++) {
+        if (!sm_worker_owns(page_n)) continue;
+
+        page = sm_page(page_n);
+        page->busy = 1;
+
+        copies = page->readers | ((page->writer >= 0) ? 1ULL << page->writer : 0);
+        SM_FOR_EACH_NODE(i, copies) {
+            requests[n_requests++] = (struct sm_frame) { client_sockets[i], i, SM_RELEASE, page_n, NULL, 0, 0 };
+        }
+    }
+    if (n_requests > 0 && sm_send_all(requests, n_requests)) return sm_fatal("sending invalidate release message failed");
+
+    for (uint32_t page_n = request->page; page_n < end; page_n++) {
+        if (!sm_worker_owns(page_n)) continue;
+
+        page = sm_page(page_n);
+        copies = page->readers | ((page->writer >= 0) ? 1ULL << page->writer : 0);
+        SM_FOR_EACH_NODE(i, copies) {
+            status = node_await(i, SM_RLSE_REPLY, page_n, &reply);
+            if (status) return sm_fatal("receiving release acknowledgement failed in put");
+            if (i == page->writer) node_migrated(page, page_n, reply);
+            sm_msg_free(reply);
+        }
+
+        memcpy((char *) sm_memory_map + (long) page_n * page_size + offset,
+               bytes + (long) (page_n - request->page) * page_size, (request->type == SM_PUT) ? len : page_size);
+
+        page->readers = 0;
+        page->writer  = -1;
+        page->version++;
+        page->busy    = 0;
+    }
+
+    sm_puts_done[nid]++;
+
+    if (options->log_file) fprintf(options->log_file, "#%d: put %u bytes @ %u\n", nid, len, request->page);
+
+    return 0;
+}
+
+/*
+ * Every put of the node's window has been applied (by this shard), acknowledge the window
+ */
+int node_put_done(int nid, msg_t *request) {
+    sm_puts_done[nid] -= sm_get32(SM_MSG_BODY(request));
+
+    if (sm_workers_last(nid) && sm_reply(client_sockets[nid], request, nid, SM_PUT_REPLY, NULL, 0))
+        return sm_fatal("failed to send put reply");
+
+    return 0;
+}
+
+/*
+ * Pin the protocol of the range's pages (those owned by this thread), or with SM_PROTO_AUTO let them
+ * switch by themselves again
+ */
+int node_advise(int nid, msg_t *request) {
+    uint32_t n_pages, protocol, end;
+    struct memory_page *page;
+
+    if (request->len < 8) return sm_fatal("malformed advice");
+    n_pages  = sm_get32(SM_MSG_BODY(request));
+    protocol = sm_get32(SM_MSG_BODY(request) + 4);
+    if (protocol > SM_PROTO_AUTO) return sm_fatal("unknown protocol advised");
+
+    end = request->page;
+    if (request->page < sm_current_page) {
+        end = (n_pages < sm_current_page - request->page) ? request->page + n_pages : sm_current_page;
+    }
+
+    for (uint32_t page_n = request->page; node_adaptive() && page_n < end; page_n++) {
+        if (!sm_worker_owns(page_n) || (page = sm_page(page_n)) == NULL) continue;
+
+        page->votes = 0;
+        if (protocol == SM_PROTO_AUTO) {
+            page->protocol &= ~SM_PAGE_PINNED;
         } else {
-            node_execute(message);
+            node_switch(page, page_n, protocol);
+            page->protocol |= SM_PAGE_PINNED;
         }
     }
 
-    /* Send the page to the node that triggered the fault */
-    memset(buffer, 0, 4096)
-    char buffer[] = {page}
-    status = sm_send(client_sockets[nid], nid, SM_READ_REPLY, buffer)
+    if (options->log_file) {
+        fprintf(options->log_file, "#%d: advising protocol %u for %u pages @ %u\n", nid, protocol, n_pages,
+                request->page);
+    }
+
+    /* With workers every shard sets its own pages, the reply goes out once they all have */
+    if (sm_workers_last(nid) && sm_reply(client_sockets[nid], request, nid, SM_ADVISE_REPLY, NULL, 0))
+        return sm_fatal("failed to send advice reply");
+
+    return 0;
+}
+
+/*
+ * Create a lock, it starts out free and bound to nothing
+ */
+int node_lock_create(int nid, msg_t *request) {
+    int32_t lock = -1;
+    char body[4];
+
+    if (sm_n_locks < SM_LOCKS_MAX && (sm_locks[sm_n_locks].grant = malloc(12 + SM_LOCK_RANGE_MAX)) != NULL) {
+        lock = sm_n_locks++;
+        sm_locks[lock].holder = sm_locks[lock].first = sm_locks[lock].last = -1;
+        memset(sm_locks[lock].grant, 0, 12);
+        sm_locks[lock].grant_len = 12;
+    }
+
+    sm_put32(body, lock);
+    if (sm_reply(client_sockets[nid], request, nid, SM_LOCK_CREATE_REPLY, body, sizeof(body)))
+        return sm_fatal("failed to send lock");
+
+    if (options->log_file) fprintf(options->log_file, "#%d: created lock %d\n", nid, lock);
+
+    return 0;
+}
+
+/*
+ * Bind a range of shared memory to the lock, every grant from now on names it
+ */
+int node_lock_bind(int nid, msg_t *request) {
+    struct sm_lock *lock;
+    uint64_t offset;
+    uint32_t lock_n, len;
+
+    if (request->len < 16 || (lock_n = sm_get32(SM_MSG_BODY(request))) >= (uint32_t) sm_n_locks)
+        return sm_fatal("malformed lock binding");
+    lock   = &sm_locks[lock_n];
+    offset = sm_get64(SM_MSG_BODY(request) + 4);
+    len    = sm_get32(SM_MSG_BODY(request) + 12);
+    if (len > SM_LOCK_RANGE_MAX || offset + len > (uint64_t) sm_current_page * getpagesize())
+        return sm_fatal("lock bound to a range outside of the allocated memory");
+
+    /* Whatever was released with the old range is no use any more */
+    memcpy(lock->grant, SM_MSG_BODY(request) + 4, 12);
+    lock->grant_len = 12;
+
+    if (sm_reply(client_sockets[nid], request, nid, SM_LOCK_BIND_REPLY, NULL, 0))
+        return sm_fatal("failed to send lock binding reply");
+
+    return 0;
+}
+
+/*
+ * Grant the lock to the node, answering its SM_LOCK
+ */
+static int node_grant(uint32_t lock_n, int nid, uint32_t seq) {
+    struct sm_lock *lock = &sm_locks[lock_n];
+    struct sm_frame frame = { client_sockets[nid], nid, SM_LOCK_GRANT, lock_n, lock->grant, lock->grant_len, seq };
+
+    lock->holder = nid;
+    lock->seq    = seq;
+
+    if (options->log_file) fprintf(options->log_file, "#%d: granted lock %u\n", nid, lock_n);
+
+    return sm_send_all(&frame, 1);
+}
+
+/*
+ * A node asks for the lock. If it isn't free the node waits behind the last one to ask for it: with the
+ * nodes connected to each other that one is told to hand the lock over, otherwise the node is queued.
+ */
+int node_lock(int nid, msg_t *request) {
+    struct sm_lock *lock;
+    char body[12];
+
+    if (request->page >= (uint32_t) sm_n_locks) return sm_fatal("no such lock");
+    lock = &sm_locks[request->page];
+
+    if (lock->holder < 0) {
+        if (node_grant(request->page, nid, request->seq)) return sm_fatal("failed to grant lock");
+    } else if (options->distributed || options->homes) {
+        sm_put32(body, lock->seq);
+        sm_put32(body + 4, nid);
+        sm_put32(body + 8, request->seq);
+        if (sm_send(client_sockets[lock->holder], lock->holder, SM_LOCK_NEXT, request->page, body, sizeof(body)))
+            return sm_fatal("failed to send the next holder of a lock");
+
+        lock->holder = nid;
+        lock->seq    = request->seq;
+    } else {
+        sm_lock_queue[nid]   = -1;
+        sm_lock_waiting[nid] = request->seq;
+        if (lock->last >= 0) sm_lock_queue[lock->last] = nid;
+        else                 lock->first = nid;
+        lock->last = nid;
+    }
+
+    return 0;
+}
+
+/*
+ * A node releases the lock, with the range bound to it as it left it. Without anyone waiting the lock is
+ * free again and the range kept for the next grant. With the nodes connected to each other a node that
+ * isn't the last to ask has been, or is about to be, told who is next, and hands the lock over itself.
+ */
+int node_unlock(int nid, msg_t *request) {
+    struct sm_lock *lock;
+    const char *grant = SM_MSG_BODY(request) + 4;
+    uint32_t hold;
+
+    if (request->page >= (uint32_t) sm_n_locks || request->len < 16) return sm_fatal("malformed unlock");
+    lock = &sm_locks[request->page];
+    hold = sm_get32(SM_MSG_BODY(request));
+
+    if (lock->holder != nid || lock->seq != hold) {
+        if (options->distributed || options->homes) return 0;
+        return sm_fatal("unlock of a lock the node doesn't hold");
+    }
+
+    /* The range is only kept if the lock is still bound to the range it came from */
+    if (request->len > 16 && request->len - 16 == sm_get32(lock->grant + 8) && memcmp(lock->grant, grant, 12) == 0) {
+        memcpy(lock->grant, grant, request->len - 4);
+        lock->grant_len = request->len - 4;
+    }
+
+    if (options->log_file) fprintf(options->log_file, "#%d: released lock %u\n", nid, request->page);
+
+    lock->holder = -1;
+    if (lock->first < 0) return 0;
+
+    nid = lock->first;
+    lock->first = sm_lock_queue[nid];
+    if (lock->first < 0) lock->last = -1;
+
+    if (node_grant(request->page, nid, sm_lock_waiting[nid])) return sm_fatal("failed to grant lock");
+
+    return 0;
+}
+
+/*
+ * Leave the fault pending on its page until every one of the nodes has answered, the requests to all of
+ * them going out in one batch. The page stays busy, so later faults on it are deferred, but the thread
+ * goes on serving other pages; node_answered() finishes the fault once the last answer is in.
+ */
+static int node_pend(struct memory_page *page, msg_t *request, int type, uint64_t nodes, const void *body,
+                     uint32_t len) {
+    struct sm_frame frames[SM_MAX_NODES];
+    int n_frames = 0, i;
+
+    page->busy    = 1;
+    page->pending = request;
+    page->waiting = nodes;
+
+    SM_FOR_EACH_NODE(i, nodes) {
+        frames[n_frames++] = (struct sm_frame) { client_sockets[i], i, type, request->page, body, len, 0 };
+    }
+    if (sm_send_all(frames, n_frames)) return sm_fatal("sending page requests failed");
+
+    return SM_PENDING;
+}
+
+/*
+ * Send the node a read copy of the page, now that the cache holds its latest contents. Any pages the
+ * node asked to prefetch go out ahead of the reply, in the same batch. The nodes that kept their copies
+ * of a write-update page through the last write are brought up to date at the same time, the node
+ * itself among them if it says it still has its copy. A node whose kept copy is current (updated by this
+ * read or by one just before it) is only told so, the reply doesn't carry the page.
+ */
+static int node_read_done(int nid, struct memory_page *page, msg_t *request) {
+    int status, page_size = getpagesize(), n_frames, n_candidates = 0, current = 0;
+    int kept = (request->len >= 4 && sm_get32(SM_MSG_BODY(request)));
+    uint32_t page_n = request->page, candidates[SM_PREF_MAX + 1];
+    struct sm_frame frames[SM_PREF_MAX + 1];
+
+    /* The page stays busy while prefetching */
+    for (uint32_t i = 4; i + 4 <= request->len && n_candidates < SM_PREF_MAX; i += 4) {
+        candidates[n_candidates++] = sm_get32(SM_MSG_BODY(request) + i);
+    }
+    page->busy = 1;
+    if (node_adaptive() && page->stale) {
+        uint64_t nodes = page->stale & ~(kept ? 0 : 1ULL << nid);
+
+        page->stale = 0;
+        if (nodes && node_update(page, page_n, nodes)) return -1;
+    }
+    current = (kept && node_adaptive() && (page->readers & (1ULL << nid)));
+    n_frames = node_ahead(nid, candidates, n_candidates, 0, frames);
+    if (n_frames < 0) return -1;
+    frames[n_frames++] = (struct sm_frame) { client_sockets[nid], nid, SM_READ_REPLY, page_n,
+                                             current ? NULL : (char *) sm_memory_map + (long) page_n * page_size,
+                                             current ? 0 : page_size, request->seq };
+    for (int i = 0; i < n_frames; i++) candidates[i] = frames[i].page;
+
+    status = sm_send_all(frames, node_merge(frames, n_frames));
     if (status) return sm_fatal("failed to send page to node");
+    page->readers |= 1ULL << nid;
 
-    if (allocator->log) {
-        fprintf(options->log_file, "#%d: write fault @ %d\n\
-                                    #%d: releasing ownership of %d\n\
-                                    #%d: receiving ownership of %d\n", 
-                                    nid, page_n, page->writer, page_n, nid, page_n);
+    for (int i = 0; i < n_frames; i++) sm_page(candidates[i])->busy = 0;
+
+    if (options->log_file) {
+        fprintf(options->log_file, "#%d: receiving read permission for %u%s\n", nid, page_n, current ? " (updated)" : "");
     }
 
     return 0;
-}
\ No newline at end of file
+}
+
+/*
+ * Give the node a read copy of the page. A page without a writer is served straight from the cache,
+ * otherwise the writer is asked to downgrade to a read copy and send back its version of the page first.
+ * A migratory page nobody else is reading is handed over with ownership instead, its writer invalidated.
+ */
+int handle_read_fault(int nid, msg_t *request) {
+    struct memory_page *page;
+    int migrate;
+
+    page = sm_page(request->page);
+    if (page == NULL) return sm_fatal("read fault outside of the allocated memory");
+
+    if (options->log_file) fprintf(options->log_file, "#%d: read fault @ %u\n", nid, request->page);
+
+    migrate = ((page->protocol & SM_PAGE_PROTOCOL) == SM_PROTO_MIGRATORY && !(page->readers & ~(1ULL << nid)));
+    if (migrate) page->protocol |= SM_PAGE_MIGRATING;
+
+    if (page->writer >= 0 && page->writer != nid) {
+        node_contend(page);
+        return node_pend(page, request, migrate ? SM_RELEASE : SM_REQUEST, 1ULL << page->writer, NULL, 0);
+    }
+
+    return migrate ? node_write_done(nid, page, request) : node_read_done(nid, page, request);
+}
+
+/*
+ * Give the node ownership of the page, now that every other copy is gone. A node upgrading a read copy
+ * which is still current (it is still a reader, so no write has invalidated it since) is only told it may
+ * write, the page isn't sent again. A read fault on a migratory page is answered the same way.
+ */
+static int node_write_done(int nid, struct memory_page *page, msg_t *request) {
+    int status, page_size = getpagesize(), migrate = (request->type == SM_READ);
+    uint32_t page_n = request->page;
+    int upgrade = (!migrate && request->len >= 4 && sm_get32(SM_MSG_BODY(request)) &&
+                   (page->readers & (1ULL << nid)));
+
+    page->readers = 0;
+    page->writer  = nid;
+    page->last    = nid;
+    page->version++;
+    if (options->hold || options->log_file) page->granted = node_now();
+    if (node_adaptive()) page->stale &= ~(1ULL << nid);
+
+    /* Whether the node writes to a page it only read faulted on is known once it gives the page up */
+    page->protocol &= ~(SM_PAGE_MIGRATING | SM_PAGE_MIGRATED);
+    if (migrate) page->protocol |= SM_PAGE_MIGRATED;
+
+    status = sm_reply(client_sockets[nid], request, nid, migrate ? SM_MIGR_REPLY : SM_WRIT_REPLY,
+                      upgrade ? NULL : (char *) sm_memory_map + (long) page_n * page_size, upgrade ? 0 : page_size);
+    if (status) return sm_fatal("failed to send page to node");
+
+    if (options->log_file) {
+        fprintf(options->log_file, "#%d: receiving ownership of %u%s\n", nid, page_n,
+                upgrade ? " (upgrade)" : migrate ? " (migratory)" : "");
+    }
+
+    return 0;
+}
+
+/*
+ * Give the node exclusive write access to the page, invalidating the writer and every reader first. The
+ * invalidations all go out at once and the fault waits for their acknowledgements on the page. The
+ * readers of a write-update page are asked to keep their copies for the update that follows.
+ */
+int handle_write_fault(int nid, msg_t *request) {
+    struct memory_page *page;
+    uint64_t copies;
+    char keep[4];
+
+    page = sm_page(request->page);
+    if (page == NULL) return sm_fatal("write fault outside of the allocated memory");
+
+    if (options->log_file) fprintf(options->log_file, "#%d: write fault @ %u\n", nid, request->page);
+
+    /* The writer also sends back its version of the page, received straight into the cache */
+    copies = (page->readers | ((page->writer >= 0) ? 1ULL << page->writer : 0)) & ~(1ULL << nid);
+    if (page->writer >= 0 && page->writer != nid) node_contend(page);
+    node_classify(page, request->page, nid, copies);
+    if (!copies) return node_write_done(nid, page, request);
+
+    sm_put32(keep, 1);
+    return node_pend(page, request, SM_RELEASE, copies, keep, node_keep(page, request->page, nid) ? sizeof(keep) : 0);
+}
+
+/*
+ * Apply the node's atomic operations to the cached page and send it the old values. Under release
+ * consistency every other node is owed a write notice for the page, otherwise no copy of it is left.
+ */
+static int node_atomic_done(int nid, struct memory_page *page, msg_t *request) {
+    static __thread char olds[SM_ATOMIC_MAX * 8];
+    int page_size = getpagesize(), n_ops;
+
+    n_ops = sm_atomic_apply((char *) sm_memory_map + (long) request->page * page_size, page_size,
+                            SM_MSG_BODY(request), request->len, olds);
+    if (n_ops < 0) return sm_fatal("malformed atomic operations");
+
+    if (options->release) {
+        sm_page_stale(request->page, ~(1ULL << nid));
+    } else {
+        page->readers = 0;
+        page->writer  = -1;
+    }
+    page->version++;
+
+    if (sm_reply(client_sockets[nid], request, nid, SM_ATOMIC_REPLY, olds, n_ops * 8))
+        return sm_fatal("failed to send atomic results");
+
+    if (options->log_file) fprintf(options->log_file, "#%d: %d atomic operations @ %u\n", nid, n_ops, request->page);
+
+    return 0;
+}
+
+/*
+ * Execute atomic operations on the page here, without moving it to the node. The writer and every
+ * reader are invalidated first, the writer's version arriving in the cache, and the operations are
+ * applied once they have all answered. Under release consistency the copies are left alone.
+ */
+int node_atomic(int nid, msg_t *request) {
+    struct memory_page *page;
+    uint64_t copies;
+
+    page = sm_page(request->page);
+    if (page == NULL) return sm_fatal("atomic operations outside of the allocated memory");
+
+    copies = options->release ? 0 : page->readers | ((page->writer >= 0) ? 1ULL << page->writer : 0);
+    if (!copies) return node_atomic_done(nid, page, request);
+
+    return node_pend(page, request, SM_RELEASE, copies, NULL, 0);
+}
+
+/*
+ * A node has answered the request of a fault pending on the page, the fault is finished once they all
+ * have. Returns 1 if no pending fault was waiting for the reply (it belongs to a nested wait), otherwise
+ * 0 (the caller frees the reply) or -1 on error.
+ */
+int node_answered(msg_t *reply) {
+    struct memory_page *page = sm_page_lookup(reply->page);
+    uint64_t node = 1ULL << reply->nid;
+    msg_t *request;
+    int status, read;
+
+    if (page == NULL || page->pending == NULL || !(page->waiting & node)) return 1;
+    request = page->pending;
+
+    /* A read fault on a migratory page invalidates the writer rather than downgrading it */
+    read = (request->type == SM_READ && !(page->protocol & SM_PAGE_MIGRATING));
+    if (reply->type != (read ? SM_REQU_REPLY : SM_RLSE_REPLY)) return 1;
+
+    if (options->log_file) {
+        fprintf(options->log_file, "#%d: releasing %s of %u\n", reply->nid,
+                (page->writer == reply->nid) ? "ownership" : "read permission", reply->page);
+    }
+
+    if (page->writer == reply->nid) node_migrated(page, reply->page, reply);
+
+    /* The writer of a page being read keeps a read copy */
+    if (read) {
+        page->readers |= node;
+        page->writer = -1;
+    }
+
+    page->waiting &= ~node;
+    if (page->waiting) return 0;
+
+    page->pending = NULL;
+    page->busy    = 0;
+
+    if (read) {
+        status = node_read_done(request->nid, page, request);
+    } else if (request->type == SM_ATOMIC) {
+        status = node_atomic_done(request->nid, page, request);
+    } else {
+        status = node_write_done(request->nid, page, request);
+    }
+    sm_msg_free(request);
+
+    return status ? -1 : 0;
+}
@@ -7,21 +7,48 @@
 
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
 #include <signal.h>
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <signal.h>
 #include <ucontext.h>
 #include <errno.h>
+#include <assert.h>
+#include <pthread.h>
 
 #include "sm.h"
+#include "sm_ext.h"
 #include "config.h"
 #include "sm_message.h"
-
-int sm_sock, sm_nid;
+#include "sm_peer.h"
+#include "sm_lrc.h"
+#include "sm_home.h"
+#include "sm_lock.h"
+#include "sm_shm.h"
+#include "sm_progress.h"
+#include "sm_uffd.h"
+#include "sm_prefetch.h"
+
+int sm_sock, sm_nid, sm_nodes;
 char *sm_map;
-// sm_page_table[];
+
+long          sm_page_size;
+unsigned char sm_access[SM_NUM_PAGES]; /* The access held for each page of the region */
+
+/* Migratory pages are granted ownership by a read fault but installed read-only, so that whether they
+ * are written is known. The first write takes it up without asking the allocator. */
+static unsigned char   sm_owned[SM_NUM_PAGES];
+static pthread_mutex_t sm_owned_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define SM_ARENA_PAGES_MAX 16 /* The largest chunk of pages sm_malloc() asks the allocator for */
+
+static char *sm_arena_next = NULL; /* The next free byte in the node's current chunk */
+static char *sm_arena_end  = NULL;
+static long  sm_arena_pages = 1;   /* The size of the next chunk, doubled each refill */
 
 int sm_fatal(char *message) {
     fprintf(stderr, "Error: %s.\n", message);
@@ -31,117 +58,385 @@ int sm_fatal(char *message) {
     return -1;
 }
 
-void sm_segv(int signum, siginfo_t *si, void *ctx) {
-    /* Find the offset of the variable from the memory base */
-    long offset = (char *) si->si_addr - sm_map;
+/*
+ * Block (or unblock) SIGIO so that sm_poll() can't read from the sockets while a reply is awaited (dsm -d)
+ */
+void sm_block_io(int block, sigset_t *previous) {
+    sigset_t set;
 
-    /* Determine if it is a read or write fault, and direct it to the relevant function */
-    if (((ucontext_t *)ctx)->uc_mcontext.gregs[REG_ERR] & 0x2) {
-        sm_write_fault(si, offset);
+    if (block) {
+        sigemptyset(&set);
+        sigaddset(&set, SIGIO);
+        sigprocmask(SIG_BLOCK, &set, previous);
     } else {
-        sm_read_fault(si, offset);
+        sigprocmask(SIG_SETMASK, previous, NULL);
     }
+}
 
-    return;
+/*
+ * Wait for the allocator's reply to a request, serving any requests for pages in the meantime
+ */
+static int sm_await(int type, uint32_t seq, msg_t **message) {
+    if (sm_peer_active)     return sm_peer_await(type, 0, message);
+    if (sm_progress_active) return sm_progress_await(seq, message);
+
+    return sm_recv_type(sm_sock, message, type);
 }
 
-int sm_read_fault(siginfo_t *si, long offset) {
-    char buffer[4096] = "\0";
-    int status, size, value;
-    msg_t *message;
-    
-    /* Send a message to the allocator to find the value at the address */
-    snprintf(buffer, sizeof(long), "%ld", offset);
-    status = sm_send(sm_sock, sm_nid, SM_READ, buffer);
-    if (status) sm_fatal("milk");
+/*
+ * Send a request to the allocator and wait for its reply, which must be of the given type (a read fault
+ * on a migratory page may be answered with ownership instead)
+ */
+int sm_call(int type, uint32_t page, const void *body, uint32_t len, int reply_type, msg_t **reply) {
+    uint32_t seq;
 
-    /* Wait for a response containing the new page */
-    status = sm_recv_type(sm_sock, &message, SM_READ_REPLY);
-    if (status) sm_fatal("failed to receive read fault ACK");
-    sscanf(message->buffer, "%d %d", &size, &value);
+    if (sm_request(sm_sock, sm_nid, type, page, body, len, &seq)) return sm_fatal("failed to send request");
+    if (sm_await(reply_type, seq, reply)) return sm_fatal("failed to receive reply");
 
-    /* Write the new value to the page */
-    mprotect(si->si_addr, size, PROT_READ);
-    *(char *)(si->si_addr) = value;
+    if ((*reply)->type != reply_type && !(reply_type == SM_READ_REPLY && (*reply)->type == SM_MIGR_REPLY)) {
+        sm_msg_free(*reply);
+        return sm_fatal("unexpected reply");
+    }
 
     return 0;
 }
 
-int sm_write_fault(siginfo_t *si, long offset) {
-    char buffer[4096] = "\0";
-    int status, size;
-    msg_t *message;
-    
-    /* Send a message to the allocator to find the value at the address */
-    snprintf(buffer, 4096, "%ld", offset);
-    status = sm_send(sm_sock, sm_nid, SM_WRIT, buffer);
-    if (status) sm_fatal("milk");
+/*
+ * Change the access held for a page, through userfaultfd if it handles the node's faults
+ */
+static void sm_protect(uint32_t page_n, int access) {
+    static const int prot[] = { PROT_NONE, PROT_READ, PROT_READ|PROT_WRITE };
 
-    /* Wait for a response containing the new page */
-    status = sm_recv_type(sm_sock, &message, SM_WRIT_REPLY);
-    if (status) sm_fatal("failed to receive read fault ACK");
+    if (sm_uffd_active) {
+        sm_uffd_protect(page_n, access);
+        return;
+    }
 
-    /* Write the new value to the page */
-    mprotect(si->si_addr, getpagesize(), PROT_WRITE | PROT_READ);
-    *(char *)(si->si_addr) = 0; // TODO: Change to the relevant value
+    mprotect(sm_map + page_n * sm_page_size, sm_page_size, prot[access]);
+    sm_access[page_n] = access;
+}
 
-    return 0;
+/*
+ * A read fault was answered with ownership of the page (SM_MIGR_REPLY), it is in place read-only
+ */
+void sm_owned_grant(uint32_t page_n) {
+    pthread_mutex_lock(&sm_owned_lock);
+    sm_owned[page_n] = 1;
+    pthread_mutex_unlock(&sm_owned_lock);
 }
 
-void sm_poll(int signum) {
-    char buffer[4196] = "\0";
-    int offset, status;
-    msg_t *message;
+/*
+ * A write fault on a page the node was granted ownership of is served here (returns 1), unless the
+ * allocator has taken the page away in the meantime
+ */
+int sm_owned_upgrade(uint32_t page_n) {
+    int owned;
+
+    pthread_mutex_lock(&sm_owned_lock);
+    owned = sm_owned[page_n];
+    if (owned) {
+        sm_owned[page_n] = 0;
+        sm_protect(page_n, SM_ACCESS_WRITE);
+    }
+    pthread_mutex_unlock(&sm_owned_lock);
 
-    status = sm_recv(sm_sock, &message);
-    if (status) sm_fatal("failed to receive read request");
+    return owned;
+}
+
+/*
+ * The split-phase barrier and broadcast in progress (sm_barrier_begin() and sm_ibcast()), a node has at
+ * most one of each. A request names its slot and how many collectives the slot had started before it.
+ */
+#define SM_SPLIT_BARR 0
+#define SM_SPLIT_CAST 1
+static struct sm_split {
+    int      active;
+    uint32_t started;
+    uint32_t seq;      /* The request the allocator's reply answers */
+    void   **addr;     /* Where the broadcast's value goes */
+    int      arrived;  /* The reply has reached sm_serve(), its value in `value' (dsm -s) */
+    uint64_t value;
+} sm_splits[2];
+
+static int sm_split_finish(int slot, int wait);
+
+/*
+ * Without a progress thread the reply to a split-phase collective may arrive while another one is awaited
+ */
+static void sm_split_arrived(msg_t *message) {
+    for (int slot = SM_SPLIT_BARR; slot <= SM_SPLIT_CAST; slot++) {
+        struct sm_split *split = &sm_splits[slot];
+
+        if (!split->active || split->arrived || split->seq != message->seq) continue;
+
+        split->arrived = 1;
+        split->value   = (message->len >= 8) ? sm_get64(SM_MSG_BODY(message)) : 0;
+    }
+}
+
+/*
+ * Serve a request for a page from the allocator (either a read request or an invalidation)
+ */
+static void sm_serve(msg_t *message) {
+    char *page;
+    int status, owned;
+
+    /* A barrier or broadcast this node is between the two phases of */
+    if (message->type == SM_BARR_REPLY || message->type == SM_CAST_REPLY) {
+        sm_split_arrived(message);
+        return;
+    }
+
+    /* Another node's part of a reduction this node is the root of */
+    if (message->type == SM_REDUCE_DATA) {
+        sm_reduce_serve(message);
+        return;
+    }
 
-    sscanf(buffer, "%d", &offset);
+    if (message->page >= SM_NUM_PAGES) return;
+    page = sm_map + message->page * sm_page_size;
 
-    /* Handle a read request for a memory address */
+    /* Handle a read request for a memory address, downgrading to a read copy before it is sent */
     if (message->type == SM_REQUEST) {
+        /* The node was given ownership ahead of using the page, its copy hasn't been moved into place */
+        if (sm_prefetch_request(message)) return;
+
+        /* Ownership of a migratory page that was never written goes back without the page */
+        pthread_mutex_lock(&sm_owned_lock);
+        owned = sm_owned[message->page];
+        sm_owned[message->page] = 0;
+        sm_protect(message->page, SM_ACCESS_READ);
+        pthread_mutex_unlock(&sm_owned_lock);
+
         /* Send the request page back */
-        snprintf(buffer, 4096 + 6, "%s", sm_map + offset);
-        status = sm_send(sm_sock, sm_nid, SM_REQU_REPLY, buffer);
+        status = sm_reply(sm_sock, message, sm_nid, SM_REQU_REPLY, page, owned ? 0 : sm_page_size);
         if (status) sm_fatal("failed to send page to allocator");
-    /* Handle a loss of write permissions */
+    /* Handle a loss of permissions, sending back the page if this node was the writer */
     } else if (message->type == SM_RELEASE) {
-        /* Invalidate the required memory and send an acknowledgement */
-        mprotect(sm_map + offset, getpagesize(), PROT_NONE);
+        int dirty, keep = (message->len >= 4 && sm_get32(SM_MSG_BODY(message)));
+
+        /* An unused prefetched copy is acknowledged on its own, a read copy may be in place as well */
+        if (sm_prefetch_release(message)) {
+            if (sm_access[message->page] != SM_ACCESS_NONE) sm_protect(message->page, SM_ACCESS_NONE);
+            return;
+        }
 
-        status = sm_send(sm_sock, sm_nid, SM_RLSE_REPLY, NULL);
+        /* The application thread may still be writing to the page, stop it before it is sent */
+        pthread_mutex_lock(&sm_owned_lock);
+        sm_owned[message->page] = 0;
+        dirty = (sm_access[message->page] == SM_ACCESS_WRITE);
+        if (dirty) sm_protect(message->page, SM_ACCESS_READ);
+        pthread_mutex_unlock(&sm_owned_lock);
+
+        /* A reader of a write-update page holds on to its copy, the writer's changes are sent to it later */
+        if (keep && sm_access[message->page] == SM_ACCESS_READ && !dirty) sm_prefetch_keep(message->page);
+
+        status = sm_reply(sm_sock, message, sm_nid, SM_RLSE_REPLY, page, dirty ? sm_page_size : 0);
         if (status) sm_fatal("failed to send invalidation acknowledgement to allocator");
+
+        /* Invalidate the required memory */
+        sm_protect(message->page, SM_ACCESS_NONE);
+    /* The changes made to a page whose copy the node kept through a write */
+    } else if (message->type == SM_UPDATE) {
+        sm_prefetch_update(message);
+    /* A page sent ahead of its first use, it was received into the prefetch shadow */
+    } else if (message->type == SM_PREF_PAGE || message->type == SM_PREF_OWN) {
+        for (uint32_t i = 0; i < message->len / sm_page_size; i++) {
+            sm_prefetch_arrived(message->page + i, (message->type == SM_PREF_OWN) ? SM_ACCESS_WRITE : SM_ACCESS_READ);
+        }
+    /* Pages for sm_get(), which may only want part of them */
+    } else if (message->type == SM_GET_PAGES) {
+        sm_ext_serve(message);
+    /* The node waiting for a lock after this one */
+    } else if (message->type == SM_LOCK_NEXT) {
+        sm_lock_next(message);
     }
+}
+
+/*
+ * Pages sent in reply to a fault are received straight into the mapped region, the page is made
+ * writable for the duration and the fault handler then sets the final protection. Pages sent ahead
+ * of a fault wait in the prefetch shadow and those for sm_get() go straight to its destination, as do
+ * the chunks of a reduction's result and of a buffer broadcast.
+ */
+static char *sm_page_sink(msg_t *message) {
+    char *page;
+
+    if (message->type == SM_REDUCE_DATA) return sm_reduce_sink(message);
+    if (message->type == SM_TREE_DATA) return sm_peer_sink(message);
+
+    if (message->type != SM_READ_REPLY && message->type != SM_WRIT_REPLY && message->type != SM_MIGR_REPLY &&
+            message->type != SM_PEER_PAGE && message->type != SM_PREF_PAGE && message->type != SM_PREF_OWN &&
+            message->type != SM_GET_PAGES && message->type != SM_HOME_PAGE && message->type != SM_HOME_GIVE)
+        return NULL;
+    if (message->page >= SM_NUM_PAGES || message->len > (SM_NUM_PAGES - message->page) * sm_page_size) return NULL;
+
+    if (message->type == SM_GET_PAGES) return sm_ext_sink(message);
+    if (message->type == SM_HOME_GIVE) return sm_home_sink(message);
+    if (message->type == SM_PREF_PAGE || message->type == SM_PREF_OWN) return sm_prefetch_sink(message);
+    if (message->len > sm_page_size) return NULL;
+
+    /* The page can't be written in place without faulting, it is installed once the fault has its reply */
+    if (sm_uffd_active) return sm_uffd_sink(message);
+
+    page = sm_map + message->page * sm_page_size;
+    if (mprotect(page, sm_page_size, PROT_READ|PROT_WRITE)) return NULL;
+
+    return page;
+}
+
+void sm_segv(int signum, siginfo_t *si, void *ctx) {
+    /* Find the offset of the variable from the memory base */
+    long offset = (char *) si->si_addr - sm_map;
+    int status;
+
+    /* A fault outside of the shared region is a genuine segfault, let it happen */
+    if (offset < 0 || offset >= SM_NUM_PAGES * sm_page_size) {
+        signal(SIGSEGV, SIG_DFL);
+        return;
+    }
+
+    /* Determine if it is a read or write fault, and direct it to the relevant function */
+    if (((ucontext_t *)ctx)->uc_mcontext.gregs[REG_ERR] & 0x2) {
+        status = sm_write_fault(si, offset);
+    } else {
+        status = sm_read_fault(si, offset);
+    }
+
+    /* Returning would just fault again, the allocator is gone so terminate the node */
+    if (status) _exit(EXIT_FAILURE);
 
     return;
 }
 
-int socket_init(char *ip, int port) {
-    int status = 0;    
+int sm_read_fault(siginfo_t *si, long offset) {
+    uint32_t page_n = offset / sm_page_size, len;
+    char *page = sm_map + page_n * sm_page_size, body[4 + SM_PREF_MAX * 4];
+    int status;
+    msg_t *message;
+#ifdef SM_CHECK_COPIES
+    uint64_t refills = sm_msg_stats.refills;
+#endif
+
+    /* The page comes from its owner, or its home, rather than the allocator */
+    if (sm_peer_active) return sm_peer_read_fault(page_n);
+    if (sm_home_active) return sm_home_read_fault(page_n);
+
+    /* The page may have been prefetched already, otherwise the pages expected next are asked for too */
+    if (sm_prefetch_hit(page_n, 0)) return 0;
+    sm_put32(body, sm_prefetch_kept(page_n));
+    len = 4 + sm_prefetch_plan(page_n, body + 4);
+
+    /* Ask the allocator for a read copy of the page, the reply carries the page */
+    status = sm_call(SM_READ, page_n, body, len, SM_READ_REPLY, &message);
+    if (status) return sm_fatal("failed to read fault");
+    sm_prefetch_granted();
+
+    /* Without the page the copy kept here has been brought up to date, otherwise the page was received
+     * straight into place by sm_page_sink() and drops to read-only access */
+    if (message->len == 0) {
+        if (sm_prefetch_take(page_n)) return sm_fatal("no copy of the page to read");
+    } else {
+        sm_prefetch_forget(page_n);
+        mprotect(page, sm_page_size, PROT_READ);
+        sm_access[page_n] = SM_ACCESS_READ;
+        if (message->type == SM_MIGR_REPLY) sm_owned_grant(page_n);
+    }
+    sm_progress_done(page_n);
+
+#ifdef SM_CHECK_COPIES
+    assert(sm_msg_in_place(message) && sm_msg_stats.refills == refills);
+#endif
+    sm_msg_free(message);
+    return 0;
+}
+
+int sm_write_fault(siginfo_t *si, long offset) {
+    uint32_t page_n = offset / sm_page_size;
+    char *page = sm_map + page_n * sm_page_size, body[4];
+    int status;
+    msg_t *message;
+#ifdef SM_CHECK_COPIES
+    uint64_t refills = sm_msg_stats.refills;
+#endif
+
+    /* The page comes from its owner rather than the allocator */
+    if (sm_peer_active) return sm_peer_write_fault(page_n);
+
+    /* Under release consistency the write is only made known at the next release */
+    if (sm_lrc_active) return sm_lrc_write_fault(page_n);
+
+    /* Ownership of the page may have been granted by its read fault, or prefetched already */
+    if (sm_owned_upgrade(page_n)) return 0;
+    if (sm_prefetch_hit(page_n, 1)) return 0;
+
+    /* Ask the allocator for ownership of the page, the reply carries the page unless the read copy held
+     * here is still current */
+    sm_put32(body, sm_access[page_n] == SM_ACCESS_READ);
+    status = sm_call(SM_WRIT, page_n, body, sizeof(body), SM_WRIT_REPLY, &message);
+    if (status) return sm_fatal("failed to write fault");
+
+    /* The read copy may have been released and brought up to date in the prefetch shadow since */
+    if (message->len == 0) sm_prefetch_take(page_n);
+    sm_prefetch_forget(page_n);
+
+    /* The page was received straight into place by sm_page_sink(), or is the read copy already there */
+    mprotect(page, sm_page_size, PROT_WRITE | PROT_READ);
+    sm_access[page_n] = SM_ACCESS_WRITE;
+    sm_progress_done(page_n);
+
+#ifdef SM_CHECK_COPIES
+    assert(sm_msg_in_place(message) && sm_msg_stats.refills == refills);
+#endif
+    sm_msg_free(message);
+    return 0;
+}
+
+/*
+ * Serve the other nodes (and the allocator) when a message arrives, only used with -d as otherwise the
+ * progress thread owns the allocator's socket
+ */
+void sm_poll(int signum) {
+    int saved_errno = errno;
+
+    if (sm_peer_active) sm_peer_poll();
+
+    errno = saved_errno;
+    return;
+}
+
+int socket_init(char *host, int port) {
+    struct addrinfo hints, *address;
+    char service[16];
+    int status = 0;
 
     /* Create the socket to communicate with the allocator */
     sm_sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sm_sock == 0) {
+    if (sm_sock < 0) {
         return sm_fatal("Failed to create socket");
     }
 
-    struct sockaddr_in address;
-    address.sin_family = AF_INET;
-    address.sin_port   = htons(port);
-    inet_pton(AF_INET, ip, &address.sin_addr);
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%d", port);
+
+    status = getaddrinfo(host, service, &hints, &address);
+    if (status) return sm_fatal("failed to resolve the allocator's address");
 
     /* Connect to the allocator to initalize the node */
-    status = connect(sm_sock, (struct sockaddr *)&address, sizeof(address));
+    status = connect(sm_sock, address->ai_addr, address->ai_addrlen);
+    freeaddrinfo(address);
     if (status < 0) return sm_fatal("failed to connect socket");
 
+    /* Requests and replies are single frames, Nagle would only hold them back */
+    int opt = 1;
+    setsockopt(sm_sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
     return 0;
 }
 
 int handler_init() {
-    /* enable SIGPOLL on the socket */
-    fcntl(sm_sock, F_SETFL, O_ASYNC);
-    fcntl(sm_sock, F_SETOWN, getpid());
-
     /* Create the handler for POLL */
     struct sigaction sa;
     sa.sa_handler = sm_poll;
@@ -149,30 +444,47 @@ int handler_init() {
     sigemptyset(&sa.sa_mask);
     sigaction(SIGIO, &sa, NULL);
 
-    /* Create the handler for SEGV */
+    /* Create the handler for SEGV, the handler does its own socket I/O so SIGIO is held off */
     sa.sa_sigaction = sm_segv;
     sa.sa_flags     = SA_SIGINFO|SA_RESTART;
     sigemptyset(&sa.sa_mask);
+    sigaddset(&sa.sa_mask, SIGIO);
     sigaction(SIGSEGV, &sa, NULL);
 
     return 0;
 }
 
 int sm_node_init (int *argc, char **argv[], int *nodes, int *nid) {
-    char *ip;
+    char *host;
     int status, port;
+    uint32_t flags, fanout, shm;
     msg_t *message;
+    sigset_t mask;
+
+    if (*argc < 3) return sm_fatal("missing allocator contact information");
+    sm_page_size = getpagesize();
 
     /* Extract the contact information from the end of the arguments */
-    ip   = strndup(argv[0][*argc - 2], 0x4);
-    port = strtoul(argv[0][*argc - 1], '\0', 10);
+    host = argv[0][*argc - 2];
+    port = strtoul(argv[0][*argc - 1], NULL, 10);
     *argc -= 2;
+    argv[0][*argc] = NULL;
 
-    socket_init(ip, port);
+    status = socket_init(host, port);
+    if (status) return status;
+
+    /* Map in the shared memory */
+    sm_map = mmap((void *)SM_MAP_START, SM_NUM_PAGES * sm_page_size,
+                PROT_NONE, MAP_FIXED|MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if (sm_map == MAP_FAILED) return sm_fatal("failed to map memory");
+
+    sm_block_io(1, &mask);
+    sm_msg_unsolicited = sm_serve;
+    sm_msg_sink        = sm_page_sink;
     handler_init();
 
     /* Send an initalization request to the dsm */
-    status = sm_send(sm_sock, sm_nid, SM_INIT, NULL);
+    status = sm_send(sm_sock, sm_nid, SM_INIT, 0, NULL, 0);
     if (status) {
         return sm_fatal("failed to send initialization to allocator");
     }
@@ -182,14 +494,65 @@ int sm_node_init (int *argc, char **argv[], int *nodes, int *nid) {
     if (status || message->type != SM_INIT_REPLY) {
         return sm_fatal("failed to receive initalization acknowledgement");
     } else {
-        *nid = sm_nid = (int) message->nid;
-        *nodes = 7777;
+        *nid   = sm_nid   = message->nid;
+        *nodes = sm_nodes = sm_get32(SM_MSG_BODY(message));
+        flags  = sm_get32(SM_MSG_BODY(message) + 4);
+        fanout = sm_get32(SM_MSG_BODY(message) + 8);
+        shm    = sm_get32(SM_MSG_BODY(message) + 12);
+        sm_msg_free(message);
     }
 
-    /* Map in the shared memory */
-    sm_map = mmap((void *)SM_MAP_START, SM_NUM_PAGES * getpagesize(), 
-                PROT_NONE, MAP_FIXED|MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
-    if (sm_map == MAP_FAILED) return sm_fatal("failed to map memory");
+    /* On the allocator's host the region is shared memory, it is always accessible and never faults */
+    if (flags & SM_INIT_SHM) {
+        status = sm_shm_attach(shm, sm_sock, sm_nid);
+        if (status) return status;
+
+        memset(sm_access, SM_ACCESS_WRITE, sizeof(sm_access));
+    }
+
+    sm_prefetch_active = !!(flags & SM_INIT_PREFETCH);
+
+    /* Faults are handled by a thread reading them from a userfaultfd, if the kernel allows it */
+    if ((flags & SM_INIT_UFFD) && sm_uffd_init())
+        fprintf(stderr, "Warning: node %d can't use userfaultfd, handling faults with SIGSEGV.\n", sm_nid);
+
+    /* The homes of the pages are nodes, connect to them while the allocator's socket is still this thread's */
+    if (flags & SM_INIT_HOME) {
+        status = sm_home_init();
+        if (status) return status;
+    }
+
+    /* Otherwise a thread serves the allocator's requests for pages, and may receive them unasked */
+    if (!(flags & (SM_INIT_PEER|SM_INIT_SHM))) {
+        status = sm_prefetch_init();
+        if (status) return status;
+
+        status = sm_progress_start(sm_serve);
+        if (status) return status;
+    }
+
+    /* Pages are transferred directly between the nodes, whoever has something for this node raises SIGIO */
+    if (flags & SM_INIT_PEER) {
+        sm_msg_guard(SIGIO);
+        fcntl(sm_sock, F_SETOWN, getpid());
+        fcntl(sm_sock, F_SETFL, O_ASYNC);
+
+        status = sm_peer_init(fanout);
+        if (status) return status;
+    }
+
+    /* Writes are only made visible at releases */
+    if (flags & SM_INIT_LRC) {
+        status = sm_lrc_init();
+        if (status) return status;
+    }
+
+    /* A home thread serves the other nodes the master copies of the pages homed here */
+    if (flags & SM_INIT_HOME) {
+        status = sm_home_start();
+        if (status) return status;
+    }
+    sm_block_io(0, &mask);
 
     fflush(stdout);
     return 0;
@@ -198,84 +561,327 @@ int sm_node_init (int *argc, char **argv[], int *nodes, int *nid) {
 void sm_node_exit (void) {
     msg_t *message;
     int status;
+    sigset_t mask;
 
     fflush(NULL);
+    sm_block_io(1, &mask);
+    sm_split_finish(SM_SPLIT_CAST, 1);
+    sm_block_io(0, &mask);
     sm_barrier();
 
-    /* Send a message to the allocator to remove this node */  
-    status = sm_send(sm_sock, sm_nid, SM_EXIT, NULL);
-    if (status) sm_fatal("failed to send close to allocator");
-    
-    /* Wait for an acknowledgement */
-    status = sm_recv(sm_nid, &message);
-    if (status) sm_fatal("failed to receive closing acknowledgement");
-    
-    munmap(sm_map, 0xFFFF * getpagesize());
+    sm_block_io(1, &mask);
+    sm_ext_exit();
+
+    /* Ask the allocator to remove this node and wait for the acknowledgement */
+    status = sm_call(SM_EXIT, 0, NULL, 0, SM_EXIT_REPLY, &message);
+    if (status) sm_fatal("failed to close the connection to the allocator");
+    else        sm_msg_free(message);
+
+    sm_uffd_exit();
+    sm_home_exit();
+    sm_progress_stop();
+    sm_peer_exit();
+    sm_lrc_exit();
+    sm_shm_detach();
+    sm_msg_forget(sm_sock);
+    close(sm_sock);
+    sm_sock = 0;
+
+    sm_prefetch_exit();
+    sm_lock_exit();
+#ifdef SM_CHECK_COPIES
+    fprintf(stderr, "node %d: page bytes sent %lu, received in place %lu, staged %lu (%lu copies)\n",
+            sm_nid, sm_msg_stats.sent_bytes, sm_msg_stats.direct_bytes, sm_msg_stats.buffered_bytes,
+            sm_msg_stats.buffered_copies);
+    fprintf(stderr, "node %d: %lu frames sent in %lu sendmsg() calls, %lu recvmsg() calls, %lu message allocations "
+            "(%lu refills), %lu receive rings, %lu frames pooled\n", sm_nid, sm_msg_stats.sent_frames,
+            sm_msg_stats.send_calls, sm_msg_stats.recv_calls, sm_msg_stats.allocations, sm_msg_stats.refills,
+            sm_msg_stats.rings, sm_msg_stats.pooled);
+#endif
+
+    munmap(sm_map, SM_NUM_PAGES * sm_page_size);
     fflush(stdout);
     return;
 }
 
-void *sm_malloc (size_t size) {
-    int status = 0, offset = 0;
+/*
+ * Ask the allocator for a page aligned range of whole pages covering `size' bytes, returns NULL if
+ * there is no room left
+ */
+static char *sm_grant(uint64_t size) {
+    int status = 0;
+    uint64_t offset;
+    char buffer[8];
     msg_t *message;
+    sigset_t mask;
+
+    sm_block_io(1, &mask);
 
-    /* Send a message to the allocator to allocate some memory */
-    char buffer[] = {size};
-    status = sm_send(sm_sock, sm_nid, SM_ALOC, buffer);
+    /* Ask the allocator for some memory, the reply holds its offset */
+    sm_put64(buffer, size);
+    status = sm_call(SM_ALOC, 0, buffer, sizeof(buffer), SM_ALOC_REPLY, &message);
+    sm_block_io(0, &mask);
     if (status) {
-        sm_fatal("milk");
+        sm_fatal("failed to allocate");
         return NULL;
     }
 
-    /* Wait for a reply with the memory allocation offset */
-    status = sm_recv_type(sm_sock, &message, SM_ALOC_REPLY);
-    if (status) {
-        sm_fatal("milk");
-        return NULL;
+    offset = sm_get64(SM_MSG_BODY(message));
+    sm_msg_free(message);
+
+    /* The allocator couldn't find room for the allocation */
+    if (offset == UINT64_MAX) return NULL;
+
+    return sm_map + offset;
+}
+
+void *sm_malloc (size_t size) {
+    char *object;
+
+    /* Keep objects word aligned */
+    size = (size + 7) & ~7UL;
+    if (size == 0) size = 8;
+
+    /* Objects larger than a page get a range of their own */
+    if (size > sm_page_size) {
+        object = sm_grant(size);
+        fflush(stdout);
+        return object;
+    }
+
+    /* Small objects are carved out of the node's arena, refilled with a bigger chunk each time */
+    if (sm_arena_next == NULL || sm_arena_next + size > sm_arena_end) {
+        object = sm_grant(sm_arena_pages * sm_page_size);
+        if (object == NULL && sm_arena_pages > 1) {
+            sm_arena_pages = 1;
+            object = sm_grant(sm_page_size);
+        }
+        if (object == NULL) return NULL;
+
+        sm_arena_next = object;
+        sm_arena_end  = object + sm_arena_pages * sm_page_size;
+        if (sm_arena_pages < SM_ARENA_PAGES_MAX) sm_arena_pages *= 2;
     }
 
-    offset = message->buffer[3];
-    mprotect(sm_map + offset, getpagesize(), PROT_READ|PROT_WRITE);
-    memset(sm_map+offset, 0, size);
+    object = sm_arena_next;
+    sm_arena_next += size;
+
+    return object;
+}
+
+/*
+ * Complete the collective in the slot, waiting for it or not. Returns 1 if it has completed (or there
+ * wasn't one), 0 if it hasn't yet, -1 on error.
+ */
+static int sm_split_finish(int slot, int wait) {
+    struct sm_split *split = &sm_splits[slot];
+    int kind = (slot == SM_SPLIT_CAST) ? SM_CAST : SM_BARR, status = 0;
+    uint64_t value = 0;
+    msg_t *reply = NULL;
+
+    if (!split->active) return 1;
+
+    if (sm_peer_active) {
+        if (!wait && !sm_peer_test(kind, &value)) return 0;
+        if (wait) status = sm_peer_end(kind, &value);
+    } else if (sm_progress_active) {
+        if (!wait && !sm_progress_test(split->seq, &reply)) return 0;
+        if (wait) status = sm_progress_await(split->seq, &reply);
+    } else {
+        /* The reply reaches sm_serve() like anything else that isn't being awaited */
+        while (!split->arrived && !status) {
+            msg_t *message;
+
+            if (!wait && !sm_shm_pending()) return 0;
+
+            status = sm_recv(sm_sock, &message);
+            if (!status) {
+                sm_serve(message);
+                sm_msg_free(message);
+            }
+        }
+        value = split->value;
+    }
+    split->active = 0;
+    if (status) return sm_fatal((kind == SM_BARR) ? "failed to complete barrier" : "failed to complete broadcast");
+
+    /* The release carries the write notices under release consistency (and the moves of homes) */
+    if (reply != NULL) {
+        if (kind == SM_CAST && reply->len >= 8) {
+            value = sm_get64(SM_MSG_BODY(reply));
+        } else if (kind == SM_BARR && sm_home_active) {
+            status = sm_home_barrier_end(reply);
+        } else if (kind == SM_BARR && sm_lrc_active) {
+            sm_lrc_notices(SM_MSG_BODY(reply), reply->len);
+        }
+        sm_msg_free(reply);
+    }
+    if (kind == SM_CAST) *split->addr = (void *) (uintptr_t) value;
 
     fflush(stdout);
-    return (void *)(sm_map + offset);
+    return status ? -1 : 1;
+}
+
+/*
+ * Start the collective in the slot, after completing the one started before it. A barrier is a release
+ * followed by an acquire, and the release is made here. Returns the request, or -1.
+ */
+static int sm_split_start(int slot, void **addr, int root_nid) {
+    struct sm_split *split = &sm_splits[slot];
+    int kind = (slot == SM_SPLIT_CAST) ? SM_CAST : SM_BARR, status;
+    char body[12];
+
+    if (sm_split_finish(slot, 1) < 0) return -1;
+
+    split->started++;
+    split->addr    = addr;
+    split->arrived = 0;
+
+    /* The nodes combine their arrivals along a tree, only node 0 arrives at the allocator */
+    if (sm_peer_active) {
+        status = sm_peer_begin(kind, (kind == SM_CAST) ? (uint64_t) (uintptr_t) *addr : 0, root_nid);
+    /* Pages may change homes at the barrier */
+    } else if (kind == SM_BARR && sm_home_active) {
+        sm_msg_cork();
+        status = sm_home_barrier_begin(&split->seq);
+        status |= sm_msg_uncork();
+    } else {
+        /* The last of the diffs go out with the arrival */
+        sm_msg_cork();
+        if (kind == SM_BARR && sm_lrc_active) sm_lrc_flush();
+
+        /* Every node sends the root, but only the root's value is used by the allocator */
+        sm_put32(body, root_nid);
+        sm_put64(body + 4, (kind == SM_CAST) ? (uint64_t) (uintptr_t) *addr : 0);
+        status = sm_request(sm_sock, sm_nid, kind, 0, body, (kind == SM_CAST) ? sizeof(body) : 0, &split->seq);
+        status |= sm_msg_uncork();
+    }
+    if (status) return sm_fatal((kind == SM_BARR) ? "failed to start barrier" : "failed to start broadcast");
+
+    split->active = 1;
+    return (int) ((split->started & 0x3FFFFFFF) << 1) | slot;
+}
+
+int sm_barrier_begin (void) {
+    sigset_t mask;
+    int request;
+
+    sm_block_io(1, &mask);
+    request = sm_split_start(SM_SPLIT_BARR, NULL, 0);
+    sm_block_io(0, &mask);
+
+    return request;
+}
+
+void sm_barrier_end (void) {
+    sigset_t mask;
+
+    sm_block_io(1, &mask);
+    sm_split_finish(SM_SPLIT_BARR, 1);
+    sm_block_io(0, &mask);
 }
 
 void sm_barrier (void) {
+    sigset_t mask;
+#ifdef SM_CHECK_COPIES
+    uint64_t refills = sm_msg_stats.refills;
+#endif
+
+    sm_block_io(1, &mask);
+    if (sm_split_start(SM_SPLIT_BARR, NULL, 0) >= 0) sm_split_finish(SM_SPLIT_BARR, 1);
+    sm_block_io(0, &mask);
+
+#ifdef SM_CHECK_COPIES
+    assert(sm_msg_stats.refills == refills);
+#endif
+}
+
+int sm_ibcast (void **addr, int root_nid) {
+    sigset_t mask;
+    int request;
+
+    sm_block_io(1, &mask);
+    request = sm_split_start(SM_SPLIT_CAST, addr, root_nid);
+    sm_block_io(0, &mask);
+
+    return request;
+}
+
+void sm_bcast (void **addr, int root_nid) {
+    sigset_t mask;
+
+    sm_block_io(1, &mask);
+    if (sm_split_start(SM_SPLIT_CAST, addr, root_nid) >= 0) sm_split_finish(SM_SPLIT_CAST, 1);
+    sm_block_io(0, &mask);
+}
+
+/*
+ * Returns whether the request is still the one in progress in its slot, an older one has completed
+ */
+static int sm_split_current(int request) {
+    struct sm_split *split = &sm_splits[request & 1];
+
+    return request >= 0 && split->active && (uint32_t) (request >> 1) == (split->started & 0x3FFFFFFF);
+}
+
+int sm_wait (int request) {
+    sigset_t mask;
+    int status;
+
+    if (request < 0) return -1;
+    if (!sm_split_current(request)) return 0;
+
+    sm_block_io(1, &mask);
+    status = sm_split_finish(request & 1, 1);
+    sm_block_io(0, &mask);
+
+    return (status < 0) ? -1 : 0;
+}
+
+int sm_test (int request) {
+    sigset_t mask;
+    int status;
+
+    if (request < 0) return -1;
+    if (!sm_split_current(request)) return 1;
+
+    sm_block_io(1, &mask);
+    status = sm_split_finish(request & 1, 0);
+    sm_block_io(0, &mask);
+
+    return status;
+}
+
+void sm_acquire (void) {
     int status;
     msg_t *message;
+    sigset_t mask;
 
-    status = sm_send(sm_sock, sm_nid, SM_BARR, NULL);
-    if (status) sm_fatal("milk");
+    if (!sm_lrc_active) return;
 
-    /* Wait for an acknowledgement */
-    status = sm_recv_type(sm_sock, &message, SM_BARR_REPLY);
-    if (status || message->type != SM_BARR_REPLY) {
-        sm_fatal("failed to receive barrier acknowledgement");
+    sm_block_io(1, &mask);
+
+    /* Ask the allocator which pages other nodes have released changes to */
+    status = sm_call(SM_ACQU, 0, NULL, 0, SM_ACQU_REPLY, &message);
+    if (status) {
+        sm_fatal("failed to receive write notices");
+    } else {
+        sm_lrc_notices(SM_MSG_BODY(message), message->len);
+        sm_msg_free(message);
     }
 
-    fflush(stdout);
+    sm_block_io(0, &mask);
     return;
 }
 
-void sm_bcast (void **addr, int root_nid) {
-    int status;
-    char buffer[1024];
-    msg_t *message;
+void sm_release (void) {
+    sigset_t mask;
 
-    sm_barrier();
+    if (!sm_lrc_active) return;
 
-    snprintf(buffer, 1024, "%d %s", root_nid, (char *) *addr);
-    status = sm_send(sm_sock, sm_nid, SM_CAST, buffer);
-    if (status) sm_fatal("milk");
-    
-    /* Wait for an acknowledgement */
-    status = sm_recv_type(sm_sock, &message, SM_CAST_REPLY);
-    if (status) sm_fatal("failed to receive cast acknowledgement");
+    sm_block_io(1, &mask);
+    if (sm_lrc_flush()) sm_fatal("failed to release writes");
+    sm_block_io(0, &mask);
 
-    sscanf(message->buffer, "%*d %*d %*d %s", (char *) *addr);
-    
-    fflush(stdout);
     return;
-}
\ No newline at end of file
+}
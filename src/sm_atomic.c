@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+
+#include "sm.h"
+#include "sm_ext.h"
+#include "sm_node.h"
+#include "sm_lrc.h"
+#include "sm_home.h"
+#include "sm_peer.h"
+#include "sm_progress.h"
+#include "config.h"
+
+_Static_assert(SM_ATOMIC_ADD == SM_ATOM_ADD && SM_ATOMIC_SWAP == SM_ATOM_SWAP && SM_ATOMIC_CAS == SM_ATOM_CAS,
+               "atomic operations are sent as they are");
+
+/*
+ * The word's value after the operation, given its value before
+ */
+static uint64_t atomic_new(const struct sm_atomic_op *op) {
+    uint64_t mask = (op->width == 4) ? UINT32_MAX : UINT64_MAX;
+
+    switch (op->op) {
+        case SM_ATOMIC_ADD:  return (op->result + op->value) & mask;
+        case SM_ATOMIC_SWAP: return op->value & mask;
+        default:             return (op->result == (op->compare & mask)) ? op->value & mask : op->result;
+    }
+}
+
+/*
+ * Under release consistency the operations were applied to the page somewhere else, bring this node's
+ * copy of the words (if it has one) up to date without it counting as a write of its own
+ */
+static int atomic_install(uint32_t page_n, const struct sm_atomic_op *ops, int n_ops) {
+    if (sm_access[page_n] == SM_ACCESS_NONE) return 0;
+
+    for (int i = 0; i < n_ops; i++) {
+        uint64_t value = atomic_new(&ops[i]);
+        uint32_t narrow = value;
+
+        /* A run of operations on one word only needs its last value */
+        if (i + 1 < n_ops && ops[i + 1].addr == ops[i].addr) continue;
+
+        if (sm_lrc_install((char *) ops[i].addr - sm_map, (ops[i].width == 4) ? (char *) &narrow : (char *) &value,
+                           ops[i].width))
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Apply the encoded operations on the page wherever its latest contents are, the old values go to `olds'
+ */
+static int atomic_page(uint32_t page_n, const char *body, uint32_t len, char *olds) {
+    msg_t *reply;
+    int status;
+
+    /* The region is shared with the allocator and every other node (dsm -s) */
+    if (!sm_peer_active && !sm_progress_active) {
+        if (sm_atomic_apply(sm_map + (long) page_n * sm_page_size, sm_page_size, body, len, olds) < 0)
+            return sm_fatal("malformed atomic operations");
+        return 0;
+    }
+
+    if (sm_peer_active) return sm_peer_atomic(page_n, body, len, olds);
+    if (sm_home_active) return sm_home_atomic(page_n, body, len, olds);
+
+    if (sm_call(SM_ATOMIC, page_n, body, len, SM_ATOMIC_REPLY, &reply)) return -1;
+
+    status = (reply->len == len / SM_ATOM_LEN * 8) ? 0 : sm_fatal("malformed atomic results");
+    if (!status) memcpy(olds, SM_MSG_BODY(reply), reply->len);
+    sm_msg_free(reply);
+
+    return status;
+}
+
+int sm_atomic_batch (struct sm_atomic_op *ops, int n_ops) {
+    static char body[SM_ATOMIC_MAX * SM_ATOM_LEN], olds[SM_ATOMIC_MAX * 8];
+    sigset_t mask;
+    int status = 0;
+
+    for (int i = 0; i < n_ops; i++) {
+        char *addr = ops[i].addr;
+
+        if ((ops[i].width != 4 && ops[i].width != 8) || ops[i].op < SM_ATOMIC_ADD || ops[i].op > SM_ATOMIC_CAS)
+            return sm_fatal("invalid atomic operation");
+        if (addr < sm_map || addr + ops[i].width > sm_map + (long) SM_NUM_PAGES * sm_page_size ||
+                (addr - sm_map) % ops[i].width != 0)
+            return sm_fatal("atomic operation on a word outside of shared memory, or not aligned");
+    }
+
+    sm_block_io(1, &mask);
+
+    /* A message for each run of operations on one page */
+    for (int first = 0, last; first < n_ops && !status; first = last) {
+        uint32_t page_n = ((char *) ops[first].addr - sm_map) / sm_page_size;
+
+        for (last = first; last < n_ops && last - first < SM_ATOMIC_MAX; last++) {
+            uint32_t offset = (char *) ops[last].addr - sm_map - (long) page_n * sm_page_size;
+            char *op = body + (last - first) * SM_ATOM_LEN;
+
+            if (offset >= sm_page_size) break;
+
+            op[0] = offset & 0xff;
+            op[1] = offset >> 8;
+            op[2] = ops[last].op;
+            op[3] = ops[last].width;
+            sm_put64(op + 4, ops[last].value);
+            sm_put64(op + 12, ops[last].compare);
+        }
+
+        status = atomic_page(page_n, body, (last - first) * SM_ATOM_LEN, olds);
+        if (status) break;
+
+        for (int i = first; i < last; i++) ops[i].result = sm_get64(olds + (i - first) * 8);
+
+        if (sm_lrc_active) status = atomic_install(page_n, ops + first, last - first);
+    }
+
+    sm_block_io(0, &mask);
+
+    return status ? -1 : 0;
+}
+
+int sm_atomic (void *addr, int op, int width, uint64_t value, uint64_t compare, uint64_t *old) {
+    struct sm_atomic_op one = { addr, op, width, value, compare, 0 };
+    int status = sm_atomic_batch(&one, 1);
+
+    *old = status ? 0 : one.result;
+    return status;
+}
@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sm_directory.h"
+#include "allocator.h"
+
+struct sm_dir_leaf {
+    uint64_t           stale;              /* The union of the stale bits of the leaf's pages */
+    struct memory_page pages[SM_DIR_LEAF];
+};
+
+static struct sm_dir_leaf *sm_directory[SM_DIR_ROOT];
+
+/*
+ * Returns the leaf holding the page, allocating it if the page has never been used. Worker threads may
+ * race to allocate the same leaf, the loser frees its copy.
+ */
+static struct sm_dir_leaf *directory_leaf(uint32_t page_n) {
+    struct sm_dir_leaf **slot = &sm_directory[page_n >> SM_DIR_BITS], *leaf, *expected = NULL;
+
+    leaf = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    if (leaf != NULL) return leaf;
+
+    leaf = aligned_alloc(64, sizeof(struct sm_dir_leaf));
+    if (leaf == NULL) return NULL;
+
+    memset(leaf, 0, sizeof(struct sm_dir_leaf));
+    for (int i = 0; i < SM_DIR_LEAF; i++) {
+        leaf->pages[i].writer = -1;
+        leaf->pages[i].last   = -1;
+    }
+
+    if (!__atomic_compare_exchange_n(slot, &expected, leaf, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free(leaf);
+        return expected;
+    }
+
+    return leaf;
+}
+
+/*
+ * Returns the directory entry of the page, creating it if need be (NULL if out of memory)
+ */
+struct memory_page *sm_page(uint32_t page_n) {
+    struct sm_dir_leaf *leaf;
+
+    if (page_n >= SM_NUM_PAGES) return NULL;
+
+    leaf = directory_leaf(page_n);
+    if (leaf == NULL) return NULL;
+
+    return &leaf->pages[page_n & (SM_DIR_LEAF - 1)];
+}
+
+/*
+ * Returns the directory entry of the page, or NULL if the page has never been used
+ */
+struct memory_page *sm_page_lookup(uint32_t page_n) {
+    struct sm_dir_leaf *leaf;
+
+    if (page_n >= SM_NUM_PAGES) return NULL;
+
+    leaf = __atomic_load_n(&sm_directory[page_n >> SM_DIR_BITS], __ATOMIC_ACQUIRE);
+    if (leaf == NULL) return NULL;
+
+    return &leaf->pages[page_n & (SM_DIR_LEAF - 1)];
+}
+
+/*
+ * Mark the page as stale for the given nodes, they are owed a write notice for it
+ */
+void sm_page_stale(uint32_t page_n, uint64_t nodes) {
+    struct sm_dir_leaf *leaf;
+
+    if (page_n >= SM_NUM_PAGES || (leaf = directory_leaf(page_n)) == NULL) return;
+
+    leaf->pages[page_n & (SM_DIR_LEAF - 1)].stale |= nodes;
+    leaf->stale |= nodes;
+}
+
+/*
+ * Collect (and clear) the pages the node is owed write notices for, only visiting the leaves that have
+ * any. Returns the number of pages, or -1 if there were more than `max' (they are all cleared anyway,
+ * so the node has to drop every copy it has).
+ */
+int sm_directory_stale(int nid, uint32_t *pages, int max) {
+    uint64_t bit = 1ULL << nid;
+    int n_pages = 0;
+
+    for (int i = 0; i < SM_DIR_ROOT; i++) {
+        struct sm_dir_leaf *leaf = sm_directory[i];
+        if (leaf == NULL || !(leaf->stale & bit)) continue;
+
+        for (int j = 0; j < SM_DIR_LEAF; j++) {
+            if (!(leaf->pages[j].stale & bit)) continue;
+
+            leaf->pages[j].stale &= ~bit;
+            if (n_pages >= 0 && n_pages < max) pages[n_pages++] = (i << SM_DIR_BITS) | j;
+            else                               n_pages = -1;
+        }
+        leaf->stale &= ~bit;
+    }
+
+    return n_pages;
+}
+
+void sm_directory_free(void) {
+    for (int i = 0; i < SM_DIR_ROOT; i++) {
+        free(sm_directory[i]);
+        sm_directory[i] = NULL;
+    }
+}
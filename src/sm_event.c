@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+
+#include <sys/select.h>
+#include <sys/epoll.h>
+
+#include "sm_event.h"
+#include "allocator.h"
+#include "config.h"
+
+struct sm_event_engine *sm_event = &sm_event_epoll;
+
+/*
+ * Select the event engine by name, returns -1 if there is no such engine
+ */
+int sm_event_choose(char *name) {
+    struct sm_event_engine *engines[] = { &sm_event_select, &sm_event_epoll, &sm_event_uring };
+
+    for (int i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+        if (strcmp(engines[i]->name, name) == 0) {
+            sm_event = engines[i];
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Check (without blocking) whether there is data waiting to be read on the socket, a nested wait may
+ * have already read the message an earlier readiness notification was for
+ */
+static int socket_ready(int socket) {
+    struct pollfd pfd = { .fd = socket, .events = POLLIN };
+
+    return (sm_msg_poll(&pfd, 1, 0) > 0);
+}
+
+/* The sockets being watched by the select/epoll engines, indexed by nid */
+static int  event_sockets[SM_MAX_NODES];
+static int  event_max;
+
+/*
+ * A watched socket whose receive ring still holds frames, which select() and epoll won't report again.
+ * Returns -1 if there is none.
+ */
+static int event_buffered(void) {
+    for (int i = 0; i < event_max; i++) {
+        if (event_sockets[i] >= 0 && sm_msg_buffered(event_sockets[i])) return event_sockets[i];
+    }
+
+    return -1;
+}
+
+/*
+ * select() engine
+ */
+static fd_set select_ready;
+static int    select_cursor;
+
+static int select_init(int max_clients) {
+    event_max = max_clients;
+    for (int i = 0; i < SM_MAX_NODES; i++) event_sockets[i] = -1;
+
+    FD_ZERO(&select_ready);
+    select_cursor = max_clients;
+
+    return 0;
+}
+
+static int select_add(int nid, int socket) {
+    if (socket >= FD_SETSIZE) return sm_fatal("socket is too large for select()");
+
+    event_sockets[nid] = socket;
+    return 0;
+}
+
+static int select_remove(int nid) {
+    event_sockets[nid] = -1;
+    return 0;
+}
+
+static int select_next(msg_t **message, long timeout) {
+    struct timeval limit = { timeout / 1000000, timeout % 1000000 };
+    int max_sock, activity, socket;
+
+    while (1) {
+        /* Hand out the next client which select() reported as readable */
+        while (select_cursor < event_max) {
+            socket = event_sockets[select_cursor++];
+
+            if (socket >= 0 && FD_ISSET(socket, &select_ready) && socket_ready(socket)) {
+                return sm_recv(socket, message);
+            }
+        }
+
+        if ((socket = event_buffered()) >= 0) return sm_recv(socket, message);
+
+        /* Initialize the list of client sockets */
+        FD_ZERO(&select_ready);
+        max_sock = -1;
+        for (int i = 0; i < event_max; i++) {
+            if (event_sockets[i] < 0) continue;
+
+            FD_SET(event_sockets[i], &select_ready);
+            if (event_sockets[i] > max_sock) max_sock = event_sockets[i];
+        }
+        if (max_sock < 0) return sm_fatal("no clients left to wait for");
+
+        do {
+            activity = select(max_sock + 1, &select_ready, NULL, NULL, (timeout < 0) ? NULL : &limit);
+        } while (activity < 0 && errno == EINTR);
+        if (activity < 0) return sm_fatal("select() failed");
+
+        select_cursor = 0;
+        if (activity == 0) {
+            *message = NULL;
+            return 0;
+        }
+    }
+}
+
+static void select_end(void) {
+}
+
+struct sm_event_engine sm_event_select = {
+    "select", select_init, select_add, select_remove, select_next, select_end
+};
+
+/*
+ * epoll() engine
+ */
+#define EPOLL_BATCH 64
+
+static int                epoll_fd = -1;
+static struct epoll_event epoll_ready[EPOLL_BATCH];
+static int                epoll_count, epoll_cursor;
+
+static int epoll_init(int max_clients) {
+    event_max = max_clients;
+    for (int i = 0; i < SM_MAX_NODES; i++) event_sockets[i] = -1;
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) return sm_fatal("failed to create epoll instance");
+
+    epoll_count = epoll_cursor = 0;
+    return 0;
+}
+
+static int epoll_add(int nid, int socket) {
+    struct epoll_event event = { .events = EPOLLIN, .data.u32 = nid };
+
+    event_sockets[nid] = socket;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socket, &event)) return sm_fatal("failed to watch socket");
+
+    return 0;
+}
+
+static int epoll_remove(int nid) {
+    if (event_sockets[nid] < 0) return 0;
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, event_sockets[nid], NULL);
+    event_sockets[nid] = -1;
+
+    return 0;
+}
+
+static int epoll_next(msg_t **message, long timeout) {
+    struct timespec limit = { timeout / 1000000, (timeout % 1000000) * 1000 };
+    int socket;
+
+    while (1) {
+        /* Hand out the next client which epoll reported as readable */
+        while (epoll_cursor < epoll_count) {
+            socket = event_sockets[epoll_ready[epoll_cursor++].data.u32];
+
+            if (socket >= 0 && socket_ready(socket)) return sm_recv(socket, message);
+        }
+
+        if ((socket = event_buffered()) >= 0) return sm_recv(socket, message);
+
+        /* epoll_wait() only counts milliseconds, too coarse for a hold window */
+        do {
+            epoll_count = (timeout < 0) ? epoll_wait(epoll_fd, epoll_ready, EPOLL_BATCH, -1)
+                                        : epoll_pwait2(epoll_fd, epoll_ready, EPOLL_BATCH, &limit, NULL);
+        } while (epoll_count < 0 && errno == EINTR);
+        while (epoll_count < 0 && (errno == ENOSYS || errno == EINTR)) {
+            epoll_count = epoll_wait(epoll_fd, epoll_ready, EPOLL_BATCH, (timeout + 999) / 1000);
+        }
+        if (epoll_count < 0) return sm_fatal("epoll_wait() failed");
+
+        epoll_cursor = 0;
+        if (epoll_count == 0) {
+            *message = NULL;
+            return 0;
+        }
+    }
+}
+
+static void epoll_end(void) {
+    if (epoll_fd >= 0) close(epoll_fd);
+    epoll_fd = -1;
+}
+
+struct sm_event_engine sm_event_epoll = {
+    "epoll", epoll_init, epoll_add, epoll_remove, epoll_next, epoll_end
+};
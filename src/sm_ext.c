@@ -0,0 +1,287 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sm.h"
+#include "config.h"
+#include "sm_ext.h"
+#include "sm_node.h"
+#include "sm_lrc.h"
+#include "sm_progress.h"
+#include "sm_prefetch.h"
+
+static int      ext_fetching = 0; /* Set while an sm_prefetch() request hasn't been answered */
+static uint32_t ext_fetch_seq;
+
+/* The sm_get() in progress, its pages are received straight into `dst' by sm_ext_sink() */
+static char       *ext_get_dst = NULL;
+static const char *ext_get_src;
+static size_t      ext_get_len;
+
+static char *ext_put_stage = NULL; /* The bodies of a window of SM_PUTs, {offset:32, bytes} each */
+
+_Static_assert(SM_ADVISE_INVALIDATE == SM_PROTO_INVALIDATE && SM_ADVISE_UPDATE == SM_PROTO_UPDATE &&
+               SM_ADVISE_MIGRATORY == SM_PROTO_MIGRATORY && SM_ADVISE_AUTO == SM_PROTO_AUTO,
+               "sm_advise() policies are sent as they are");
+
+/*
+ * The bulk messages are only understood by the allocator's own protocol, and the node has to have a
+ * progress thread to receive pages it isn't waiting for
+ */
+static int ext_bulk(void) {
+    return sm_progress_active && !sm_lrc_active;
+}
+
+/*
+ * Returns whether [addr, addr + len) lies within the shared region
+ */
+static int ext_shared(const void *addr, size_t len) {
+    const char *start = addr;
+
+    return start >= sm_map && len <= (size_t) SM_NUM_PAGES * sm_page_size &&
+           start + len <= sm_map + (long) SM_NUM_PAGES * sm_page_size;
+}
+
+/*
+ * Returns whether [addr, addr + len) overlaps the shared region at all
+ */
+static int ext_overlaps(const void *addr, size_t len) {
+    const char *start = addr;
+
+    return start < sm_map + (long) SM_NUM_PAGES * sm_page_size && start + len > sm_map;
+}
+
+/*
+ * Wait for the allocator to have handled the outstanding sm_prefetch() request, if there is one
+ */
+static int ext_settle(void) {
+    msg_t *reply;
+
+    if (!ext_fetching) return 0;
+    ext_fetching = 0;
+
+    if (sm_progress_await(ext_fetch_seq, &reply)) return sm_fatal("failed to receive prefetch reply");
+    sm_msg_free(reply);
+
+    return 0;
+}
+
+int sm_prefetch (void *addr, size_t len, int mode) {
+    uint32_t first, last;
+    char body[8];
+
+    if (!ext_bulk() || len == 0) return 0;
+    if (!ext_shared(addr, len)) return sm_fatal("prefetch outside of shared memory");
+    if (ext_settle()) return -1;
+
+    first = ((char *) addr - sm_map) / sm_page_size;
+    last  = ((char *) addr + len - 1 - sm_map) / sm_page_size;
+
+    sm_put32(body, last - first + 1);
+    sm_put32(body + 4, mode == SM_PREFETCH_WRITE);
+    if (sm_request(sm_sock, sm_nid, SM_FETCH, first, body, sizeof(body), &ext_fetch_seq))
+        return sm_fatal("failed to send prefetch request");
+
+    ext_fetching = 1;
+    sm_prefetch_asked(last - first + 1);
+
+    return 0;
+}
+
+/*
+ * Ask for the runs of pages listed in `body' and wait until they have all arrived
+ */
+static int ext_get_runs(char *body, uint32_t n_runs) {
+    msg_t *reply;
+
+    if (n_runs == 0) return 0;
+
+    if (sm_call(SM_GET, 0, body, n_runs * 8, SM_GET_REPLY, &reply)) return sm_fatal("failed to get pages");
+    sm_msg_free(reply);
+
+    return 0;
+}
+
+int sm_get (void *dst, const void *src, size_t len) {
+    static char body[SM_MSG_MAX];
+    uint32_t first, last, n_runs = 0, run_end = 0;
+    const char *end = (const char *) src + len;
+    int status = 0;
+
+    if (!ext_bulk() || len == 0 || !ext_shared(src, len) || ext_overlaps(dst, len)) {
+        memcpy(dst, src, len);
+        return 0;
+    }
+    if (ext_settle()) return -1;
+
+    first = ((const char *) src - sm_map) / sm_page_size;
+    last  = (end - 1 - sm_map) / sm_page_size;
+
+    ext_get_dst = dst;
+    ext_get_src = src;
+    ext_get_len = len;
+
+    for (uint32_t p = first; p <= last; p++) {
+        const char *page = sm_map + (long) p * sm_page_size;
+        const char *lo = (page > (const char *) src) ? page : (const char *) src;
+        const char *hi = (page + sm_page_size < end) ? page + sm_page_size : end;
+
+        /* A copy the node already holds is as good as the allocator's */
+        if (sm_access[p] != SM_ACCESS_NONE) {
+            memcpy((char *) dst + (lo - (const char *) src), lo, hi - lo);
+            continue;
+        }
+
+        if (n_runs > 0 && run_end == p) {
+            sm_put32(body + (n_runs - 1) * 8 + 4, sm_get32(body + (n_runs - 1) * 8 + 4) + 1);
+        } else {
+            if (n_runs == SM_MSG_MAX / 8) {
+                status = ext_get_runs(body, n_runs);
+                if (status) break;
+                n_runs = 0;
+            }
+            sm_put32(body + n_runs * 8, p);
+            sm_put32(body + n_runs * 8 + 4, 1);
+            n_runs++;
+        }
+        run_end = p + 1;
+    }
+    if (status == 0) status = ext_get_runs(body, n_runs);
+
+    ext_get_dst = NULL;
+    return status;
+}
+
+/*
+ * Where pages sent by sm_get() are received, straight into the destination if all of them were asked
+ * for in full and into the message otherwise (sm_ext_serve() copies out the part that was)
+ */
+char *sm_ext_sink(msg_t *message) {
+    const char *page = sm_map + (long) message->page * sm_page_size;
+
+    if (ext_get_dst == NULL) return NULL;
+    if (page < ext_get_src || page + message->len > ext_get_src + ext_get_len) return NULL;
+
+    return ext_get_dst + (page - ext_get_src);
+}
+
+/*
+ * Pages sent by sm_get() have been received (from the progress thread)
+ */
+void sm_ext_serve(msg_t *message) {
+    const char *page = sm_map + (long) message->page * sm_page_size, *lo, *hi;
+
+    if (ext_get_dst == NULL || sm_ext_sink(message) != NULL) return;
+
+    lo = (page > ext_get_src) ? page : ext_get_src;
+    hi = (page + message->len < ext_get_src + ext_get_len) ? page + message->len : ext_get_src + ext_get_len;
+    if (lo < hi) memcpy(ext_get_dst + (lo - ext_get_src), SM_MSG_BODY(message) + (lo - page), hi - lo);
+}
+
+/*
+ * Send a window of puts and wait until the allocator has applied them all
+ */
+static int ext_put_window(struct sm_frame *frames, uint32_t n_frames) {
+    char body[4];
+    msg_t *reply;
+
+    if (n_frames == 0) return 0;
+
+    if (sm_send_all(frames, n_frames)) return sm_fatal("failed to send pages");
+
+    sm_put32(body, n_frames);
+    if (sm_call(SM_PUT_DONE, 0, body, sizeof(body), SM_PUT_REPLY, &reply)) return sm_fatal("failed to put pages");
+    sm_msg_free(reply);
+
+    return 0;
+}
+
+int sm_put (void *dst, const void *src, size_t len) {
+    struct sm_frame frames[SM_PUT_WINDOW];
+    uint32_t first, last, n_frames = 0, n_staged = 0;
+    const char *end = (const char *) dst + len;
+
+    if (!ext_bulk() || len == 0 || !ext_shared(dst, len) || ext_overlaps(src, len)) {
+        memcpy(dst, src, len);
+        return 0;
+    }
+    if (ext_settle()) return -1;
+
+    /* Only the first and last pages can be partial, whole pages are sent straight from `src' */
+    if (ext_put_stage == NULL) {
+        ext_put_stage = malloc(2 * (4 + sm_page_size));
+        if (ext_put_stage == NULL) return sm_fatal("failed to allocate the put staging buffer");
+    }
+
+    first = ((const char *) dst - sm_map) / sm_page_size;
+    last  = (end - 1 - sm_map) / sm_page_size;
+
+    for (uint32_t p = first; p <= last; p++) {
+        const char *page = sm_map + (long) p * sm_page_size;
+        const char *lo = (page > (const char *) dst) ? page : (const char *) dst;
+        const char *hi = (page + sm_page_size < end) ? page + sm_page_size : end;
+        const char *from = (const char *) src + (lo - (const char *) dst);
+        struct sm_frame *run = (n_frames > 0) ? &frames[n_frames - 1] : NULL;
+        char *stage;
+
+        /* The node owns the page, nobody else has a copy to invalidate */
+        if (sm_access[p] == SM_ACCESS_WRITE) {
+            memcpy((char *) lo, from, hi - lo);
+            continue;
+        }
+
+        /* A whole page following on from the last one joins its run */
+        if (run != NULL && hi - lo == sm_page_size && run->type == SM_PUT_PAGES &&
+                run->page + run->len / sm_page_size == p && run->len + sm_page_size <= SM_BULK_MAX) {
+            run->len += sm_page_size;
+            continue;
+        }
+
+        if (n_frames == SM_PUT_WINDOW) {
+            if (ext_put_window(frames, n_frames)) return -1;
+            n_frames = 0;
+        }
+
+        if (hi - lo == sm_page_size) {
+            frames[n_frames++] = (struct sm_frame) { sm_sock, sm_nid, SM_PUT_PAGES, p, from, sm_page_size, 0 };
+        } else {
+            stage = ext_put_stage + (n_staged++) * (4 + sm_page_size);
+            sm_put32(stage, lo - page);
+            memcpy(stage + 4, from, hi - lo);
+            frames[n_frames++] = (struct sm_frame) { sm_sock, sm_nid, SM_PUT, p, stage, 4 + (hi - lo), 0 };
+        }
+    }
+
+    return ext_put_window(frames, n_frames);
+}
+
+int sm_advise (void *addr, size_t len, int policy) {
+    uint32_t first, last;
+    msg_t *reply;
+    char body[8];
+
+    if (!ext_bulk() || len == 0) return 0;
+    if (!ext_shared(addr, len)) return sm_fatal("advice outside of shared memory");
+    if (policy < SM_ADVISE_INVALIDATE || policy > SM_ADVISE_AUTO) return sm_fatal("unknown sm_advise() policy");
+    if (ext_settle()) return -1;
+
+    first = ((char *) addr - sm_map) / sm_page_size;
+    last  = ((char *) addr + len - 1 - sm_map) / sm_page_size;
+
+    sm_put32(body, last - first + 1);
+    sm_put32(body + 4, policy);
+    if (sm_call(SM_ADVISE, first, body, sizeof(body), SM_ADVISE_REPLY, &reply)) return sm_fatal("failed to advise");
+    sm_msg_free(reply);
+
+    return 0;
+}
+
+/*
+ * The node is leaving, the allocator must have answered its last sm_prefetch() first
+ */
+void sm_ext_exit(void) {
+    if (ext_bulk()) ext_settle();
+
+    free(ext_put_stage);
+    ext_put_stage = NULL;
+}
@@ -0,0 +1,595 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include <sys/mman.h>
+
+#include "sm.h"
+#include "sm_home.h"
+#include "sm_lrc.h"
+#include "sm_peer.h"
+#include "sm_progress.h"
+#include "config.h"
+
+#define SM_HOME_STREAK  4                  /* Accesses in a row by one other node that propose it as the home */
+#define SM_HOME_REPLIES (SM_MAX_NODES + 1) /* A fault, or a flush of every home, is outstanding at a time */
+
+int sm_home_active = 0;
+
+static int             home_peers[SM_MAX_NODES];      /* The socket connected to each other node */
+static char            home_gone[SM_MAX_NODES];       /* Set once the node has closed its connection */
+static pthread_mutex_t home_send_locks[SM_MAX_NODES]; /* Each frame to a node is written whole */
+static int           (*home_writer)(int socket, struct iovec *iov, int iovcnt); /* Everything else */
+
+static int16_t  home_of[SM_NUM_PAGES];  /* The home of each page, -1 until the allocator has said */
+static char    *home_masters;           /* The master copy of a page homed here is at the same offset */
+
+static pthread_mutex_t home_lock = PTHREAD_MUTEX_INITIALIZER; /* Guards the master copies and below */
+static int16_t  home_last[SM_NUM_PAGES];   /* The node that used each page homed here last */
+static uint8_t  home_streak[SM_NUM_PAGES]; /* How many times in a row, up to SM_HOME_STREAK */
+static uint32_t home_proposed[SM_HOME_MOVES_MAX * 2]; /* (page, home) to propose at the next barrier */
+static int      home_n_proposed = 0;
+
+static char     home_notices[SM_MSG_MAX];  /* The pages released since the allocator was last told */
+static uint32_t home_n_notices = 0;
+static uint64_t home_flushing  = 0;        /* The homes sent diffs since they were last flushed */
+
+static pthread_t       home_thread;
+static int             home_wake[2];          /* Closing the write end stops the home thread */
+static pthread_mutex_t home_reply_lock = PTHREAD_MUTEX_INITIALIZER;
+static sem_t           home_ready;            /* Posted for every reply and every master copy received */
+static msg_t          *home_replies[SM_HOME_REPLIES];
+static int             home_n_replies = 0;
+static uint32_t        home_given = 0;        /* Master copies received and not yet waited for */
+
+static struct {
+    uint64_t local;     /* Faults on pages homed here */
+    uint64_t remote;    /* Faults on pages fetched from their homes */
+    uint64_t served;    /* Pages sent to other nodes */
+    uint64_t diffs;     /* Diffs from other nodes applied here */
+    uint64_t moved_in;  /* Pages whose home moved here */
+    uint64_t moved_out; /* Pages whose home moved away */
+} home_stats;
+
+static char *home_page(uint32_t page_n) {
+    return sm_map + (long) page_n * sm_page_size;
+}
+
+static char *home_master(uint32_t page_n) {
+    return home_masters + (long) page_n * sm_page_size;
+}
+
+/*
+ * Both threads send to the other nodes, each connection has its own lock so that a thread blocked on a
+ * full socket never holds up the frames for another node
+ */
+static int home_write(int socket, struct iovec *iov, int iovcnt) {
+    for (int i = 0; i < sm_nodes; i++) {
+        if (home_peers[i] != socket) continue;
+
+        pthread_mutex_lock(&home_send_locks[i]);
+        int status = sm_writev_all(socket, iov, iovcnt);
+        pthread_mutex_unlock(&home_send_locks[i]);
+
+        return status;
+    }
+
+    return (home_writer != NULL) ? home_writer(socket, iov, iovcnt) : sm_writev_all(socket, iov, iovcnt);
+}
+
+/*
+ * Count a use of a page homed here, a run of SM_HOME_STREAK by one other node (with nobody else using
+ * the page in between) proposes that node as its home. Called with home_lock held.
+ */
+static void home_count(uint32_t page_n, int nid) {
+    if (home_last[page_n] != nid) {
+        home_last[page_n]   = nid;
+        home_streak[page_n] = 0;
+    }
+    if (nid == sm_nid || home_streak[page_n] == SM_HOME_STREAK) return;
+
+    if (++home_streak[page_n] < SM_HOME_STREAK || home_n_proposed == SM_HOME_MOVES_MAX) return;
+    home_proposed[home_n_proposed * 2]     = page_n;
+    home_proposed[home_n_proposed * 2 + 1] = nid;
+    home_n_proposed++;
+}
+
+/*
+ * The home of the page, asking the allocator if this node doesn't know it yet. The reply names the
+ * homes of the pages that follow too, so a walk through an array asks once every SM_HOME_RUN pages.
+ */
+static int home_lookup(uint32_t page_n) {
+    msg_t *message;
+
+    if (home_of[page_n] >= 0) return home_of[page_n];
+
+    if (sm_call(SM_HOME_WHERE, page_n, NULL, 0, SM_HOME_WHERE_REPLY, &message)) return -1;
+
+    for (uint32_t i = 0; i < SM_HOME_RUN && (i + 1) * 4 <= message->len && page_n + i < SM_NUM_PAGES; i++) {
+        int home = (int32_t) sm_get32(SM_MSG_BODY(message) + i * 4);
+
+        if (home >= 0 && home < sm_nodes && home_of[page_n + i] < 0) home_of[page_n + i] = home;
+    }
+    sm_msg_free(message);
+
+    if (home_of[page_n] < 0) return sm_fatal("the page has no home");
+    return home_of[page_n];
+}
+
+/*
+ * Wait for the reply to the request with the given sequence id, received by the home thread
+ */
+static void home_await(uint32_t seq, msg_t **reply) {
+    if (sm_msg_flush()) sm_fatal("failed to send queued messages");
+
+    while (1) {
+        pthread_mutex_lock(&home_reply_lock);
+        for (int i = 0; i < home_n_replies; i++) {
+            if (home_replies[i]->seq != seq) continue;
+
+            *reply = home_replies[i];
+            home_replies[i] = home_replies[--home_n_replies];
+            pthread_mutex_unlock(&home_reply_lock);
+            return;
+        }
+        pthread_mutex_unlock(&home_reply_lock);
+
+        while (sem_wait(&home_ready) && errno == EINTR);
+    }
+}
+
+/*
+ * Serve a message from another node on the home thread
+ */
+static void home_serve(int socket, msg_t *message) {
+    static char olds[SM_ATOMIC_MAX * 8];
+    uint32_t page_n = message->page;
+    int status = 0, n_ops;
+
+    if (page_n >= SM_NUM_PAGES || message->nid < 0 || message->nid >= sm_nodes) {
+        sm_msg_free(message);
+        return;
+    }
+
+    /* Only the page's home is sent requests for it, this node may not have asked the allocator yet */
+    if ((message->type == SM_HOME_READ || message->type == SM_HOME_DIFF || message->type == SM_ATOMIC) &&
+            home_of[page_n] < 0) {
+        home_of[page_n] = sm_nid;
+    }
+
+    switch (message->type) {
+        case SM_HOME_READ:
+            /* A node that asks the wrong node is told so by a reply without the page */
+            pthread_mutex_lock(&home_lock);
+            if (home_of[page_n] == sm_nid) {
+                home_count(page_n, message->nid);
+                status = sm_reply(socket, message, sm_nid, SM_HOME_PAGE, home_master(page_n), sm_page_size);
+                home_stats.served++;
+            } else {
+                status = sm_reply(socket, message, sm_nid, SM_HOME_PAGE, NULL, 0);
+            }
+            pthread_mutex_unlock(&home_lock);
+            break;
+        case SM_HOME_DIFF:
+            pthread_mutex_lock(&home_lock);
+            if (home_of[page_n] != sm_nid ||
+                    sm_patch(home_master(page_n), sm_page_size, SM_MSG_BODY(message), message->len) < 0) {
+                status = sm_fatal("received a diff for a page not homed here");
+            } else {
+                home_count(page_n, message->nid);
+                home_stats.diffs++;
+            }
+            pthread_mutex_unlock(&home_lock);
+            break;
+        case SM_ATOMIC:
+            /* Applied to the master copy, the node releases the page once it has the old values */
+            pthread_mutex_lock(&home_lock);
+            n_ops = (home_of[page_n] == sm_nid) ? sm_atomic_apply(home_master(page_n), sm_page_size,
+                                                                  SM_MSG_BODY(message), message->len, olds) : -1;
+            if (n_ops >= 0) home_count(page_n, message->nid);
+            status = sm_reply(socket, message, sm_nid, SM_ATOMIC_REPLY, olds, (n_ops > 0) ? n_ops * 8 : 0);
+            pthread_mutex_unlock(&home_lock);
+            break;
+        case SM_HOME_FLUSH:
+            /* Every diff the node sent before the flush has been applied, they arrive in order */
+            status = sm_reply(socket, message, sm_nid, SM_HOME_FLUSH_REPLY, NULL, 0);
+            break;
+        case SM_HOME_GIVE:
+            /* The master copy was received straight into place by sm_home_sink() */
+            if (message->len != sm_page_size) status = sm_fatal("received a page without its contents");
+            __atomic_add_fetch(&home_given, 1, __ATOMIC_RELEASE);
+            sem_post(&home_ready);
+            break;
+        case SM_LOCK_GRANT:
+            /* A lock handed over by its last holder, the application thread waits for it with its replies */
+            sm_progress_deliver(message);
+            return;
+        case SM_HOME_PAGE:
+        case SM_HOME_FLUSH_REPLY:
+        case SM_ATOMIC_REPLY:
+            pthread_mutex_lock(&home_reply_lock);
+            if (home_n_replies == SM_HOME_REPLIES) {
+                sm_fatal("too many replies waiting");
+                _exit(EXIT_FAILURE);
+            }
+            home_replies[home_n_replies++] = message;
+            pthread_mutex_unlock(&home_reply_lock);
+
+            sem_post(&home_ready);
+            return;
+        default:
+            break;
+    }
+
+    /* The other nodes would wait forever for a home that can't answer them */
+    if (status) _exit(EXIT_FAILURE);
+
+    sm_msg_free(message);
+}
+
+static void *home_main(void *argument) {
+    struct pollfd fds[SM_MAX_NODES + 1];
+    int nids[SM_MAX_NODES + 1], n_fds;
+    msg_t *message;
+
+    while (1) {
+        fds[0] = (struct pollfd) { home_wake[0], POLLIN, 0 };
+        n_fds = 1;
+        for (int i = 0; i < sm_nodes; i++) {
+            if (home_peers[i] < 0 || home_gone[i]) continue;
+
+            fds[n_fds]  = (struct pollfd) { home_peers[i], POLLIN, 0 };
+            nids[n_fds] = i;
+            n_fds++;
+        }
+
+        if (sm_msg_poll(fds, n_fds, -1) < 0) {
+            if (errno == EINTR) continue;
+
+            sm_fatal("failed to wait for the other nodes");
+            _exit(EXIT_FAILURE);
+        }
+        if (fds[0].revents) return NULL;
+
+        for (int i = 1; i < n_fds; i++) {
+            if (fds[i].revents == 0) continue;
+
+            /* Nodes only leave once every node is past the last barrier, nobody needs them any more */
+            if (sm_recv(fds[i].fd, &message)) {
+                home_gone[nids[i]] = 1;
+                continue;
+            }
+            home_serve(fds[i].fd, message);
+        }
+    }
+}
+
+/*
+ * The socket connected to another node, locks are handed over on it too (sm_lock.c)
+ */
+int sm_home_socket(int nid) {
+    return home_peers[nid];
+}
+
+/*
+ * Where the contents of a page handed over to this node are received to, its master copy
+ */
+char *sm_home_sink(msg_t *message) {
+    if (message->len != sm_page_size) return NULL;
+
+    return home_master(message->page);
+}
+
+/*
+ * Bring the page into place from its master copy, local if it is homed here and otherwise sent by its
+ * home. The page is left writable, the caller sets the access it is faulted in with.
+ */
+int sm_home_fetch(uint32_t page_n) {
+    msg_t *reply;
+    uint32_t seq;
+    int home = home_lookup(page_n), status;
+
+    if (home < 0) return -1;
+
+    if (home == sm_nid) {
+        pthread_mutex_lock(&home_lock);
+        mprotect(home_page(page_n), sm_page_size, PROT_READ|PROT_WRITE);
+        memcpy(home_page(page_n), home_master(page_n), sm_page_size);
+        home_count(page_n, sm_nid);
+        pthread_mutex_unlock(&home_lock);
+
+        home_stats.local++;
+        return 0;
+    }
+
+    /* The reply is received straight into place by sm_page_sink() */
+    status = sm_request(home_peers[home], sm_nid, SM_HOME_READ, page_n, NULL, 0, &seq);
+    if (status) return sm_fatal("failed to ask the page's home for it");
+
+    home_await(seq, &reply);
+    status = (reply->len == sm_page_size) ? 0 : sm_fatal("the page isn't at the home it was said to be");
+    sm_msg_free(reply);
+
+    home_stats.remote++;
+    return status;
+}
+
+int sm_home_read_fault(uint32_t page_n) {
+    if (sm_home_fetch(page_n)) return sm_fatal("failed to read fault");
+
+    mprotect(home_page(page_n), sm_page_size, PROT_READ);
+    sm_access[page_n] = SM_ACCESS_READ;
+
+    return 0;
+}
+
+/*
+ * Release the changes to a page, the diff is applied to the master copy here or sent to the page's
+ * home. The allocator is told at the next sm_home_release(), once the homes have applied them.
+ */
+int sm_home_diff(uint32_t page_n, const char *diff, uint32_t len) {
+    int home = home_lookup(page_n), status;
+
+    if (home < 0) return -1;
+
+    if (home == sm_nid) {
+        pthread_mutex_lock(&home_lock);
+        status = sm_patch(home_master(page_n), sm_page_size, diff, len) < 0;
+        if (!status) home_count(page_n, sm_nid);
+        pthread_mutex_unlock(&home_lock);
+
+        if (status) return sm_fatal("malformed diff");
+    } else {
+        status = sm_send(home_peers[home], sm_nid, SM_HOME_DIFF, page_n, diff, len);
+        if (status) return sm_fatal("failed to send diff");
+
+        home_flushing |= 1ULL << home;
+    }
+
+    if (home_n_notices == SM_MSG_MAX / 4 && sm_home_release()) return -1;
+    sm_put32(home_notices + home_n_notices++ * 4, page_n);
+
+    return 0;
+}
+
+/*
+ * Apply atomic operations to the master copy of a page, here or at the page's home, which sends back
+ * the old values. The page is released as if it had been written, its write notice goes out at the next
+ * sm_home_release().
+ */
+int sm_home_atomic(uint32_t page_n, const char *ops, uint32_t len, char *olds) {
+    msg_t *reply;
+    uint32_t seq;
+    int home = home_lookup(page_n), status;
+
+    if (home < 0) return -1;
+
+    if (home == sm_nid) {
+        pthread_mutex_lock(&home_lock);
+        status = sm_atomic_apply(home_master(page_n), sm_page_size, ops, len, olds) < 0;
+        if (!status) home_count(page_n, sm_nid);
+        pthread_mutex_unlock(&home_lock);
+
+        if (status) return sm_fatal("malformed atomic operations");
+    } else {
+        status = sm_request(home_peers[home], sm_nid, SM_ATOMIC, page_n, ops, len, &seq);
+        if (status) return sm_fatal("failed to send atomic operations to the page's home");
+
+        home_await(seq, &reply);
+        status = (reply->len == len / SM_ATOM_LEN * 8) ? 0 : sm_fatal("the page isn't at the home it was said to be");
+        if (!status) memcpy(olds, SM_MSG_BODY(reply), reply->len);
+        sm_msg_free(reply);
+
+        if (status) return -1;
+    }
+
+    if (home_n_notices == SM_MSG_MAX / 4 && sm_home_release()) return -1;
+    sm_put32(home_notices + home_n_notices++ * 4, page_n);
+
+    return 0;
+}
+
+/*
+ * Wait until every home sent diffs has applied them, then send the allocator the write notices for the
+ * pages, so that no node can be told of a change its home doesn't have yet
+ */
+int sm_home_release(void) {
+    uint32_t seqs[SM_MAX_NODES];
+    msg_t *reply;
+    int status;
+
+    for (int i = 0; i < sm_nodes; i++) {
+        if (!(home_flushing & (1ULL << i))) continue;
+
+        status = sm_request(home_peers[i], sm_nid, SM_HOME_FLUSH, 0, NULL, 0, &seqs[i]);
+        if (status) return sm_fatal("failed to flush diffs");
+    }
+    for (int i = 0; i < sm_nodes; i++) {
+        if (!(home_flushing & (1ULL << i))) continue;
+
+        home_await(seqs[i], &reply);
+        sm_msg_free(reply);
+    }
+    home_flushing = 0;
+
+    if (home_n_notices == 0) return 0;
+
+    status = sm_send(sm_sock, sm_nid, SM_NOTICE, 0, home_notices, home_n_notices * 4);
+    home_n_notices = 0;
+    if (status) return sm_fatal("failed to send write notices");
+
+    return 0;
+}
+
+/*
+ * Make the moves listed in a barrier's release. Each old home hands its master copy over and keeps its
+ * own copy of the page like any other node, each new home waits until it has all of its pages.
+ */
+static int home_move(const char *moves, uint32_t n_moves) {
+    uint32_t expected = 0;
+
+    for (uint32_t i = 0; i < n_moves; i++) {
+        uint32_t page_n = sm_get32(moves + i * 8), home = sm_get32(moves + i * 8 + 4);
+        int status;
+
+        if (page_n >= SM_NUM_PAGES || home >= (uint32_t) sm_nodes) continue;
+
+        if (home_of[page_n] == sm_nid) {
+            status = sm_send(home_peers[home], sm_nid, SM_HOME_GIVE, page_n, home_master(page_n), sm_page_size);
+            if (status) return sm_fatal("failed to hand a page over to its new home");
+
+            madvise(home_master(page_n), sm_page_size, MADV_DONTNEED);
+            home_stats.moved_out++;
+        } else if (home == (uint32_t) sm_nid) {
+            home_last[page_n]   = sm_nid;
+            home_streak[page_n] = 0;
+            expected++;
+        }
+        home_of[page_n] = home;
+    }
+
+    while (__atomic_load_n(&home_given, __ATOMIC_ACQUIRE) < expected) {
+        while (sem_wait(&home_ready) && errno == EINTR);
+    }
+    __atomic_sub_fetch(&home_given, expected, __ATOMIC_ACQ_REL);
+    home_stats.moved_in += expected;
+
+    return 0;
+}
+
+/*
+ * The first half of a barrier: release, then arrive with the moves proposed for the pages homed here.
+ * `seq' is set to the request the allocator's SM_BARR_REPLY answers.
+ */
+int sm_home_barrier_begin(uint32_t *seq) {
+    static char body[SM_HOME_MOVES_MAX * 8];
+    uint32_t len;
+
+    if (sm_lrc_flush()) return -1;
+
+    /* A proposal the allocator turns down is made again after another streak */
+    pthread_mutex_lock(&home_lock);
+    for (int i = 0; i < home_n_proposed; i++) {
+        sm_put32(body + i * 8, home_proposed[i * 2]);
+        sm_put32(body + i * 8 + 4, home_proposed[i * 2 + 1]);
+        home_streak[home_proposed[i * 2]] = 0;
+    }
+    len = home_n_proposed * 8;
+    home_n_proposed = 0;
+    pthread_mutex_unlock(&home_lock);
+
+    if (sm_request(sm_sock, sm_nid, SM_BARR, 0, body, len, seq)) return sm_fatal("failed to send barrier");
+
+    return 0;
+}
+
+/*
+ * The second half of a barrier, given its release: make the moves the allocator agreed to and take the
+ * write notices. If any page moved the nodes meet again before leaving, so that none of them asks a new
+ * home for a page it hasn't been handed yet.
+ */
+int sm_home_barrier_end(msg_t *message) {
+    const char *moves;
+    uint32_t n_moves;
+    int status;
+
+    n_moves = (message->len >= 4) ? sm_get32(SM_MSG_BODY(message)) : UINT32_MAX;
+    if (n_moves > SM_HOME_MOVES_MAX || message->len < 4 + n_moves * 8) return sm_fatal("malformed barrier release");
+    moves = SM_MSG_BODY(message) + 4;
+
+    status = home_move(moves, n_moves);
+    sm_lrc_notices(moves + n_moves * 8, message->len - 4 - n_moves * 8);
+    if (status || n_moves == 0) return status;
+
+    if (sm_call(SM_BARR, 0, NULL, 0, SM_BARR_REPLY, &message)) return -1;
+    if (message->len >= 4 && sm_get32(SM_MSG_BODY(message)) == 0) {
+        sm_lrc_notices(SM_MSG_BODY(message) + 4, message->len - 4);
+    }
+    sm_msg_free(message);
+
+    return 0;
+}
+
+/*
+ * Connect to the other nodes, before the progress thread takes over the allocator's socket
+ */
+int sm_home_init(void) {
+    home_masters = mmap(NULL, SM_NUM_PAGES * sm_page_size, PROT_READ|PROT_WRITE,
+                        MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if (home_masters == MAP_FAILED) return sm_fatal("failed to map master copies");
+
+    for (long p = 0; p < SM_NUM_PAGES; p++) {
+        home_of[p]   = -1;
+        home_last[p] = sm_nid;
+    }
+
+    return sm_peer_connect(home_peers);
+}
+
+/*
+ * Start the home thread, once the progress thread is sending to the allocator
+ */
+int sm_home_start(void) {
+    sigset_t all, previous;
+    int status;
+
+    if (sem_init(&home_ready, 0, 0)) return sm_fatal("failed to create the reply semaphore");
+    if (pipe(home_wake)) return sm_fatal("failed to create the home thread's pipe");
+    for (int i = 0; i < SM_MAX_NODES; i++) pthread_mutex_init(&home_send_locks[i], NULL);
+
+    home_writer   = sm_msg_writer;
+    sm_msg_writer = home_write;
+
+    /* Signals (faults in particular) are for the application thread */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &previous);
+    status = pthread_create(&home_thread, NULL, home_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+    if (status) {
+        sm_msg_writer = home_writer;
+        return sm_fatal("failed to start the home thread");
+    }
+
+    sm_home_active = 1;
+    return 0;
+}
+
+/*
+ * Stop the home thread once the allocator has acknowledged the node's exit
+ */
+void sm_home_exit(void) {
+    if (!sm_home_active) return;
+
+    close(home_wake[1]);
+    pthread_join(home_thread, NULL);
+    close(home_wake[0]);
+    sm_msg_writer = home_writer;
+
+    for (int i = 0; i < sm_nodes; i++) {
+        if (home_peers[i] >= 0) {
+            sm_msg_forget(home_peers[i]);
+            close(home_peers[i]);
+        }
+        home_peers[i] = -1;
+    }
+    while (home_n_replies > 0) sm_msg_free(home_replies[--home_n_replies]);
+    sem_destroy(&home_ready);
+    munmap(home_masters, SM_NUM_PAGES * sm_page_size);
+
+#ifdef SM_CHECK_COPIES
+    if (home_stats.local + home_stats.remote + home_stats.served > 0) {
+        fprintf(stderr, "node %d: %lu faults on pages homed here, %lu on pages homed elsewhere, served %lu pages "
+                "and %lu diffs, %lu homes moved here and %lu away\n", sm_nid, home_stats.local, home_stats.remote,
+                home_stats.served, home_stats.diffs, home_stats.moved_in, home_stats.moved_out);
+    }
+#endif
+
+    sm_home_active = 0;
+}
@@ -0,0 +1,227 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "sm.h"
+#include "sm_ext.h"
+#include "sm_lock.h"
+#include "sm_lrc.h"
+#include "sm_home.h"
+#include "sm_peer.h"
+#include "sm_progress.h"
+#include "config.h"
+
+/* What this node knows of each lock */
+static struct lock_state {
+    char     held;        /* This node holds the lock */
+    uint32_t seq;         /* The SM_LOCK of this node's latest hold */
+    uint32_t owed;        /* A hold released with nobody known to be next, the allocator may yet name someone */
+    int      next;        /* The node to hand the lock over to, -1 if none is known yet (dsm -d and -m) */
+    uint32_t next_seq;    /* The SM_LOCK it is waiting on */
+    char    *release;     /* {hold:32, offset:64, len:32, range *} as last released here, a grant from byte 4 */
+    uint32_t release_len;
+} lock_states[SM_LOCKS_MAX];
+
+/* The progress thread is told of the next holders (dsm -m), the SIGIO handler is blocked out instead */
+static pthread_mutex_t lock_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * The socket connected to another node, for handing a lock over
+ */
+static int lock_socket(int nid) {
+    return sm_peer_active ? sm_peer_socket(nid) : sm_home_socket(nid);
+}
+
+/*
+ * Hand the lock over to the next holder, with the range as it was released here. Called with lock_mutex
+ * held.
+ */
+static int lock_hand(uint32_t lock_n) {
+    struct lock_state *state = &lock_states[lock_n];
+    struct sm_frame frame = { lock_socket(state->next), sm_nid, SM_LOCK_GRANT, lock_n, state->release + 4,
+                              state->release_len - 4, state->next_seq };
+
+    state->next = -1;
+    return sm_send_all(&frame, 1);
+}
+
+/*
+ * The allocator names the node that asked for the lock after this node's hold `hold' (dsm -d and -m).
+ * If the hold has already been released the lock is handed over straight away.
+ */
+void sm_lock_next(msg_t *message) {
+    struct lock_state *state;
+    uint32_t hold;
+
+    if (message->page >= SM_LOCKS_MAX || message->len < 12) return;
+    state = &lock_states[message->page];
+    hold  = sm_get32(SM_MSG_BODY(message));
+
+    pthread_mutex_lock(&lock_mutex);
+    state->next     = sm_get32(SM_MSG_BODY(message) + 4);
+    state->next_seq = sm_get32(SM_MSG_BODY(message) + 8);
+
+    if (hold == state->owed) {
+        state->owed = 0;
+        if (lock_hand(message->page)) sm_fatal("failed to hand a lock over");
+    }
+    pthread_mutex_unlock(&lock_mutex);
+}
+
+/*
+ * Wait for the grant of the lock, from the allocator or the lock's last holder
+ */
+static int lock_await(uint32_t lock_n, uint32_t seq, msg_t **grant) {
+    if (sm_peer_active)     return sm_peer_await(SM_LOCK_GRANT, lock_n, grant);
+    if (sm_progress_active) return sm_progress_await(seq, grant);
+
+    return sm_recv_type(sm_sock, grant, SM_LOCK_GRANT);
+}
+
+int sm_lock_create (void) {
+    msg_t *reply;
+    sigset_t mask;
+    int status, lock;
+
+    sm_block_io(1, &mask);
+    status = sm_call(SM_LOCK_CREATE, 0, NULL, 0, SM_LOCK_CREATE_REPLY, &reply);
+    sm_block_io(0, &mask);
+    if (status) return -1;
+
+    lock = (int32_t) sm_get32(SM_MSG_BODY(reply));
+    sm_msg_free(reply);
+
+    return lock;
+}
+
+int sm_lock_bind (int lock, void *addr, size_t len) {
+    char body[16];
+    msg_t *reply;
+    sigset_t mask;
+    int status;
+
+    if (lock < 0 || lock >= SM_LOCKS_MAX) return sm_fatal("no such lock");
+    if (len > SM_LOCK_RANGE_MAX) return sm_fatal("range too large to bind to a lock");
+    if (len > 0 && ((char *) addr < sm_map || (char *) addr + len > sm_map + (long) SM_NUM_PAGES * sm_page_size))
+        return sm_fatal("lock bound to a range outside of shared memory");
+
+    sm_put32(body, lock);
+    sm_put64(body + 4, (len > 0) ? (char *) addr - sm_map : 0);
+    sm_put32(body + 12, len);
+
+    sm_block_io(1, &mask);
+    status = sm_call(SM_LOCK_BIND, 0, body, sizeof(body), SM_LOCK_BIND_REPLY, &reply);
+    sm_block_io(0, &mask);
+    if (status) return -1;
+
+    sm_msg_free(reply);
+    return 0;
+}
+
+void sm_lock (int lock) {
+    struct lock_state *state;
+    msg_t *grant;
+    uint64_t offset;
+    uint32_t seq, len;
+    sigset_t mask;
+    int status;
+
+    if (lock < 0 || lock >= SM_LOCKS_MAX || lock_states[lock].held) {
+        sm_fatal("no such lock, or this node already holds it");
+        return;
+    }
+    state = &lock_states[lock];
+
+    if (state->release == NULL && (state->release = malloc(16 + SM_LOCK_RANGE_MAX)) == NULL) {
+        sm_fatal("failed to allocate a lock's range");
+        return;
+    }
+
+    sm_block_io(1, &mask);
+
+    /* The allocator may name the next holder as soon as it has the request, the hold has to be known by then */
+    pthread_mutex_lock(&lock_mutex);
+    status = sm_request(sm_sock, sm_nid, SM_LOCK, lock, NULL, 0, &seq);
+    state->seq  = seq;
+    state->next = -1;
+    pthread_mutex_unlock(&lock_mutex);
+
+    if (status || lock_await(lock, seq, &grant)) {
+        sm_block_io(0, &mask);
+        sm_fatal("failed to take lock");
+        return;
+    }
+
+    /* The binding comes with every grant, and goes with the release */
+    offset = sm_get64(SM_MSG_BODY(grant));
+    len    = sm_get32(SM_MSG_BODY(grant) + 8);
+    memcpy(state->release + 4, SM_MSG_BODY(grant), 12);
+    state->held = 1;
+
+    /* A bound range is all there is to acquire, if it came with the grant, otherwise it is a full acquire */
+    if (sm_lrc_active && len > 0 && grant->len == 12 + len && offset + len <= (uint64_t) SM_NUM_PAGES * sm_page_size) {
+        if (sm_lrc_install(offset, SM_MSG_BODY(grant) + 12, len)) sm_fatal("failed to install a lock's range");
+    } else if (sm_lrc_active) {
+        sm_acquire();
+    }
+    sm_msg_free(grant);
+
+    sm_block_io(0, &mask);
+}
+
+void sm_unlock (int lock) {
+    struct lock_state *state;
+    uint64_t offset;
+    uint32_t len;
+    sigset_t mask;
+    int status = 0;
+
+    if (lock < 0 || lock >= SM_LOCKS_MAX || !lock_states[lock].held) {
+        sm_fatal("unlock of a lock this node doesn't hold");
+        return;
+    }
+    state = &lock_states[lock];
+
+    sm_block_io(1, &mask);
+
+    offset = sm_get64(state->release + 4);
+    len    = sm_get32(state->release + 12);
+    sm_put32(state->release, state->seq);
+    state->release_len = 16;
+
+    if (sm_lrc_active && len > 0) {
+        /* Only the bound range is released, and it goes along with the lock */
+        status = sm_lrc_flush_range(offset / sm_page_size, (offset + len - 1) / sm_page_size);
+        memcpy(state->release + 16, sm_map + offset, len);
+        state->release_len += len;
+    } else if (sm_lrc_active) {
+        status = sm_lrc_flush();
+
+        /* The homes' write notices are sent to the allocator, which has them once it answers an acquire,
+         * so the next holder can't acquire ahead of them */
+        if (!status && sm_home_active) sm_acquire();
+    }
+    state->held = 0;
+
+    /* Without a next holder known the allocator frees the lock, or has named one that is on its way */
+    pthread_mutex_lock(&lock_mutex);
+    if (state->next >= 0) {
+        status |= lock_hand(lock);
+    } else {
+        state->owed = state->seq;
+        status |= sm_send(sm_sock, sm_nid, SM_UNLOCK, lock, state->release, state->release_len);
+    }
+    pthread_mutex_unlock(&lock_mutex);
+
+    sm_block_io(0, &mask);
+    if (status) sm_fatal("failed to release lock");
+}
+
+void sm_lock_exit(void) {
+    for (int i = 0; i < SM_LOCKS_MAX; i++) {
+        free(lock_states[i].release);
+        lock_states[i].release = NULL;
+    }
+}
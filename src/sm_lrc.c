@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include <sys/mman.h>
+
+#include "sm.h"
+#include "sm_lrc.h"
+#include "sm_home.h"
+#include "sm_progress.h"
+#include "config.h"
+
+int sm_lrc_active = 0;
+
+static char     *sm_twins;                /* The twin of page p is at the same offset as p in here */
+static uint32_t  sm_dirty[SM_NUM_PAGES];  /* The pages written since the last release */
+static int       sm_n_dirty = 0;
+
+static char *lrc_page(uint32_t page_n) {
+    return sm_map + (long) page_n * sm_page_size;
+}
+
+static char *lrc_twin(uint32_t page_n) {
+    return sm_twins + (long) page_n * sm_page_size;
+}
+
+static void lrc_protect(uint32_t page_n, int access) {
+    int prot = (access == SM_ACCESS_WRITE) ? PROT_READ|PROT_WRITE :
+               (access == SM_ACCESS_READ)  ? PROT_READ : PROT_NONE;
+
+    mprotect(lrc_page(page_n), sm_page_size, prot);
+    sm_access[page_n] = access;
+}
+
+/*
+ * Send the diff of a written page to the allocator (or the page's home), the page drops back to
+ * read-only so that the next write takes a fresh twin
+ */
+static int lrc_flush_page(uint32_t page_n) {
+    char diff[SM_MSG_MAX];
+    uint32_t len = sm_diff(lrc_page(page_n), lrc_twin(page_n), sm_page_size, diff);
+
+    if (len > 0 && sm_home_active) {
+        if (sm_home_diff(page_n, diff, len)) return -1;
+    } else if (len > 0 && sm_send(sm_sock, sm_nid, SM_DIFF, page_n, diff, len)) {
+        return sm_fatal("failed to send diff");
+    }
+
+    lrc_protect(page_n, SM_ACCESS_READ);
+    return 0;
+}
+
+/*
+ * Bring a page this node has no copy of into place, from the allocator or the page's home. It is left
+ * writable for the caller to set its access.
+ */
+static int lrc_fetch(uint32_t page_n) {
+    msg_t *message;
+
+    if (sm_home_active) return sm_home_fetch(page_n);
+
+    if (sm_call(SM_READ, page_n, NULL, 0, SM_READ_REPLY, &message)) return -1;
+    sm_msg_free(message);
+
+    return 0;
+}
+
+/*
+ * The first write to a page since the last release, the page (fetched first if this node has no copy)
+ * is twinned and made writable, nothing is sent to any other node
+ */
+int sm_lrc_write_fault(uint32_t page_n) {
+    if (sm_access[page_n] == SM_ACCESS_NONE && lrc_fetch(page_n)) return sm_fatal("failed to write fault");
+
+    /* A page flushed early by an acquire can be listed again, make room by releasing everything */
+    if (sm_n_dirty == SM_NUM_PAGES && sm_lrc_flush()) return -1;
+
+    memcpy(lrc_twin(page_n), lrc_page(page_n), sm_page_size);
+    sm_dirty[sm_n_dirty++] = page_n;
+
+    lrc_protect(page_n, SM_ACCESS_WRITE);
+    sm_progress_done(page_n);
+    return 0;
+}
+
+/*
+ * Release, send the diffs of every page written since the last release. The allocator applies them
+ * before anything this node sends afterwards, so there is nothing to wait for, but the homes of dsm -m
+ * have to have applied theirs before the allocator is told of them. The diffs are queued, so each
+ * socket gets them with one write (together with whatever follows if the caller has corked too).
+ */
+int sm_lrc_flush(void) {
+    int status = 0;
+
+    sm_msg_cork();
+    for (int i = 0; i < sm_n_dirty && !status; i++) {
+        if (sm_access[sm_dirty[i]] != SM_ACCESS_WRITE) continue;
+        status = lrc_flush_page(sm_dirty[i]);
+    }
+    if (sm_msg_uncork() || status) return -1;
+
+    sm_n_dirty = 0;
+    return sm_home_active ? sm_home_release() : 0;
+}
+
+/*
+ * Release only the pages from `first' to `last', for a lock the range is bound to (sm_lock.c). The rest
+ * stay on the list for the next full release.
+ */
+int sm_lrc_flush_range(uint32_t first, uint32_t last) {
+    for (int i = 0; i < sm_n_dirty; i++) {
+        if (sm_dirty[i] < first || sm_dirty[i] > last || sm_access[sm_dirty[i]] != SM_ACCESS_WRITE) continue;
+        if (lrc_flush_page(sm_dirty[i])) return -1;
+    }
+
+    return sm_home_active ? sm_home_release() : 0;
+}
+
+/*
+ * Copy a range handed over with a lock into place. A page the range only covers part of is fetched
+ * first if this node has no copy, and a page being written has its twin patched too, so that the
+ * range's contents aren't released again as this node's own changes.
+ */
+int sm_lrc_install(uint64_t offset, const char *range, uint32_t len) {
+    uint64_t end = offset + len;
+
+    for (uint64_t at = offset; at < end;) {
+        uint32_t page_n = at / sm_page_size, skip = at % sm_page_size;
+        uint32_t n = (end - at < sm_page_size - skip) ? end - at : sm_page_size - skip;
+        int access = sm_access[page_n];
+
+        if (access == SM_ACCESS_NONE && n < sm_page_size && lrc_fetch(page_n)) return -1;
+
+        mprotect(lrc_page(page_n), sm_page_size, PROT_READ|PROT_WRITE);
+        memcpy(lrc_page(page_n) + skip, range + (at - offset), n);
+        if (access == SM_ACCESS_WRITE) memcpy(lrc_twin(page_n) + skip, range + (at - offset), n);
+
+        lrc_protect(page_n, (access == SM_ACCESS_WRITE) ? SM_ACCESS_WRITE : SM_ACCESS_READ);
+        if (access == SM_ACCESS_NONE) sm_progress_done(page_n);
+        at += n;
+    }
+
+    return 0;
+}
+
+/*
+ * Acquire, invalidate every page named in the write notices. A page this node is still writing has its
+ * own changes sent first so that they aren't lost.
+ */
+static void lrc_invalidate(uint32_t page_n) {
+    if (sm_access[page_n] == SM_ACCESS_WRITE) lrc_flush_page(page_n);
+    lrc_protect(page_n, SM_ACCESS_NONE);
+}
+
+void sm_lrc_notices(const char *notices, uint32_t len) {
+    for (uint32_t i = 0; i + 4 <= len; i += 4) {
+        uint32_t page_n = sm_get32(notices + i);
+
+        /* There were too many notices to list, drop every copy */
+        if (page_n == SM_NOTICE_ALL) {
+            for (page_n = 0; page_n < SM_NUM_PAGES; page_n++) {
+                if (sm_access[page_n] != SM_ACCESS_NONE) lrc_invalidate(page_n);
+            }
+            break;
+        }
+        if (page_n >= SM_NUM_PAGES) continue;
+
+        lrc_invalidate(page_n);
+    }
+
+    /* Changes flushed early are released at their homes straight away */
+    if (sm_home_active && sm_home_release()) sm_fatal("failed to release writes");
+}
+
+int sm_lrc_init(void) {
+    sm_twins = mmap(NULL, SM_NUM_PAGES * sm_page_size, PROT_READ|PROT_WRITE,
+                    MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if (sm_twins == MAP_FAILED) return sm_fatal("failed to map twins");
+
+    sm_lrc_active = 1;
+    return 0;
+}
+
+void sm_lrc_exit(void) {
+    if (!sm_lrc_active) return;
+
+    munmap(sm_twins, SM_NUM_PAGES * sm_page_size);
+    sm_lrc_active = 0;
+}
@@ -1,96 +1,904 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <signal.h>
+#include <pthread.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 #include "sm_message.h"
 #include "config.h"
 
-/* 
- * 
+void  (*sm_msg_unsolicited)(msg_t *message) = NULL;
+char *(*sm_msg_sink)(msg_t *message)        = NULL;
+int   (*sm_msg_writer)(int socket, struct iovec *iov, int iovcnt) = NULL;
+int   (*sm_msg_reader)(int socket, char *buffer, size_t len)     = NULL;
+
+struct sm_msg_stats sm_msg_stats;
+
+static uint32_t sm_msg_seq = 0; /* The sequence id given to the next request sent */
+
+#define SM_POOL_CLASSES 3      /* The sizes of message buffers pooled */
+#define SM_RING_LEN     0x4000 /* The bytes a socket's receive ring holds */
+#define SM_RING_VIEWS   64     /* The most messages handed out from one ring and not freed yet */
+#define SM_RING_SOCKETS 1024   /* Sockets below this descriptor get a receive ring */
+
+/*
+ * The message pool, for messages that don't fit in their socket's ring (or have none), a free list for
+ * each size of buffer holding no more than a few of them, so that the pool gives memory back once a burst
+ * is over. A list is held for a few instructions, so a thread that finds it taken just waits. A handler
+ * interrupting its own thread in the middle would wait for ever, so the signal whose handler takes and
+ * frees messages (SIGIO under dsm -d, see sm_msg_guard()) is blocked while a list is held.
+ */
+static const uint32_t sm_pool_sizes[SM_POOL_CLASSES] = { 256, 0x2000, SM_MSG_MAX };
+static const int      sm_pool_keep[SM_POOL_CLASSES]  = { 256, 32, 4 };
+
+static struct sm_pool {
+    char     taken;
+    int      n_free;
+    msg_t   *free;
+    uint64_t made;   /* The messages of this size malloc()ed */
+} sm_pools[SM_POOL_CLASSES];
+
+static int sm_pool_signal = 0; /* The signal blocked while a list is held, none if 0 */
+
+/*
+ * What has been read from a socket. The bodies of the frames received from it, up to the message's
+ * sm_msg_free(), are views into `bytes', which is taken in order and given back in the same order: the
+ * bytes held run from `head' to `tail', wrapping round once the end is reached. After the last body may
+ * come part or all of the next header, but never anything past it, since only that header says where the
+ * next body goes (the page it carries may go straight into place).
+ */
+struct sm_recv_ring {
+    uint32_t have;                  /* The bytes of `header' read so far */
+    char     header[HEADER_LEN];
+    uint32_t head, tail;
+    uint32_t first, next;           /* The views not taken back yet are views[first] up to views[next] */
+    msg_t    views[SM_RING_VIEWS];  /* Indexed modulo SM_RING_VIEWS */
+    char     bytes[SM_RING_LEN];
+};
+static struct sm_recv_ring *sm_rings[SM_RING_SOCKETS]; /* Indexed by socket, made on its first sm_recv() */
+
+#define SM_QUEUE_FRAMES 64    /* The most frames a thread queues before writing them out */
+#define SM_QUEUE_COPY   1024  /* Bodies up to this long are copied into the queue, longer ones are sent in place */
+#define SM_BATCH_FRAMES 512   /* The most frames of a batch written with one call (IOV_MAX is 1024) */
+
+/*
+ * The frames a thread has queued between sm_msg_cork() and sm_msg_uncork(), for any number of sockets.
+ * Only the few threads that ever cork (the allocator's and each node's main thread) have one, it is
+ * made the first time they do and kept for as long as the thread runs.
+ */
+struct sm_queue {
+    int          corked;
+    int          n_frames;
+    uint32_t     used;                              /* The bytes of `copies' in use */
+    int          sockets[SM_QUEUE_FRAMES];
+    struct sm_header headers[SM_QUEUE_FRAMES];
+    struct iovec bodies[SM_QUEUE_FRAMES];
+    char         copies[SM_QUEUE_FRAMES * SM_QUEUE_COPY]; /* The short bodies */
+};
+static __thread struct sm_queue *sm_queue = NULL;
+
+void sm_put32(char *buffer, uint32_t value) {
+    value = htole32(value);
+    memcpy(buffer, &value, sizeof(value));
+}
+
+void sm_put64(char *buffer, uint64_t value) {
+    value = htole64(value);
+    memcpy(buffer, &value, sizeof(value));
+}
+
+uint32_t sm_get32(const char *buffer) {
+    uint32_t value;
+    memcpy(&value, buffer, sizeof(value));
+    return le32toh(value);
+}
+
+uint64_t sm_get64(const char *buffer) {
+    uint64_t value;
+    memcpy(&value, buffer, sizeof(value));
+    return le64toh(value);
+}
+
+/*
+ * Encode the bytes of the page that differ from its twin as runs of {offset:16, len:16, bytes}, the
+ * runs are exact as other nodes may have changed the bytes in between. Returns the encoded length.
+ */
+uint32_t sm_diff(const char *page, const char *twin, uint32_t size, char *diff) {
+    uint32_t len = 0, i = 0, start;
+    uint64_t a, b;
+
+    while (i < size) {
+        /* Skip unchanged words quickly */
+        if ((i & 7) == 0 && i + 8 <= size) {
+            memcpy(&a, page + i, 8);
+            memcpy(&b, twin + i, 8);
+            if (a == b) {
+                i += 8;
+                continue;
+            }
+        }
+        if (page[i] == twin[i]) {
+            i++;
+            continue;
+        }
+
+        start = i;
+        while (i < size && page[i] != twin[i]) i++;
+
+        diff[len]     = start & 0xff;
+        diff[len + 1] = start >> 8;
+        diff[len + 2] = (i - start) & 0xff;
+        diff[len + 3] = (i - start) >> 8;
+        memcpy(diff + len + 4, page + start, i - start);
+        len += 4 + (i - start);
+    }
+
+    return len;
+}
+
+/*
+ * Write the runs of a diff over the page, returns the number of bytes written or -1 if the diff is
+ * malformed
+ */
+int sm_patch(char *page, uint32_t size, const char *diff, uint32_t len) {
+    int bytes = 0;
+
+    for (uint32_t i = 0; i + 4 <= len; ) {
+        uint32_t offset = (uint8_t) diff[i] | (uint8_t) diff[i + 1] << 8;
+        uint32_t run    = (uint8_t) diff[i + 2] | (uint8_t) diff[i + 3] << 8;
+
+        if (offset + run > size || i + 4 + run > len) return -1;
+        memcpy(page + offset, diff + i + 4, run);
+
+        bytes += run;
+        i += 4 + run;
+    }
+
+    return bytes;
+}
+
+/*
+ * Apply the operations to the words of the page in order, atomically so that a page other processes
+ * map as well (dsm -s) stays coherent, writing each word's old value to `olds'. Returns the number of
+ * operations or -1 if they are malformed.
+ */
+int sm_atomic_apply(char *page, uint32_t size, const char *ops, uint32_t len, char *olds) {
+    int n_ops = 0;
+
+    if (len % SM_ATOM_LEN != 0 || len > SM_ATOMIC_MAX * SM_ATOM_LEN) return -1;
+
+    for (uint32_t i = 0; i < len; i += SM_ATOM_LEN) {
+        uint32_t offset = (uint8_t) ops[i] | (uint8_t) ops[i + 1] << 8;
+        uint8_t  op = ops[i + 2], width = ops[i + 3];
+        uint64_t value = sm_get64(ops + i + 4), compare = sm_get64(ops + i + 12), old;
+
+        if ((width != 4 && width != 8) || offset % width != 0 || offset + width > size || op > SM_ATOM_CAS)
+            return -1;
+
+        if (width == 4) {
+            uint32_t *word = (uint32_t *) (page + offset), expected = compare;
+
+            if (op == SM_ATOM_ADD)       old = __atomic_fetch_add(word, (uint32_t) value, __ATOMIC_SEQ_CST);
+            else if (op == SM_ATOM_SWAP) old = __atomic_exchange_n(word, (uint32_t) value, __ATOMIC_SEQ_CST);
+            else {
+                __atomic_compare_exchange_n(word, &expected, (uint32_t) value, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+                old = expected;
+            }
+        } else {
+            uint64_t *word = (uint64_t *) (page + offset), expected = compare;
+
+            if (op == SM_ATOM_ADD)       old = __atomic_fetch_add(word, value, __ATOMIC_SEQ_CST);
+            else if (op == SM_ATOM_SWAP) old = __atomic_exchange_n(word, value, __ATOMIC_SEQ_CST);
+            else {
+                __atomic_compare_exchange_n(word, &expected, value, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+                old = expected;
+            }
+        }
+
+        sm_put64(olds + n_ops++ * 8, old);
+    }
+
+    return n_ops;
+}
+
+/*
+ * Encode the header fields into their little-endian wire format
+*/
+static void sm_header_encode(struct sm_header *header, int nid, int type, uint32_t page,
+                             uint32_t seq, uint32_t len) {
+    header->version = SM_MSG_VERSION;
+    header->type    = type;
+    header->nid     = htole16((int16_t) nid);
+    header->len     = htole32(len);
+    header->page    = htole32(page);
+    header->seq     = htole32(seq);
+}
+
+/*
+ * Decode the header into the message's fields, returns 1 if it is malformed
 */
-msg_t *sm_msg_create(char nid, char type, char buffer[]) {
-    msg_t *message = malloc(sizeof(msg_t));
-    memset(message, 0, sizeof(msg_t));
+static int sm_msg_decode(msg_t *message, const char *buffer) {
+    struct sm_header header;
 
-    message->buffer[0] = message->type = type;
-    message->buffer[1] = message->len  = (char) (strlen(buffer) + HEADER_LEN);
-    message->buffer[2] = message->nid  = nid;
+    memcpy(&header, buffer, HEADER_LEN);
+    if (header.version != SM_MSG_VERSION) return 1;
 
-    /* Fill the rest of the buffer with the message to be passed */
-    if (buffer != NULL) {
-        for (int i = 0; i < SM_MSG_MAX && i < strlen(buffer); i++) 
-            message->buffer[i + 3] = buffer[i];
+    message->type = header.type;
+    message->nid  = (int16_t) le16toh(header.nid);
+    message->len  = le32toh(header.len);
+    message->page = le32toh(header.page);
+    message->seq  = le32toh(header.seq);
+
+    return (message->len > SM_MSG_MAX);
+}
+
+/*
+ * Block the signal whose handler takes and frees messages while a list of the pool is held, for every
+ * thread from here on
+*/
+void sm_msg_guard(int signo) {
+    sm_pool_signal = signo;
+}
+
+/*
+ * Hold the pool's list, with the guarded signal blocked until sm_pool_release()
+*/
+static void sm_pool_hold(struct sm_pool *pool, sigset_t *previous) {
+    sigset_t set;
+
+    if (sm_pool_signal) {
+        sigemptyset(&set);
+        sigaddset(&set, sm_pool_signal);
+        pthread_sigmask(SIG_BLOCK, &set, previous);
+    }
+
+    while (__atomic_test_and_set(&pool->taken, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(&pool->taken, __ATOMIC_RELAXED)) __builtin_ia32_pause();
     }
+}
+
+static void sm_pool_release(struct sm_pool *pool, sigset_t *previous) {
+    __atomic_clear(&pool->taken, __ATOMIC_RELEASE);
+
+    if (sm_pool_signal) pthread_sigmask(SIG_SETMASK, previous, NULL);
+}
+
+/*
+ * Take a message with room for a body of `len' bytes from the pool, returns NULL if there is none and
+ * none can be made
+*/
+msg_t *sm_msg_alloc(uint32_t len) {
+    struct sm_pool *pool;
+    msg_t *message;
+    sigset_t previous;
+    int size = 0;
+
+    if (len > SM_MSG_MAX) return NULL;
+    while (sm_pool_sizes[size] < len) size++;
+    pool = &sm_pools[size];
+
+    sm_pool_hold(pool, &previous);
+    message = pool->free;
+    if (message != NULL) {
+        pool->free = message->pool_next;
+        pool->n_free--;
+    }
+    sm_pool_release(pool, &previous);
+
+    if (message == NULL) {
+        message = malloc(sizeof(msg_t) + sm_pool_sizes[size]);
+        if (message == NULL) return NULL;
+        __atomic_add_fetch(&sm_msg_stats.allocations, 1, __ATOMIC_RELAXED);
+        if (__atomic_fetch_add(&pool->made, 1, __ATOMIC_RELAXED) > 0) {
+            __atomic_add_fetch(&sm_msg_stats.refills, 1, __ATOMIC_RELAXED);
+        }
+        message->pool = size;
+    }
+
+    message->ring = NULL;
+    message->body = (char *) (message + 1);
+    message->len  = 0;
 
     return message;
 }
 
+/*
+ * A pooled copy of the message, for a receiver that hands the same message to several others
+*/
+msg_t *sm_msg_copy(const msg_t *message) {
+    msg_t *copy = sm_msg_alloc(message->len);
+
+    if (copy == NULL) return NULL;
+
+    copy->type = message->type;
+    copy->nid  = message->nid;
+    copy->len  = message->len;
+    copy->page = message->page;
+    copy->seq  = message->seq;
+    memcpy(copy->body, message->body, message->len);
+
+    return copy;
+}
+
+/*
+ * Whether the message's body was received straight to its sm_msg_sink() destination, as every page is
+ * (an empty body is too). Other frames the same thread receives meanwhile don't affect it, unlike the
+ * counters.
+*/
+int sm_msg_in_place(const msg_t *message) {
+    if (message->len == 0) return 1;
+
+    if (message->ring != NULL) return message->body != message->ring->bytes + message->at;
+    return message->body != (char *) (message + 1);
+}
+
+/*
+ * Give a message back: a view to its ring, which takes it back once those before it have been freed too,
+ * and any other to the pool unless the pool has enough of its size already
+*/
 int sm_msg_free(msg_t *message) {
-    free(message->buffer);
-    free(message);
+    struct sm_pool *pool;
+    sigset_t previous;
+    int kept;
 
+    if (message == NULL) return 0;
+
+    if (message->ring != NULL) {
+        __atomic_store_n(&message->released, 1, __ATOMIC_RELEASE);
+        return 0;
+    }
+
+    pool = &sm_pools[message->pool];
+    sm_pool_hold(pool, &previous);
+    kept = (pool->n_free < sm_pool_keep[message->pool]);
+    if (kept) {
+        message->pool_next = pool->free;
+        pool->free = message;
+        pool->n_free++;
+    }
+    sm_pool_release(pool, &previous);
+
+    if (!kept) free(message);
     return 0;
 }
 
 /*
- * Return 0 if all bytes are successfully sent, otherwise returns 1
+ * Write every byte described by the io vector to the socket with sendmsg() `flags', returns 1 on failure
 */
-int sm_send(int socket, char nid, char type, char buffer[]) {
-    msg_t *message = sm_msg_create(nid, type, buffer);
-    int sent = 0, bytes = 0;
+static int sm_writev_flags(int socket, struct iovec *iov, int iovcnt, int flags) {
+    struct msghdr header = { .msg_iov = iov, .msg_iovlen = iovcnt };
+    ssize_t bytes;
+
+    while (header.msg_iovlen > 0) {
+        bytes = sendmsg(socket, &header, MSG_NOSIGNAL | flags);
+        __atomic_add_fetch(&sm_msg_stats.send_calls, 1, __ATOMIC_RELAXED);
+        if (bytes < 0 && errno == EINTR) continue;
+        if (bytes <= 0) return 1;
 
-    while (sent < message->len) {
-        bytes = send(socket, message->buffer + sent, message->len - sent, 0);
-        sent += bytes;
+        /* Skip past whatever was written, the kernel may stop part way through a vector */
+        while (header.msg_iovlen > 0 && (size_t) bytes >= header.msg_iov->iov_len) {
+            bytes -= header.msg_iov->iov_len;
+            header.msg_iov++, header.msg_iovlen--;
+        }
+        if (header.msg_iovlen > 0) {
+            header.msg_iov->iov_base = (char *) header.msg_iov->iov_base + bytes;
+            header.msg_iov->iov_len -= bytes;
+        }
     }
 
-    if (message != NULL) free(message);
+    return 0;
+}
 
-    return (sent != message->len);
+/*
+ * Write every byte described by the io vector to the socket, returns 1 on failure
+*/
+int sm_writev_all(int socket, struct iovec *iov, int iovcnt) {
+    return sm_writev_flags(socket, iov, iovcnt, 0);
 }
 
 /*
- * 
+ * Write whole frames, as (header, body) pairs of the io vector, to the socket. `more' tells the kernel
+ * the rest of the batch follows straight away (MSG_MORE), so it doesn't push out a partial segment.
 */
-int sm_recv(int socket, msg_t **buffer) {
-    memset(*buffer, 0, sizeof(msg_t));
-    /* Allocate memory for the message */
-    msg_t *message = malloc(sizeof(msg_t));
+static int sm_write_frames(int socket, struct iovec *iov, int iovcnt, int more) {
+    if (sm_msg_writer != NULL) return sm_msg_writer(socket, iov, iovcnt);
 
-    /* Receive the message header */
-    int status = recv(socket, message->buffer, HEADER_LEN, MSG_WAITALL);
-    if (status == 0) {
-        return 1;
+    return sm_writev_flags(socket, iov, iovcnt, more ? MSG_MORE : 0);
+}
+
+/*
+ * The socket's receive ring, made if it has none yet. Returns NULL if it can't have one.
+*/
+static struct sm_recv_ring *sm_ring(int socket) {
+    struct sm_recv_ring *ring;
+
+    if (socket < 0 || socket >= SM_RING_SOCKETS) return NULL;
+    if (sm_rings[socket] != NULL) return sm_rings[socket];
+
+    ring = malloc(sizeof(struct sm_recv_ring));
+    if (ring == NULL) return NULL;
+    __atomic_add_fetch(&sm_msg_stats.rings, 1, __ATOMIC_RELAXED);
+
+    ring->have  = 0;
+    ring->head  = ring->tail = 0;
+    ring->first = ring->next = 0;
+    sm_rings[socket] = ring;
+
+    return ring;
+}
+
+/*
+ * Take back the bytes of the views at the front of the ring that have been freed
+*/
+static void sm_ring_reclaim(struct sm_recv_ring *ring) {
+    while (ring->first != ring->next &&
+           __atomic_load_n(&ring->views[ring->first % SM_RING_VIEWS].released, __ATOMIC_ACQUIRE)) {
+        ring->first++;
     }
 
-    /* Extract the metadata from the received message */
-    message->type   = message->buffer[0];
-    message->len    = message->buffer[1];
-    message->nid    = message->buffer[2];
+    if (ring->first == ring->next) ring->head = ring->tail = 0;
+    else ring->head = ring->views[ring->first % SM_RING_VIEWS].at;
+}
+
+/*
+ * A message whose body is the next `len' bytes of the ring, NULL if the ring is too full of messages
+ * that haven't been freed yet
+*/
+static msg_t *sm_ring_view(struct sm_recv_ring *ring, uint32_t len) {
+    msg_t *view;
+    uint32_t at;
+
+    sm_ring_reclaim(ring);
+    if (ring->next - ring->first == SM_RING_VIEWS) return NULL;
+
+    /* The bytes held either run from head to tail, or from head to the end and on from the start */
+    if (ring->tail >= ring->head) {
+        if (ring->tail + len <= SM_RING_LEN) at = ring->tail;
+        else if (len < ring->head) at = 0;
+        else return NULL;
+    } else if (ring->tail + len < ring->head) {
+        at = ring->tail;
+    } else {
+        return NULL;
+    }
+
+    view = &ring->views[ring->next++ % SM_RING_VIEWS];
+    view->ring     = ring;
+    view->at       = at;
+    view->released = 0;
+    view->body     = ring->bytes + at;
+    ring->tail     = at + len;
+
+    return view;
+}
+
+/*
+ * Receive the rest of the next header into the ring, returns 1 on failure or EOF
+*/
+static int sm_ring_header(int socket, struct sm_recv_ring *ring) {
+    struct iovec iov;
+    struct msghdr header = { .msg_iov = &iov, .msg_iovlen = 1 };
+    ssize_t bytes;
+
+    while (ring->have < HEADER_LEN) {
+        iov.iov_base = ring->header + ring->have;
+        iov.iov_len  = HEADER_LEN - ring->have;
+
+        bytes = recvmsg(socket, &header, 0);
+        __atomic_add_fetch(&sm_msg_stats.recv_calls, 1, __ATOMIC_RELAXED);
+        if (bytes < 0 && errno == EINTR) continue;
+        if (bytes <= 0) return 1;
+        ring->have += bytes;
+    }
+
+    return 0;
+}
+
+/*
+ * Receive a body of `len' bytes straight into `body', and as much of the header after it as has
+ * arrived into the ring along with it (the header the ring held has been decoded). Returns 1 on
+ * failure or EOF.
+*/
+static int sm_ring_body(int socket, struct sm_recv_ring *ring, char *body, uint32_t len) {
+    struct iovec iov[2];
+    struct msghdr header = { .msg_iov = iov, .msg_iovlen = 2 };
+    uint32_t recvd = 0;
+    ssize_t bytes;
+
+    ring->have = 0;
+    while (recvd < len) {
+        iov[0].iov_base = body + recvd;
+        iov[0].iov_len  = len - recvd;
+        iov[1].iov_base = ring->header;
+        iov[1].iov_len  = HEADER_LEN;
+
+        bytes = recvmsg(socket, &header, 0);
+        __atomic_add_fetch(&sm_msg_stats.recv_calls, 1, __ATOMIC_RELAXED);
+        if (bytes < 0 && errno == EINTR) continue;
+        if (bytes <= 0) return 1;
+
+        if ((uint32_t) bytes > len - recvd) ring->have = bytes - (len - recvd);
+        recvd += (uint32_t) bytes - ring->have;
+    }
 
-    /* Receive the message body */
-    int recvd = 0, bytes = 0; // TODO: Allocate more memory when required
-    while (recvd < message->len - HEADER_LEN) {
-        bytes = recv(socket, &(message->buffer[HEADER_LEN + recvd]), 
-                    message->len - HEADER_LEN - recvd, MSG_WAITALL);
+    return 0;
+}
+
+/*
+ * Read exactly `len' bytes from the socket into `buffer', whatever its receive ring holds first. Returns
+ * 1 on failure or EOF.
+*/
+int sm_read_all(int socket, char *buffer, size_t len) {
+    struct sm_recv_ring *ring = (socket >= 0 && socket < SM_RING_SOCKETS) ? sm_rings[socket] : NULL;
+    struct iovec iov;
+    struct msghdr header = { .msg_iov = &iov, .msg_iovlen = 1 };
+    size_t recvd = 0;
+    ssize_t bytes;
+
+    /* What the ring holds is the start of a header, so it is only ever asked for along with the rest */
+    if (ring != NULL && ring->have > 0) {
+        recvd = (ring->have < len) ? ring->have : len;
+        memcpy(buffer, ring->header, recvd);
+        memmove(ring->header, ring->header + recvd, ring->have - recvd);
+        ring->have -= recvd;
+    }
+
+    while (recvd < len) {
+        iov.iov_base = buffer + recvd;
+        iov.iov_len  = len - recvd;
+
+        bytes = recvmsg(socket, &header, MSG_WAITALL);
+        __atomic_add_fetch(&sm_msg_stats.recv_calls, 1, __ATOMIC_RELAXED);
+        if (bytes < 0 && errno == EINTR) continue;
+        if (bytes <= 0) return 1;
         recvd += bytes;
     }
 
+    return 0;
+}
+
+/*
+ * Write out every frame the thread has queued, each socket's frames with one call in the order they
+ * were queued. Returns 1 if any of them failed.
+*/
+int sm_msg_flush(void) {
+    struct sm_queue *queue = sm_queue;
+    struct iovec iov[2 * SM_QUEUE_FRAMES];
+    char sent[SM_QUEUE_FRAMES] = { 0 };
+    int failed = 0;
+
+    if (queue == NULL) return 0;
+
+    for (int i = 0; i < queue->n_frames; i++) {
+        int iovcnt = 0;
+
+        if (sent[i]) continue;
+
+        for (int j = i; j < queue->n_frames; j++) {
+            if (sent[j] || queue->sockets[j] != queue->sockets[i]) continue;
+
+            iov[iovcnt].iov_base   = &queue->headers[j];
+            iov[iovcnt++].iov_len  = HEADER_LEN;
+            iov[iovcnt++]          = queue->bodies[j];
+            sent[j] = 1;
+        }
+        failed |= sm_write_frames(queue->sockets[i], iov, iovcnt, 0);
+    }
+
+    queue->n_frames = 0;
+    queue->used     = 0;
+    return failed;
+}
+
+/*
+ * Queue the thread's frames from here on, until the matching sm_msg_uncork() (calls nest). A thread
+ * whose queue can't be made sends each frame straight away as if it weren't corked.
+*/
+void sm_msg_cork(void) {
+    if (sm_queue == NULL) {
+        sm_queue = calloc(1, sizeof(struct sm_queue));
+        if (sm_queue == NULL) return;
+        __atomic_add_fetch(&sm_msg_stats.allocations, 1, __ATOMIC_RELAXED);
+    }
+
+    sm_queue->corked++;
+}
+
+/*
+ * Stop queueing and write out the queued frames, returns 1 if any of them failed
+*/
+int sm_msg_uncork(void) {
+    if (sm_queue == NULL || --sm_queue->corked > 0) return 0;
+
+    return sm_msg_flush();
+}
+
+/*
+ * Queue a frame. A short body is copied, a longer one (e.g. a page) is written in place straight away
+ * and takes the frames queued ahead of it along.
+*/
+static int sm_queue_frame(int socket, struct sm_header *header, const void *body, uint32_t len) {
+    struct sm_queue *queue = sm_queue;
+    int i;
+
+    if (queue->n_frames == SM_QUEUE_FRAMES || (len <= SM_QUEUE_COPY && queue->used + len > sizeof(queue->copies))) {
+        if (sm_msg_flush()) return 1;
+    }
+
+    i = queue->n_frames++;
+    queue->sockets[i] = socket;
+    queue->headers[i] = *header;
+
+    if (len > SM_QUEUE_COPY) {
+        queue->bodies[i] = (struct iovec) { (void *) body, len };
+        return sm_msg_flush();
+    }
+
+    if (len > 0) memcpy(queue->copies + queue->used, body, len);
+    queue->bodies[i] = (struct iovec) { queue->copies + queue->used, len };
+    queue->used += len;
+
+    return 0;
+}
+
+/*
+ * Send a header and body as one frame, the body is handed to the kernel in place unless it is short
+ * and the thread is queueing its frames
+*/
+static int sm_send_frame(int socket, int nid, int type, uint32_t page, uint32_t seq,
+                         const void *body, uint32_t len) {
+    struct sm_header header;
+    struct iovec iov[2];
+
+    if (body == NULL) len = 0;
+    if (len > SM_MSG_MAX) return 1;
+
+    sm_header_encode(&header, nid, type, page, seq, len);
+
+    __atomic_add_fetch(&sm_msg_stats.sent_bytes, len, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&sm_msg_stats.sent_frames, 1, __ATOMIC_RELAXED);
+    if (sm_queue != NULL && sm_queue->corked) return sm_queue_frame(socket, &header, body, len);
+
+    iov[0].iov_base = &header;
+    iov[0].iov_len  = HEADER_LEN;
+    iov[1].iov_base = (void *) body;
+    iov[1].iov_len  = len;
+
+    return sm_write_frames(socket, iov, 2, 0);
+}
+
+/*
+ * Send a single framed message, return 0 if all bytes are successfully sent, otherwise returns 1
+*/
+int sm_send(int socket, int nid, int type, uint32_t page, const void *body, uint32_t len) {
+    return sm_send_frame(socket, nid, type, page, __atomic_add_fetch(&sm_msg_seq, 1, __ATOMIC_RELAXED),
+                         body, len);
+}
+
+/*
+ * Send a request whose reply will echo its sequence id, which is returned in `seq'
+*/
+int sm_request(int socket, int nid, int type, uint32_t page, const void *body, uint32_t len, uint32_t *seq) {
+    *seq = __atomic_add_fetch(&sm_msg_seq, 1, __ATOMIC_RELAXED);
+
+    return sm_send_frame(socket, nid, type, page, *seq, body, len);
+}
+
+/*
+ * Send a reply to `request', echoing its page and sequence id
+*/
+int sm_reply(int socket, msg_t *request, int nid, int type, const void *body, uint32_t len) {
+    return sm_send_frame(socket, nid, type, request->page, request->seq, body, len);
+}
+
+/*
+ * Send a batch of frames (e.g. the release of a barrier to every node). The headers are all encoded
+ * up front and each socket's frames are then written with one call, in the order they are in the batch,
+ * so an event engine that queues its sends submits the whole batch at once. Anything the thread has
+ * queued goes first. Returns 1 if any frame failed, the rest are still sent.
+ */
+int sm_send_all(struct sm_frame *frames, int n_frames) {
+    struct sm_header headers[n_frames > 0 ? n_frames : 1];
+    char sent[n_frames > 0 ? n_frames : 1];
+    struct iovec iov[2 * SM_BATCH_FRAMES];
+    int failed = 0;
+
+    for (int i = 0; i < n_frames; i++) {
+        if (frames[i].body == NULL) frames[i].len = 0;
+        if (frames[i].len > SM_MSG_MAX) return 1;
+
+        sm_header_encode(&headers[i], frames[i].nid, frames[i].type, frames[i].page,
+                         frames[i].seq ? frames[i].seq : __atomic_add_fetch(&sm_msg_seq, 1, __ATOMIC_RELAXED),
+                         frames[i].len);
+        sent[i] = 0;
+    }
+
+    if (sm_queue != NULL && sm_queue->n_frames > 0) failed |= sm_msg_flush();
+
+    for (int i = 0; i < n_frames; i++) {
+        int iovcnt = 0, last = i;
+
+        if (sent[i]) continue;
+
+        for (int j = i; j < n_frames; j++) {
+            if (frames[j].socket == frames[i].socket && !sent[j]) last = j;
+        }
+
+        for (int j = i; j <= last; j++) {
+            if (sent[j] || frames[j].socket != frames[i].socket) continue;
+
+            iov[iovcnt].iov_base   = &headers[j];
+            iov[iovcnt++].iov_len  = HEADER_LEN;
+            iov[iovcnt].iov_base   = (void *) frames[j].body;
+            iov[iovcnt++].iov_len  = frames[j].len;
+            sent[j] = 1;
+
+            __atomic_add_fetch(&sm_msg_stats.sent_bytes, frames[j].len, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&sm_msg_stats.sent_frames, 1, __ATOMIC_RELAXED);
+
+            /* A long run goes out in parts, every part but the last marked as having more to come */
+            if (iovcnt == 2 * SM_BATCH_FRAMES || j == last) {
+                failed |= sm_write_frames(frames[i].socket, iov, iovcnt, j < last);
+                iovcnt = 0;
+            }
+        }
+    }
+
+    return failed;
+}
+
+/*
+ * The message for the frame with this header, whose body is to be received to its `body': wherever
+ * sm_msg_sink says, otherwise a view into the socket's ring if it has one with room left, otherwise the
+ * message's own buffer. Returns NULL if the header is malformed or there is no message to be had.
+*/
+static msg_t *sm_msg_receive(struct sm_recv_ring *ring, const char *header) {
+    msg_t frame = { .body = NULL, .ring = NULL }, *message = NULL;
+    char *destination = NULL;
+
+    if (sm_msg_decode(&frame, header)) return NULL;
+
+    if (frame.len > 0 && sm_msg_sink != NULL) destination = sm_msg_sink(&frame);
+
+    if (ring != NULL) message = sm_ring_view(ring, destination ? 0 : frame.len);
+    if (message == NULL) {
+        message = sm_msg_alloc(destination ? 0 : frame.len);
+        if (message == NULL) return NULL;
+        if (ring != NULL) __atomic_add_fetch(&sm_msg_stats.pooled, 1, __ATOMIC_RELAXED);
+    }
+
+    message->type = frame.type;
+    message->nid  = frame.nid;
+    message->len  = frame.len;
+    message->page = frame.page;
+    message->seq  = frame.seq;
+
+    if (destination != NULL) {
+        message->body = destination;
+        __atomic_add_fetch(&sm_msg_stats.direct_bytes, message->len, __ATOMIC_RELAXED);
+    } else if (message->len > 0) {
+        __atomic_add_fetch(&sm_msg_stats.buffered_bytes, message->len, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&sm_msg_stats.buffered_copies, 1, __ATOMIC_RELAXED);
+    }
+
+    return message;
+}
+
+/*
+ * Begin receiving a frame whose header has been read, for a receiver with buffering of its own (e.g. an
+ * io_uring). The body is to be received to the message's body.
+*/
+msg_t *sm_msg_begin(const char *header) {
+    return sm_msg_receive(NULL, header);
+}
+
+/*
+ * Receive a single framed message, the caller must release it with sm_msg_free(). Each body is received
+ * with the header after it, so a frame costs one call once the one ahead of it has been received, and
+ * the body goes wherever sm_msg_sink() says without passing through the ring. Any other body is a view
+ * into the ring, which holds it until it is freed; a frame that finds the ring full of messages still
+ * held gets a pooled message instead.
+*/
+int sm_recv(int socket, msg_t **buffer) {
+    struct sm_recv_ring *ring;
+    char header[HEADER_LEN];
+    msg_t *message;
+
+    /* Nothing the thread has queued may wait behind the read */
+    if (sm_queue != NULL && sm_queue->n_frames > 0 && sm_msg_flush()) return 1;
+
+    /* A reader hook has its own buffering, it is asked for the header and then the body */
+    ring = (sm_msg_reader == NULL) ? sm_ring(socket) : NULL;
+    if (ring == NULL) {
+        int (*read_all)(int, char *, size_t) = (sm_msg_reader != NULL) ? sm_msg_reader : sm_read_all;
+
+        if (read_all(socket, header, HEADER_LEN)) return 1;
+
+        message = sm_msg_receive(NULL, header);
+        if (message == NULL) return 1;
+
+        if (read_all(socket, message->body, message->len)) {
+            sm_msg_free(message);
+            return 1;
+        }
+
+        *buffer = message;
+        return 0;
+    }
+
+    if (sm_ring_header(socket, ring)) return 1;
+
+    message = sm_msg_receive(ring, ring->header);
+    if (message == NULL || sm_ring_body(socket, ring, message->body, message->len)) {
+        ring->have = 0;
+        sm_msg_free(message);
+        return 1;
+    }
+
     *buffer = message;
-    return (recvd != message->len);
+    return 0;
 }
 
-/* Receive a message of a specific type */
+/*
+ * Whether the socket's receive ring holds anything, which poll() can't see
+*/
+int sm_msg_buffered(int socket) {
+    struct sm_recv_ring *ring;
+
+    if (socket < 0 || socket >= SM_RING_SOCKETS) return 0;
+
+    ring = sm_rings[socket];
+    return (ring != NULL && ring->have > 0);
+}
+
+/*
+ * poll() for reading message sockets. Sockets whose receive rings hold something are ready at once
+ * (and the others are left for the next call), otherwise it is poll() itself.
+*/
+int sm_msg_poll(struct pollfd *fds, nfds_t n_fds, int timeout) {
+    int ready = 0;
+
+    for (nfds_t i = 0; i < n_fds; i++) {
+        fds[i].revents = sm_msg_buffered(fds[i].fd) ? POLLIN : 0;
+        if (fds[i].revents) ready++;
+    }
+    if (ready > 0) return ready;
+
+    return poll(fds, n_fds, timeout);
+}
+
+/*
+ * Drop whatever the socket's receive ring holds, for a socket being closed
+*/
+void sm_msg_forget(int socket) {
+    if (socket < 0 || socket >= SM_RING_SOCKETS || sm_rings[socket] == NULL) return;
+
+    sm_rings[socket]->have = 0;
+}
+
+/*
+ * Receive a message of a specific type, any other messages received in the meantime are passed to
+ * sm_msg_unsolicited (or dropped if there is no handler)
+*/
 int sm_recv_type(int socket, msg_t **buffer, int type) {
-    /* Allocate memory for the message */
-    msg_t *message = malloc(sizeof(msg_t));
+    msg_t *message;
+
+    while (1) {
+        int status = sm_recv(socket, &message);
+        if (status) return status;
 
-    int status = sm_recv(socket, &message);
-    if (status) return status;
+        if (message->type == type) break;
+
+        if (sm_msg_unsolicited != NULL) sm_msg_unsolicited(message);
+        sm_msg_free(message);
+    }
 
     *buffer = message;
-    return (message->type == type);
-}
\ No newline at end of file
+    return 0;
+}
@@ -0,0 +1,935 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <errno.h>
+
+#include "sm.h"
+#include "sm_peer.h"
+#include "sm_lock.h"
+#include "config.h"
+
+/*
+ * How long a node holds on to a page it has just faulted in before serving the requests for it which
+ * arrived in the meantime, so that the faulting instruction can complete before the page moves on
+ */
+#define SM_PEER_HOLD_NS 100000
+
+#define SM_PEER_DEFER_MAX (SM_MAX_NODES * 2) /* A request and an invalidation from each node at most */
+#define SM_PEER_EARLY_MAX (2 * (SM_MAX_NODES + 1)) /* An arrival from each child and the parent's release,
+                                                    * for a barrier and a broadcast */
+
+int sm_peer_active = 0;
+
+static int      sm_peers[SM_MAX_NODES];          /* The socket connected to each other node */
+static int16_t  sm_prob_owner[SM_NUM_PAGES];     /* The node believed to own each page */
+static uint64_t sm_copyset[SM_NUM_PAGES];        /* The nodes with read copies, kept by the owner */
+static char     sm_owned[SM_NUM_PAGES];          /* Whether this node owns each page */
+
+static uint32_t sm_pending_page = UINT32_MAX;    /* The page this node is currently faulting on */
+static int      sm_pending_type = SM_ACCESS_NONE;
+
+static msg_t   *sm_deferred[SM_PEER_DEFER_MAX];  /* Requests held back until the fault completes */
+static int      sm_n_deferred = 0;
+
+static msg_t   *sm_early[SM_PEER_EARLY_MAX];     /* Tree messages received before this node got there */
+static int      sm_n_early = 0;
+
+static int      sm_fanout = 2;                   /* The fan-out of the barrier and broadcast tree */
+
+/* The barrier and the broadcast this node is taking part in, at most one of each. The SIGIO handler moves
+ * them along as their tree messages arrive, so a node doesn't hold up its subtree between the two phases
+ * of a split barrier (sm_barrier_begin()). */
+static struct peer_collective {
+    int      active;
+    int      waiting;    /* The children yet to arrive */
+    int      arrived;    /* This node has arrived at its parent, or node 0 at the allocator */
+    int      done;       /* The release has come down the tree */
+    int      has_value;  /* The root's value is in `value' */
+    uint64_t value;
+} sm_collectives[2];
+
+/* The buffer broadcast (sm_bcast_buf()) this node is receiving, if `id' isn't 0. Its chunks are received
+ * straight into `buf'; those of broadcasts this node hasn't reached yet are held until it does. */
+static struct peer_bcast {
+    uint32_t id;         /* The seq its chunks carry, the broadcast's number and its root */
+    char    *buf;
+    uint64_t len;
+    uint32_t n_chunks;
+    uint32_t received;
+} sm_incoming;
+
+static uint32_t sm_bcast_count = 0;              /* The buffer broadcasts this node has taken part in */
+static msg_t  **sm_bcast_held = NULL;            /* Chunks of broadcasts this node hasn't reached yet */
+static int      sm_bcast_n_held = 0, sm_bcast_max_held = 0;
+
+static timer_t  sm_hold_timer;
+
+static char *peer_page(uint32_t page_n) {
+    return sm_map + (long) page_n * sm_page_size;
+}
+
+static void peer_protect(uint32_t page_n, int access) {
+    int prot = (access == SM_ACCESS_WRITE) ? PROT_READ|PROT_WRITE :
+               (access == SM_ACCESS_READ)  ? PROT_READ : PROT_NONE;
+
+    mprotect(peer_page(page_n), sm_page_size, prot);
+    sm_access[page_n] = access;
+}
+
+/*
+ * Serve a read or write request that has reached this node, forwarding it towards the owner if this
+ * node doesn't own the page
+ */
+static void peer_request(msg_t *message) {
+    uint32_t page_n = message->page;
+    int requester = sm_get32(SM_MSG_BODY(message)), status;
+    char body[8];
+
+    if (requester < 0 || requester >= sm_nodes || sm_peers[requester] < 0) return;
+
+    if (!sm_owned[page_n]) {
+        int owner = sm_prob_owner[page_n];
+
+        status = sm_send(sm_peers[owner], sm_nid, message->type, page_n, SM_MSG_BODY(message), 4);
+        if (status) sm_fatal("failed to forward request");
+
+        /* The requester will own the page once the request gets there */
+        if (message->type == SM_PEER_WRIT) sm_prob_owner[page_n] = requester;
+        return;
+    }
+
+    /* The owner always holds a valid copy, make sure it can be read to send it */
+    if (sm_access[page_n] != SM_ACCESS_READ) peer_protect(page_n, SM_ACCESS_READ);
+
+    status = sm_send(sm_peers[requester], sm_nid, SM_PEER_PAGE, page_n, peer_page(page_n), sm_page_size);
+    if (status) sm_fatal("failed to send page");
+
+    if (message->type == SM_PEER_READ) {
+        sm_copyset[page_n] |= 1ULL << requester;
+        return;
+    }
+
+    /* Hand over ownership, the new owner invalidates the remaining copies itself */
+    sm_put64(body, sm_copyset[page_n] & ~(1ULL << requester));
+    status = sm_send(sm_peers[requester], sm_nid, SM_PEER_OWNER, page_n, body, sizeof(body));
+    if (status) sm_fatal("failed to send ownership");
+
+    sm_owned[page_n]      = 0;
+    sm_copyset[page_n]    = 0;
+    sm_prob_owner[page_n] = requester;
+    peer_protect(page_n, SM_ACCESS_NONE);
+}
+
+/*
+ * Apply atomic operations to the page for another node, forwarding them towards the owner if this node
+ * doesn't own the page. An owner that has handed out read copies can't invalidate them from here, it
+ * answers without any old values and the requester takes ownership to apply the operations itself.
+ */
+static void peer_atomic(msg_t *message) {
+    static char olds[SM_ATOMIC_MAX * 8];
+    uint32_t page_n = message->page;
+    int requester = (message->len >= 4) ? (int) sm_get32(SM_MSG_BODY(message)) : -1;
+    int access = sm_access[page_n], n_ops = 0, status;
+
+    if (requester < 0 || requester >= sm_nodes || sm_peers[requester] < 0) return;
+
+    if (!sm_owned[page_n]) {
+        status = sm_send(sm_peers[sm_prob_owner[page_n]], sm_nid, SM_PEER_ATOMIC, page_n, SM_MSG_BODY(message),
+                         message->len);
+        if (status) sm_fatal("failed to forward atomic operations");
+        return;
+    }
+
+    if (!(sm_copyset[page_n] & ~(1ULL << sm_nid))) {
+        if (access != SM_ACCESS_WRITE) mprotect(peer_page(page_n), sm_page_size, PROT_READ|PROT_WRITE);
+        n_ops = sm_atomic_apply(peer_page(page_n), sm_page_size, SM_MSG_BODY(message) + 4, message->len - 4, olds);
+        if (access != SM_ACCESS_WRITE) peer_protect(page_n, access);
+
+        if (n_ops < 0) n_ops = 0;
+    }
+
+    status = sm_send(sm_peers[requester], sm_nid, SM_ATOMIC_REPLY, page_n, olds, n_ops * 8);
+    if (status) sm_fatal("failed to send atomic results");
+}
+
+/*
+ * Drop this node's read copy of the page for its new owner
+ */
+static void peer_invalidate(msg_t *message) {
+    peer_protect(message->page, SM_ACCESS_NONE);
+    sm_prob_owner[message->page] = message->nid;
+
+    if (sm_send(sm_peers[message->nid], sm_nid, SM_PEER_INV_REPLY, message->page, NULL, 0)) {
+        sm_fatal("failed to acknowledge invalidation");
+    }
+}
+
+/*
+ * The collective of the kind (SM_BARR or SM_CAST)
+ */
+static struct peer_collective *peer_collective(int kind) {
+    return &sm_collectives[kind == SM_CAST];
+}
+
+/*
+ * Move the collective along with the tree messages that have arrived for it: take in the children's
+ * arrivals, arrive at the parent once they are all in, and pass the release on to the children
+ */
+static int peer_advance(int kind) {
+    struct peer_collective *collective = peer_collective(kind);
+    int first = sm_nid * sm_fanout + 1, last = first + sm_fanout, release = -1, status;
+    char body[12];
+
+    if (!collective->active || collective->done) return 0;
+    if (last > sm_nodes) last = sm_nodes;
+
+    for (int i = 0; i < sm_n_early; i++) {
+        msg_t *message = sm_early[i];
+
+        if (message->type == SM_TREE_UP && message->page == (uint32_t) kind && collective->waiting > 0) {
+            if (message->len >= 12 && sm_get32(SM_MSG_BODY(message))) {
+                collective->has_value = 1;
+                collective->value     = sm_get64(SM_MSG_BODY(message) + 4);
+            }
+            collective->waiting--;
+        } else if (collective->arrived && release < 0 &&
+                   ((message->type == SM_TREE_DOWN && message->page == (uint32_t) kind) ||
+                    (sm_nid == 0 && message->type == ((kind == SM_CAST) ? SM_CAST_REPLY : SM_BARR_REPLY)))) {
+            release = (message->len >= 8) ? 1 : 0;
+            if (release) collective->value = sm_get64(SM_MSG_BODY(message));
+        } else {
+            continue;
+        }
+
+        sm_msg_free(message);
+        sm_early[i--] = sm_early[--sm_n_early];
+    }
+
+    /* The whole subtree is in, node 0 arrives at the allocator for everyone */
+    if (!collective->arrived && collective->waiting == 0) {
+        sm_put32(body, collective->has_value);
+        sm_put64(body + 4, collective->value);
+
+        if (sm_nid != 0) {
+            status = sm_send(sm_peers[(sm_nid - 1) / sm_fanout], sm_nid, SM_TREE_UP, kind, body, 12);
+        } else if (kind == SM_CAST) {
+            sm_put32(body, 0);
+            status = sm_send(sm_sock, sm_nid, SM_CAST, 0, body, 12);
+        } else {
+            status = sm_send(sm_sock, sm_nid, SM_BARR, 0, NULL, 0);
+        }
+        if (status) return sm_fatal("failed to send arrival");
+
+        collective->arrived = 1;
+        return peer_advance(kind);
+    }
+    if (release < 0) return 0;
+
+    sm_put64(body, collective->value);
+    for (int child = first; child < last; child++) {
+        if (sm_peers[child] < 0) continue;
+
+        status = sm_send(sm_peers[child], sm_nid, SM_TREE_DOWN, kind, body, 8);
+        if (status) return sm_fatal("failed to send release");
+    }
+    collective->done = 1;
+
+    return 0;
+}
+
+/*
+ * Pass a chunk of a buffer broadcast on to this node's children in the tree rooted at the broadcast's
+ * root (the barrier's tree, with the nodes numbered from the root)
+ */
+static int peer_bcast_forward(uint32_t id, uint32_t chunk, const char *data, uint32_t len) {
+    struct sm_frame frames[SM_MAX_NODES];
+    int root = id % SM_MAX_NODES, self = (sm_nid - root + sm_nodes) % sm_nodes, n_frames = 0;
+
+    for (int child = self * sm_fanout + 1; child <= self * sm_fanout + sm_fanout && child < sm_nodes; child++) {
+        int nid = (child + root) % sm_nodes;
+
+        if (sm_peers[nid] < 0) continue;
+
+        frames[n_frames++] = (struct sm_frame) { sm_peers[nid], sm_nid, SM_TREE_DATA, chunk, data, len, id };
+    }
+
+    return sm_send_all(frames, n_frames);
+}
+
+/*
+ * Where a chunk of the buffer broadcast in progress goes in its buffer, NULL if it is for another one
+ */
+static char *peer_bcast_place(msg_t *message) {
+    uint64_t offset = (uint64_t) message->page * SM_BULK_MAX;
+
+    if (sm_incoming.id == 0 || message->seq != sm_incoming.id || message->page >= sm_incoming.n_chunks) return NULL;
+    if (message->len != ((sm_incoming.len - offset < SM_BULK_MAX) ? sm_incoming.len - offset : SM_BULK_MAX)) return NULL;
+
+    return sm_incoming.buf + offset;
+}
+
+/*
+ * A chunk of a buffer broadcast, passed on at once whether or not this node has reached the broadcast.
+ * Returns 1 if it is held until it does.
+ */
+static int peer_bcast_chunk(msg_t *message) {
+    char *place = peer_bcast_place(message);
+
+    if (peer_bcast_forward(message->seq, message->page, place ? place : SM_MSG_BODY(message), message->len))
+        sm_fatal("failed to pass on a broadcast");
+
+    /* It was received straight into place by sm_peer_sink() */
+    if (place != NULL) {
+        sm_incoming.received++;
+        return 0;
+    }
+
+    if (sm_bcast_n_held == sm_bcast_max_held) {
+        int max = sm_bcast_max_held ? sm_bcast_max_held * 2 : SM_MAX_NODES;
+        msg_t **grown = realloc(sm_bcast_held, max * sizeof(msg_t *));
+
+        if (grown == NULL) {
+            sm_fatal("failed to hold a broadcast");
+            _exit(EXIT_FAILURE);
+        }
+        sm_bcast_held     = grown;
+        sm_bcast_max_held = max;
+    }
+    sm_bcast_held[sm_bcast_n_held++] = message;
+
+    return 1;
+}
+
+/*
+ * Serve a message from another node, returns 1 if it has been deferred (and must not be freed)
+ */
+static int peer_serve(msg_t *message) {
+    int pending = (message->page == sm_pending_page);
+
+    if (message->page >= SM_NUM_PAGES || message->nid < 0 || message->nid >= sm_nodes) return 0;
+
+    switch (message->type) {
+        case SM_PEER_READ:
+        case SM_PEER_WRIT:
+            /* This node is about to become the owner, the request has to wait until it is */
+            if (pending && sm_pending_type == SM_ACCESS_WRITE) break;
+
+            peer_request(message);
+            return 0;
+        case SM_PEER_ATOMIC:
+            if (pending && sm_pending_type == SM_ACCESS_WRITE) break;
+
+            peer_atomic(message);
+            return 0;
+        case SM_PEER_INV:
+            /* The page on its way to this node is already out of date, drop it once it has been used */
+            if (pending && sm_pending_type == SM_ACCESS_READ) break;
+
+            peer_invalidate(message);
+            return 0;
+        case SM_LOCK_NEXT:
+            sm_lock_next(message);
+            return 0;
+        case SM_REDUCE_DATA:
+            sm_reduce_serve(message);
+            return 0;
+        case SM_TREE_DATA:
+            return peer_bcast_chunk(message);
+        case SM_TREE_UP:
+        case SM_TREE_DOWN:
+        case SM_BARR_REPLY:
+        case SM_CAST_REPLY:
+            /* Part of a barrier or broadcast, kept until this node has reached it */
+            if (sm_n_early == SM_PEER_EARLY_MAX) {
+                sm_fatal("too many early tree messages");
+                _exit(EXIT_FAILURE);
+            }
+            sm_early[sm_n_early++] = message;
+
+            peer_advance(SM_BARR);
+            peer_advance(SM_CAST);
+            return 1;
+        default:
+            return 0;
+    }
+
+    if (sm_n_deferred == SM_PEER_DEFER_MAX) {
+        sm_fatal("too many deferred requests");
+        _exit(EXIT_FAILURE);
+    }
+    sm_deferred[sm_n_deferred++] = message;
+
+    return 1;
+}
+
+/*
+ * Whether a deferred request has to keep waiting for the fault in progress. An invalidation only waits
+ * for the page it invalidates to arrive, once it has the new owner may well be waiting on it.
+ */
+static int peer_held(msg_t *message) {
+    if (message->page != sm_pending_page) return 0;
+
+    return message->type != SM_PEER_INV || sm_pending_type == SM_ACCESS_READ;
+}
+
+/*
+ * Serve the deferred requests for every page except the one currently being faulted on
+ */
+static void peer_drain() {
+    int kept = 0;
+
+    for (int i = 0; i < sm_n_deferred; i++) {
+        msg_t *message = sm_deferred[i];
+
+        if (peer_held(message)) {
+            sm_deferred[kept++] = message;
+            continue;
+        }
+
+        if (message->type == SM_PEER_INV)         peer_invalidate(message);
+        else if (message->type == SM_PEER_ATOMIC) peer_atomic(message);
+        else                                      peer_request(message);
+        sm_msg_free(message);
+    }
+
+    sm_n_deferred = kept;
+}
+
+/*
+ * Apply the invalidations of the page deferred by the last fault on it before faulting on it again: the
+ * node that sent them owns the page now and won't serve this node until it has dropped its copy
+ */
+static void peer_settle(uint32_t page_n) {
+    int kept = 0;
+
+    for (int i = 0; i < sm_n_deferred; i++) {
+        msg_t *message = sm_deferred[i];
+
+        if (message->page != page_n || message->type != SM_PEER_INV) {
+            sm_deferred[kept++] = message;
+            continue;
+        }
+
+        peer_invalidate(message);
+        sm_msg_free(message);
+    }
+
+    sm_n_deferred = kept;
+}
+
+/*
+ * Finish a fault, the deferred requests for the page are served once the hold time has passed
+ */
+static void peer_done(uint32_t page_n, int access) {
+    struct itimerspec hold = { .it_value.tv_nsec = SM_PEER_HOLD_NS };
+
+    peer_protect(page_n, access);
+    sm_pending_page = UINT32_MAX;
+    sm_pending_type = SM_ACCESS_NONE;
+
+    if (sm_n_deferred > 0) timer_settime(sm_hold_timer, 0, &hold, NULL);
+}
+
+/*
+ * Receive a message from the socket (index 0 is the allocator, otherwise the peer index - 1). Returns
+ * 1 if there is no message, a closed peer just means that node has exited.
+ */
+static int peer_recv(int index, msg_t **message) {
+    int socket = index ? sm_peers[index - 1] : sm_sock;
+
+    if (sm_recv(socket, message) == 0) return 0;
+
+    if (index == 0) {
+        sm_fatal("lost connection to the allocator");
+        _exit(EXIT_FAILURE);
+    }
+
+    sm_msg_forget(socket);
+    close(socket);
+    sm_peers[index - 1] = -1;
+    return 1;
+}
+
+/*
+ * Frames left in a receive ring when a wait returns raise no SIGIO of their own, so the handler is
+ * raised for them once it is unblocked
+ */
+static void peer_strand(void) {
+    int buffered = sm_msg_buffered(sm_sock);
+
+    for (int i = 0; i < sm_nodes && !buffered; i++) buffered = sm_msg_buffered(sm_peers[i]);
+
+    if (buffered) raise(SIGIO);
+}
+
+static int peer_pollfds(struct pollfd *fds) {
+    fds[0].fd = sm_sock;
+    fds[0].events = POLLIN;
+
+    for (int i = 0; i < sm_nodes; i++) {
+        fds[i + 1].fd = sm_peers[i];
+        fds[i + 1].events = POLLIN;
+    }
+
+    return sm_nodes + 1;
+}
+
+/*
+ * Wait for a message of the given type for the page (from the allocator or any node), serving every
+ * other message in the meantime
+ */
+int sm_peer_await(int type, uint32_t page, msg_t **reply) {
+    struct pollfd fds[SM_MAX_NODES + 1];
+    msg_t *message;
+    int n_fds = peer_pollfds(fds);
+
+    if (sm_msg_flush()) return sm_fatal("failed to send queued messages");
+
+    /* It may have arrived while this node was doing something else */
+    for (int i = 0; i < sm_n_early; i++) {
+        if (sm_early[i]->type == type && sm_early[i]->page == page) {
+            *reply = sm_early[i];
+            sm_early[i] = sm_early[--sm_n_early];
+            return 0;
+        }
+    }
+
+    while (1) {
+        peer_drain();
+
+        if (sm_msg_poll(fds, n_fds, -1) < 0) {
+            if (errno == EINTR) continue;
+            return sm_fatal("poll() failed");
+        }
+
+        for (int i = 0; i < n_fds; i++) {
+            if (!(fds[i].revents & (POLLIN|POLLHUP|POLLERR))) continue;
+
+            if (peer_recv(i, &message)) {
+                fds[i].fd = -1;
+                continue;
+            }
+
+            if (message->type == type && message->page == page) {
+                *reply = message;
+                peer_strand();
+                return 0;
+            }
+
+            if (!peer_serve(message)) sm_msg_free(message);
+        }
+    }
+}
+
+/*
+ * Serve every message that has arrived (and any deferred request whose hold time has passed), called
+ * from the SIGIO handler
+ */
+void sm_peer_poll(void) {
+    struct pollfd fds[SM_MAX_NODES + 1];
+    msg_t *message;
+    int n_fds = peer_pollfds(fds);
+
+    peer_drain();
+
+    while (sm_msg_poll(fds, n_fds, 0) > 0) {
+        for (int i = 0; i < n_fds; i++) {
+            if (!(fds[i].revents & (POLLIN|POLLHUP|POLLERR))) continue;
+
+            if (peer_recv(i, &message)) {
+                fds[i].fd = -1;
+                continue;
+            }
+            if (!peer_serve(message)) sm_msg_free(message);
+        }
+    }
+}
+
+int sm_peer_read_fault(uint32_t page_n) {
+    msg_t *reply;
+    char body[4];
+    int status;
+
+    /* The owner always has a valid copy, it just hasn't been mapped in yet */
+    if (sm_owned[page_n]) {
+        peer_protect(page_n, SM_ACCESS_READ);
+        return 0;
+    }
+
+    peer_settle(page_n);
+    sm_pending_page = page_n;
+    sm_pending_type = SM_ACCESS_READ;
+
+    sm_put32(body, sm_nid);
+    status = sm_send(sm_peers[sm_prob_owner[page_n]], sm_nid, SM_PEER_READ, page_n, body, sizeof(body));
+    if (status) return sm_fatal("failed to send read request");
+
+    /* The page is received straight into place, the owner that sent it is the best hint there is */
+    status = sm_peer_await(SM_PEER_PAGE, page_n, &reply);
+    if (status) return sm_fatal("failed to receive page");
+
+    sm_prob_owner[page_n] = reply->nid;
+    sm_msg_free(reply);
+
+    peer_done(page_n, SM_ACCESS_READ);
+    return 0;
+}
+
+int sm_peer_write_fault(uint32_t page_n) {
+    msg_t *reply;
+    char body[4];
+    int status, copies = 0;
+    uint64_t copyset;
+
+    peer_settle(page_n);
+    sm_pending_page = page_n;
+    sm_pending_type = SM_ACCESS_WRITE;
+
+    /* Take ownership (and the page) from the current owner */
+    if (!sm_owned[page_n]) {
+        sm_put32(body, sm_nid);
+        status = sm_send(sm_peers[sm_prob_owner[page_n]], sm_nid, SM_PEER_WRIT, page_n, body, sizeof(body));
+        if (status) return sm_fatal("failed to send write request");
+
+        status = sm_peer_await(SM_PEER_OWNER, page_n, &reply);
+        if (status) return sm_fatal("failed to receive ownership");
+
+        sm_copyset[page_n] = sm_get64(SM_MSG_BODY(reply));
+        sm_owned[page_n]   = 1;
+        sm_msg_free(reply);
+    }
+
+    /* Invalidate every read copy, the acknowledgements can come back in any order */
+    copyset = sm_copyset[page_n] & ~(1ULL << sm_nid);
+    for (int i = 0; i < sm_nodes; i++) {
+        if (!(copyset & (1ULL << i)) || sm_peers[i] < 0) continue;
+
+        status = sm_send(sm_peers[i], sm_nid, SM_PEER_INV, page_n, NULL, 0);
+        if (status) return sm_fatal("failed to send invalidation");
+        copies++;
+    }
+
+    while (copies-- > 0) {
+        status = sm_peer_await(SM_PEER_INV_REPLY, page_n, &reply);
+        if (status) return sm_fatal("failed to receive invalidation acknowledgement");
+        sm_msg_free(reply);
+    }
+
+    sm_copyset[page_n]    = 0;
+    sm_prob_owner[page_n] = sm_nid;
+
+    peer_done(page_n, SM_ACCESS_WRITE);
+    return 0;
+}
+
+/*
+ * Apply atomic operations to the page at its owner, which sends back the old values. If the owner has
+ * read copies out (or this node is the owner) the operations are applied here, with ownership of the
+ * page taken as for a write.
+ */
+int sm_peer_atomic(uint32_t page_n, const char *ops, uint32_t len, char *olds) {
+    static char body[4 + SM_ATOMIC_MAX * SM_ATOM_LEN];
+    msg_t *reply;
+    int status;
+
+    if (!sm_owned[page_n]) {
+        sm_put32(body, sm_nid);
+        memcpy(body + 4, ops, len);
+        status = sm_send(sm_peers[sm_prob_owner[page_n]], sm_nid, SM_PEER_ATOMIC, page_n, body, 4 + len);
+        if (status) return sm_fatal("failed to send atomic operations");
+
+        status = sm_peer_await(SM_ATOMIC_REPLY, page_n, &reply);
+        if (status) return sm_fatal("failed to receive atomic results");
+
+        sm_prob_owner[page_n] = reply->nid;
+        status = (reply->len == len / SM_ATOM_LEN * 8);
+        if (status) memcpy(olds, SM_MSG_BODY(reply), reply->len);
+        sm_msg_free(reply);
+
+        if (status) return 0;
+    }
+
+    if (sm_access[page_n] != SM_ACCESS_WRITE && sm_peer_write_fault(page_n)) return -1;
+    if (sm_atomic_apply(peer_page(page_n), sm_page_size, ops, len, olds) < 0)
+        return sm_fatal("malformed atomic operations");
+
+    return 0;
+}
+
+/*
+ * Wait for messages and serve them all, the SIGIO handler being blocked
+ */
+static int peer_wait(void) {
+    struct pollfd fds[SM_MAX_NODES + 1];
+    msg_t *message;
+    int n_fds = peer_pollfds(fds);
+
+    if (sm_msg_flush()) return sm_fatal("failed to send queued messages");
+    peer_drain();
+
+    if (sm_msg_poll(fds, n_fds, -1) < 0) return (errno == EINTR) ? 0 : sm_fatal("poll() failed");
+
+    for (int i = 0; i < n_fds; i++) {
+        if (!(fds[i].revents & (POLLIN|POLLHUP|POLLERR))) continue;
+
+        if (peer_recv(i, &message)) continue;
+        if (!peer_serve(message)) sm_msg_free(message);
+    }
+    peer_strand();
+
+    return 0;
+}
+
+/*
+ * Start a barrier (kind SM_BARR) or broadcast (kind SM_CAST) combined along a tree of the nodes, node i
+ * being the parent of nodes i * fanout + 1 to i * fanout + fanout. Each node arrives at its parent once
+ * its whole subtree has, node 0 arrives at the allocator for everyone and the release then travels back
+ * down. The root's value travels up with the arrivals and down with the release. The collective moves
+ * along as its messages arrive, whether or not this node is waiting for it.
+ */
+int sm_peer_begin(int kind, uint64_t value, int root) {
+    struct peer_collective *collective = peer_collective(kind);
+    int first = sm_nid * sm_fanout + 1, last = first + sm_fanout;
+
+    if (last > sm_nodes) last = sm_nodes;
+
+    *collective = (struct peer_collective) { 1, (last > first) ? last - first : 0, 0, 0, sm_nid == root, value };
+
+    return peer_advance(kind);
+}
+
+/*
+ * Returns whether the collective has completed (its value in `value'), serving whatever has arrived
+ */
+int sm_peer_test(int kind, uint64_t *value) {
+    struct peer_collective *collective = peer_collective(kind);
+
+    sm_peer_poll();
+    if (!collective->done) return 0;
+
+    collective->active = 0;
+    *value = collective->value;
+    return 1;
+}
+
+/*
+ * Wait for the collective to complete, serving every other message in the meantime
+ */
+int sm_peer_end(int kind, uint64_t *value) {
+    struct peer_collective *collective = peer_collective(kind);
+
+    while (!collective->done) {
+        if (peer_wait()) return -1;
+    }
+
+    collective->active = 0;
+    *value = collective->value;
+    return 0;
+}
+
+/*
+ * Broadcast `len' bytes at `buf' (at most SM_REDUCE_CHUNKS chunks) from the root along the tree of the
+ * nodes numbered from it. Every node passes each chunk on to its children the moment it arrives, so the
+ * chunks stream down every level of the tree at once and the root only sends to its own children.
+ */
+int sm_peer_bcast(char *buf, uint64_t len, int root) {
+    uint32_t n_chunks = (len + SM_BULK_MAX - 1) / SM_BULK_MAX, id;
+
+    /* Every node numbers the broadcasts alike, none is numbered 0 */
+    sm_bcast_count = sm_bcast_count % (UINT32_MAX / SM_MAX_NODES) + 1;
+    id = sm_bcast_count * SM_MAX_NODES + root;
+
+    if (sm_nid == root) {
+        for (uint32_t chunk = 0; chunk < n_chunks; chunk++) {
+            uint64_t offset = (uint64_t) chunk * SM_BULK_MAX;
+
+            if (peer_bcast_forward(id, chunk, buf + offset, (len - offset < SM_BULK_MAX) ? len - offset : SM_BULK_MAX))
+                return sm_fatal("failed to send a broadcast");
+        }
+        return 0;
+    }
+
+    sm_incoming = (struct peer_bcast) { id, buf, len, n_chunks, 0 };
+
+    /* The chunks which arrived before this node got here have been passed on already */
+    for (int i = 0; i < sm_bcast_n_held; i++) {
+        msg_t *message = sm_bcast_held[i];
+        char *place = peer_bcast_place(message);
+
+        if (place == NULL) continue;
+
+        memcpy(place, SM_MSG_BODY(message), message->len);
+        sm_incoming.received++;
+        sm_msg_free(message);
+        sm_bcast_held[i--] = sm_bcast_held[--sm_bcast_n_held];
+    }
+
+    while (sm_incoming.received < sm_incoming.n_chunks) {
+        if (peer_wait()) {
+            sm_incoming.id = 0;
+            return -1;
+        }
+    }
+    sm_incoming.id = 0;
+
+    return 0;
+}
+
+/*
+ * Chunks of the buffer broadcast in progress go straight to their place in its buffer
+ */
+char *sm_peer_sink(msg_t *message) {
+    return peer_bcast_place(message);
+}
+
+/*
+ * The socket connected to another node, locks are handed over on it too (sm_lock.c)
+ */
+int sm_peer_socket(int nid) {
+    return sm_peers[nid];
+}
+
+static int peer_socket_options(int socket) {
+    fcntl(socket, F_SETOWN, getpid());
+    return fcntl(socket, F_SETFL, O_ASYNC);
+}
+
+/*
+ * Connect this node to every other node, `peers' gets the socket for each (-1 for this node). The
+ * allocator collects each node's listening port and sends out the full list, then every node connects
+ * to the nodes below it and accepts the ones above it. Also used by the homes of dsm -m.
+ */
+int sm_peer_connect(int *peers) {
+    struct sockaddr_in address;
+    socklen_t addrlen = sizeof(address);
+    msg_t *message;
+    char body[4];
+    int listener, status, opt = 1;
+
+    for (int i = 0; i < SM_MAX_NODES; i++) peers[i] = -1;
+
+    /* Listen on any free port and tell the allocator which one */
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener < 0) return sm_fatal("failed to create peer socket");
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family      = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port        = 0;
+    if (bind(listener, (struct sockaddr *) &address, sizeof(address)) ||
+            listen(listener, SM_MAX_NODES) ||
+            getsockname(listener, (struct sockaddr *) &address, &addrlen)) {
+        close(listener);
+        return sm_fatal("failed to listen for peers");
+    }
+
+    sm_put32(body, ntohs(address.sin_port));
+    status = sm_send(sm_sock, sm_nid, SM_PEER_ADDR, 0, body, sizeof(body));
+    if (status) return sm_fatal("failed to send peer address");
+
+    status = sm_recv_type(sm_sock, &message, SM_PEERS);
+    if (status || message->len < sm_nodes * 8) return sm_fatal("failed to receive peer addresses");
+
+    /* Connect to the nodes below this one */
+    for (int i = 0; i < sm_nid; i++) {
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        memcpy(&address.sin_addr.s_addr, SM_MSG_BODY(message) + i * 8, 4);
+        address.sin_port   = htons(sm_get32(SM_MSG_BODY(message) + i * 8 + 4));
+
+        peers[i] = socket(AF_INET, SOCK_STREAM, 0);
+        if (peers[i] < 0 || connect(peers[i], (struct sockaddr *) &address, sizeof(address))) {
+            return sm_fatal("failed to connect to peer");
+        }
+
+        status = sm_send(peers[i], sm_nid, SM_PEER_HELLO, 0, NULL, 0);
+        if (status) return sm_fatal("failed to greet peer");
+    }
+    sm_msg_free(message);
+
+    /* Accept the nodes above this one, they identify themselves straight away */
+    for (int i = sm_nid + 1; i < sm_nodes; i++) {
+        int peer = accept(listener, NULL, NULL);
+        if (peer < 0) return sm_fatal("failed to accept peer");
+
+        status = sm_recv(peer, &message);
+        if (status || message->type != SM_PEER_HELLO || message->nid <= sm_nid ||
+                message->nid >= sm_nodes || peers[message->nid] >= 0) {
+            return sm_fatal("invalid peer greeting");
+        }
+
+        peers[message->nid] = peer;
+        sm_msg_free(message);
+    }
+    close(listener);
+
+    /* Requests and page transfers are small and latency bound */
+    for (int i = 0; i < sm_nodes; i++) {
+        if (i != sm_nid) setsockopt(peers[i], IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    }
+
+    return 0;
+}
+
+/*
+ * Connect this node to every other node for the distributed manager
+ */
+int sm_peer_init(int fanout) {
+    struct sigevent event;
+    int status;
+
+    if (fanout > 0) sm_fanout = fanout;
+    for (long p = 0; p < SM_NUM_PAGES; p++) {
+        sm_prob_owner[p] = 0;
+        sm_owned[p]      = (sm_nid == 0);
+    }
+
+    status = sm_peer_connect(sm_peers);
+    if (status) return status;
+
+    for (int i = 0; i < sm_nodes; i++) {
+        if (i != sm_nid) peer_socket_options(sm_peers[i]);
+    }
+
+    /* Deferred requests are served when the hold timer raises SIGIO */
+    memset(&event, 0, sizeof(event));
+    event.sigev_notify = SIGEV_SIGNAL;
+    event.sigev_signo  = SIGIO;
+    if (timer_create(CLOCK_MONOTONIC, &event, &sm_hold_timer)) return sm_fatal("failed to create timer");
+
+    sm_peer_active = 1;
+
+    /* Requests may have arrived before SIGIO was enabled on the sockets */
+    sm_peer_poll();
+
+    return 0;
+}
+
+void sm_peer_exit(void) {
+    if (!sm_peer_active) return;
+
+    timer_delete(sm_hold_timer);
+    while (sm_n_early > 0) sm_msg_free(sm_early[--sm_n_early]);
+    for (int i = 0; i < sm_nodes; i++) {
+        if (sm_peers[i] >= 0) {
+            sm_msg_forget(sm_peers[i]);
+            close(sm_peers[i]);
+        }
+        sm_peers[i] = -1;
+    }
+
+    sm_peer_active = 0;
+}
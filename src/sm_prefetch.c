@@ -0,0 +1,483 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+
+#include "sm.h"
+#include "config.h"
+#include "sm_prefetch.h"
+#include "sm_uffd.h"
+
+#define SM_PREFETCH_STREAMS    4  /* The number of access streams followed at once */
+#define SM_PREFETCH_STRIDE_MAX 64 /* Faults further apart than this (in pages) never form a stream */
+#define SM_PREFETCH_DEPTH      2  /* The number of pages a stream prefetches when it first locks on */
+
+/* Copies kept through another node's write (write-update) wait in the shadow too */
+#define SM_PREFETCH_KEPT    3 /* Kept, waiting for the writer's changes (SM_UPDATE) */
+#define SM_PREFETCH_UPDATED 4 /* Brought up to date, moved into place read-only when used */
+
+int sm_prefetch_active = 0;
+
+struct prefetch_stream {
+    uint32_t last;      /* The page last faulted on */
+    int32_t  stride;    /* The distance between its faults, in pages */
+    int      confirmed; /* The number of times in a row the stride has repeated */
+    int      depth;     /* The number of strides ahead a miss prefetches */
+    uint32_t batch[SM_PREF_MAX]; /* The pages granted to the stream's last batch */
+    int      n_batch;
+    int      n_asked;   /* The number of pages that batch asked for */
+    uint32_t used;      /* The pages used since then */
+    uint64_t touched;   /* When the stream was last used, 0 if it never has been */
+};
+
+static struct prefetch_stream  prefetch_streams[SM_PREFETCH_STREAMS];
+static struct prefetch_stream *prefetch_current = NULL; /* The stream of the read fault being handled */
+static uint64_t                prefetch_clock = 0;
+
+static uint32_t prefetch_plan[SM_PREF_MAX];           /* The pages asked for by the fault being handled */
+static int      prefetch_n_plan = 0;
+
+/* The progress thread receives and invalidates prefetched pages while the faulting thread uses them */
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned char   prefetch_pending[SM_NUM_PAGES]; /* The access a page was prefetched with (or its
+                                                        * SM_PREFETCH_* state), until used */
+static char           *prefetch_shadow = NULL;         /* Where they wait, at the same offsets as in the region */
+static int             prefetch_any = 0;               /* Set once a page has been prefetched */
+
+static struct {
+    uint64_t faults;    /* Read faults that asked for pages to be prefetched */
+    uint64_t calls;     /* sm_prefetch() calls */
+    uint64_t requested; /* Pages asked for */
+    uint64_t granted;   /* Pages received */
+    uint64_t used;      /* Pages received and then used */
+    uint64_t wasted;    /* Pages received and invalidated or never used */
+    uint64_t updates;   /* Kept copies brought up to date */
+    uint64_t updates_used; /* Updated copies used */
+} prefetch_stats;
+
+static char *prefetch_page(uint32_t page_n) {
+    return sm_map + (long) page_n * sm_page_size;
+}
+
+static char *prefetch_copy(uint32_t page_n) {
+    return prefetch_shadow + (long) page_n * sm_page_size;
+}
+
+/*
+ * Map the shadow of the region the prefetched pages are received into
+ */
+int sm_prefetch_init(void) {
+    prefetch_shadow = mmap(NULL, SM_NUM_PAGES * sm_page_size, PROT_READ|PROT_WRITE,
+                           MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if (prefetch_shadow == MAP_FAILED) {
+        prefetch_shadow = NULL;
+        return sm_fatal("failed to map the prefetch shadow");
+    }
+
+    return 0;
+}
+
+/*
+ * Where a prefetched page is received, it is moved into place when it is first used
+ */
+char *sm_prefetch_sink(msg_t *message) {
+    if (prefetch_shadow == NULL) return NULL;
+
+    return prefetch_copy(message->page);
+}
+
+/*
+ * Give up prefetched copies (with the lock held)
+ */
+static void prefetch_discard(uint32_t page_n, uint32_t n_pages) {
+    memset(&prefetch_pending[page_n], SM_ACCESS_NONE, n_pages);
+    madvise(prefetch_copy(page_n), n_pages * sm_page_size, MADV_DONTNEED);
+}
+
+/*
+ * Move a run of prefetched copies into place with the access they were granted (with the lock held),
+ * this is only ever done by the faulting thread so nothing else can be using the pages in the meantime
+ */
+static void prefetch_install(uint32_t page_n, uint32_t n_pages) {
+    int access = (prefetch_pending[page_n] == SM_PREFETCH_UPDATED) ? SM_ACCESS_READ : prefetch_pending[page_n];
+    char *page = prefetch_page(page_n);
+
+    if (sm_uffd_active) {
+        for (uint32_t i = 0; i < n_pages; i++) {
+            if (sm_uffd_install(page_n + i, prefetch_copy(page_n + i), access == SM_ACCESS_WRITE)) {
+                sm_fatal("failed to install a prefetched page");
+                _exit(EXIT_FAILURE);
+            }
+        }
+    } else {
+        mprotect(page, n_pages * sm_page_size, PROT_READ|PROT_WRITE);
+        memcpy(page, prefetch_copy(page_n), n_pages * sm_page_size);
+        if (access == SM_ACCESS_READ) mprotect(page, n_pages * sm_page_size, PROT_READ);
+    }
+
+    memset(&sm_access[page_n], access, n_pages);
+    prefetch_discard(page_n, n_pages);
+}
+
+/*
+ * Feed a read fault to the stream it continues, or else retrain the closest unconfirmed stream or
+ * replace the least recently used one
+ */
+static struct prefetch_stream *prefetch_train(uint32_t page_n) {
+    struct prefetch_stream *stream, *closest = NULL, *oldest = &prefetch_streams[0];
+    int64_t delta, closest_delta = 0;
+
+    prefetch_clock++;
+
+    for (int i = 0; i < SM_PREFETCH_STREAMS; i++) {
+        stream = &prefetch_streams[i];
+        delta  = (int64_t) page_n - stream->last;
+
+        if (stream->touched && delta != 0 && delta == stream->stride) {
+            stream->confirmed++;
+            goto found;
+        }
+
+        if (stream->touched && stream->confirmed == 0 && delta != 0 && llabs(delta) <= SM_PREFETCH_STRIDE_MAX &&
+                (closest == NULL || llabs(delta) < llabs(closest_delta))) {
+            closest = stream;
+            closest_delta = delta;
+        }
+        if (stream->touched < oldest->touched) oldest = stream;
+    }
+
+    if (closest != NULL) {
+        stream = closest;
+        stream->stride = closest_delta;
+    } else {
+        stream = oldest;
+        memset(stream, 0, sizeof(*stream));
+        stream->depth = SM_PREFETCH_DEPTH;
+    }
+    stream->confirmed = 0;
+
+found:
+    stream->last    = page_n;
+    stream->touched = prefetch_clock;
+    return stream;
+}
+
+/*
+ * Called first for every fault, a fault on a page that was prefetched with enough access is served
+ * here (returns 1). A write fault on a read copy needs ownership from the allocator as usual, the copy
+ * only counts as used.
+ */
+int sm_prefetch_hit(uint32_t page_n, int write) {
+    struct prefetch_stream *stream = NULL;
+    uint32_t n_pages = 1;
+    int pending;
+
+    prefetch_current = NULL;
+    if (!sm_prefetch_active && !__atomic_load_n(&prefetch_any, __ATOMIC_ACQUIRE)) return 0;
+
+    pthread_mutex_lock(&prefetch_lock);
+
+    if (!write && sm_prefetch_active) stream = prefetch_current = prefetch_train(page_n);
+
+    pending = prefetch_pending[page_n];
+    if (pending == SM_ACCESS_NONE || pending == SM_PREFETCH_KEPT) {
+        pthread_mutex_unlock(&prefetch_lock);
+        return 0;
+    }
+
+    /* A kept copy the writer's changes were applied to, a write needs the page with ownership anyway */
+    if (pending == SM_PREFETCH_UPDATED) {
+        if (write) {
+            prefetch_discard(page_n, 1);
+        } else {
+            prefetch_stats.updates_used++;
+            prefetch_install(page_n, 1);
+        }
+        pthread_mutex_unlock(&prefetch_lock);
+        return !write;
+    }
+
+    prefetch_stats.used++;
+    if (stream != NULL) stream->used++;
+
+    if (write && pending == SM_ACCESS_READ) {
+        prefetch_discard(page_n, 1);
+        pthread_mutex_unlock(&prefetch_lock);
+        return 0;
+    }
+
+    /*
+     * The pages after it that were prefetched the same way (and aren't in place already) are valid
+     * copies too, a sequential walk doesn't fault on them. The stream carries on from the last one.
+     */
+    if (sm_access[page_n] == SM_ACCESS_NONE && (stream == NULL || stream->stride == 1)) {
+        while (n_pages < SM_PREF_MAX && page_n + n_pages < SM_NUM_PAGES &&
+               prefetch_pending[page_n + n_pages] == pending && sm_access[page_n + n_pages] == SM_ACCESS_NONE) {
+            n_pages++;
+        }
+    }
+    prefetch_stats.used += n_pages - 1;
+    if (stream != NULL) {
+        stream->used += n_pages - 1;
+        stream->last += n_pages - 1;
+    }
+
+    /* The pages are installed under the lock so an invalidation can't slip in between */
+    prefetch_install(page_n, n_pages);
+
+    pthread_mutex_unlock(&prefetch_lock);
+    return 1;
+}
+
+/*
+ * A read fault missed, if its stream has locked on list the pages to prefetch along with it in `body'
+ * (which has room for SM_PREF_MAX). Returns the length of the list.
+ */
+uint32_t sm_prefetch_plan(uint32_t page_n, char *body) {
+    struct prefetch_stream *stream = prefetch_current;
+    uint32_t skipped = 0;
+    int64_t next;
+
+    prefetch_n_plan = 0;
+    if (!sm_prefetch_active || stream == NULL || stream->confirmed == 0) return 0;
+
+    pthread_mutex_lock(&prefetch_lock);
+
+    /*
+     * Go further ahead once the stream has used every page of its last batch (or none were granted,
+     * with -w the nearest pages may belong to other workers), back off when it has walked past more of
+     * them than it used. Pages still ahead of this fault aren't judged yet.
+     */
+    for (int i = 0; i < stream->n_batch; i++) {
+        int64_t ahead = ((int64_t) stream->batch[i] - page_n) * stream->stride;
+        if (ahead < 0 && prefetch_pending[stream->batch[i]]) skipped++;
+    }
+    if (stream->n_asked > 0) {
+        if (stream->used >= stream->n_batch) {
+            if (stream->depth < SM_PREF_MAX) stream->depth *= 2;
+        } else if (skipped > stream->used) {
+            if (stream->depth > 1) stream->depth /= 2;
+        }
+    }
+    stream->n_batch = stream->n_asked = stream->used = 0;
+
+    for (int i = 1; i <= stream->depth; i++) {
+        next = (int64_t) page_n + (int64_t) stream->stride * i;
+        if (next < 0 || next >= SM_NUM_PAGES) break;
+        if (sm_access[next] != SM_ACCESS_NONE || prefetch_pending[next]) continue;
+
+        sm_put32(body + prefetch_n_plan * 4, next);
+        prefetch_plan[prefetch_n_plan++] = next;
+    }
+    pthread_mutex_unlock(&prefetch_lock);
+
+    stream->n_asked = prefetch_n_plan;
+    if (prefetch_n_plan > 0) {
+        prefetch_stats.faults++;
+        prefetch_stats.requested += prefetch_n_plan;
+    }
+
+    return prefetch_n_plan * 4;
+}
+
+/*
+ * The fault's reply has arrived, every page the allocator granted came in ahead of it
+ */
+void sm_prefetch_granted(void) {
+    struct prefetch_stream *stream = prefetch_current;
+
+    if (prefetch_n_plan == 0) return;
+
+    pthread_mutex_lock(&prefetch_lock);
+    for (int i = 0; i < prefetch_n_plan; i++) {
+        if (prefetch_pending[prefetch_plan[i]]) stream->batch[stream->n_batch++] = prefetch_plan[i];
+    }
+    pthread_mutex_unlock(&prefetch_lock);
+
+    prefetch_n_plan = 0;
+}
+
+/*
+ * The node asked for `n_pages' pages with sm_prefetch()
+ */
+void sm_prefetch_asked(uint32_t n_pages) {
+    prefetch_stats.calls++;
+    prefetch_stats.requested += n_pages;
+}
+
+/*
+ * A prefetched page has been received (from the progress thread) with the given access, it stays out
+ * of place until used
+ */
+void sm_prefetch_arrived(uint32_t page_n, int access) {
+    pthread_mutex_lock(&prefetch_lock);
+    prefetch_pending[page_n] = access;
+    prefetch_stats.granted++;
+    pthread_mutex_unlock(&prefetch_lock);
+
+    __atomic_store_n(&prefetch_any, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * The node's own fault on the page has its reply, a copy prefetched ahead of it is out of date
+ */
+void sm_prefetch_forget(uint32_t page_n) {
+    if (!__atomic_load_n(&prefetch_any, __ATOMIC_ACQUIRE)) return;
+
+    pthread_mutex_lock(&prefetch_lock);
+    if (prefetch_pending[page_n]) {
+        if (prefetch_pending[page_n] <= SM_ACCESS_WRITE) prefetch_stats.wasted++;
+        prefetch_discard(page_n, 1);
+    }
+    pthread_mutex_unlock(&prefetch_lock);
+}
+
+/*
+ * The allocator wants the page back from its writer (from the progress thread). If the node was given
+ * ownership ahead of using it the prefetched copy is sent and kept as a read copy, returns 1 if so.
+ */
+int sm_prefetch_request(msg_t *message) {
+    int served = 0;
+
+    if (!__atomic_load_n(&prefetch_any, __ATOMIC_ACQUIRE)) return 0;
+
+    pthread_mutex_lock(&prefetch_lock);
+    if (prefetch_pending[message->page] == SM_ACCESS_WRITE) {
+        if (sm_reply(sm_sock, message, sm_nid, SM_REQU_REPLY, prefetch_copy(message->page), sm_page_size))
+            sm_fatal("failed to send page to allocator");
+
+        prefetch_pending[message->page] = SM_ACCESS_READ;
+        served = 1;
+    }
+    pthread_mutex_unlock(&prefetch_lock);
+
+    return served;
+}
+
+/*
+ * The allocator is invalidating the page (from the progress thread). An unused prefetched copy is
+ * acknowledged from here, sent back if it was ownership, and wasted. An updated copy that wasn't used
+ * yet is kept again if asked to. Returns 1 if so.
+ */
+int sm_prefetch_release(msg_t *message) {
+    int pending, keep = (message->len >= 4 && sm_get32(SM_MSG_BODY(message)));
+
+    if (!__atomic_load_n(&prefetch_any, __ATOMIC_ACQUIRE)) return 0;
+
+    pthread_mutex_lock(&prefetch_lock);
+    pending = prefetch_pending[message->page];
+    if (pending == SM_PREFETCH_KEPT) {
+        prefetch_discard(message->page, 1);
+        pending = SM_ACCESS_NONE;
+    } else if (pending == SM_PREFETCH_UPDATED) {
+        if (sm_reply(sm_sock, message, sm_nid, SM_RLSE_REPLY, NULL, 0))
+            sm_fatal("failed to send invalidation acknowledgement to allocator");
+
+        if (keep) prefetch_pending[message->page] = SM_PREFETCH_KEPT;
+        else      prefetch_discard(message->page, 1);
+    } else if (pending != SM_ACCESS_NONE) {
+        if (sm_reply(sm_sock, message, sm_nid, SM_RLSE_REPLY, prefetch_copy(message->page),
+                     (pending == SM_ACCESS_WRITE) ? sm_page_size : 0))
+            sm_fatal("failed to send invalidation acknowledgement to allocator");
+
+        prefetch_stats.wasted++;
+        prefetch_discard(message->page, 1);
+    }
+    pthread_mutex_unlock(&prefetch_lock);
+
+    return (pending != SM_ACCESS_NONE);
+}
+
+/*
+ * A reader of a write-update page is being invalidated (from the progress thread), its copy is kept in
+ * the shadow until the writer's changes arrive
+ */
+void sm_prefetch_keep(uint32_t page_n) {
+    if (prefetch_shadow == NULL) return;
+
+    pthread_mutex_lock(&prefetch_lock);
+    memcpy(prefetch_copy(page_n), prefetch_page(page_n), sm_page_size);
+    prefetch_pending[page_n] = SM_PREFETCH_KEPT;
+    pthread_mutex_unlock(&prefetch_lock);
+
+    __atomic_store_n(&prefetch_any, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Apply the writer's changes to a kept copy (from the progress thread), the next access moves it into
+ * place without asking the allocator. A copy given up in the meantime stays given up.
+ */
+void sm_prefetch_update(msg_t *message) {
+    if (message->page >= SM_NUM_PAGES) return;
+
+    pthread_mutex_lock(&prefetch_lock);
+    if (prefetch_pending[message->page] == SM_PREFETCH_KEPT) {
+        if (sm_patch(prefetch_copy(message->page), sm_page_size, SM_MSG_BODY(message), message->len) < 0) {
+            prefetch_discard(message->page, 1);
+        } else {
+            prefetch_pending[message->page] = SM_PREFETCH_UPDATED;
+            prefetch_stats.updates++;
+        }
+    }
+    pthread_mutex_unlock(&prefetch_lock);
+}
+
+/*
+ * Returns whether the node kept its copy of the page through a write and is still waiting for the
+ * writer's changes, a read fault tells the allocator so that only the changes are sent
+ */
+int sm_prefetch_kept(uint32_t page_n) {
+    if (!__atomic_load_n(&prefetch_any, __ATOMIC_ACQUIRE)) return 0;
+
+    return (__atomic_load_n(&prefetch_pending[page_n], __ATOMIC_RELAXED) == SM_PREFETCH_KEPT);
+}
+
+/*
+ * The fault's reply came without the page, the copy the node holds is current but may be waiting in the
+ * shadow: brought up to date by the writer's changes, or prefetched. Move it into place read-only.
+ * Returns -1 if there is no such copy.
+ */
+int sm_prefetch_take(uint32_t page_n) {
+    int pending;
+
+    if (!__atomic_load_n(&prefetch_any, __ATOMIC_ACQUIRE)) return -1;
+
+    pthread_mutex_lock(&prefetch_lock);
+    pending = prefetch_pending[page_n];
+    if (pending == SM_PREFETCH_UPDATED) prefetch_stats.updates_used++;
+    if (pending == SM_ACCESS_READ)      prefetch_stats.used++;
+    if (pending == SM_PREFETCH_UPDATED || pending == SM_ACCESS_READ) prefetch_install(page_n, 1);
+    pthread_mutex_unlock(&prefetch_lock);
+
+    return (pending == SM_PREFETCH_UPDATED || pending == SM_ACCESS_READ) ? 0 : -1;
+}
+
+/*
+ * Print how well prefetching did (pages never used by now were wasted too) and unmap the shadow
+ */
+void sm_prefetch_exit(void) {
+    for (uint32_t i = 0; i < SM_NUM_PAGES; i++) {
+        prefetch_stats.wasted += (prefetch_pending[i] == SM_ACCESS_READ || prefetch_pending[i] == SM_ACCESS_WRITE);
+    }
+
+#ifdef SM_CHECK_COPIES
+    if (prefetch_stats.requested > 0) {
+        fprintf(stderr, "node %d: prefetched %lu of %lu pages asked for by %lu faults and %lu sm_prefetch() calls, "
+                "%lu used (%.0f%%), %lu wasted\n",
+                sm_nid, prefetch_stats.granted, prefetch_stats.requested, prefetch_stats.faults,
+                prefetch_stats.calls, prefetch_stats.used,
+                prefetch_stats.granted ? 100.0 * prefetch_stats.used / prefetch_stats.granted : 0.0,
+                prefetch_stats.wasted);
+    }
+    if (prefetch_stats.updates > 0) {
+        fprintf(stderr, "node %d: %lu kept copies brought up to date by their writers, %lu used\n",
+                sm_nid, prefetch_stats.updates, prefetch_stats.updates_used);
+    }
+#endif
+
+    if (prefetch_shadow != NULL) munmap(prefetch_shadow, SM_NUM_PAGES * sm_page_size);
+    prefetch_shadow = NULL;
+}
@@ -0,0 +1,232 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include <sys/socket.h>
+
+#include "sm.h"
+#include "sm_node.h"
+#include "sm_progress.h"
+
+#define SM_PROGRESS_REPLIES 8 /* A request of the application thread, and a split barrier and broadcast */
+#define SM_PROGRESS_HELD    4 /* The allocator waits for each request it sends, so there is one at most */
+
+int sm_progress_active = 0;
+
+static pthread_t       progress_thread;
+static pthread_mutex_t progress_send_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t progress_lock      = PTHREAD_MUTEX_INITIALIZER; /* Guards everything below */
+static sem_t           progress_ready;                                 /* Posted for every reply */
+
+static msg_t   *progress_replies[SM_PROGRESS_REPLIES]; /* Replies not yet picked up */
+static int      progress_n_replies = 0;
+static uint32_t progress_page = UINT32_MAX;            /* The page a grant is being applied to */
+static msg_t   *progress_held[SM_PROGRESS_HELD];       /* Requests for that page */
+static int      progress_n_held = 0;
+static int      progress_stopping = 0;
+
+static void   (*progress_serve)(msg_t *message);
+
+/*
+ * Both threads send to the allocator, so each frame is written whole under a lock
+ */
+static int progress_write(int socket, struct iovec *iov, int iovcnt) {
+    pthread_mutex_lock(&progress_send_lock);
+    int status = sm_writev_all(socket, iov, iovcnt);
+    pthread_mutex_unlock(&progress_send_lock);
+
+    return status;
+}
+
+static void *progress_main(void *argument) {
+    msg_t *message;
+
+    while (1) {
+        if (sm_recv(sm_sock, &message)) {
+            if (__atomic_load_n(&progress_stopping, __ATOMIC_ACQUIRE)) return NULL;
+
+            /* The application thread may be waiting for a reply which will never come */
+            sm_fatal("lost connection to the allocator");
+            _exit(EXIT_FAILURE);
+        }
+
+        pthread_mutex_lock(&progress_lock);
+
+        /* Pages sent ahead of a fault, or for sm_get(), updates, lock hand-overs and reductions never wait
+         * for a grant */
+        if (message->type == SM_PREF_PAGE || message->type == SM_PREF_OWN || message->type == SM_GET_PAGES ||
+                message->type == SM_UPDATE || message->type == SM_LOCK_NEXT || message->type == SM_REDUCE_DATA) {
+            pthread_mutex_unlock(&progress_lock);
+
+            progress_serve(message);
+            sm_msg_free(message);
+            continue;
+        }
+
+        if (message->type == SM_REQUEST || message->type == SM_RELEASE) {
+            if (message->page != progress_page) {
+                pthread_mutex_unlock(&progress_lock);
+
+                progress_serve(message);
+                sm_msg_free(message);
+                continue;
+            }
+
+            if (progress_n_held == SM_PROGRESS_HELD) {
+                sm_fatal("too many requests held for a page");
+                _exit(EXIT_FAILURE);
+            }
+            progress_held[progress_n_held++] = message;
+            pthread_mutex_unlock(&progress_lock);
+            continue;
+        }
+
+        /* The allocator closes the connection straight after acknowledging the node's exit */
+        if (message->type == SM_EXIT_REPLY) __atomic_store_n(&progress_stopping, 1, __ATOMIC_RELEASE);
+
+        /* A fault's grant has to be applied before anything else happens to the page */
+        if (message->type == SM_READ_REPLY || message->type == SM_WRIT_REPLY || message->type == SM_MIGR_REPLY)
+            progress_page = message->page;
+
+        if (progress_n_replies == SM_PROGRESS_REPLIES) {
+            sm_fatal("too many replies waiting");
+            _exit(EXIT_FAILURE);
+        }
+        progress_replies[progress_n_replies++] = message;
+        pthread_mutex_unlock(&progress_lock);
+
+        sem_post(&progress_ready);
+    }
+}
+
+/*
+ * Start the progress thread, `serve' handles page requests and invalidations from the allocator
+ */
+int sm_progress_start(void (*serve)(msg_t *message)) {
+    sigset_t all, previous;
+    int status;
+
+    if (sem_init(&progress_ready, 0, 0)) return sm_fatal("failed to create the reply semaphore");
+
+    progress_serve = serve;
+    progress_stopping = 0;
+    sm_msg_writer = progress_write;
+
+    /* Signals (faults in particular) are for the application thread */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &previous);
+    status = pthread_create(&progress_thread, NULL, progress_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+    if (status) {
+        sm_msg_writer = NULL;
+        sem_destroy(&progress_ready);
+        return sm_fatal("failed to start the progress thread");
+    }
+
+    sm_progress_active = 1;
+    return 0;
+}
+
+/*
+ * Wait for the reply to the request with the given sequence id, this is called from the fault handler
+ * so it only waits on a semaphore
+ */
+int sm_progress_await(uint32_t seq, msg_t **reply) {
+    if (sm_msg_flush()) return sm_fatal("failed to send queued messages");
+
+    while (1) {
+        pthread_mutex_lock(&progress_lock);
+        for (int i = 0; i < progress_n_replies; i++) {
+            if (progress_replies[i]->seq != seq) continue;
+
+            *reply = progress_replies[i];
+            progress_replies[i] = progress_replies[--progress_n_replies];
+            pthread_mutex_unlock(&progress_lock);
+            return 0;
+        }
+        pthread_mutex_unlock(&progress_lock);
+
+        while (sem_wait(&progress_ready) && errno == EINTR);
+    }
+}
+
+/*
+ * Returns 1 and the reply to the request with the given sequence id if it has arrived, 0 otherwise
+ */
+int sm_progress_test(uint32_t seq, msg_t **reply) {
+    int found = 0;
+
+    pthread_mutex_lock(&progress_lock);
+    for (int i = 0; i < progress_n_replies && !found; i++) {
+        if (progress_replies[i]->seq != seq) continue;
+
+        *reply = progress_replies[i];
+        progress_replies[i] = progress_replies[--progress_n_replies];
+        found = 1;
+    }
+    pthread_mutex_unlock(&progress_lock);
+
+    return found;
+}
+
+/*
+ * Hand the application thread a reply that reached the node some other way, a lock handed over by
+ * another node (dsm -m)
+ */
+void sm_progress_deliver(msg_t *reply) {
+    pthread_mutex_lock(&progress_lock);
+    if (progress_n_replies == SM_PROGRESS_REPLIES) {
+        sm_fatal("too many replies waiting");
+        _exit(EXIT_FAILURE);
+    }
+    progress_replies[progress_n_replies++] = reply;
+    pthread_mutex_unlock(&progress_lock);
+
+    sem_post(&progress_ready);
+}
+
+/*
+ * The faulting thread has applied the grant for the page, serve the requests held back for it
+ */
+void sm_progress_done(uint32_t page_n) {
+    msg_t *held[SM_PROGRESS_HELD];
+    int n_held;
+
+    if (!sm_progress_active) return;
+
+    pthread_mutex_lock(&progress_lock);
+    if (progress_page == page_n) progress_page = UINT32_MAX;
+
+    n_held = progress_n_held;
+    for (int i = 0; i < n_held; i++) held[i] = progress_held[i];
+    progress_n_held = 0;
+    pthread_mutex_unlock(&progress_lock);
+
+    for (int i = 0; i < n_held; i++) {
+        progress_serve(held[i]);
+        sm_msg_free(held[i]);
+    }
+}
+
+/*
+ * Stop the progress thread once the allocator has acknowledged the node's exit
+ */
+void sm_progress_stop(void) {
+    if (!sm_progress_active) return;
+
+    __atomic_store_n(&progress_stopping, 1, __ATOMIC_RELEASE);
+    shutdown(sm_sock, SHUT_RDWR);
+    pthread_join(progress_thread, NULL);
+
+    while (progress_n_replies > 0) sm_msg_free(progress_replies[--progress_n_replies]);
+    while (progress_n_held > 0)    sm_msg_free(progress_held[--progress_n_held]);
+
+    sem_destroy(&progress_ready);
+    sm_msg_writer = NULL;
+    sm_progress_active = 0;
+}
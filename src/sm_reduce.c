@@ -0,0 +1,225 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+
+#include "sm.h"
+#include "sm_ext.h"
+#include "sm_node.h"
+#include "sm_peer.h"
+#include "sm_progress.h"
+#include "config.h"
+
+_Static_assert(SM_INT32 == SM_RED_INT32 && SM_INT64 == SM_RED_INT64 && SM_UINT32 == SM_RED_UINT32 &&
+               SM_UINT64 == SM_RED_UINT64 && SM_FLOAT == SM_RED_FLOAT && SM_DOUBLE == SM_RED_DOUBLE,
+               "element types are sent as they are");
+_Static_assert(SM_SUM == SM_RED_SUM && SM_MIN == SM_RED_MIN && SM_MAX == SM_RED_MAX,
+               "built-in operations are sent as they are");
+
+#define REDUCE_OP_FIRST 16 /* The operations of sm_op_create() follow the built-in ones */
+#define REDUCE_OPS_MAX  16 /* The most operations sm_op_create() makes */
+
+static void (*reduce_ops[REDUCE_OPS_MAX])(void *inout, const void *in, size_t count);
+static int    reduce_n_ops = 0;
+
+static const size_t reduce_size[] = { 4, 8, 4, 8, 4, 8, 1 }; /* The bytes of each element type */
+
+/* The reduction in progress. The chunks of its result are received straight into `dst', unless the node
+ * is the root of a gather: then they are the other nodes' elements, combined into `dst' as they arrive. */
+static char    *reduce_dst = NULL;
+static uint64_t reduce_len;
+static size_t   reduce_elem;
+static void   (*reduce_combine)(void *inout, const void *in, size_t count) = NULL;
+
+/*
+ * Chunks of a reduction's result go straight to their place in the node's vector
+ */
+char *sm_reduce_sink(msg_t *message) {
+    uint64_t offset = (uint64_t) message->page * SM_BULK_MAX;
+
+    if (reduce_dst == NULL || reduce_combine != NULL) return NULL;
+    if (offset >= reduce_len || message->len > reduce_len - offset) return NULL;
+
+    return reduce_dst + offset;
+}
+
+/*
+ * Another node's chunk has been relayed to this node, the root of a gather, combine it into the vector
+ */
+void sm_reduce_serve(msg_t *message) {
+    uint64_t offset = (uint64_t) message->page * SM_BULK_MAX;
+
+    if (reduce_dst == NULL || reduce_combine == NULL) return;
+    if (offset >= reduce_len || message->len > reduce_len - offset || message->len % reduce_elem) return;
+
+    reduce_combine(reduce_dst + offset, SM_MSG_BODY(message), message->len / reduce_elem);
+}
+
+/*
+ * Wait for the allocator to acknowledge the reduction, the chunks of the result arrive before it
+ */
+static int reduce_await(uint32_t seq, msg_t **reply) {
+    if (sm_peer_active)     return sm_peer_await(SM_REDUCE_REPLY, 0, reply);
+    if (sm_progress_active) return sm_progress_await(seq, reply);
+
+    return sm_recv_type(sm_sock, reply, SM_REDUCE_REPLY);
+}
+
+/*
+ * Take part in one reduction of at most SM_REDUCE_CHUNKS chunks. The node's chunks go out in one batch
+ * behind the SM_REDUCE, straight from `buf'.
+ */
+static int reduce_round(char *buf, uint64_t count, int type, uint32_t op, uint32_t root,
+                        void (*combine)(void *inout, const void *in, size_t count)) {
+    static struct sm_frame frames[SM_REDUCE_CHUNKS];
+    uint64_t size = count * reduce_size[type];
+    uint32_t n_chunks = (size + SM_BULK_MAX - 1) / SM_BULK_MAX, seq;
+    int contributes, receives, status;
+    char body[20];
+    msg_t *reply;
+
+    if (op == SM_RED_GATHER) {
+        contributes = ((uint32_t) sm_nid != root);
+        receives    = !contributes;
+    } else if (op == SM_RED_ROOT) {
+        contributes = ((uint32_t) sm_nid == root);
+        receives    = !contributes;
+    } else {
+        contributes = 1;
+        receives    = (root == SM_REDUCE_ALL || (uint32_t) sm_nid == root);
+    }
+
+    reduce_dst     = receives ? buf : NULL;
+    reduce_len     = size;
+    reduce_elem    = reduce_size[type];
+    reduce_combine = (op == SM_RED_GATHER) ? combine : NULL;
+
+    sm_put32(body, root);
+    sm_put32(body + 4, op);
+    sm_put32(body + 8, type);
+    sm_put64(body + 12, count);
+    status = sm_request(sm_sock, sm_nid, SM_REDUCE, 0, body, sizeof(body), &seq);
+
+    for (uint32_t chunk = 0; contributes && chunk < n_chunks; chunk++) {
+        uint64_t offset = (uint64_t) chunk * SM_BULK_MAX;
+
+        frames[chunk] = (struct sm_frame) { sm_sock, sm_nid, SM_REDUCE_DATA, chunk, buf + offset,
+                                            (size - offset < SM_BULK_MAX) ? size - offset : SM_BULK_MAX, 0 };
+    }
+    if (!status && contributes && n_chunks > 0) status = sm_send_all(frames, n_chunks);
+    if (status) {
+        reduce_dst = NULL;
+        return sm_fatal("failed to send a reduction");
+    }
+
+    status = reduce_await(seq, &reply);
+    reduce_dst = NULL;
+    if (status) return sm_fatal("failed to complete a reduction");
+
+    sm_msg_free(reply);
+    return 0;
+}
+
+/*
+ * Returns whether `len' bytes at `buf' overlap shared memory
+ */
+static int reduce_shared(const void *buf, uint64_t len) {
+    return (const char *) buf < sm_map + (long) SM_NUM_PAGES * sm_page_size && (const char *) buf + len > sm_map;
+}
+
+/*
+ * Reduce the vector a part at a time. The built-in operations are combined at the allocator; those of
+ * the program are gathered at the root, and then sent on to every node from node 0 for sm_allreduce().
+ */
+static int reduce(void *buf, size_t count, int type, int op, uint32_t root) {
+    void (*combine)(void *inout, const void *in, size_t count) = NULL;
+    uint64_t per_round;
+    sigset_t mask;
+    int status = 0;
+
+    if (type < SM_INT32 || type > SM_DOUBLE) return sm_fatal("invalid reduction type");
+    if (op >= REDUCE_OP_FIRST && op < REDUCE_OP_FIRST + reduce_n_ops) {
+        combine = reduce_ops[op - REDUCE_OP_FIRST];
+    } else if (op < SM_SUM || op > SM_MAX) {
+        return sm_fatal("invalid reduction operation");
+    }
+    if (root != SM_REDUCE_ALL && root >= (uint32_t) sm_nodes) return sm_fatal("invalid reduction root");
+    if (count == 0) return 0;
+    if (count > SIZE_MAX / reduce_size[type]) return sm_fatal("reduction too long");
+    if (reduce_shared(buf, count * reduce_size[type])) return sm_fatal("reduction of shared memory");
+
+    per_round = (uint64_t) SM_REDUCE_CHUNKS * SM_BULK_MAX / reduce_size[type];
+
+    sm_block_io(1, &mask);
+
+    for (uint64_t done = 0; done < count && !status; done += per_round) {
+        char *part = (char *) buf + done * reduce_size[type];
+        uint64_t n = (count - done < per_round) ? count - done : per_round;
+
+        if (combine == NULL) {
+            status = reduce_round(part, n, type, op, root, NULL);
+        } else {
+            status = reduce_round(part, n, type, SM_RED_GATHER, (root == SM_REDUCE_ALL) ? 0 : root, combine);
+            if (!status && root == SM_REDUCE_ALL) status = reduce_round(part, n, type, SM_RED_ROOT, 0, NULL);
+        }
+    }
+
+    sm_block_io(0, &mask);
+
+    return status ? -1 : 0;
+}
+
+int sm_reduce (void *buf, size_t count, int type, int op, int root_nid) {
+    if (root_nid < 0) return sm_fatal("invalid reduction root");
+
+    return reduce(buf, count, type, op, root_nid);
+}
+
+int sm_allreduce (void *buf, size_t count, int type, int op) {
+    return reduce(buf, count, type, op, SM_REDUCE_ALL);
+}
+
+/*
+ * Broadcast the buffer a part at a time. Under -d each part streams down a tree of the nodes rooted at
+ * the root, otherwise the allocator passes the root's chunks on to every node as they arrive (a reduction
+ * of bytes with SM_RED_ROOT). A buffer no bigger than a pointer is simply sm_bcast()'s value.
+ */
+int sm_bcast_buf (void *buf, size_t len, int root_nid) {
+    uint64_t per_round = (uint64_t) SM_REDUCE_CHUNKS * SM_BULK_MAX;
+    sigset_t mask;
+    int status = 0;
+
+    if (root_nid < 0 || root_nid >= sm_nodes) return sm_fatal("invalid broadcast root");
+    if (len == 0) return 0;
+    if (reduce_shared(buf, len)) return sm_fatal("broadcast of shared memory");
+
+    if (len <= sizeof(void *)) {
+        void *value = NULL;
+
+        memcpy(&value, buf, len);
+        sm_bcast(&value, root_nid);
+        memcpy(buf, &value, len);
+        return 0;
+    }
+
+    sm_block_io(1, &mask);
+
+    for (uint64_t done = 0; done < len && !status; done += per_round) {
+        char *part = (char *) buf + done;
+        uint64_t n = (len - done < per_round) ? len - done : per_round;
+
+        if (sm_peer_active) status = sm_peer_bcast(part, n, root_nid);
+        else                status = reduce_round(part, n, SM_RED_BYTE, SM_RED_ROOT, root_nid, NULL);
+    }
+
+    sm_block_io(0, &mask);
+
+    return status ? -1 : 0;
+}
+
+int sm_op_create (void (*combine) (void *inout, const void *in, size_t count)) {
+    if (combine == NULL || reduce_n_ops == REDUCE_OPS_MAX) return -1;
+
+    reduce_ops[reduce_n_ops] = combine;
+    return REDUCE_OP_FIRST + reduce_n_ops++;
+}
@@ -4,11 +4,16 @@
 #include <unistd.h>
 #include <string.h>
 #include <fcntl.h>
+#include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include "sm_setup.h"
 #include "allocator.h"
+#include "node_functions.h"
 #include "config.h"
+#include "sm_event.h"
+#include "sm_shm.h"
 
 /* */
 int setup(int argc, char **argv) {
@@ -31,8 +36,17 @@ int setup(int argc, char **argv) {
 
 /* Initialize the data structure to store the command-line options (number of nodes, program to run ect) */
 int options_init() {
-    options = malloc(sizeof(options));
-    options->n_nodes  = 1;
+    options = malloc(sizeof(struct options));
+    options->n_nodes   = 1;
+    options->n_workers = 0;
+    options->distributed = 0;
+    options->release     = 0;
+    options->homes       = 0;
+    options->fanout      = 2;
+    options->shared      = 0;
+    options->userfault   = 0;
+    options->prefetch    = 0;
+    options->hold        = 0;
     options->log_file = NULL;
     
     /* Allocate memory for the host names */
@@ -41,6 +55,8 @@ int options_init() {
         options->host_names[i] = NULL;
     }
 
+    options->n_hosts   = 0;
+    options->program   = NULL;
     options->prog_args = NULL;
 
     return 0;
@@ -59,8 +75,24 @@ int process_arguments(int argc, char **argv) {
     if (result) return result;
 
     /* Read and process the options */
-    while ((opt = getopt(argc, argv, "H:hl:n:v")) != -1) {
+    while ((opt = getopt(argc, argv, "de:f:H:hl:m:n:prst:uvw:")) != -1) {
         switch (opt) {
+            case 'd':
+                options->distributed = 1;
+                break;
+            case 'e':
+                if (sm_event_choose(optarg)) {
+                    fprintf(stderr, "Error: unknown event engine '%s'\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'f':
+                options->fanout = strtol(optarg, NULL, 10);
+                if (options->fanout < 1 || options->fanout >= SM_MAX_NODES) {
+                    fprintf(stderr, "Error: invalid fan-out '%s'\n", optarg);
+                    return -1;
+                }
+                break;
             case 'H':
                 options->host_names[0] = strndup(optarg, SM_LEN_MAX);
                 break;
@@ -73,18 +105,90 @@ int process_arguments(int argc, char **argv) {
                 options->log_file = fopen(optarg, "w+");
                 // TODO: Check if opening the log file failed
                 break;
+            case 'm':
+                if      (!strcmp(optarg, "touch")) options->homes = SM_HOME_TOUCH;
+                else if (!strcmp(optarg, "alloc")) options->homes = SM_HOME_ALLOC;
+                else {
+                    fprintf(stderr, "Error: unknown home placement '%s'\n", optarg);
+                    return -1;
+                }
+                options->release = 1;
+                break;
             case 'n':
                 options->n_nodes = strtol(optarg, NULL, 10);
+                if (options->n_nodes < 1 || options->n_nodes > SM_MAX_NODES) {
+                    fprintf(stderr, "Error: invalid number of nodes '%s' (at most %d)\n", optarg, SM_MAX_NODES);
+                    return -1;
+                }
+                break;
+            case 'p':
+                options->prefetch = 1;
+                break;
+            case 'r':
+                options->release = 1;
+                break;
+            case 's':
+                options->shared = 1;
+                break;
+            case 't':
+                options->hold = strtoul(optarg, NULL, 10);
+                if (options->hold > SM_HOLD_MAX) {
+                    fprintf(stderr, "Error: invalid hold window '%s' (at most %d microseconds)\n", optarg, SM_HOLD_MAX);
+                    return -1;
+                }
+                break;
+            case 'u':
+                options->userfault = 1;
                 break;
             case 'v':
                 fprintf(stdout, "version 1.0\n");
                 break;
+            case 'w':
+                options->n_workers = strtol(optarg, NULL, 10);
+                if (options->n_workers < 0 || options->n_workers > SM_MAX_PAGES) {
+                    fprintf(stderr, "Error: invalid number of workers '%s'\n", optarg);
+                    return -1;
+                }
+                break;
             default:
                 fprintf(stderr, "Error: invalid option given '%c'\n", opt);
                 return -1;
         }
     }
 
+    /* Diffs have to be applied in order with the barriers and acquires that follow them */
+    if (options->release && (options->distributed || options->n_workers > 0)) {
+        fprintf(stderr, "Error: -r (or -m) can't be used with -d or -w\n");
+        return -1;
+    }
+
+    /* The io_uring engine queues sends from the network thread only */
+    if (options->n_workers > 0 && sm_event == &sm_event_uring) {
+        fprintf(stderr, "Error: the uring event engine can't be used with -w\n");
+        return -1;
+    }
+
+    /* The distributed manager and release consistency manage the protection of pages themselves */
+    if (options->userfault && (options->distributed || options->release || options->shared)) {
+        fprintf(stderr, "Error: -u can't be used with -d, -r or -s\n");
+        return -1;
+    }
+
+    /* Only the allocator's own protocol grants prefetched pages */
+    if (options->prefetch && (options->distributed || options->release || options->shared)) {
+        fprintf(stderr, "Error: -p can't be used with -d, -r or -s\n");
+        return -1;
+    }
+
+    /* Shared memory replaces both the event engine and the fault protocols */
+    if (options->shared) {
+        if (options->distributed || options->release || options->n_workers > 0) {
+            fprintf(stderr, "Error: -s can't be used with -d, -r or -w\n");
+            return -1;
+        }
+        sm_event = &sm_event_shm;
+    }
+
     /* */
     result = process_program(argc, argv, optind);
     if (result) return result;
@@ -93,6 +197,11 @@ int process_arguments(int argc, char **argv) {
     result = read_hostfile();
     if (result) return result;
 
+    if (options->shared && !local_hosts()) {
+        fprintf(stderr, "Error: -s needs every host to be this host\n");
+        return -1;
+    }
+
     return 0;
 }
 
@@ -113,10 +222,10 @@ int process_program(int argc, char **argv, int optind) {
     /* Read and process the NODE-OPTIONs */
     if (optind < argc) {
         int n_prog_args = argc - optind;
-        prog_args = malloc(sizeof(char *) * n_prog_args);
+        prog_args = malloc(sizeof(char *) * (n_prog_args + 1));
 
         /* Read each node option into the array */
-        for (int i = 0; i < SM_ARG_MAX && i < n_prog_args; i++)
+        for (int i = 0; i < n_prog_args; i++)
             prog_args[i] = strndup(argv[optind++], SM_LEN_MAX);
         
         /* NULL-terminate the array to prevent reading unallocated memory */
@@ -148,14 +257,16 @@ int read_hostfile() {
     /* If the hostfile (or 'hosts' if none supplied) doesn't exist, use localhost instead */
     if (host_file == NULL) {
         host_names[0] = strndup("localhost", 10);
+        host_names[1] = NULL;
+        options->n_hosts = 1;
     /* Otherwise read from the host_file */
     } else {
         char name_buff[SM_LEN_MAX];
         int i = 0;
 
         /* Read the file for host file names */
-        for (i = 0; fgets(name_buff, SM_LEN_MAX, host_file); i++) {
-            name_buff[strlen(name_buff) - 1] = '\0'; /* Remove trailing newline */
+        for (i = 0; i < SM_HOSTS_MAX - 1 && fgets(name_buff, SM_LEN_MAX, host_file); i++) {
+            name_buff[strcspn(name_buff, "\n")] = '\0'; /* Remove trailing newline */
             host_names[i] = strndup(name_buff, SM_LEN_MAX);
         }
 
@@ -164,6 +275,8 @@ int read_hostfile() {
         /* If the file is empty, use localhost */
         if (i == 0) {
             host_names[0] = strndup("localhost", 10);
+            host_names[1] = NULL;
+            options->n_hosts = 1;
         } else {
             /* NULL-terminate the array for later traversal */
             host_names[i] = NULL;
@@ -177,6 +290,23 @@ int read_hostfile() {
     return 0;
 }
 
+/*
+ * Returns whether every host the nodes are started on is this host
+ */
+int local_hosts() {
+    char name[NAME_LEN_MAX] = "";
+
+    gethostname(name, NAME_LEN_MAX - 1);
+
+    for (int i = 0; i < options->n_hosts; i++) {
+        char *host = options->host_names[i];
+
+        if (strcmp(host, "localhost") && strcmp(host, "127.0.0.1") && strcmp(host, name)) return 0;
+    }
+
+    return 1;
+}
+
 /*
  * First start up all of the nodes via ssh, then setup communication sockets with all of the nodes.
  */
@@ -185,6 +315,7 @@ int initialize() {
 
     /* Loop until you've created the required number of processes */
     while (sm_node_count < options->n_nodes) {
+        fflush(NULL);
         pid_t pid = fork();
         sm_node_count++;
 
@@ -219,6 +350,10 @@ int initialize() {
             return sm_fatal("Failed to accept connections");
         }
 
+        /* Every frame is written whole, a batch of them (e.g. prefetched pages) mustn't wait on an ACK */
+        int opt = 1;
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
         /* Initailize the new node and socket */
         status = node_init(client);
         if (status < 0) {
@@ -226,6 +361,12 @@ int initialize() {
         }
     }
 
+    /* Every node is connected, so they can now connect to each other */
+    if (options->distributed || options->homes) {
+        status = node_peers();
+        if (status) return sm_fatal("failed to introduce the nodes to each other");
+    }
+
     /* */
     return 0;
 }
@@ -235,28 +376,28 @@ int initialize() {
  */
 int node_start() {
     int host_index = 0, status = 0;
-    char command[SM_LEN_MAX], buffer[SM_LEN_MAX];
+    char command[COMMAND_LEN_MAX], buffer[NAME_LEN_MAX];
 
     /* Loop around when insufficient numbers of hosts */
     host_index = (sm_node_count - 1) % options->n_hosts;
 
     /* write the command to be executed on the target device */
-    status = snprintf(command, SM_LEN_MAX, "ssh %s %s", options->host_names[host_index], options->program);
+    status = snprintf(command, COMMAND_LEN_MAX, "ssh %s %s", options->host_names[host_index], options->program);
     if (status == 0) {
         return sm_fatal("failed to create command");
     }
 
     /* Append the arguments to the command */
-    for (int i = 0; options->prog_args[i] != NULL; i++) {
-        status = snprintf(command + strlen(command), SM_LEN_MAX, " %s", options->prog_args[i]);
+    for (int i = 0; options->prog_args && options->prog_args[i] != NULL; i++) {
+        status = snprintf(command + strlen(command), COMMAND_LEN_MAX - strlen(command), " %s", options->prog_args[i]);
         if (status == 0) {
             return sm_fatal("failed to add arguments to command");
         }
     }
 
     /* Append the communication information (ip/port) to the command */
-    gethostname(buffer, 1023);
-    status = snprintf(command + strlen(command), SM_LEN_MAX, " %s %d", buffer, SM_PORT);
+    gethostname(buffer, NAME_LEN_MAX - 1);
+    status = snprintf(command + strlen(command), COMMAND_LEN_MAX - strlen(command), " %s %d", buffer, SM_PORT);
     if (status == 0) return sm_fatal("failed to add ip/port to command");
 
     /* ssh into the host and execute the program */
@@ -0,0 +1,385 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "sm_shm.h"
+#include "config.h"
+
+int sm_fatal(char *message);
+
+#define SM_SHM_SPIN       2000 /* How many times a reader polls an empty ring before it sleeps */
+#define SM_SHM_TIMEOUT_MS 100  /* How often a sleeping reader checks that the other end is still there */
+
+/*
+ * A single producer, single consumer byte ring. The head and tail only ever grow (wrapping at 2^32),
+ * so the ring holds tail - head bytes, and each lives in its own cache line as they are written by
+ * different processes.
+ */
+struct sm_ring {
+    uint32_t head __attribute__((aligned(64)));  /* Bytes read, only advanced by the reader */
+    uint32_t head_waiting;                        /* Set while the writer sleeps waiting for room */
+    uint32_t tail __attribute__((aligned(64)));  /* Bytes written, only advanced by the writer */
+    uint32_t tail_waiting;                        /* Set while the reader sleeps waiting for data */
+    char     data[SM_SHM_RING_SIZE] __attribute__((aligned(64)));
+};
+
+/*
+ * Follows the region in the shared memory object. The allocator reads from every node, so rather than
+ * sleeping on one ring it sleeps on a doorbell that nodes ring after each write.
+ */
+struct sm_shm_control {
+    uint32_t       doorbell __attribute__((aligned(64)));
+    uint32_t       doorbell_waiting;
+    struct sm_ring up[SM_MAX_NODES];    /* node -> allocator */
+    struct sm_ring down[SM_MAX_NODES];  /* allocator -> node */
+};
+
+static struct sm_shm_control *shm_control = NULL;
+static unsigned               shm_id;
+static int                    shm_allocator = 0;         /* Whether this process is the allocator */
+static int                    shm_sockets[SM_MAX_NODES]; /* The socket each node's rings stand in for */
+static int                    shm_nid = -1;              /* The node this process is, if it is one */
+static int                    shm_max, shm_cursor;
+static int                    shm_spin = SM_SHM_SPIN;    /* Spinning only helps if the writer has a CPU */
+
+static const struct timespec  shm_timeout = { .tv_nsec = SM_SHM_TIMEOUT_MS * 1000000L };
+
+static size_t shm_region_size(void) {
+    return (size_t) SM_NUM_PAGES * getpagesize();
+}
+
+static long shm_futex(uint32_t *word, int op, uint32_t value, const struct timespec *timeout) {
+    return syscall(SYS_futex, word, op, value, timeout, NULL, 0);
+}
+
+/*
+ * Wait until the word is no longer `seen', spinning for a while before going to sleep. Returns 1 if
+ * the timeout passed without the word changing.
+ */
+static int shm_wait(uint32_t *word, uint32_t seen, uint32_t *waiting, const struct timespec *timeout) {
+    for (int i = 0; i < shm_spin; i++) {
+        if (__atomic_load_n(word, __ATOMIC_ACQUIRE) != seen) return 0;
+        __builtin_ia32_pause();
+    }
+
+    /* The writer checks the flag after changing the word, so one of the two sees the other */
+    __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(word, __ATOMIC_SEQ_CST) != seen) return 0;
+
+    if (shm_futex(word, FUTEX_WAIT, seen, timeout) && errno == ETIMEDOUT) return 1;
+    return 0;
+}
+
+static void shm_wake(uint32_t *word, uint32_t *waiting) {
+    if (__atomic_exchange_n(waiting, 0, __ATOMIC_SEQ_CST)) shm_futex(word, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+/*
+ * Nothing but the rings is used once a node is attached, so anything to read on its socket means the
+ * other end has gone
+ */
+static int shm_hung_up(int socket) {
+    struct pollfd pfd = { .fd = socket, .events = POLLIN };
+
+    return (poll(&pfd, 1, 0) != 0);
+}
+
+/*
+ * Make the bytes written so far visible to the reader and wake it if it is asleep
+ */
+static void ring_publish(struct sm_ring *ring, uint32_t tail) {
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_SEQ_CST);
+
+    if (shm_allocator) {
+        shm_wake(&ring->tail, &ring->tail_waiting);
+    } else {
+        __atomic_add_fetch(&shm_control->doorbell, 1, __ATOMIC_SEQ_CST);
+        shm_wake(&shm_control->doorbell, &shm_control->doorbell_waiting);
+    }
+}
+
+static int ring_write(struct sm_ring *ring, int socket, struct iovec *iov, int iovcnt) {
+    uint32_t tail = ring->tail, head, room, n;
+
+    for (int i = 0; i < iovcnt; i++) {
+        const char *bytes = iov[i].iov_base;
+        size_t len = iov[i].iov_len;
+
+        while (len > 0) {
+            head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+            room = SM_SHM_RING_SIZE - (tail - head);
+
+            /* Full, let the reader have what there is and wait for it to make room */
+            if (room == 0) {
+                ring_publish(ring, tail);
+                if (shm_wait(&ring->head, head, &ring->head_waiting, &shm_timeout) && shm_hung_up(socket)) return 1;
+                continue;
+            }
+
+            n = SM_SHM_RING_SIZE - (tail & (SM_SHM_RING_SIZE - 1));
+            if (n > room) n = room;
+            if (n > len)  n = len;
+
+            memcpy(ring->data + (tail & (SM_SHM_RING_SIZE - 1)), bytes, n);
+            tail += n, bytes += n, len -= n;
+        }
+    }
+
+    ring_publish(ring, tail);
+    return 0;
+}
+
+static int ring_read(struct sm_ring *ring, int socket, char *buffer, size_t len) {
+    uint32_t head = ring->head, tail, seen, n;
+    int timed_out;
+
+    while (len > 0) {
+        tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+        if (tail == head) {
+            if (shm_allocator) {
+                seen = __atomic_load_n(&shm_control->doorbell, __ATOMIC_SEQ_CST);
+                if (__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) != head) continue;
+                timed_out = shm_wait(&shm_control->doorbell, seen, &shm_control->doorbell_waiting, &shm_timeout);
+            } else {
+                timed_out = shm_wait(&ring->tail, tail, &ring->tail_waiting, &shm_timeout);
+            }
+
+            if (timed_out && shm_hung_up(socket)) return 1;
+            continue;
+        }
+
+        n = SM_SHM_RING_SIZE - (head & (SM_SHM_RING_SIZE - 1));
+        if (n > tail - head) n = tail - head;
+        if (n > len)         n = len;
+
+        memcpy(buffer, ring->data + (head & (SM_SHM_RING_SIZE - 1)), n);
+        head += n, buffer += n, len -= n;
+
+        __atomic_store_n(&ring->head, head, __ATOMIC_SEQ_CST);
+        shm_wake(&ring->head, &ring->head_waiting);
+    }
+
+    return 0;
+}
+
+/*
+ * Returns the node whose rings stand in for the socket, or -1 if it is an ordinary socket
+ */
+static int shm_node(int socket) {
+    for (int i = 0; i < SM_MAX_NODES; i++) {
+        if (shm_sockets[i] == socket) return i;
+    }
+
+    return -1;
+}
+
+static int shm_write(int socket, struct iovec *iov, int iovcnt) {
+    int nid = shm_node(socket);
+
+    if (nid < 0) return sm_writev_all(socket, iov, iovcnt);
+
+    return ring_write(shm_allocator ? &shm_control->down[nid] : &shm_control->up[nid], socket, iov, iovcnt);
+}
+
+static int shm_read(int socket, char *buffer, size_t len) {
+    int nid = shm_node(socket);
+
+    if (nid < 0) return sm_read_all(socket, buffer, len);
+
+    return ring_read(shm_allocator ? &shm_control->up[nid] : &shm_control->down[nid], socket, buffer, len);
+}
+
+/*
+ * Map the region and the rings from the shared memory object, the region replaces whatever is mapped
+ * at SM_MAP_START (the allocator's cache or the node's private copy)
+ */
+static int shm_map(int fd) {
+    void *region;
+
+    region = mmap((void *) SM_MAP_START, shm_region_size(), PROT_READ|PROT_WRITE,
+                  MAP_FIXED|MAP_SHARED|MAP_NORESERVE, fd, 0);
+    if (region == MAP_FAILED) return sm_fatal("failed to map the shared region");
+
+    shm_control = mmap(NULL, sizeof(struct sm_shm_control), PROT_READ|PROT_WRITE, MAP_SHARED, fd,
+                       shm_region_size());
+    if (shm_control == MAP_FAILED) {
+        shm_control = NULL;
+        return sm_fatal("failed to map the shared rings");
+    }
+
+    for (int i = 0; i < SM_MAX_NODES; i++) shm_sockets[i] = -1;
+    if (sysconf(_SC_NPROCESSORS_ONLN) < 2) shm_spin = 0;
+
+    sm_msg_writer = shm_write;
+    sm_msg_reader = shm_read;
+
+    return 0;
+}
+
+static void shm_unmap(void) {
+    if (shm_control != NULL) munmap(shm_control, sizeof(struct sm_shm_control));
+    shm_control = NULL;
+
+    sm_msg_writer = NULL;
+    sm_msg_reader = NULL;
+}
+
+/*
+ * The id nodes attach to the allocator's shared memory object with
+ */
+unsigned sm_shm_id(void) {
+    return shm_id;
+}
+
+/*
+ * Attach a node to the allocator's shared memory object, from then on the socket is only used to
+ * notice the allocator going away
+ */
+int sm_shm_attach(unsigned id, int socket, int nid) {
+    char name[32];
+    int fd, status;
+
+    if (nid < 0 || nid >= SM_MAX_NODES) return sm_fatal("invalid nid for shared memory");
+
+    snprintf(name, sizeof(name), SM_SHM_NAME, id);
+    fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) return sm_fatal("failed to open the allocator's shared memory");
+
+    status = shm_map(fd);
+    close(fd);
+    if (status) return status;
+
+    shm_id = id;
+    shm_sockets[nid] = socket;
+    shm_nid = nid;
+    return 0;
+}
+
+void sm_shm_detach(void) {
+    shm_unmap();
+    shm_nid = -1;
+}
+
+/*
+ * Returns whether the allocator has written to the node's ring, without waiting
+ */
+int sm_shm_pending(void) {
+    struct sm_ring *ring;
+
+    if (shm_control == NULL || shm_nid < 0) return 0;
+    ring = &shm_control->down[shm_nid];
+
+    return __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) != ring->head;
+}
+
+/*
+ * Create the shared memory object (the region followed by the rings), the pages are only allocated
+ * as they are touched
+ */
+static int shm_engine_init(int max_clients) {
+    char name[32];
+    int fd, status;
+
+    shm_id = getpid();
+    snprintf(name, sizeof(name), SM_SHM_NAME, shm_id);
+
+    fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0600);
+    if (fd < 0) return sm_fatal("failed to create shared memory");
+
+    if (ftruncate(fd, shm_region_size() + sizeof(struct sm_shm_control))) {
+        close(fd);
+        shm_unlink(name);
+        return sm_fatal("failed to size shared memory");
+    }
+
+    status = shm_map(fd);
+    close(fd);
+    if (status) {
+        shm_unlink(name);
+        return status;
+    }
+
+    shm_allocator = 1;
+    shm_max       = max_clients;
+    shm_cursor    = 0;
+    return 0;
+}
+
+static int shm_engine_add(int nid, int socket) {
+    shm_sockets[nid] = socket;
+    return 0;
+}
+
+static int shm_engine_remove(int nid) {
+    shm_sockets[nid] = -1;
+    return 0;
+}
+
+/*
+ * Hand out the next message from the nodes' rings in turn, sleeping on the doorbell when they are all
+ * empty
+ */
+static int shm_engine_next(msg_t **message, long timeout) {
+    struct timespec limit = { timeout / 1000000, (timeout % 1000000) * 1000 };
+    uint32_t seen;
+    int clients;
+
+    while (1) {
+        seen = __atomic_load_n(&shm_control->doorbell, __ATOMIC_SEQ_CST);
+        clients = 0;
+
+        for (int i = 0; i < shm_max; i++) {
+            int nid = (shm_cursor + i) % shm_max;
+            struct sm_ring *ring = &shm_control->up[nid];
+
+            if (shm_sockets[nid] < 0) continue;
+            clients++;
+
+            if (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) != ring->head) {
+                shm_cursor = nid + 1;
+                return sm_recv(shm_sockets[nid], message);
+            }
+        }
+        if (clients == 0) return sm_fatal("no clients left to wait for");
+
+        /* A hold window ending before the usual timeout wakes the allocator early */
+        if (timeout >= 0 && timeout < SM_SHM_TIMEOUT_MS * 1000L) {
+            if (shm_wait(&shm_control->doorbell, seen, &shm_control->doorbell_waiting, &limit)) {
+                *message = NULL;
+                return 0;
+            }
+            continue;
+        }
+
+        if (shm_wait(&shm_control->doorbell, seen, &shm_control->doorbell_waiting, &shm_timeout)) {
+            for (int i = 0; i < shm_max; i++) {
+                if (shm_sockets[i] >= 0 && shm_hung_up(shm_sockets[i])) return sm_fatal("lost connection to node");
+            }
+        }
+    }
+}
+
+static void shm_engine_end(void) {
+    char name[32];
+
+    snprintf(name, sizeof(name), SM_SHM_NAME, shm_id);
+    shm_unlink(name);
+    shm_unmap();
+}
+
+struct sm_event_engine sm_event_shm = {
+    "shm", shm_engine_init, shm_engine_add, shm_engine_remove, shm_engine_next, shm_engine_end
+};
@@ -0,0 +1,253 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/userfaultfd.h>
+
+#include "sm.h"
+#include "config.h"
+#include "sm_progress.h"
+#include "sm_prefetch.h"
+#include "sm_uffd.h"
+
+int sm_uffd_active = 0;
+
+static int       uffd = -1;      /* The userfaultfd the region is registered with */
+static int       uffd_stop = -1; /* An eventfd written to stop the handler thread */
+static char     *uffd_stage;     /* The page being faulted in is received here, one fault at a time */
+static pthread_t uffd_thread;
+
+static inline char *uffd_page(uint32_t page_n) {
+    return sm_map + (long) page_n * sm_page_size;
+}
+
+/*
+ * Set or clear the write protection of a page, waking the threads faulting on it unless told not to
+ */
+static int uffd_write_protect(uint32_t page_n, int protect, int wake) {
+    struct uffdio_writeprotect wp;
+
+    wp.range.start = (uintptr_t) uffd_page(page_n);
+    wp.range.len   = sm_page_size;
+    wp.mode        = (protect ? UFFDIO_WRITEPROTECT_MODE_WP : 0) | (wake ? 0 : UFFDIO_WRITEPROTECT_MODE_DONTWAKE);
+
+    return ioctl(uffd, UFFDIO_WRITEPROTECT, &wp);
+}
+
+/*
+ * Map a copy of the page into place (write-protected for a read copy) and wake the faulting thread
+ */
+int sm_uffd_install(uint32_t page_n, const char *source, int write) {
+    struct uffdio_copy copy;
+    struct uffdio_range range;
+
+    copy.dst  = (uintptr_t) uffd_page(page_n);
+    copy.src  = (uintptr_t) source;
+    copy.len  = sm_page_size;
+    copy.mode = write ? 0 : UFFDIO_COPY_MODE_WP;
+
+    while (ioctl(uffd, UFFDIO_COPY, &copy)) {
+        if (errno == EAGAIN) continue;
+        if (errno != EEXIST) return -1;
+
+        /* The node holds a read copy already and is upgrading it, lift the protection and refresh it */
+        if (write) {
+            if (uffd_write_protect(page_n, 0, 0)) return -1;
+            memcpy(uffd_page(page_n), source, sm_page_size);
+        }
+
+        range.start = (uintptr_t) uffd_page(page_n);
+        range.len   = sm_page_size;
+        return ioctl(uffd, UFFDIO_WAKE, &range);
+    }
+
+    return 0;
+}
+
+/*
+ * Fetch a page from the allocator and install it, the progress thread receives it into the stage
+ */
+static int uffd_fault(uint32_t page_n, int write) {
+    char body[4 + SM_PREF_MAX * 4];
+    uint32_t len = 0;
+    msg_t *message;
+    int status, migrate;
+
+    if (write && sm_owned_upgrade(page_n)) return 0;
+    if (sm_prefetch_hit(page_n, write)) return 0;
+    /* A write tells the allocator whether a read copy is installed already, a read whether it kept one */
+    if (write) {
+        sm_put32(body, sm_access[page_n] == SM_ACCESS_READ);
+        len = 4;
+    } else {
+        sm_put32(body, sm_prefetch_kept(page_n));
+        len = 4 + sm_prefetch_plan(page_n, body + 4);
+    }
+
+    status = sm_call(write ? SM_WRIT : SM_READ, page_n, body, len, write ? SM_WRIT_REPLY : SM_READ_REPLY,
+                     &message);
+    if (status) return sm_fatal(write ? "failed to write fault" : "failed to read fault");
+    if (!write) sm_prefetch_granted();
+    migrate = (message->type == SM_MIGR_REPLY);
+
+    /* A read without contents, the copy kept here has been brought up to date and is installed from there */
+    if (!write && message->len == 0) {
+        sm_msg_free(message);
+        if (sm_prefetch_take(page_n)) return sm_fatal("no copy of the page to read");
+
+        sm_progress_done(page_n);
+        return 0;
+    }
+
+    /* No contents, the read copy held here is current and only needs its protection lifting. It may
+     * have been released and brought up to date in the prefetch shadow since the fault was sent. */
+    if (write && message->len == 0) sm_prefetch_take(page_n);
+    sm_prefetch_forget(page_n);
+
+    if (write && message->len == 0) {
+        sm_msg_free(message);
+        status = uffd_write_protect(page_n, 0, 1);
+    } else {
+        if (message->len < sm_page_size) memset(uffd_stage + message->len, 0, sm_page_size - message->len);
+        sm_msg_free(message);
+
+        status = sm_uffd_install(page_n, uffd_stage, write);
+    }
+    if (status) return sm_fatal("failed to install a faulted page");
+
+    sm_access[page_n] = write ? SM_ACCESS_WRITE : SM_ACCESS_READ;
+    if (migrate) sm_owned_grant(page_n);
+    sm_progress_done(page_n);
+
+    return 0;
+}
+
+static void *uffd_main(void *argument) {
+    struct uffd_msg event;
+    struct pollfd fds[2] = {{ .fd = uffd, .events = POLLIN }, { .fd = uffd_stop, .events = POLLIN }};
+    long offset;
+
+    while (1) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            sm_fatal("failed to wait for page faults");
+            _exit(EXIT_FAILURE);
+        }
+        if (fds[1].revents) return NULL;
+
+        if (read(uffd, &event, sizeof(event)) != sizeof(event)) continue;
+        if (event.event != UFFD_EVENT_PAGEFAULT) continue;
+
+        offset = (char *) (uintptr_t) event.arg.pagefault.address - sm_map;
+
+        /* The faulting thread can't go on without the page, and the allocator is gone */
+        if (uffd_fault(offset / sm_page_size, !!(event.arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WRITE)))
+            _exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Switch the node over to userfaultfd, returns -1 (and leaves the SIGSEGV handler in charge) if the
+ * kernel doesn't support write-protect faults on anonymous memory or doesn't let this process use them
+ */
+int sm_uffd_init(void) {
+    struct uffdio_api api;
+    struct uffdio_register reg;
+    long size = SM_NUM_PAGES * sm_page_size;
+    sigset_t all, previous;
+
+    /* Faults in the kernel (e.g. read(2) into the region) are left to fail as they always have, which
+     * is also all an unprivileged process is allowed */
+    uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK | UFFD_USER_MODE_ONLY);
+    if (uffd < 0 && errno == EINVAL) uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (uffd < 0) return -1;
+
+    memset(&api, 0, sizeof(api));
+    api.api      = UFFD_API;
+    api.features = UFFD_FEATURE_PAGEFAULT_FLAG_WP;
+    if (ioctl(uffd, UFFDIO_API, &api) || !(api.features & UFFD_FEATURE_PAGEFAULT_FLAG_WP)) goto fail;
+
+    uffd_stage = mmap(NULL, sm_page_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (uffd_stage == MAP_FAILED) goto fail;
+
+    /* Pages are installed one at a time, a huge page would hide every fault but the first */
+    madvise(sm_map, size, MADV_NOHUGEPAGE);
+    if (mprotect(sm_map, size, PROT_READ|PROT_WRITE)) goto stage;
+
+    reg.range.start = (uintptr_t) sm_map;
+    reg.range.len   = size;
+    reg.mode        = UFFDIO_REGISTER_MODE_MISSING | UFFDIO_REGISTER_MODE_WP;
+    if (ioctl(uffd, UFFDIO_REGISTER, &reg)) goto protect;
+    if (!(reg.ioctls & (1ULL << _UFFDIO_COPY)) || !(reg.ioctls & (1ULL << _UFFDIO_WRITEPROTECT))) goto protect;
+
+    uffd_stop = eventfd(0, EFD_CLOEXEC);
+    if (uffd_stop < 0) goto protect;
+
+    /* Signals are for the application thread */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &previous);
+    if (pthread_create(&uffd_thread, NULL, uffd_main, NULL)) {
+        pthread_sigmask(SIG_SETMASK, &previous, NULL);
+        close(uffd_stop);
+        goto protect;
+    }
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+    sm_uffd_active = 1;
+    return 0;
+
+protect:
+    mprotect(sm_map, size, PROT_NONE);
+stage:
+    munmap(uffd_stage, sm_page_size);
+fail:
+    close(uffd);
+    uffd = -1;
+    return -1;
+}
+
+/*
+ * Where a faulted page is received, it is installed once the fault has its reply
+ */
+char *sm_uffd_sink(msg_t *message) {
+    return uffd_stage;
+}
+
+/*
+ * Change the access the node holds for a page on the allocator's behalf (from the progress thread)
+ */
+void sm_uffd_protect(uint32_t page_n, int access) {
+    if (access == SM_ACCESS_NONE) {
+        /* The page is no longer present, the next access faults it in again */
+        madvise(uffd_page(page_n), sm_page_size, MADV_DONTNEED);
+    } else {
+        uffd_write_protect(page_n, access == SM_ACCESS_READ, 1);
+    }
+    sm_access[page_n] = access;
+}
+
+void sm_uffd_exit(void) {
+    uint64_t one = 1;
+
+    if (!sm_uffd_active) return;
+
+    if (write(uffd_stop, &one, sizeof(one)) == sizeof(one)) pthread_join(uffd_thread, NULL);
+
+    close(uffd_stop);
+    close(uffd);
+    munmap(uffd_stage, sm_page_size);
+    uffd = uffd_stop = -1;
+    sm_uffd_active = 0;
+}
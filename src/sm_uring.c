@@ -0,0 +1,462 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "sm_event.h"
+#include "allocator.h"
+#include "config.h"
+
+/*
+ * io_uring engine
+ *
+ * Every client always has a receive posted for the next header. When a header completes the body is
+ * received with a second request straight into the body sm_msg_begin() gives it (the page cache for
+ * pages), then the message is queued for the allocator and a new header receive is posted once the
+ * allocator has taken it. Sends are queued by uring_write() and submitted as one linked chain (which
+ * keeps them in order) with the receives on the next turn of the loop.
+ */
+#define URING_ENTRIES   256
+#define URING_SLOTS     128           /* The most sends that can be queued or in flight */
+#define URING_COPY_MAX  4096          /* Bodies smaller than this are copied into the send slot */
+
+#define URING_OP_HEADER 1
+#define URING_OP_BODY   2
+#define URING_OP_SEND   3
+
+#define URING_DATA(op, index) (((uint64_t) (op) << 32) | (uint32_t) (index))
+
+struct uring_client {
+    int      socket;  /* The client's socket (-1 once removed) */
+    char     header[HEADER_LEN]; /* The pre-posted receive buffer for the next header */
+    msg_t   *message; /* The message whose body is being received, once its header has been */
+    char    *dest;    /* Where the current part of the message is being received to */
+    uint32_t want;    /* The number of bytes left in the current part */
+    int      posted;  /* A receive is outstanding on the socket */
+};
+
+struct uring_slot {
+    int           socket;
+    int           in_use;
+    size_t        total;                /* The total number of bytes in the frame */
+    struct msghdr header;
+    struct iovec  iov[2];
+    char          frame[HEADER_LEN];    /* A copy of the frame's header */
+    char          body[URING_COPY_MAX]; /* A copy of the body, if it is small */
+};
+
+static struct {
+    int                  fd;
+    unsigned            *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned            *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void                *sq_ring, *cq_ring;
+    size_t               sq_ring_len, cq_ring_len, sqes_len;
+    unsigned             to_submit;     /* SQEs written but not yet submitted */
+    int                  ext_arg;       /* The kernel takes a timeout for waits (IORING_FEAT_EXT_ARG) */
+} ring = { .fd = -1 };
+
+static struct uring_client uring_clients[SM_MAX_NODES];
+static int                 uring_max;
+
+static struct uring_slot   uring_slots[URING_SLOTS];
+static int                 uring_queued[URING_SLOTS]; /* Slots waiting to be submitted, in order */
+static int                 uring_n_queued;
+static int                 uring_inflight;            /* Sends submitted but not yet completed */
+
+static msg_t              *uring_ready[SM_MAX_NODES]; /* Complete messages, in arrival order */
+static int                 uring_ready_head, uring_n_ready;
+
+static int uring_write(int socket, struct iovec *iov, int iovcnt);
+
+static int uring_enter(unsigned to_submit, unsigned min_complete, unsigned flags) {
+    int status;
+
+    do {
+        status = syscall(__NR_io_uring_enter, ring.fd, to_submit, min_complete, flags, NULL, 0);
+    } while (status < 0 && errno == EINTR);
+
+    return status;
+}
+
+/*
+ * Submit and wait for a completion for at most timeout microseconds, kernels that can't take a timeout
+ * only submit
+ */
+static int uring_enter_timeout(unsigned to_submit, long timeout) {
+    struct __kernel_timespec ts = { timeout / 1000000, (timeout % 1000000) * 1000 };
+    struct io_uring_getevents_arg arg = { .ts = (uintptr_t) &ts };
+    int status;
+
+    if (!ring.ext_arg) return uring_enter(to_submit, 0, 0);
+
+    status = syscall(__NR_io_uring_enter, ring.fd, to_submit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                     &arg, sizeof(arg));
+    if (status < 0 && (errno == ETIME || errno == EINTR)) return 0;
+
+    return status;
+}
+
+/*
+ * Get the next free submission queue entry, submitting what is already queued if the ring is full
+ */
+static struct io_uring_sqe *uring_sqe() {
+    unsigned tail = *ring.sq_tail;
+
+    if (tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) >= URING_ENTRIES) {
+        if (uring_enter(ring.to_submit, 0, 0) < 0) return NULL;
+        ring.to_submit = 0;
+        if (tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) >= URING_ENTRIES) return NULL;
+    }
+
+    unsigned index = tail & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    ring.sq_array[index] = index;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring.to_submit++;
+
+    return sqe;
+}
+
+/*
+ * Post a receive for the rest of the client's current part (header or body)
+ */
+static int uring_post_recv(int nid, int op) {
+    struct uring_client *client = &uring_clients[nid];
+    struct io_uring_sqe *sqe = uring_sqe();
+    if (sqe == NULL) return sm_fatal("io_uring submission queue is full");
+
+    sqe->opcode    = IORING_OP_RECV;
+    sqe->fd        = client->socket;
+    sqe->addr      = (uint64_t) (uintptr_t) client->dest;
+    sqe->len       = client->want;
+    sqe->msg_flags = MSG_WAITALL;
+    sqe->user_data = URING_DATA(op, nid);
+    client->posted = 1;
+
+    return 0;
+}
+
+/*
+ * Pre-post a receive for the next message header from the client
+ */
+static int uring_post_header(int nid) {
+    struct uring_client *client = &uring_clients[nid];
+
+    client->dest = client->header;
+    client->want = HEADER_LEN;
+    return uring_post_recv(nid, URING_OP_HEADER);
+}
+
+/*
+ * Put every queued send into the submission queue as a single linked chain
+ */
+static int uring_queue_sends() {
+    for (int i = 0; i < uring_n_queued; i++) {
+        struct uring_slot *slot = &uring_slots[uring_queued[i]];
+        struct io_uring_sqe *sqe = uring_sqe();
+        if (sqe == NULL) return sm_fatal("io_uring submission queue is full");
+
+        sqe->opcode    = IORING_OP_SENDMSG;
+        sqe->fd        = slot->socket;
+        sqe->addr      = (uint64_t) (uintptr_t) &slot->header;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        sqe->user_data = URING_DATA(URING_OP_SEND, uring_queued[i]);
+        if (i + 1 < uring_n_queued) sqe->flags = IOSQE_IO_LINK;
+    }
+
+    uring_inflight += uring_n_queued;
+    uring_n_queued = 0;
+
+    return 0;
+}
+
+/*
+ * A send completed. If it was cut short (or cancelled because an earlier send in its chain was) the
+ * rest is written synchronously, completions arrive in chain order so the frames stay in order.
+ */
+static void uring_send_done(int index, int result) {
+    struct uring_slot *slot = &uring_slots[index];
+
+    if (result != slot->total) {
+        struct iovec iov[2] = { slot->iov[0], slot->iov[1] };
+        size_t skip = (result > 0) ? result : 0;
+
+        for (int i = 0; i < 2; i++) {
+            size_t n = (skip < iov[i].iov_len) ? skip : iov[i].iov_len;
+            iov[i].iov_base = (char *) iov[i].iov_base + n;
+            iov[i].iov_len -= n;
+            skip -= n;
+        }
+
+        if (sm_writev_all(slot->socket, iov, 2)) sm_fatal("failed to send message to node");
+    }
+
+    slot->in_use = 0;
+    uring_inflight--;
+}
+
+/*
+ * A receive completed, move on to the body (or to the next message)
+ */
+static int uring_recv_done(int nid, int op, int result) {
+    struct uring_client *client = &uring_clients[nid];
+
+    client->posted = 0;
+    if (client->socket < 0) return 0;
+    if (result <= 0) return sm_fatal("lost connection to node");
+
+    client->dest += result;
+    client->want -= result;
+    if (client->want > 0) return uring_post_recv(nid, op);
+
+    /* The header has arrived, receive the body to wherever it belongs */
+    if (op == URING_OP_HEADER) {
+        msg_t *message = sm_msg_begin(client->header);
+        if (message == NULL) return sm_fatal("received a malformed message");
+
+        client->message = message;
+        if (message->len > 0) {
+            client->dest = message->body;
+            client->want = message->len;
+            return uring_post_recv(nid, URING_OP_BODY);
+        }
+    }
+
+    /* The message is complete */
+    uring_ready[(uring_ready_head + uring_n_ready++) % SM_MAX_NODES] = client->message;
+    client->message = NULL;
+
+    return 0;
+}
+
+/*
+ * Submit everything queued, wait for at least `wait' completions (or until the timeout, unless it is
+ * -1) and process every completion
+ */
+static int uring_turn(unsigned wait, long timeout) {
+    int entered;
+    unsigned head;
+    int status = 0;
+
+    /* Sends are only submitted once the previous chain has finished, so that frames can't overtake */
+    if (uring_inflight == 0 && uring_n_queued > 0) {
+        if (uring_queue_sends()) return -1;
+    }
+
+    if (wait && timeout >= 0) {
+        entered = uring_enter_timeout(ring.to_submit, timeout);
+    } else {
+        entered = uring_enter(ring.to_submit, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+    }
+    if (entered < 0) return sm_fatal("io_uring_enter() failed");
+    ring.to_submit = 0;
+
+    /* Reap the whole batch of completions */
+    head = *ring.cq_head;
+    while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+        int op = cqe->user_data >> 32, index = (uint32_t) cqe->user_data;
+
+        if (op == URING_OP_SEND) {
+            uring_send_done(index, cqe->res);
+        } else if (uring_recv_done(index, op, cqe->res)) {
+            status = -1;
+        }
+
+        head++;
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+    return status;
+}
+
+/*
+ * Submit every queued send and wait for all of them to complete
+ */
+static int uring_flush() {
+    while (uring_inflight > 0 || uring_n_queued > 0) {
+        if (uring_turn(uring_inflight > 0 || uring_n_queued > 0, -1)) return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Queue a frame to be sent on the next turn of the loop. The header and small bodies are copied, pages
+ * are sent in place; a page can't change before its send completes as any later write to the page
+ * needs a reply from a node which can only arrive after the frames sent to it before.
+ */
+static int uring_queue(int socket, struct iovec *header, struct iovec *body) {
+    struct uring_slot *slot = NULL;
+
+    for (int i = 0; i < URING_SLOTS && slot == NULL; i++) {
+        if (!uring_slots[i].in_use) slot = &uring_slots[i];
+    }
+    if (slot == NULL) {
+        if (uring_flush()) return 1;
+        slot = &uring_slots[0];
+    }
+
+    slot->in_use = 1;
+    slot->socket = socket;
+    memcpy(slot->frame, header->iov_base, HEADER_LEN);
+    slot->iov[0].iov_base = slot->frame;
+    slot->iov[0].iov_len  = HEADER_LEN;
+
+    slot->iov[1].iov_len  = (body != NULL) ? body->iov_len : 0;
+    if (slot->iov[1].iov_len < URING_COPY_MAX) {
+        if (slot->iov[1].iov_len > 0) memcpy(slot->body, body->iov_base, slot->iov[1].iov_len);
+        slot->iov[1].iov_base = slot->body;
+    } else {
+        slot->iov[1].iov_base = body->iov_base;
+    }
+
+    slot->total = HEADER_LEN + slot->iov[1].iov_len;
+    memset(&slot->header, 0, sizeof(slot->header));
+    slot->header.msg_iov    = slot->iov;
+    slot->header.msg_iovlen = 2;
+
+    uring_queued[uring_n_queued++] = slot - uring_slots;
+    return 0;
+}
+
+/*
+ * Queue each of the frames given, a slot each
+ */
+static int uring_write(int socket, struct iovec *iov, int iovcnt) {
+    for (int i = 0; i < iovcnt; i += 2) {
+        if (uring_queue(socket, &iov[i], (i + 1 < iovcnt) ? &iov[i + 1] : NULL)) return 1;
+    }
+
+    return 0;
+}
+
+static int uring_init(int max_clients) {
+    struct io_uring_params params;
+
+    memset(&params, 0, sizeof(params));
+    ring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring.fd < 0) return sm_fatal("io_uring is not available");
+
+    /* Map in the submission and completion rings */
+    ring.sq_ring_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring.cq_ring_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring.sqes_len    = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring.sq_ring = mmap(NULL, ring.sq_ring_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                        ring.fd, IORING_OFF_SQ_RING);
+    ring.cq_ring = mmap(NULL, ring.cq_ring_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                        ring.fd, IORING_OFF_CQ_RING);
+    ring.sqes    = mmap(NULL, ring.sqes_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                        ring.fd, IORING_OFF_SQES);
+    if (ring.sq_ring == MAP_FAILED || ring.cq_ring == MAP_FAILED || ring.sqes == MAP_FAILED) {
+        return sm_fatal("failed to map io_uring");
+    }
+
+    ring.sq_head  = (unsigned *) ((char *) ring.sq_ring + params.sq_off.head);
+    ring.sq_tail  = (unsigned *) ((char *) ring.sq_ring + params.sq_off.tail);
+    ring.sq_mask  = (unsigned *) ((char *) ring.sq_ring + params.sq_off.ring_mask);
+    ring.sq_array = (unsigned *) ((char *) ring.sq_ring + params.sq_off.array);
+    ring.cq_head  = (unsigned *) ((char *) ring.cq_ring + params.cq_off.head);
+    ring.cq_tail  = (unsigned *) ((char *) ring.cq_ring + params.cq_off.tail);
+    ring.cq_mask  = (unsigned *) ((char *) ring.cq_ring + params.cq_off.ring_mask);
+    ring.cqes     = (struct io_uring_cqe *) ((char *) ring.cq_ring + params.cq_off.cqes);
+
+    ring.ext_arg = !!(params.features & IORING_FEAT_EXT_ARG);
+
+    uring_max = max_clients;
+    for (int i = 0; i < SM_MAX_NODES; i++) {
+        uring_clients[i].socket  = -1;
+        uring_clients[i].message = NULL;
+        uring_clients[i].posted  = 0;
+    }
+
+    sm_msg_writer = uring_write;
+    return 0;
+}
+
+static int uring_add(int nid, int socket) {
+    /* The ring receives from the socket itself, nothing may be left over in its receive ring. A node waits
+     * for the replies to its handshake, so there never is. */
+    if (sm_msg_buffered(socket)) return sm_fatal("node sent ahead of its initialisation");
+
+    uring_clients[nid].socket = socket;
+    return uring_post_header(nid);
+}
+
+/*
+ * Stop receiving from the node. Its socket is closed once this returns, so everything queued for it
+ * is sent first and its outstanding receive is cancelled.
+ */
+static int uring_remove(int nid) {
+    struct uring_client *client = &uring_clients[nid];
+
+    /* The node closes its end as soon as its last reply arrives, so the EOF is expected from now on */
+    client->socket = -1;
+    if (uring_flush()) return -1;
+
+    if (client->posted) {
+        struct io_uring_sqe *sqe = uring_sqe();
+        if (sqe == NULL) return sm_fatal("io_uring submission queue is full");
+
+        sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+        sqe->addr      = URING_DATA(URING_OP_HEADER, nid);
+        sqe->user_data = URING_DATA(0, nid);
+    }
+
+    return uring_turn(0, -1);
+}
+
+static int uring_next(msg_t **message, long timeout) {
+    if (uring_n_ready == 0 && timeout >= 0) {
+        if (uring_turn(1, timeout)) return -1;
+        if (uring_n_ready == 0) {
+            *message = NULL;
+            return 0;
+        }
+    }
+    while (uring_n_ready == 0) {
+        if (uring_turn(1, -1)) return -1;
+    }
+
+    *message = uring_ready[uring_ready_head];
+    uring_ready_head = (uring_ready_head + 1) % SM_MAX_NODES;
+    uring_n_ready--;
+
+    /* Pre-post the receive for the client's next message, it is submitted on the next turn */
+    int nid = (*message)->nid;
+    if (nid >= 0 && nid < uring_max && uring_clients[nid].socket >= 0 && !uring_clients[nid].posted) {
+        if (uring_post_header(nid)) return -1;
+    }
+
+    return 0;
+}
+
+static void uring_end(void) {
+    if (ring.fd < 0) return;
+
+    uring_flush();
+    sm_msg_writer = NULL;
+
+    for (int i = 0; i < SM_MAX_NODES; i++) sm_msg_free(uring_clients[i].message);
+
+    munmap(ring.sqes, ring.sqes_len);
+    munmap(ring.cq_ring, ring.cq_ring_len);
+    munmap(ring.sq_ring, ring.sq_ring_len);
+    close(ring.fd);
+    ring.fd = -1;
+}
+
+struct sm_event_engine sm_event_uring = {
+    "uring", uring_init, uring_add, uring_remove, uring_next, uring_end
+};
@@ -0,0 +1,314 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "sm_workers.h"
+#include "allocator.h"
+#include "node_functions.h"
+#include "config.h"
+
+/* Each node has at most one fault or window of SM_PUTs outstanding, but pages sent ahead wait on every node */
+#define SM_SHARD_QUEUE (SM_MAX_NODES * (SM_PREF_MAX + 2))
+/* A pending write fault waits on every other node, and a shard has a fault pending per node at most */
+#define SM_SHARD_REPLIES (SM_MAX_NODES * (SM_MAX_NODES + SM_PREF_MAX))
+
+struct sm_shard {
+    pthread_t       thread;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+
+    msg_t   *faults[SM_SHARD_QUEUE];  /* Faults waiting to be handled, oldest first */
+    int      head, n_faults;
+    msg_t   *replies[SM_SHARD_REPLIES]; /* Replies for the shard's pending faults or its nested wait */
+    int      n_replies;
+
+    int      stopping;                /* Set once the allocator is shutting down */
+    uint64_t handled;                 /* The number of faults handled by the shard */
+};
+
+static struct sm_shard *sm_shards;
+static int              sm_n_shards = 0;
+
+static pthread_mutex_t  sm_send_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread struct sm_shard *sm_shard_self = NULL; /* The shard owned by this thread (if any) */
+
+static int sm_fanout_left[SM_MAX_NODES]; /* The shards yet to finish each node's bulk request */
+
+/*
+ * Frames to a node can now come from any thread, so each one is written whole under a lock
+ */
+static int workers_write(int socket, struct iovec *iov, int iovcnt) {
+    pthread_mutex_lock(&sm_send_lock);
+    int status = sm_writev_all(socket, iov, iovcnt);
+    pthread_mutex_unlock(&sm_send_lock);
+
+    return status;
+}
+
+/*
+ * Wait (with the shard locked) for the shard to be given something to do, or until the first window
+ * holding back one of its deferred faults ends. Returns 1 in the latter case.
+ */
+static int workers_wait(struct sm_shard *shard) {
+    long timeout = node_hold_time();
+    struct timespec deadline;
+
+    if (timeout < 0) {
+        pthread_cond_wait(&shard->cond, &shard->lock);
+        return 0;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += (timeout % 1000000) * 1000;
+    deadline.tv_sec  += timeout / 1000000 + deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+
+    return (pthread_cond_timedwait(&shard->cond, &shard->lock, &deadline) == ETIMEDOUT);
+}
+
+/*
+ * Handle the shard's faults in arrival order, and the answers to those left pending, until the
+ * allocator stops
+ */
+static void *worker_main(void *argument) {
+    struct sm_shard *shard = argument;
+    msg_t *message;
+    int status;
+
+    sm_shard_self = shard;
+
+    while (1) {
+        pthread_mutex_lock(&shard->lock);
+        while (shard->n_faults == 0 && shard->n_replies == 0 && !shard->stopping) {
+            if (workers_wait(shard)) break;
+        }
+
+        if (shard->n_replies > 0) {
+            message = shard->replies[--shard->n_replies];
+            pthread_mutex_unlock(&shard->lock);
+
+            status = node_answered(message);
+            if (status > 0) status = sm_fatal("unexpected page reply");
+            sm_msg_free(message);
+        } else if (shard->n_faults > 0) {
+            message = shard->faults[shard->head];
+            shard->head = (shard->head + 1) % SM_SHARD_QUEUE;
+            shard->n_faults--;
+            pthread_mutex_unlock(&shard->lock);
+
+            status = node_execute(message);
+            shard->handled++;
+        } else if (shard->stopping) {
+            pthread_mutex_unlock(&shard->lock);
+            break;
+        } else {
+            /* A window has ended, the faults it held back can go ahead */
+            pthread_mutex_unlock(&shard->lock);
+            status = 0;
+        }
+
+        /* Faults deferred behind a page that is no longer busy go ahead */
+        if (status == 0) status = node_deferred();
+
+        /* The node is left waiting forever if its fault fails, so take the whole allocator down */
+        if (status) {
+            sm_fatal("worker failed to handle fault");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Start the worker threads, each owning the pages p where p % n_workers is its index
+ */
+int sm_workers_start(int n_workers) {
+    if (n_workers <= 0) return 0;
+    if (sm_msg_writer != NULL) return sm_fatal("the event engine can't be used with worker threads");
+
+    sm_shards = calloc(n_workers, sizeof(struct sm_shard));
+    if (sm_shards == NULL) return sm_fatal("failed to allocate the page table shards");
+
+    sm_msg_writer = workers_write;
+
+    for (int i = 0; i < n_workers; i++) {
+        pthread_mutex_init(&sm_shards[i].lock, NULL);
+        pthread_cond_init(&sm_shards[i].cond, NULL);
+
+        if (pthread_create(&sm_shards[i].thread, NULL, worker_main, &sm_shards[i])) {
+            sm_workers_stop();
+            return sm_fatal("failed to start worker thread");
+        }
+        sm_n_shards++;
+    }
+
+    return 0;
+}
+
+/*
+ * Queue a request on the shard
+ */
+static int workers_queue(struct sm_shard *shard, msg_t *message) {
+    pthread_mutex_lock(&shard->lock);
+    if (shard->n_faults == SM_SHARD_QUEUE) {
+        pthread_mutex_unlock(&shard->lock);
+        return sm_fatal("too many faults queued on shard");
+    }
+    shard->faults[(shard->head + shard->n_faults++) % SM_SHARD_QUEUE] = message;
+
+    pthread_cond_signal(&shard->cond);
+    pthread_mutex_unlock(&shard->lock);
+
+    return 0;
+}
+
+/*
+ * A bulk request covers the pages of every shard, each gets its own copy of it in arrival order (so it
+ * follows the node's earlier requests for the shard's pages) and the last to finish replies (if it has
+ * a reply, the node only has one of those outstanding). Every shard sees every put, even one to a
+ * single page, so that each can tell when it has applied all of a window's puts.
+ */
+static int workers_fan_out(msg_t *message) {
+    msg_t *copy;
+
+    if (message->type != SM_PUT && message->type != SM_PUT_PAGES) sm_fanout_left[message->nid] = sm_n_shards;
+
+    for (int i = 0; i < sm_n_shards; i++) {
+        if (i == sm_n_shards - 1) {
+            copy = message;
+        } else {
+            copy = sm_msg_copy(message);
+            if (copy == NULL) return sm_fatal("failed to copy a bulk request");
+        }
+
+        if (workers_queue(&sm_shards[i], copy)) return -1;
+    }
+
+    return 1;
+}
+
+/*
+ * Hand a fault (or atomic operations), or a page reply a fault is waiting for, to the shard owning its
+ * page. Returns 1 if the message was taken (the shard frees it), 0 if it should be executed by the calling
+ * thread and -1 if the shard's queue is full.
+ */
+int sm_workers_dispatch(msg_t *message) {
+    struct sm_shard *shard;
+
+    if (sm_n_shards == 0 || message->page >= SM_MAX_PAGES) return 0;
+    shard = &sm_shards[message->page % sm_n_shards];
+
+    switch (message->type) {
+        case SM_READ:
+        case SM_WRIT:
+        case SM_ATOMIC:
+            return workers_queue(shard, message) ? -1 : 1;
+        case SM_FETCH:
+        case SM_GET:
+        case SM_PUT:
+        case SM_PUT_PAGES:
+        case SM_PUT_DONE:
+        case SM_ADVISE:
+            return workers_fan_out(message);
+        case SM_REQU_REPLY:
+        case SM_RLSE_REPLY:
+            pthread_mutex_lock(&shard->lock);
+            if (shard->n_replies == SM_SHARD_REPLIES) {
+                pthread_mutex_unlock(&shard->lock);
+                return sm_fatal("too many replies queued on shard");
+            }
+            shard->replies[shard->n_replies++] = message;
+            break;
+        default:
+            return 0;
+    }
+
+    pthread_cond_signal(&shard->cond);
+    pthread_mutex_unlock(&shard->lock);
+
+    return 1;
+}
+
+/*
+ * Wait (on a worker) for the reply of the given type for the page from the node, the network thread
+ * has already received the page into the cache by the time it is handed over
+ */
+int sm_workers_await(int nid, int type, uint32_t page, msg_t **reply) {
+    struct sm_shard *shard = sm_shard_self;
+
+    pthread_mutex_lock(&shard->lock);
+    while (1) {
+        for (int i = 0; i < shard->n_replies; i++) {
+            msg_t *message = shard->replies[i];
+
+            if (message->nid == nid && message->type == type && message->page == page) {
+                shard->replies[i] = shard->replies[--shard->n_replies];
+                pthread_mutex_unlock(&shard->lock);
+
+                *reply = message;
+                return 0;
+            }
+        }
+
+        pthread_cond_wait(&shard->cond, &shard->lock);
+    }
+}
+
+/*
+ * Returns whether the calling shard is the last to finish the node's bulk request, always true without
+ * workers
+ */
+int sm_workers_last(int nid) {
+    if (sm_n_shards == 0) return 1;
+
+    return (__atomic_sub_fetch(&sm_fanout_left[nid], 1, __ATOMIC_ACQ_REL) == 0);
+}
+
+/*
+ * Returns whether the calling thread is one of the workers
+ */
+int sm_worker_thread() {
+    return (sm_shard_self != NULL);
+}
+
+/*
+ * Returns whether the calling thread may change the page's entry, a worker only owns its own shard
+ */
+int sm_worker_owns(uint32_t page) {
+    return (sm_shard_self == NULL || page % sm_n_shards == sm_shard_self - sm_shards);
+}
+
+/*
+ * Wait for the workers to finish the faults they have queued and stop them
+ */
+void sm_workers_stop() {
+    if (sm_n_shards == 0) return;
+
+    for (int i = 0; i < sm_n_shards; i++) {
+        pthread_mutex_lock(&sm_shards[i].lock);
+        sm_shards[i].stopping = 1;
+        pthread_cond_signal(&sm_shards[i].cond);
+        pthread_mutex_unlock(&sm_shards[i].lock);
+    }
+
+    for (int i = 0; i < sm_n_shards; i++) {
+        pthread_join(sm_shards[i].thread, NULL);
+
+        if (options->log_file) {
+            fprintf(options->log_file, "-= worker %d handled %lu faults\n", i, sm_shards[i].handled);
+        }
+        pthread_cond_destroy(&sm_shards[i].cond);
+        pthread_mutex_destroy(&sm_shards[i].lock);
+    }
+
+    free(sm_shards);
+    sm_shards = NULL;
+    sm_n_shards = 0;
+    sm_msg_writer = NULL;
+}